@@ -77,11 +77,17 @@ YMAGINE_MAIN_C_INCLUDES += $(YMAGINE_ROOT)/jni/src
 
 YMAGINE_MAIN_SRC_FILES += src/compat/androidndk.c
 YMAGINE_MAIN_SRC_FILES += src/graphics/vbitmap.c
+YMAGINE_MAIN_SRC_FILES += src/graphics/pool.c
+YMAGINE_MAIN_SRC_FILES += src/formats/stats.c
+YMAGINE_MAIN_SRC_FILES += src/formats/limits.c
+YMAGINE_MAIN_SRC_FILES += src/formats/io.c
 
 ifeq ($(YMAGINE_CONFIG_BITMAP),true)
 YMAGINE_MAIN_CFLAGS += -DHAVE_BITMAPFACTORY=1
 YMAGINE_MAIN_SRC_FILES += src/formats/format.c
 YMAGINE_MAIN_SRC_FILES += src/formats/vformat.c
+YMAGINE_MAIN_SRC_FILES += src/formats/context.c
+YMAGINE_MAIN_SRC_FILES += src/formats/batch.c
 ifeq ($(YMAGINE_CONFIG_BITMAP_JPEG),true)
 YMAGINE_MAIN_SRC_FILES += src/formats/jpeg/jpegio.c
 YMAGINE_MAIN_SRC_FILES += src/formats/jpeg/jpeg.c
@@ -105,7 +111,9 @@ YMAGINE_MAIN_SRC_FILES += src/formats/png/png.c
 ifeq ($(YMAGINE_CONFIG_BITMAP_PNG),true)
 YMAGINE_MAIN_CFLAGS += -DHAVE_PNG=1
 YMAGINE_MAIN_C_INCLUDES += $(PNG_ROOT)
+YMAGINE_MAIN_C_INCLUDES += $(ZLIB_ROOT)
 YMAGINE_MAIN_STATIC_LIBRARIES += libyahoo_png
+YMAGINE_MAIN_STATIC_LIBRARIES += libyahoo_zlib
 endif
 YMAGINE_MAIN_SRC_FILES += src/formats/gif/gif.c
 ifeq ($(YMAGINE_CONFIG_BITMAP_GIF),true)
@@ -121,7 +129,9 @@ YMAGINE_MAIN_SRC_FILES += src/graphics/region.c
 YMAGINE_MAIN_SRC_FILES += src/filters/blursuperfast.c
 YMAGINE_MAIN_SRC_FILES += src/filters/blur.c
 YMAGINE_MAIN_SRC_FILES += src/filters/compose.c
+YMAGINE_MAIN_SRC_FILES += src/filters/overlay.c
 YMAGINE_MAIN_SRC_FILES += src/filters/sobel.c
+YMAGINE_MAIN_SRC_FILES += src/filters/smartcrop.c
 YMAGINE_MAIN_SRC_FILES += src/filters/seam.c
 
 YMAGINE_MAIN_SRC_FILES += src/filters/colorize.c
@@ -36,6 +36,16 @@ extern "C" {
 #define YMAGINE_THEME_NONE       0
 #define YMAGINE_THEME_SATURATION 1
 
+/** Maximum amount of theme colors collected while decoding */
+#define YMAGINE_THEME_MAXCOLORS 16
+
+/** Default quantization method, currently YMAGINE_QUANTIZE_EXACT */
+#define YMAGINE_QUANTIZE_DEFAULT   -1
+/** k-means over every pixel of the bitmap */
+#define YMAGINE_QUANTIZE_EXACT      0
+/** Weighted k-means over a 5 bits per channel color histogram, much faster on large bitmaps */
+#define YMAGINE_QUANTIZE_HISTOGRAM  1
+
 /**
  * @brief Extracts the theme color from a bitmap
  * @ingroup Color
@@ -61,6 +71,23 @@ getThemeColor(Vbitmap *vbitmap);
 int
 getThemeColors(Vbitmap *vbitmap, int ncol, int *colors, int *scores);
 
+/**
+ * @brief Extracts multiple theme colors from a bitmap, using a given quantization method
+ * @ingroup Color
+ *
+ * @param vbitmap This is a pointer to a vbitmap that contains the buffer for the image
+ * @param ncol maximum amount of colors wanted
+ * @param colors an array whose size is at least ncol that would be populated with colors
+ *		extracted from the image. These colors are in ARGB format.
+ * @param scores an array whose size is at least ncol that would contain level of confidence
+ *        that colors are dominant
+ * @param method one of YMAGINE_QUANTIZE_DEFAULT, YMAGINE_QUANTIZE_EXACT or YMAGINE_QUANTIZE_HISTOGRAM
+ * @return amount of colors found
+ */
+int
+getThemeColorsWithMethod(Vbitmap *vbitmap, int ncol, int *colors, int *scores,
+                         int method);
+
 /**
  * @brief Generate an RGBA 32bits color from its red, green, blue and alpha components
  * @ingroup Color
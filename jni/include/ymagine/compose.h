@@ -52,6 +52,19 @@ typedef enum {
     YMAGINE_COMPOSE_COLORIZE
 } ymagineCompose;
 
+/**
+ * @brief Composes a line of RGBA overlay pixels onto a line of pixels
+ * @ingroup Compose
+ *
+ * @param srcdata pixels to compose on, with 4 (RGBA), 3 (RGB) or 1 (grayscale) bpp
+ * @param srcbpp bytes per pixel of srcdata
+ * @param srcwidth number of pixels in srcdata
+ * @param maskdata RGBA overlay pixels, stretched to srcwidth if needed
+ * @param maskbpp bytes per pixel of maskdata, must be 4
+ * @param maskwidth number of pixels in maskdata
+ * @param composeMode mode of composition
+ * @return YMAGINE_OK on success, otherwise YMAGINE_ERROR
+ */
 int
 Ymagine_composeLine(unsigned char *srcdata, int srcbpp, int srcwidth,
                     unsigned char *maskdata, int maskbpp, int maskwidth,
@@ -75,6 +88,9 @@ Ymagine_composeColor(Vbitmap *vbitmap, int color,
  * @brief Applies composition effect on the buffer included in the vbitmap
  * @ingroup Compose
  *
+ * Destination can be RGBA, rgbA, ARGB, Argb, RGB or grayscale. Overlay
+ * must be RGBA.
+ *
  * @param vbitmap pointer to a vbitmap that contains the buffer for the image
  * @param overlay pointer to a vbitmap that contains the buffer for the overlay
  * @param x horizontal starting position
@@ -86,6 +102,58 @@ int
 Ymagine_composeImage(Vbitmap *vbitmap, Vbitmap *overlay,
              int x, int y, ymagineCompose composeMode);
 
+/**
+ * Cache of resampled overlays, keyed by overlay and target size
+ * @ingroup Compose
+ */
+typedef struct YmagineOverlayCacheStruct YmagineOverlayCache;
+
+/**
+ * @brief Create a cache of resampled overlays
+ * @ingroup Compose
+ *
+ * A cache keeps a reference on each overlay it holds a resampled copy
+ * of. Overlays must not be modified while they are cached.
+ *
+ * @param maxentries number of resampled overlays kept, 0 for default
+ * @return pointer to cache, or NULL on failure
+ */
+YmagineOverlayCache*
+YmagineOverlayCache_Create(int maxentries);
+
+/**
+ * @brief Release a cache of resampled overlays, and everything it holds
+ * @ingroup Compose
+ *
+ * @param cache cache to release
+ */
+void
+YmagineOverlayCache_Release(YmagineOverlayCache *cache);
+
+/**
+ * @brief Compose an overlay stretched to a rectangle of the vbitmap
+ * @ingroup Compose
+ *
+ * Overlay is resampled to width x height with an area filter when
+ * shrunk and a bilinear filter when enlarged, then composed at (x, y)
+ * like Ymagine_composeImage.
+ *
+ * @param vbitmap pointer to a vbitmap that contains the buffer for the image
+ * @param overlay pointer to a RGBA vbitmap that contains the overlay
+ * @param x horizontal starting position
+ * @param y vertical starting position
+ * @param width width overlay is stretched to
+ * @param height height overlay is stretched to
+ * @param composeMode mode of composition
+ * @param cache optional cache of resampled overlays, may be NULL
+ * @return YMAGINE_OK on success, otherwise YMAGINE_ERROR
+ */
+int
+Ymagine_composeImageScaled(Vbitmap *vbitmap, Vbitmap *overlay,
+                           int x, int y, int width, int height,
+                           ymagineCompose composeMode,
+                           YmagineOverlayCache *cache);
+
 /**
  * @}
  */
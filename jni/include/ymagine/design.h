@@ -69,6 +69,22 @@ VbitmapOrbRenderTile(Vbitmap *canvas, int ntiles, int tileid, Ychannel* channeli
 int
 VbitmapOrbRenderTileBitmap(Vbitmap *canvas, int ntiles, int tileid, Vbitmap *srcbitmap);
 
+/**
+ * @brief Render all tiles of group orb concurrently
+ * @ingroup Design
+ *
+ * Each tile is decoded by its own worker and composed straight into its
+ * region of canvas. Same as calling VbitmapOrbRenderTile for every tile.
+ *
+ * @param canvas Vbitmap to render into
+ * @param ntiles total number of images to compose into canvas
+ * @param channelin array of ntiles input channels, one per tile
+ * @param nthreads maximum number of worker threads, 0 for one per CPU
+ * @return YMAGINE_OK if every tile got rendered
+ */
+int
+VbitmapOrbRender(Vbitmap *canvas, int ntiles, Ychannel **channelin, int nthreads);
+
 /**
  * @}
  */
@@ -39,6 +39,66 @@ typedef struct YmagineFormatOptionsStruct YmagineFormatOptions;
 typedef int (*YmagineFormatOptions_ProgressCB)(YmagineFormatOptions *options,
                                                int format, int width, int height);
 
+typedef int (*YmagineFormatOptions_PreviewCB)(YmagineFormatOptions *options,
+                                              Vbitmap *preview, int scan);
+
+/**
+ * @brief Statistics collected by a decoding, transcoding or encoding call
+ * @ingroup YmagineFormat
+ *
+ * Times are in nanoseconds, from a wall clock. Work done inside a single
+ * codec library call can't be told apart, so entropy decoding, IDCT and
+ * color conversion are all reported as decode, and the WEBP decoder,
+ * which scales internally, includes scaling into it as well.
+ */
+typedef struct {
+  /** Whole call */
+  int64_t total;
+  /** Parsing of image header */
+  int64_t parse;
+  /** Entropy decoding, IDCT and color conversion */
+  int64_t decode;
+  /** Scaling, cropping and color mode conversion of decoded lines */
+  int64_t scale;
+  /** Pixel shader */
+  int64_t shader;
+  /** Sharpening */
+  int64_t sharpen;
+  /** Encoding, including entropy coding of output */
+  int64_t encode;
+  /** Bytes read from input channel, each byte of input counted once */
+  int64_t bytesread;
+  /** Bytes written to output channel */
+  int64_t byteswritten;
+  /**
+   * Reads from input channel. On files and streams, each is a system call
+   * (or a call into Java), except for the few bytes read to probe format.
+   * Reads of a byte array channel are counted too, but make no call.
+   */
+  int64_t readcalls;
+  /** Writes to output channel, each at least one system call on files */
+  int64_t writecalls;
+  /** Peak amount of scratch memory held by transformers and decoders */
+  size_t scratchpeak;
+} YmagineStats;
+
+/**
+ * @brief Limits enforced while decoding, transcoding or encoding an image
+ * @ingroup YmagineFormat
+ *
+ * Limits are checked as soon as image header is parsed, and before any
+ * large buffer is allocated. An image exceeding them fails with
+ * YMAGINE_ERROR_LIMIT. A zero value means no limit.
+ */
+typedef struct {
+  /** Maximum width times height of input image */
+  int64_t maxpixels;
+  /** Maximum memory allocated for output bitmap, codec and scratch buffers, in bytes */
+  int64_t maxscratch;
+  /** Maximum number of frames of an animated image */
+  int maxframes;
+} YmagineLimits;
+
 #define YMAGINE_IMAGEFORMAT_UNKNOWN 0
 #define YMAGINE_IMAGEFORMAT_JPEG    1
 #define YMAGINE_IMAGEFORMAT_WEBP    2
@@ -54,6 +114,22 @@ typedef int (*YmagineFormatOptions_ProgressCB)(YmagineFormatOptions *options,
 #define YMAGINE_ADJUST_INNER        1
 #define YMAGINE_ADJUST_OUTER        2
 
+/* zlib strategies, for lossless formats */
+#define YMAGINE_ZSTRATEGY_AUTO      -1
+#define YMAGINE_ZSTRATEGY_DEFAULT   0
+#define YMAGINE_ZSTRATEGY_FILTERED  1
+#define YMAGINE_ZSTRATEGY_HUFFMAN   2
+#define YMAGINE_ZSTRATEGY_RLE       3
+
+/* PNG row filters, can be combined to let encoder pick the best per row */
+#define YMAGINE_PNG_FILTER_AUTO     -1
+#define YMAGINE_PNG_FILTER_NONE     0x08
+#define YMAGINE_PNG_FILTER_SUB      0x10
+#define YMAGINE_PNG_FILTER_UP       0x20
+#define YMAGINE_PNG_FILTER_AVG      0x40
+#define YMAGINE_PNG_FILTER_PAETH    0x80
+#define YMAGINE_PNG_FILTER_ALL      0xf8
+
 YmagineFormatOptions*
 YmagineFormatOptions_Create();
 
@@ -81,6 +157,36 @@ YmagineFormatOptions_setQuality(YmagineFormatOptions *options,
 int
 YmagineFormatOptions_normalizeQuality(YmagineFormatOptions *options);
 
+/**
+ * Search JPEG encoding quality instead of using a fixed one
+ *
+ * Output pixels are kept in memory and encoded again at each quality
+ * probed by a binary search, so decoding and scaling are done only once.
+ * Encoder picks the lowest quality whose SSIM against output pixels
+ * reaches minssim, lowered further if needed so output fits in maxbytes.
+ * If even lowest quality doesn't fit, lowest quality is used. Chosen
+ * quality is stored into these options, which hence must not be shared
+ * by images encoded concurrently, other than by jobs of
+ * YmagineTranscodeBatch().
+ *
+ * @param options YmagineFormatOptions options
+ * @param maxbytes largest output size in bytes, 0 for no size budget
+ * @param minssim smallest SSIM, between 0.0 and 1.0, 0.0 for no target
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setQualitySearch(YmagineFormatOptions *options,
+                                      int maxbytes, double minssim);
+
+/**
+ * Get quality chosen by last quality search
+ *
+ * @param options YmagineFormatOptions options, as given to encoder
+ *
+ * @return quality chosen, or -1 if no search was run
+ */
+int
+YmagineFormatOptions_getSearchedQuality(YmagineFormatOptions *options);
+
 YmagineFormatOptions*
 YmagineFormatOptions_setAccuracy(YmagineFormatOptions *options,
                                  int accuracy);
@@ -93,6 +199,65 @@ YmagineFormatOptions*
 YmagineFormatOptions_setProgressive(YmagineFormatOptions *options,
                                     int progressive);
 
+/**
+ * Set zlib compression level for lossless encoders (PNG)
+ *
+ * When not set, level is derived from accuracy (or quality if accuracy
+ * is not set either), else encoder defaults are used.
+ *
+ * @param options YmagineFormatOptions options
+ * @param level between 0 (store) and 9 (smallest), -1 for automatic
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setCompression(YmagineFormatOptions *options,
+                                    int level);
+
+/**
+ * Set zlib strategy for lossless encoders (PNG)
+ *
+ * @param options YmagineFormatOptions options
+ * @param strategy one of the YMAGINE_ZSTRATEGY constants
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setCompressionStrategy(YmagineFormatOptions *options,
+                                            int strategy);
+
+/**
+ * Set size of zlib history window for lossless encoders (PNG)
+ *
+ * @param options YmagineFormatOptions options
+ * @param windowbits base two logarithm of window size, between 8 and 15,
+ *        -1 for automatic
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setWindowBits(YmagineFormatOptions *options,
+                                   int windowbits);
+
+/**
+ * Set row filters PNG encoder may use
+ *
+ * @param options YmagineFormatOptions options
+ * @param filters combination of YMAGINE_PNG_FILTER flags, or
+ *        YMAGINE_PNG_FILTER_AUTO
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setPngFilters(YmagineFormatOptions *options,
+                                   int filters);
+
+/**
+ * Set number of threads encoders may use. Currently only used by the PNG
+ * encoder for large non-interlaced images, which are then compressed in
+ * parallel chunks. Output is a regular PNG, a bit larger than the one
+ * produced by a single thread.
+ *
+ * @param options YmagineFormatOptions options
+ * @param threads number of threads, 1 (default) to encode in the calling
+ *        thread only, 0 to use one per processor
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setThreads(YmagineFormatOptions *options,
+                                int threads);
+
 YmagineFormatOptions*
 YmagineFormatOptions_setSharpen(YmagineFormatOptions *options,
                                 float sigma);
@@ -219,6 +384,22 @@ YmagineFormatOptions_setCropRelative(YmagineFormatOptions *options,
                                      float xr, float yr,
                                      float widthr, float heightr);
 
+/**
+ * Choose region kept by YMAGINE_SCALE_CROP from image content
+ *
+ * Instead of keeping the center of the image (or of the crop region),
+ * keep the window of output aspect ratio with most edge energy, as
+ * found on a small preview decoded first. Stream input is read in
+ * memory once, to be decoded twice. Callbacks are only invoked for the
+ * final decoding. Ignored for rotated images.
+ *
+ * @param options YmagineFormatOptions options
+ * @param smartcrop non-zero to enable content-aware cropping
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setSmartCrop(YmagineFormatOptions *options,
+                                  int smartcrop);
+
 /**
  * Set mode for handling meta (e.g. Exif) on transcode
  *
@@ -262,6 +443,126 @@ void*
 YmagineFormatOptions_getData(YmagineFormatOptions *options);
 
 
+/**
+ * Request theme colors of the image, collected while decoding or transcoding
+ *
+ * Colors are accumulated from the decoded pixels as they stream through
+ * the scaler, so no second pass over the output is needed, and pixels
+ * don't need to be retained when transcoding. Results are stored into
+ * these options, which hence must not be shared by images decoded
+ * concurrently, other than by jobs of YmagineTranscodeBatch().
+ *
+ * @param options YmagineFormatOptions options
+ * @param ncolors maximum amount of theme colors, up to YMAGINE_THEME_MAXCOLORS,
+ *        0 (default) to collect none
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setThemeColors(YmagineFormatOptions *options,
+                                    int ncolors);
+
+/**
+ * Get theme colors collected by last decoding or transcoding
+ *
+ * Colors are the same as those returned by getThemeColors(), computed
+ * with YMAGINE_QUANTIZE_HISTOGRAM over the source region of the image.
+ *
+ * @param options YmagineFormatOptions options, as given to decoder
+ * @param colors array of at least maxcolors colors, in ARGB format
+ * @param scores array of at least maxcolors scores, or NULL
+ * @param maxcolors size of arrays
+ *
+ * @return amount of colors found, 0 if none was collected
+ */
+int
+YmagineFormatOptions_getThemeColors(YmagineFormatOptions *options,
+                                    int *colors, int *scores, int maxcolors);
+
+/**
+ * Collect statistics while decoding, transcoding or encoding
+ *
+ * Statistics are gathered at a small cost (a couple of clock reads per
+ * scan line), and are disabled by default. Like theme colors, results
+ * are stored into these options, which hence must not be shared by
+ * images processed concurrently, other than by jobs of
+ * YmagineTranscodeBatch().
+ *
+ * @param options YmagineFormatOptions options
+ * @param enable YTRUE to collect statistics, YFALSE (default) not to
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setStats(YmagineFormatOptions *options,
+                              YBOOL enable);
+
+/**
+ * Get statistics collected by last decoding, transcoding or encoding
+ *
+ * @param options YmagineFormatOptions options, as given to decoder
+ * @param stats record to fill
+ *
+ * @return If statistics were collected YMAGINE_OK, otherwise YMAGINE_ERROR
+ */
+int
+YmagineFormatOptions_getStats(YmagineFormatOptions *options,
+                              YmagineStats *stats);
+
+/**
+ * Set limits enforced for calls using these options
+ *
+ * @param options YmagineFormatOptions options
+ * @param limits limits to enforce, or NULL (default) to enforce default ones
+ *
+ * @see Ymagine_setDefaultLimits
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setLimits(YmagineFormatOptions *options,
+                               const YmagineLimits *limits);
+
+/**
+ * Set limits enforced for calls whose options don't set any
+ *
+ * Defaults apply process-wide, including to calls made without options.
+ * No limit is enforced until this is called.
+ *
+ * @param limits limits to enforce, or NULL to enforce none
+ */
+void
+Ymagine_setDefaultLimits(const YmagineLimits *limits);
+
+/**
+ * Get limits enforced for calls whose options don't set any
+ *
+ * @param limits record to fill
+ */
+void
+Ymagine_getDefaultLimits(YmagineLimits *limits);
+
+/**
+ * Default size of buffers used to read input and write output channels
+ */
+#define YMAGINE_IOBUFFER_DEFAULT (64 * 1024)
+
+/**
+ * Set size of buffers used to read input and write output channels
+ *
+ * Codecs read ahead and gather output into buffers of this size, so
+ * larger ones mean fewer, larger reads and writes, which pays off on
+ * pipes and network filesystems. Setting applies process-wide, to calls
+ * starting after it.
+ *
+ * @param size buffer size in bytes, clamped to [4KB..4MB], or 0 to
+ *        restore YMAGINE_IOBUFFER_DEFAULT
+ */
+void
+Ymagine_setIOBufferSize(int size);
+
+/**
+ * Get size of buffers used to read input and write output channels
+ *
+ * @return buffer size in bytes
+ */
+int
+Ymagine_getIOBufferSize();
+
 /**
  * Set callback function to be invoked during decoding and transcoding pipeline
  *
@@ -273,6 +574,32 @@ YmagineFormatOptions_setCallback(YmagineFormatOptions *options,
                                  YmagineFormatOptions_ProgressCB progresscb);
 
 
+/**
+ * Set callback receiving previews while decoding progressive JPEG images
+ *
+ * Instead of decoding all scans before outputting any line, input is
+ * consumed one scan at a time, and after the first scan, then every
+ * scaninterval scans, the image as refined so far is scaled and cropped
+ * to output size into a preview bitmap passed to the callback. Pixel
+ * shader, sharpening and composition are not applied to previews. The
+ * preview bitmap is reused for all previews of an image and released
+ * once decoding completes, so callback must copy whatever it keeps.
+ * Decoding ends as usual, into the target bitmap.
+ *
+ * Each preview costs an extra pass over the coefficients, and is only
+ * emitted when decoding into a bitmap, not when transcoding.
+ *
+ * @param options YmagineFormatOptions options
+ * @param previewcb Callback function, or NULL (default) for no preview.
+ *        Returning anything but YMAGINE_OK stops further previews
+ * @param scaninterval Number of scans between previews after first one,
+ *        0 for first one only
+ */
+YmagineFormatOptions*
+YmagineFormatOptions_setPreviewCallback(YmagineFormatOptions *options,
+                                        YmagineFormatOptions_PreviewCB previewcb,
+                                        int scaninterval);
+
 /**
  * Invoke callback for options
  *
@@ -377,6 +704,124 @@ int
 YmagineTranscode(Ychannel *channelin, Ychannel *channelout,
                  YmagineFormatOptions *options);
 
+/**
+ * Decoder and encoder objects kept alive from one image to the next
+ */
+typedef struct YmagineCodecContextStruct YmagineCodecContext;
+
+/**
+ * Create a codec context
+ *
+ * Codecs bound to a context reset their decompressor and compressor
+ * objects between images instead of destroying and creating them again,
+ * which saves most of the per-image setup cost of small images.
+ *
+ * @return a new context, or NULL on failure
+ */
+YmagineCodecContext*
+YmagineCodecContext_Create();
+
+/**
+ * Release a codec context, and all codec objects it keeps alive
+ *
+ * Context is unbound first if it is bound to the calling thread.
+ *
+ * @param context to release
+ */
+void
+YmagineCodecContext_Release(YmagineCodecContext *context);
+
+/**
+ * Bind a codec context to the calling thread
+ *
+ * All images decoded or encoded by this thread then use the objects
+ * kept by the context. A context must not be bound to more than one
+ * thread at a time.
+ *
+ * @param context to bind, or NULL to unbind current one
+ *
+ * @return YMAGINE_OK on success
+ */
+int
+YmagineCodecContext_Bind(YmagineCodecContext *context);
+
+/**
+ * Get codec context bound to the calling thread
+ *
+ * @return bound context, or NULL if none
+ */
+YmagineCodecContext*
+YmagineCodecContext_Current();
+
+/**
+ * One transcoding job, see YmagineTranscodeBatch()
+ */
+typedef struct {
+  /** raw data source */
+  Ychannel *channelin;
+  /** raw output */
+  Ychannel *channelout;
+  /** options given to Ymagine, or NULL for defaults */
+  YmagineFormatOptions *options;
+  /** result of transcoding, set to YMAGINE_OK on success */
+  int status;
+} YmagineTranscodeJob;
+
+/**
+ * Transcode a batch of images on a bounded pool of worker threads
+ *
+ * Each worker runs jobs one after the other, and keeps its decoder and
+ * encoder objects, and its scratch memory, alive from one job to the next.
+ * Jobs must not share channels. Each job runs on its own copy of its
+ * options, so options may be shared between jobs. Results of a job
+ * (theme colors, searched quality and statistics) are stored back into
+ * its options, unless these are shared with another job.
+ *
+ * @param jobs array of jobs, whose status field is set on return
+ * @param njobs number of jobs
+ * @param nthreads maximum number of worker threads, 0 for one per CPU
+ *
+ * @return YMAGINE_OK if all jobs succeeded, YMAGINE_ERROR otherwise
+ */
+int
+YmagineTranscodeBatch(YmagineTranscodeJob *jobs, int njobs, int nthreads);
+
+/**
+ * One output of a thumbnail ladder, see YmagineTranscodeLadder()
+ */
+typedef struct {
+  /** raw output */
+  Ychannel *channelout;
+  /** size, scale mode, crop, format and quality of this output, or NULL for defaults */
+  YmagineFormatOptions *options;
+  /** result of transcoding, set to YMAGINE_OK on success */
+  int status;
+} YmagineLadderOutput;
+
+/**
+ * Transcode one image into several outputs, decoding it only once
+ *
+ * Source is decoded a single time, at the smallest scale (in eighths of
+ * its size) still large enough for the largest output. Every output is
+ * then cropped, resampled and encoded from that decoded image, on up to
+ * nthreads worker threads. Progress callbacks of outputs are invoked once
+ * with the source dimensions, before decoding. Absolute crop regions are
+ * given in source coordinates, as for YmagineTranscode(). Results of each
+ * output are stored back into its options, unless these are shared with
+ * another output.
+ *
+ * @param channelin raw data source
+ * @param outputs array of outputs, whose status field is set on return
+ * @param noutputs number of outputs
+ * @param nthreads maximum number of worker threads, 0 for one per CPU
+ *
+ * @return YMAGINE_OK if all outputs succeeded, YMAGINE_ERROR otherwise
+ */
+int
+YmagineTranscodeLadder(Ychannel *channelin,
+                       YmagineLadderOutput *outputs, int noutputs,
+                       int nthreads);
+
 /**
  * Encode a Vbitmap
  *
@@ -461,6 +906,25 @@ int
 decodeWEBP(Ychannel *channel, Vbitmap *bitmap,
            YmagineFormatOptions *options);
 
+/**
+ * Decode a WEBP coming from a Ychannel into a NV21 buffer, i.e. a Y plane
+ * followed by an interleaved VU plane at half resolution. VP8 data is natively
+ * YUV 4:2:0, so this saves any RGB conversion. Scaling and cropping options are
+ * applied as for decodeWEBP(). The result can be given to
+ * VbitmapWriteNV21Buffer(), and must be released with Ymem_free().
+ *
+ * @param channel raw WEBP data source
+ * @param options options given to Ymagine, or NULL for defaults
+ * @param nv21 set to the newly allocated NV21 buffer
+ * @param width set to the width of the decoded image
+ * @param height set to the height of the decoded image
+ *
+ * @return YMAGINE_OK on success
+ */
+int
+decodeWEBPToNV21(Ychannel *channel, YmagineFormatOptions *options,
+                 unsigned char **nv21, int *width, int *height);
+
 /**
  * Encode a Vbitmap using WEBP
  *
@@ -28,9 +28,46 @@ VbitmapSeamMap_create(int width, int height);
 int
 VbitmapSeamMap_release(VbitmapSeamMap *seammap);
 
+/**
+ * @brief Compare two seam maps
+ * @ingroup Seam
+ *
+ * @param seammap1 First seam map
+ * @param seammap2 Second seam map
+ * @param x if not NULL, set to column of first difference, -1 if sizes differ
+ * @param y if not NULL, set to row of first difference, -1 if sizes differ
+ * @return YMAGINE_OK if both maps have same size and seams, else YMAGINE_ERROR
+ */
+int
+VbitmapSeamMap_compare(VbitmapSeamMap *seammap1, VbitmapSeamMap *seammap2,
+                       int *x, int *y);
+
+/** Recompute whole cumulative energy table after each seam */
+#define YMAGINE_SEAM_UPDATE_FULL        0
+/** Only recompute the part of the table affected by the previous seam */
+#define YMAGINE_SEAM_UPDATE_INCREMENTAL 1
+
 VbitmapSeamMap*
 Vbitmap_seamPrepare(Vbitmap *vbitmap);
 
+/**
+ * @brief Compute seam map, with control over speed of computation
+ * @ingroup Seam
+ *
+ * Vbitmap_seamPrepare() is the same as incremental updates with one
+ * seam per pass. Removing several seams per pass divides the number of
+ * passes, at the cost of a less optimal choice of seams, as seams after
+ * the first one of a pass don't see the energy left by previous ones.
+ *
+ * @param vbitmap Input image
+ * @param update YMAGINE_SEAM_UPDATE_FULL or YMAGINE_SEAM_UPDATE_INCREMENTAL,
+ *        only used when removing one seam per pass
+ * @param seamsperpass maximum number of non-overlapping seams removed per pass
+ * @return seam map, or NULL on error
+ */
+VbitmapSeamMap*
+Vbitmap_seamPrepareWithOptions(Vbitmap *vbitmap, int update, int seamsperpass);
+
 /**
  * @brief Resize using seam carving
  * @ingroup Seam
@@ -51,9 +88,40 @@ Vbitmap_seamRender(Vbitmap *vbitmap, VbitmapSeamMap *seamMap, int toremove);
 int
 Vbitmap_seamDump(VbitmapSeamMap *seamMap, Ychannel *channel);
 
+/** Gradient magnitude is sqrt(dx*dx + dy*dy) */
+#define YMAGINE_SOBEL_EXACT  0
+/** Gradient magnitude is approximated by |dx| + |dy| */
+#define YMAGINE_SOBEL_APPROX 1
+
+/**
+ * @brief Compute Sobel energy map
+ * @ingroup Seam
+ *
+ * Same as Vbitmap_sobelWithOptions() with exact magnitude, in the
+ * calling thread.
+ */
 int
 Vbitmap_sobel(Vbitmap *outbitmap, Vbitmap *input);
 
+/**
+ * @brief Compute Sobel energy map
+ * @ingroup Seam
+ *
+ * Output bitmap is resized to the size of input. Energy is written
+ * directly into each pixel of a GRAYSCALE output, and replicated into
+ * color channels, with opaque alpha, of a color one.
+ *
+ * @param outbitmap Output energy map
+ * @param input Input image
+ * @param magnitude YMAGINE_SOBEL_EXACT or YMAGINE_SOBEL_APPROX
+ * @param nthreads number of threads, each processing a band of rows,
+ *        0 for one per CPU
+ * @return YMAGINE_OK on success, else YMAGINE_ERROR
+ */
+int
+Vbitmap_sobelWithOptions(Vbitmap *outbitmap, Vbitmap *input,
+                         int magnitude, int nthreads);
+
 /**
  * @}
  */
@@ -79,9 +79,32 @@ TransformerRelease(Transformer* transformer);
 int
 TransformerSetWriter(Transformer *transformer, TransformerWriterFunc writer, void *writerdata);
 
+/* Statistics collected on input lines, may be combined */
+#define TRANSFORMER_STATS_NONE      0
+/* Luminance, and red, green and blue histograms */
+#define TRANSFORMER_STATS_HISTOGRAM 1
+/* Color histogram for TransformerGetThemeColors() */
+#define TRANSFORMER_STATS_THEME     2
+
 int
 TransformerSetStats(Transformer *transformer, int statsmode);
 
+/**
+ * @brief Get theme colors of all pixels pushed through transformer
+ * @ingroup Transformer
+ *
+ * Requires TRANSFORMER_STATS_THEME statistics, and can only be called
+ * once, after last line has been pushed.
+ *
+ * @param transformer that collected statistics
+ * @param ncol maximum amount of colors wanted
+ * @param colors array of at least ncol colors, in ARGB format
+ * @param scores array of at least ncol scores, or NULL
+ * @return amount of colors found
+ */
+int
+TransformerGetThemeColors(Transformer *transformer, int ncol, int *colors, int *scores);
+
 int
 TransformerSetScale(Transformer *transformer,
                     int srcw, int srch,
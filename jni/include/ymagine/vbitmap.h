@@ -423,6 +423,84 @@ VbitmapSetOrientation(Vbitmap *vbitmap, int orientation);
 double
 VbitmapComputePSNR(Vbitmap *vbitmap, Vbitmap *reference);
 
+/**
+ * @brief Compute structural similarity (SSIM) of two vbitmap
+ *
+ * Computed on luminance, over 8x8 windows. Bitmaps must have the same
+ * dimensions, of at least 8x8 pixels, and may differ in color mode.
+ *
+ * @return SSIM between 0 and 1 (identical), negative if computation failed
+ */
+double
+VbitmapComputeSSIM(Vbitmap *vbitmap, Vbitmap *reference);
+
+/**
+ * @brief Compute multi-scale structural similarity (MS-SSIM) of two vbitmap
+ *
+ * Same as VbitmapComputeSSIM, combined over up to 5 scales, each one
+ * half the size of the previous one. Small images use fewer scales.
+ *
+ * @return MS-SSIM between 0 and 1 (identical), negative if computation failed
+ */
+double
+VbitmapComputeMSSSIM(Vbitmap *vbitmap, Vbitmap *reference);
+
+/**
+ * @brief Statistics for the pool of Vbitmap backing stores
+ * @ingroup Vbitmap
+ *
+ * Hit rate is hits / (hits + misses).
+ */
+typedef struct {
+  /** Allocations served from a retained block */
+  unsigned long hits;
+  /** Allocations which had to call the system allocator */
+  unsigned long misses;
+  /** Released blocks given back to the system allocator */
+  unsigned long discards;
+  /** Number of blocks currently retained for reuse */
+  unsigned long blocksretained;
+  /** Bytes currently retained for reuse */
+  size_t bytesretained;
+  /** Maximum number of bytes the pool may retain */
+  size_t limit;
+} VbitmapPoolStats;
+
+/**
+ * @brief Set the maximum amount of memory retained by the buffer pool
+ * @ingroup Vbitmap
+ *
+ * Pixel buffers of memory Vbitmaps, and scratch buffers of Transformer and
+ * decoders, are bucketed by size and retained after release so they can be
+ * reused by the next image of a similar size. The pool is disabled (limit
+ * of 0) by default. Lowering the limit releases retained blocks immediately.
+ *
+ * @param maxbytes maximum number of bytes to retain, 0 to disable pooling
+ * @return If succesful YMAGINE_OK, otherwise YMAGINE_ERROR
+ */
+int
+VbitmapPoolSetLimit(size_t maxbytes);
+
+/**
+ * @brief Release all blocks currently retained by the buffer pool
+ * @ingroup Vbitmap
+ *
+ * @return If succesful YMAGINE_OK, otherwise YMAGINE_ERROR
+ */
+int
+VbitmapPoolTrim();
+
+/**
+ * @brief Get statistics of the buffer pool
+ * @ingroup Vbitmap
+ *
+ * @param stats record to fill
+ * @param reset if true, reset hits, misses and discards counters
+ * @return If succesful YMAGINE_OK, otherwise YMAGINE_ERROR
+ */
+int
+VbitmapPoolGetStats(VbitmapPoolStats *stats, YBOOL reset);
+
 /**
  * @}
  */
@@ -40,6 +40,12 @@ extern "C" {
 #define YMAGINE_OK    ((int)  0)
 #define YMAGINE_ERROR ((int) -1)
 
+/**
+ * returned instead of YMAGINE_ERROR when an image exceeds decode limits,
+ * see YmagineLimits
+ */
+#define YMAGINE_ERROR_LIMIT ((int) -2)
+
 /**
  * scale and leave a letterbox (black bars) around the image
  */
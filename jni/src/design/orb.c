@@ -48,81 +48,162 @@
 
 #include "orb.h"
 
+/* Sizes of orb mask kept resampled */
+#define ORB_MASK_SIZES 4
+
+/* Orb mask decoded once at its native size, and cache of its resampled
+   versions. Both live as long as the process */
+static pthread_mutex_t orbLock = PTHREAD_MUTEX_INITIALIZER;
+static Vbitmap *orbMask = NULL;
+static YmagineOverlayCache *orbMaskCache = NULL;
+
+/* Canvas locked once for all tiles rendered into it */
+typedef struct {
+  unsigned char *pixels;
+  int width;
+  int height;
+  int pitch;
+  int colormode;
+
+  int ntiles;
+  Ychannel **channels;
+  int *status;
+} OrbCanvas;
+
 static YINLINE int
 cell(int sz, int num, int total)
 {
   return ((sz * num) / total);
 }
 
-int VbitmapOrbLoad(Vbitmap *canvas, int sz)
+/* Return a reference to the orb mask resampled to sz x sz, or at native
+   size if sz isn't positive */
+static Vbitmap*
+orbMaskAcquire(int sz)
 {
-  int rc = YMAGINE_ERROR;
-
+  Vbitmap *base = NULL;
+  Vbitmap *mask;
+  YmagineOverlayCache *cache;
   Ychannel *channelin;
 
-  if (canvas != NULL) {
+  pthread_mutex_lock(&orbLock);
+  if (orbMask == NULL) {
     channelin = YchannelInitByteArray((const char*) ORB_png, ORB_png_len);
     if (channelin != NULL) {
-      YmagineFormatOptions *options = YmagineFormatOptions_Create();
-      if (options != NULL) {
-        if (sz > 0) {
-          int maxWidth = sz;
-          int maxHeight = sz;
-          int scaleMode = YMAGINE_SCALE_CROP;
-
-          YmagineFormatOptions_setResize(options, maxWidth, maxHeight, scaleMode);
-        }
-        if (YmagineDecode(canvas, channelin, options) == YMAGINE_OK) {
-          rc = YMAGINE_OK;
+      mask = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+      if (mask != NULL) {
+        if (YmagineDecode(mask, channelin, NULL) == YMAGINE_OK) {
+          orbMask = mask;
+        } else {
+          VbitmapRelease(mask);
         }
-        YmagineFormatOptions_Release(options);
-        options = NULL;
       }
+      YchannelResetBuffer(channelin);
+      YchannelRelease(channelin);
     }
+  }
+  if (orbMask != NULL && orbMaskCache == NULL) {
+    orbMaskCache = YmagineOverlayCache_Create(ORB_MASK_SIZES);
+  }
+  if (orbMask != NULL) {
+    base = VbitmapRetain(orbMask);
+  }
+  cache = orbMaskCache;
+  pthread_mutex_unlock(&orbLock);
 
-    YchannelResetBuffer(channelin);
-    YchannelRelease(channelin);
-    channelin = NULL;
+  if (base == NULL) {
+    return NULL;
+  }
+  if (sz <= 0 || (sz == VbitmapWidth(base) && sz == VbitmapHeight(base))) {
+    return base;
   }
 
+  mask = VbitmapOverlayScaled(cache, base, sz, sz);
+  VbitmapRelease(base);
+
+  return mask;
+}
+
+int VbitmapOrbLoad(Vbitmap *canvas, int sz)
+{
+  int rc = YMAGINE_ERROR;
+  Vbitmap *mask;
+  YmagineFormatOptions *options;
+
+  if (canvas == NULL) {
+    return rc;
+  }
+
+  mask = orbMaskAcquire(sz);
+  if (mask == NULL) {
+    return rc;
+  }
+
+  options = YmagineFormatOptions_Create();
+  if (options != NULL) {
+    if (sz > 0) {
+      YmagineFormatOptions_setResize(options, sz, sz, YMAGINE_SCALE_CROP);
+    }
+    rc = YmagineDecodeCopy(canvas, mask, options);
+    YmagineFormatOptions_Release(options);
+  }
+  VbitmapRelease(mask);
+
   return rc;
 }
 
+static void
+tileRect(Vrect *rect, int canvasw, int canvash, int ntiles, int tileid)
+{
+  if (ntiles == 1) {
+    rect->x = 0;
+    rect->y = 0;
+    rect->width = canvasw;
+    rect->height = canvash;
+  } else if (ntiles == 2) {
+    rect->x = cell(canvasw, tileid % 2, 2);
+    rect->y = cell(canvash, tileid / 2, 1);
+    rect->width = cell(canvasw, (tileid % 2) + 1, 2) - rect->x;
+    rect->height = cell(canvash, (tileid / 2) + 1, 1) - rect->y;
+  } else if (ntiles == 3) {
+    if (tileid == 0) {
+      rect->x = 0;
+      rect->y = 0;
+      rect->width = cell(canvasw, 1, 2);
+      rect->height = canvash;
+    } else {
+      rect->x = cell(canvasw, 1, 2);
+      rect->y = cell(canvash, (tileid - 1) % 2, 2);
+      rect->width = cell(canvasw, 2, 2) - rect->x;
+      rect->height = cell(canvash, ((tileid - 1) % 2) + 1, 2) - rect->y;
+    }
+  } else {
+    rect->x = cell(canvasw, tileid % 2, 2);
+    rect->y = cell(canvash, tileid / 2, 2);
+    rect->width = cell(canvasw, (tileid % 2) + 1, 2) - rect->x;
+    rect->height = cell(canvash, (tileid / 2) + 1, 2) - rect->y;
+  }
+}
+
 static int
-tileRender(Vbitmap *canvas, int ntiles, int tileid, Ychannel* channelin, Vbitmap *srcbitmap)
+tileRender(OrbCanvas *orb, int ntiles, int tileid, Ychannel* channelin, Vbitmap *srcbitmap)
 {
-  int rc;
-  int maxWidth = -1;
-  int maxHeight = -1;
+  int rc = YMAGINE_ERROR;
   /* scaleMode can be YMAGINE_SCALE_CROP or YMAGINE_SCALE_LETTERBOX */
   int scaleMode = YMAGINE_SCALE_CROP;
-  /* Fit mode */
-  int adjustMode = YMAGINE_ADJUST_NONE;
   /* metaMode can be one of YMAGINE_METAMODE_ALL, YMAGINE_METAMODE_COMMENTS,
      YMAGINE_METAMODE_NONE or YMAGINE_METAMODE_DEFAULT */
   int metaMode = YMAGINE_METAMODE_DEFAULT;
-  int quality = -1;
-  int accuracy = -1;
-  int subsampling = -1;
-  int progressive = -1;
-  float sharpen = 0.0f;
-  float blur = 0.0f;
-  float rotate = 0.0f;
+  int format;
 #if YMAGINE_PROFILE
   int profile = 0;
   NSTYPE start = 0;
   NSTYPE end = 0;
-  NSTYPE start_decode = 0;
-  NSTYPE end_decode = 0;
 #endif
   YmagineFormatOptions *options = NULL;
-  Vbitmap *vbitmap = NULL;
-  int canvasw;
-  int canvash;
-  int tilex;
-  int tiley;
-  int tilew;
-  int tileh;
+  Vbitmap *tile;
+  Vbitmap *vbitmap;
+  Vrect rect;
 
 #if YMAGINE_PROFILE
   if (profile) {
@@ -130,9 +211,6 @@ tileRender(Vbitmap *canvas, int ntiles, int tileid, Ychannel* channelin, Vbitmap
   }
 #endif
 
-  canvasw = VbitmapWidth(canvas);
-  canvash = VbitmapHeight(canvas);
-
   if (ntiles > 4) {
     ntiles = 4;
   }
@@ -141,119 +219,177 @@ tileRender(Vbitmap *canvas, int ntiles, int tileid, Ychannel* channelin, Vbitmap
     return YMAGINE_OK;
   }
 
-  if (ntiles == 1) {
-    tilex = 0;
-    tiley = 0;
-    tilew = canvasw;
-    tileh = canvash;
-  } else if (ntiles == 2) {
-    tilex = cell(canvasw, tileid % 2, 2);
-    tiley = cell(canvash, tileid / 2, 1);
-    tilew = cell(canvasw, (tileid % 2) + 1, 2) - tilex;
-    tileh = cell(canvash, (tileid / 2) + 1, 1) - tiley;
-  } else if (ntiles == 3) {
-    tilex = cell(canvasw, tileid % 2, 2);
-    tiley = cell(canvash, tileid / 2, 2);
-    tilew = cell(canvasw, (tileid % 2) + 1, 2) - tilex;
-    if (tileid == 0) {
-      tilex = 0;
-      tiley = 0;
-      tilew = cell(canvasw, 1, 2) - tilex;
-      tileh = canvash;
-    } else {
-      tilex = cell(canvasw, 1, 2);
-      tiley = cell(canvash, (tileid - 1) % 2, 2);
-      tilew = cell(canvasw, 2, 2) - tilex;
-      tileh = cell(canvash, ((tileid - 1) % 2) + 1, 2) - tiley;
-    }
-  } else {
-    tilex = cell(canvasw, tileid % 2, 2);
-    tiley = cell(canvash, tileid / 2, 2);
-    tilew = cell(canvasw, (tileid % 2) + 1, 2) - tilex;
-    tileh = cell(canvash, (tileid / 2) + 1, 2) - tiley;
+  tileRect(&rect, orb->width, orb->height, ntiles, tileid);
+  if (rect.width <= 0 || rect.height <= 0) {
+    return YMAGINE_OK;
   }
 
-  maxWidth = tilew;
-  maxHeight = tileh;
-
-  rc = YMAGINE_ERROR;
+  /* Tile is a view on its region of canvas, so tiles can be rendered
+     concurrently without touching the canvas object itself */
+  tile = VbitmapInitStatic(orb->colormode, rect.width, rect.height, orb->pitch,
+                           orb->pixels + rect.y * orb->pitch +
+                           rect.x * colorBpp(orb->colormode));
+  if (tile == NULL) {
+    return rc;
+  }
 
   options = YmagineFormatOptions_Create();
   if (options != NULL) {
-    YmagineFormatOptions_setResize(options, maxWidth, maxHeight, scaleMode);
-    YmagineFormatOptions_setQuality(options, quality);
-    YmagineFormatOptions_setAccuracy(options, accuracy);
+    YmagineFormatOptions_setResize(options, rect.width, rect.height, scaleMode);
     YmagineFormatOptions_setMetaMode(options, metaMode);
-    if (subsampling >= 0) {
-      YmagineFormatOptions_setSubsampling(options, subsampling);
-    }
-    if (progressive >= 0) {
-      YmagineFormatOptions_setProgressive(options, progressive);
-    }
-    if (sharpen > 0.0f) {
-      YmagineFormatOptions_setSharpen(options, sharpen);
-    }
-    if (blur > 0.0f) {
-      YmagineFormatOptions_setBlur(options, blur);
-    }
-    if (rotate != 0.0f) {
-      YmagineFormatOptions_setRotate(options, rotate);
+    YmagineFormatOptions_setAdjust(options, YMAGINE_ADJUST_NONE);
+
+    if (channelin != NULL) {
+      format = YmagineFormat(channelin);
+    } else {
+      format = YMAGINE_IMAGEFORMAT_UNKNOWN;
     }
-    YmagineFormatOptions_setAdjust(options, adjustMode);
 
-    vbitmap = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
-    if (vbitmap != NULL) {
-#if YMAGINE_PROFILE
-      start_decode = NSTIME();
-#endif
+    if (srcbitmap != NULL ||
+        format == YMAGINE_IMAGEFORMAT_JPEG || format == YMAGINE_IMAGEFORMAT_PNG) {
+      /* Decoder output is composed straight onto the mask in canvas */
+      YmagineFormatOptions_setResizable(options, 0);
+      options->composemode = YMAGINE_COMPOSE_BUMP;
       if (channelin != NULL) {
-        rc = YmagineDecode(vbitmap, channelin, options);
-      } else if (srcbitmap != NULL) {
-        rc = YmagineDecodeCopy(vbitmap, srcbitmap, options);
+        rc = YmagineDecode(tile, channelin, options);
       } else {
-        rc = YMAGINE_ERROR;
-      }
-#if YMAGINE_PROFILE
-      end_decode = NSTIME();
-      if (profile) {
-        ALOGI("Decoded image %dx%d in %.2f ms\n",
-              VbitmapWidth(vbitmap), VbitmapHeight(vbitmap),
-              ((double) (end_decode - start_decode)) / 1000000.0);
+        rc = YmagineDecodeCopy(tile, srcbitmap, options);
       }
- #endif
-
-      if (rc == YMAGINE_OK) {
-        VbitmapRegionSelect(canvas, tilex, tiley, tilew, tileh);
-        Ymagine_composeImage(canvas, vbitmap, 0, 0, YMAGINE_COMPOSE_BUMP);
-        VbitmapRegionReset(canvas);
-
-#if YMAGINE_PROFILE
-        if (profile) {
-          end = NSTIME();
-          ALOGI("Rendered orb tile %d/%d in %.2f ms\n",
-                tileid, ntiles,
-          ((double) (end - start)) / 1000000.0);
+    } else if (channelin != NULL) {
+      /* Decoders without a transformer need an intermediate bitmap */
+      vbitmap = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+      if (vbitmap != NULL) {
+        rc = YmagineDecode(vbitmap, channelin, options);
+        if (rc == YMAGINE_OK) {
+          rc = Ymagine_composeImageScaled(tile, vbitmap, 0, 0,
+                                          rect.width, rect.height,
+                                          YMAGINE_COMPOSE_BUMP, NULL);
         }
-#endif
+        VbitmapRelease(vbitmap);
       }
-      VbitmapRelease(vbitmap);
     }
 
     YmagineFormatOptions_Release(options);
     options = NULL;
   }
 
+  VbitmapRelease(tile);
+
+#if YMAGINE_PROFILE
+  if (profile && rc == YMAGINE_OK) {
+    end = NSTIME();
+    ALOGI("Rendered orb tile %d/%d in %.2f ms\n",
+          tileid, ntiles,
+          ((double) (end - start)) / 1000000.0);
+  }
+#endif
+
   return rc;
 }
 
+static int
+orbCanvasLock(OrbCanvas *orb, Vbitmap *canvas)
+{
+  if (canvas == NULL || VbitmapLock(canvas) != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+
+  orb->pixels = VbitmapBuffer(canvas);
+  orb->width = VbitmapWidth(canvas);
+  orb->height = VbitmapHeight(canvas);
+  orb->pitch = VbitmapPitch(canvas);
+  orb->colormode = VbitmapColormode(canvas);
+  orb->ntiles = 0;
+  orb->channels = NULL;
+  orb->status = NULL;
+
+  if (orb->pixels == NULL) {
+    VbitmapUnlock(canvas);
+    return YMAGINE_ERROR;
+  }
+
+  return YMAGINE_OK;
+}
+
+static void
+orbTileJob(void *data, int idx)
+{
+  OrbCanvas *orb = (OrbCanvas*) data;
+
+  if (orb->channels[idx] == NULL) {
+    orb->status[idx] = YMAGINE_ERROR;
+  } else {
+    orb->status[idx] = tileRender(orb, orb->ntiles, idx, orb->channels[idx], NULL);
+  }
+}
+
 int
 VbitmapOrbRenderTile(Vbitmap *canvas, int ntiles, int tileid, Ychannel* channelin)
 {
-  return tileRender(canvas, ntiles, tileid, channelin, NULL);
+  OrbCanvas orb;
+  int rc;
+
+  if (orbCanvasLock(&orb, canvas) != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+  rc = tileRender(&orb, ntiles, tileid, channelin, NULL);
+  VbitmapUnlock(canvas);
+
+  return rc;
 }
 
 int
 VbitmapOrbRenderTileBitmap(Vbitmap *canvas, int ntiles, int tileid, Vbitmap *srcbitmap)
 {
-  return tileRender(canvas, ntiles, tileid, NULL, srcbitmap);
+  OrbCanvas orb;
+  int rc;
+
+  if (orbCanvasLock(&orb, canvas) != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+  rc = tileRender(&orb, ntiles, tileid, NULL, srcbitmap);
+  VbitmapUnlock(canvas);
+
+  return rc;
+}
+
+int
+VbitmapOrbRender(Vbitmap *canvas, int ntiles, Ychannel **channelin, int nthreads)
+{
+  OrbCanvas orb;
+  int status[4];
+  int rc = YMAGINE_OK;
+  int i;
+
+  if (channelin == NULL || ntiles <= 0) {
+    return YMAGINE_ERROR;
+  }
+  if (orbCanvasLock(&orb, canvas) != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+
+  orb.ntiles = ntiles;
+  orb.channels = channelin;
+  orb.status = status;
+
+  /* Tiles past the fourth one are never rendered */
+  if (ntiles > 4) {
+    ntiles = 4;
+  }
+  for (i = 0; i < ntiles; i++) {
+    status[i] = YMAGINE_ERROR;
+  }
+
+  if (BatchRun(orbTileJob, &orb, ntiles, nthreads) != YMAGINE_OK) {
+    rc = YMAGINE_ERROR;
+  }
+  VbitmapUnlock(canvas);
+
+  for (i = 0; i < ntiles; i++) {
+    if (status[i] != YMAGINE_OK) {
+      rc = YMAGINE_ERROR;
+    }
+  }
+
+  return rc;
 }
@@ -268,6 +268,63 @@ composeColorize(unsigned char *output,
   output[3] = source[3];
 }
 
+/*
+ * Destinations other than RGBA are composed through a temporary RGBA
+ * pixel, so every mode has the exact same semantic on all of them.
+ * Opaque destinations are loaded with full alpha, and alpha of result
+ * is dropped when storing it back.
+ */
+static YINLINE void
+composeLoadRGB(const unsigned char *pixel, unsigned char *rgba)
+{
+  rgba[0] = pixel[0];
+  rgba[1] = pixel[1];
+  rgba[2] = pixel[2];
+  rgba[3] = MAX_VAL;
+}
+
+static YINLINE void
+composeStoreRGB(const unsigned char *rgba, unsigned char *pixel)
+{
+  pixel[0] = rgba[0];
+  pixel[1] = rgba[1];
+  pixel[2] = rgba[2];
+}
+
+static YINLINE void
+composeLoadARGB(const unsigned char *pixel, unsigned char *rgba)
+{
+  rgba[0] = pixel[1];
+  rgba[1] = pixel[2];
+  rgba[2] = pixel[3];
+  rgba[3] = pixel[0];
+}
+
+static YINLINE void
+composeStoreARGB(const unsigned char *rgba, unsigned char *pixel)
+{
+  pixel[0] = rgba[3];
+  pixel[1] = rgba[0];
+  pixel[2] = rgba[1];
+  pixel[3] = rgba[2];
+}
+
+static YINLINE void
+composeLoadGray(const unsigned char *pixel, unsigned char *rgba)
+{
+  rgba[0] = pixel[0];
+  rgba[1] = pixel[0];
+  rgba[2] = pixel[0];
+  rgba[3] = MAX_VAL;
+}
+
+static YINLINE void
+composeStoreGray(const unsigned char *rgba, unsigned char *pixel)
+{
+  /* Y = 0.2126 R + 0.7152 G + 0.0722 B */
+  pixel[0] = (218 * rgba[0] + 732 * rgba[1] + 74 * rgba[2]) >> 10;
+}
+
 #define COMPOSE_LOOP(pixels, width, bpp,                                 \
                      overlay, overlaybpp,                                \
                      composemethod)                                      \
@@ -280,6 +337,21 @@ composeColorize(unsigned char *output,
     }                                                                    \
 }
 
+#define COMPOSE_LOOP_CONVERT(pixels, width, bpp,                         \
+                             overlay, overlaybpp,                        \
+                             composemethod, load, store)                 \
+{                                                                        \
+    int i;                                                               \
+    unsigned char rgba[4];                                               \
+    for (i = 0; i < width; i++) {                                        \
+        load(pixels, rgba);                                              \
+        composemethod(rgba, rgba, overlay);                              \
+        store(rgba, pixels);                                             \
+        pixels += bpp;                                                   \
+        overlay += overlaybpp;                                           \
+    }                                                                    \
+}
+
 #define COMPOSE_LOOP_SCALE(pixels, width, bpp,                           \
                            overlay, overlaywidth, overlaybpp,            \
                            composemethod)                                \
@@ -288,78 +360,230 @@ composeColorize(unsigned char *output,
     int overlayi;                                                        \
     unsigned char *current;                                              \
     for (i = 0; i < width; i++) {                                        \
-        overlayi = (i * (overlaywidth - 1)) / (width - 1);               \
+        overlayi = (width > 1) ?                                         \
+          (i * (overlaywidth - 1)) / (width - 1) : 0;                    \
         current = overlay + overlaybpp * overlayi;                       \
         composemethod(pixels, pixels, current);                          \
         pixels += bpp;                                                   \
     }                                                                    \
 }
 
-static YINLINE int
-composeLine(unsigned char *source, unsigned char *overlay, 
-                int bpp, int overlaybpp, int width,
+#define COMPOSE_LOOP_SCALE_CONVERT(pixels, width, bpp,                   \
+                                   overlay, overlaywidth, overlaybpp,    \
+                                   composemethod, load, store)           \
+{                                                                        \
+    int i;                                                               \
+    int overlayi;                                                        \
+    unsigned char *current;                                              \
+    unsigned char rgba[4];                                               \
+    for (i = 0; i < width; i++) {                                        \
+        overlayi = (width > 1) ?                                         \
+          (i * (overlaywidth - 1)) / (width - 1) : 0;                    \
+        current = overlay + overlaybpp * overlayi;                       \
+        load(pixels, rgba);                                              \
+        composemethod(rgba, rgba, current);                              \
+        store(rgba, pixels);                                             \
+        pixels += bpp;                                                   \
+    }                                                                    \
+}
+
+/* Expand loop for the compose method of every mode */
+#define COMPOSE_DISPATCH(composeMode, rc, loop)                          \
+  switch (composeMode) {                                                 \
+  case YMAGINE_COMPOSE_REPLACE:                                          \
+    loop(composeReplace);                                                \
+    break;                                                               \
+  case YMAGINE_COMPOSE_OVER:                                             \
+    loop(composeOver);                                                   \
+    break;                                                               \
+  case YMAGINE_COMPOSE_UNDER:                                            \
+    loop(composeUnder);                                                  \
+    break;                                                               \
+  case YMAGINE_COMPOSE_PLUS:                                             \
+    loop(composePlus);                                                   \
+    break;                                                               \
+  case YMAGINE_COMPOSE_MINUS:                                            \
+    loop(composeMinus);                                                  \
+    break;                                                               \
+  case YMAGINE_COMPOSE_ADD:                                              \
+    loop(composeAdd);                                                    \
+    break;                                                               \
+  case YMAGINE_COMPOSE_SUBTRACT:                                         \
+    loop(composeSubtract);                                               \
+    break;                                                               \
+  case YMAGINE_COMPOSE_DIFFERENCE:                                       \
+    loop(composeDifference);                                             \
+    break;                                                               \
+  case YMAGINE_COMPOSE_BUMP:                                             \
+    loop(composeBump);                                                   \
+    break;                                                               \
+  case YMAGINE_COMPOSE_MAP:                                              \
+    loop(composeMap);                                                    \
+    break;                                                               \
+  case YMAGINE_COMPOSE_MIX:                                              \
+    loop(composeMix);                                                    \
+    break;                                                               \
+  case YMAGINE_COMPOSE_MULT:                                             \
+    loop(composeMult);                                                   \
+    break;                                                               \
+  case YMAGINE_COMPOSE_LUMINANCE:                                        \
+    loop(composeLuminance);                                              \
+    break;                                                               \
+  case YMAGINE_COMPOSE_LUMINANCEINV:                                     \
+    loop(composeLuminanceInv);                                           \
+    break;                                                               \
+  case YMAGINE_COMPOSE_COLORIZE:                                         \
+    loop(composeColorize);                                               \
+    break;                                                               \
+  default:                                                               \
+    /* Wrong composition mode */                                         \
+    ALOGE("Specified composition mode doesn't exist");                   \
+    rc = YMAGINE_ERROR;                                                  \
+    break;                                                               \
+  }
+
+#define COMPOSE_LINE_RGBA(method)                                        \
+  COMPOSE_LOOP(source, width, 4, overlay, overlaybpp, method)
+#define COMPOSE_LINE_RGB(method)                                         \
+  COMPOSE_LOOP_CONVERT(source, width, 3, overlay, overlaybpp, method,    \
+                       composeLoadRGB, composeStoreRGB)
+#define COMPOSE_LINE_ARGB(method)                                        \
+  COMPOSE_LOOP_CONVERT(source, width, 4, overlay, overlaybpp, method,    \
+                       composeLoadARGB, composeStoreARGB)
+#define COMPOSE_LINE_GRAY(method)                                        \
+  COMPOSE_LOOP_CONVERT(source, width, 1, overlay, overlaybpp, method,    \
+                       composeLoadGray, composeStoreGray)
+
+#define COMPOSE_LINE_SCALE_RGBA(method)                                  \
+  COMPOSE_LOOP_SCALE(source, width, 4, overlay, overlaywidth, overlaybpp, \
+                     method)
+#define COMPOSE_LINE_SCALE_RGB(method)                                   \
+  COMPOSE_LOOP_SCALE_CONVERT(source, width, 3, overlay, overlaywidth,    \
+                             overlaybpp, method,                         \
+                             composeLoadRGB, composeStoreRGB)
+#define COMPOSE_LINE_SCALE_ARGB(method)                                  \
+  COMPOSE_LOOP_SCALE_CONVERT(source, width, 4, overlay, overlaywidth,    \
+                             overlaybpp, method,                         \
+                             composeLoadARGB, composeStoreARGB)
+#define COMPOSE_LINE_SCALE_GRAY(method)                                  \
+  COMPOSE_LOOP_SCALE_CONVERT(source, width, 1, overlay, overlaywidth,    \
+                             overlaybpp, method,                         \
+                             composeLoadGray, composeStoreGray)
+
+static YINLINE YBOOL
+composeSupported(int colormode)
+{
+  switch (colormode) {
+  case VBITMAP_COLOR_RGBA:
+  case VBITMAP_COLOR_rgbA:
+  case VBITMAP_COLOR_RGB:
+  case VBITMAP_COLOR_ARGB:
+  case VBITMAP_COLOR_Argb:
+  case VBITMAP_COLOR_GRAYSCALE:
+    return YTRUE;
+  default:
+    return YFALSE;
+  }
+}
+
+/*
+ * Common modes on a line of overlay pixels, without going through the
+ * per-pixel functions. Loops have no branch and walk bytes in order, so
+ * compiler can vectorize them. Results are the same as generic loops.
+ * Returns YTRUE if line was handled.
+ */
+static YINLINE YOPTIMIZE_SPEED YBOOL
+composeLineFast(unsigned char *source, unsigned char *overlay,
+                int colormode, int overlaybpp, int width,
                 int composeMode)
+{
+  int i;
+  int alpha;
+
+  if (overlaybpp != 4) {
+    return YFALSE;
+  }
+
+  if (colormode == VBITMAP_COLOR_RGBA || colormode == VBITMAP_COLOR_rgbA) {
+    if (composeMode == YMAGINE_COMPOSE_PLUS) {
+      for (i = 0; i < 4 * width; i++) {
+        source[i] = COMPOSE_PLUS(source[i], overlay[i]);
+      }
+      return YTRUE;
+    }
+    if (composeMode == YMAGINE_COMPOSE_MULT) {
+      for (i = 0; i < 4 * width; i++) {
+        source[i] = COMPOSE_MULT(source[i], overlay[i]);
+      }
+      return YTRUE;
+    }
+  } else if (colormode == VBITMAP_COLOR_RGB) {
+    if (composeMode == YMAGINE_COMPOSE_PLUS) {
+      for (i = 0; i < width; i++) {
+        source[3 * i + 0] = COMPOSE_PLUS(source[3 * i + 0], overlay[4 * i + 0]);
+        source[3 * i + 1] = COMPOSE_PLUS(source[3 * i + 1], overlay[4 * i + 1]);
+        source[3 * i + 2] = COMPOSE_PLUS(source[3 * i + 2], overlay[4 * i + 2]);
+      }
+      return YTRUE;
+    }
+    if (composeMode == YMAGINE_COMPOSE_MULT) {
+      for (i = 0; i < width; i++) {
+        source[3 * i + 0] = COMPOSE_MULT(source[3 * i + 0], overlay[4 * i + 0]);
+        source[3 * i + 1] = COMPOSE_MULT(source[3 * i + 1], overlay[4 * i + 1]);
+        source[3 * i + 2] = COMPOSE_MULT(source[3 * i + 2], overlay[4 * i + 2]);
+      }
+      return YTRUE;
+    }
+    if (composeMode == YMAGINE_COMPOSE_OVER) {
+      /* Opaque destination stays opaque, so output alpha is always 255,
+         and a transparent overlay pixel leaves destination unchanged */
+      for (i = 0; i < width; i++) {
+        alpha = overlay[4 * i + 3];
+        source[3 * i + 0] = (alpha * overlay[4 * i + 0] +
+                             (MAX_VAL - alpha) * source[3 * i + 0]) / MAX_VAL;
+        source[3 * i + 1] = (alpha * overlay[4 * i + 1] +
+                             (MAX_VAL - alpha) * source[3 * i + 1]) / MAX_VAL;
+        source[3 * i + 2] = (alpha * overlay[4 * i + 2] +
+                             (MAX_VAL - alpha) * source[3 * i + 2]) / MAX_VAL;
+      }
+      return YTRUE;
+    }
+  }
+
+  return YFALSE;
+}
+
+static YINLINE int
+composeLine(unsigned char *source, unsigned char *overlay,
+            int colormode, int overlaybpp, int width,
+            int composeMode)
 {
   int rc = YMAGINE_ERROR;
 
-  if (bpp != 4) return rc;
+  if (!composeSupported(colormode)) return rc;
   if (overlaybpp != 0 && overlaybpp != 4) return rc;
   if (width <= 0) return rc;
   if (source == NULL || overlay == NULL) return rc;
 
   rc = YMAGINE_OK;
 
-  switch (composeMode) {
-  case YMAGINE_COMPOSE_REPLACE:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeReplace);
-    break;
-  case YMAGINE_COMPOSE_OVER:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeOver);
-    break;
-  case YMAGINE_COMPOSE_UNDER:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeUnder);
-    break;
-  case YMAGINE_COMPOSE_PLUS:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composePlus);
-    break;
-  case YMAGINE_COMPOSE_MINUS:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeMinus);
-    break;
-  case YMAGINE_COMPOSE_ADD:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeAdd);
-    break;
-  case YMAGINE_COMPOSE_SUBTRACT:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeSubtract);
-    break;
-  case YMAGINE_COMPOSE_DIFFERENCE:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeDifference);
-    break;
-  case YMAGINE_COMPOSE_BUMP:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeBump);
-    break;
-  case YMAGINE_COMPOSE_MAP:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeMap);
-    break;
-  case YMAGINE_COMPOSE_MIX:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeMix);
-    break;
-  case YMAGINE_COMPOSE_MULT:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeMult);
-    break;
+  if (composeLineFast(source, overlay, colormode, overlaybpp, width, composeMode)) {
+    return rc;
+  }
 
-  case YMAGINE_COMPOSE_LUMINANCE:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeLuminance);
+  switch (colormode) {
+  case VBITMAP_COLOR_RGB:
+    COMPOSE_DISPATCH(composeMode, rc, COMPOSE_LINE_RGB);
     break;
-  case YMAGINE_COMPOSE_LUMINANCEINV:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeLuminanceInv);
+  case VBITMAP_COLOR_ARGB:
+  case VBITMAP_COLOR_Argb:
+    COMPOSE_DISPATCH(composeMode, rc, COMPOSE_LINE_ARGB);
     break;
-  case YMAGINE_COMPOSE_COLORIZE:
-    COMPOSE_LOOP(source, width, bpp, overlay, overlaybpp, composeColorize);
+  case VBITMAP_COLOR_GRAYSCALE:
+    COMPOSE_DISPATCH(composeMode, rc, COMPOSE_LINE_GRAY);
     break;
   default:
-    /* Wrong composition mode */
-    ALOGE("Specified composition mode doesn't exist");
-    rc = YMAGINE_ERROR;
+    COMPOSE_DISPATCH(composeMode, rc, COMPOSE_LINE_RGBA);
     break;
   }
 
@@ -368,89 +592,103 @@ composeLine(unsigned char *source, unsigned char *overlay,
 
 static YINLINE int
 composeLineScale(unsigned char *source, unsigned char *overlay,
-                 int bpp, int overlaybpp,
+                 int colormode, int overlaybpp,
                  int width, int overlaywidth,
                  int composeMode)
 {
   int rc = YMAGINE_ERROR;
 
-  if (bpp != 4) return rc;
+  if (!composeSupported(colormode)) return rc;
   if (overlaybpp != 0 && overlaybpp != 4) return rc;
   if (width <= 0) return rc;
   if (source == NULL || overlay == NULL) return rc;
 
   rc = YMAGINE_OK;
 
-  switch (composeMode) {
-  case YMAGINE_COMPOSE_REPLACE:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeReplace);
-    break;
-  case YMAGINE_COMPOSE_OVER:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeOver);
-    break;
-  case YMAGINE_COMPOSE_UNDER:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeUnder);
-    break;
-  case YMAGINE_COMPOSE_PLUS:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composePlus);
-    break;
-  case YMAGINE_COMPOSE_MINUS:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeMinus);
-    break;
-  case YMAGINE_COMPOSE_ADD:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeAdd);
-    break;
-  case YMAGINE_COMPOSE_SUBTRACT:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeSubtract);
-    break;
-  case YMAGINE_COMPOSE_DIFFERENCE:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeDifference);
-    break;
-  case YMAGINE_COMPOSE_BUMP:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeBump);
+  switch (colormode) {
+  case VBITMAP_COLOR_RGB:
+    COMPOSE_DISPATCH(composeMode, rc, COMPOSE_LINE_SCALE_RGB);
     break;
-  case YMAGINE_COMPOSE_MAP:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeMap);
+  case VBITMAP_COLOR_ARGB:
+  case VBITMAP_COLOR_Argb:
+    COMPOSE_DISPATCH(composeMode, rc, COMPOSE_LINE_SCALE_ARGB);
     break;
-  case YMAGINE_COMPOSE_MIX:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeMix);
-    break;
-  case YMAGINE_COMPOSE_MULT:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeMult);
-    break;
-  case YMAGINE_COMPOSE_LUMINANCE:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeLuminance);
-    break;
-  case YMAGINE_COMPOSE_LUMINANCEINV:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeLuminanceInv);
-    break;
-  case YMAGINE_COMPOSE_COLORIZE:
-    COMPOSE_LOOP_SCALE(source, width, bpp, overlay, overlaywidth, overlaybpp, composeColorize);
+  case VBITMAP_COLOR_GRAYSCALE:
+    COMPOSE_DISPATCH(composeMode, rc, COMPOSE_LINE_SCALE_GRAY);
     break;
   default:
-    /* Wrong composition mode */
-    ALOGE("Specified composition mode doesn't exist");
-    rc = YMAGINE_ERROR;
+    COMPOSE_DISPATCH(composeMode, rc, COMPOSE_LINE_SCALE_RGBA);
     break;
   }
 
   return rc;
 }
 
+/* Premultiply colors of a rgbA or Argb line by alpha, as done after BUMP */
+static void
+composePremultiply(unsigned char *pixels, int colormode, int width)
+{
+  int i;
+  int alpha;
+  int alphaidx = (colormode == VBITMAP_COLOR_Argb) ? 0 : 3;
+  int coloridx = (colormode == VBITMAP_COLOR_Argb) ? 1 : 0;
+  unsigned char *nextc = pixels;
+
+  for (i = 0; i < width; i++) {
+    alpha = (int) nextc[alphaidx];
+    if (alpha != 0xff) {
+      nextc[coloridx + 0] = (nextc[coloridx + 0] * alpha) / 0xff;
+      nextc[coloridx + 1] = (nextc[coloridx + 1] * alpha) / 0xff;
+      nextc[coloridx + 2] = (nextc[coloridx + 2] * alpha) / 0xff;
+    }
+    nextc += 4;
+  }
+}
+
+int
+YmagineComposeLine(unsigned char *pixels, int colormode,
+                   unsigned char *overlay, int width, int composeMode)
+{
+  int rc;
+
+  rc = composeLine(pixels, overlay, colormode, 4, width, composeMode);
+  if (rc == YMAGINE_OK && composeMode == YMAGINE_COMPOSE_BUMP &&
+      (colormode == VBITMAP_COLOR_rgbA || colormode == VBITMAP_COLOR_Argb)) {
+    composePremultiply(pixels, colormode, width);
+  }
+
+  return rc;
+}
+
 int
 Ymagine_composeLine(unsigned char *srcdata, int srcbpp, int srcwidth,
                     unsigned char *maskdata, int maskbpp, int maskwidth,
                     int composeMode)
 {
   int rc = YMAGINE_ERROR;
+  int colormode;
+
+  switch (srcbpp) {
+  case 1:
+    colormode = VBITMAP_COLOR_GRAYSCALE;
+    break;
+  case 3:
+    colormode = VBITMAP_COLOR_RGB;
+    break;
+  case 4:
+    colormode = VBITMAP_COLOR_RGBA;
+    break;
+  default:
+    return rc;
+  }
 
   if (srcwidth == maskwidth) {
     rc = composeLine(srcdata, maskdata,
-                     srcbpp, maskbpp,
+                     colormode, maskbpp,
                      srcwidth, composeMode);
   } else {
     rc = composeLineScale(srcdata, maskdata,
-                          srcbpp, maskbpp,
+                          colormode, maskbpp,
                           srcwidth, maskwidth, composeMode);
   }
 
@@ -470,13 +708,14 @@ Ymagine_drawRect(Vbitmap *vbitmap,
     int bpp;
     int i;
     int overlaybpp = 0;
+    int colormode;
 
-    bpp = VbitmapBpp(vbitmap);
-    if (bpp != 4) {
-        // Not configured for bpp other than 4 (need alpha!)
-        ALOGE("Failed compose (bitmap must be RGBA)");
+    colormode = VbitmapColormode(vbitmap);
+    if (!composeSupported(colormode)) {
+        ALOGE("Failed compose (unsupported color mode %d)", colormode);
         return rc;
     }
+    bpp = VbitmapBpp(vbitmap);
 
     if (VbitmapLock(vbitmap) != YMAGINE_OK) {
         return rc;
@@ -530,7 +769,7 @@ Ymagine_drawRect(Vbitmap *vbitmap,
         unsigned char *l = pixels + by * pitch + bx * bpp;
 
         for (i = 0; i < bh; i++) {
-          rc = composeLine(l, colorArray, bpp, overlaybpp, bw, composeMode);
+          rc = composeLine(l, colorArray, colormode, overlaybpp, bw, composeMode);
           if (rc == YMAGINE_ERROR) break;
           l += pitch;
         }
@@ -573,9 +812,9 @@ Ymagine_composeImage(Vbitmap *vbitmap, Vbitmap *overlay,
 
     bpp = VbitmapBpp(vbitmap);
     obpp = VbitmapBpp(overlay);
-    if (bpp != 4 || obpp != 4) {
-        // Not configured for bpp other than 4 (need alpha!)
-        ALOGE("Failed compose (both bitmaps must be RGBA)");
+    if (!composeSupported(colormode) || ocolormode != VBITMAP_COLOR_RGBA) {
+        // Overlay needs alpha
+        ALOGE("Failed compose (overlay must be RGBA)");
         return rc;
     }
 
@@ -660,31 +899,16 @@ Ymagine_composeImage(Vbitmap *vbitmap, Vbitmap *overlay,
     // if rc == YMAGINE_ERROR this means bounding box has a size of 0.
     if (pixels != NULL && opixels != NULL && rc != YMAGINE_ERROR) {
       unsigned char *iline = pixels + xstart * bpp + ystart * pitch;
-      unsigned char *oline = opixels + ((xstart - x) * obpp) + ystart * opitch;
+      unsigned char *oline = opixels + ((xstart - x) * obpp) + (ystart - y) * opitch;
       
       ALOGD("compose with mode %d to %d rc=%d", colormode, ocolormode, rc);
 
-      if ( (colormode == VBITMAP_COLOR_RGBA || colormode == VBITMAP_COLOR_rgbA) && (ocolormode == VBITMAP_COLOR_RGBA) ) {
-        for (j = 0; j < newheight; j++) {
-          rc = composeLine(iline, oline, bpp, obpp, newwidth, composeMode);
-          if (rc == YMAGINE_ERROR) break;
+      for (j = 0; j < newheight; j++) {
+        rc = YmagineComposeLine(iline, colormode, oline, newwidth, composeMode);
+        if (rc == YMAGINE_ERROR) break;
 
-          if (composeMode == YMAGINE_COMPOSE_BUMP && colormode == VBITMAP_COLOR_rgbA) {
-            int i;
-            unsigned char *nextc = iline;
-            for (i = 0; i < newwidth; i++) {
-              int alpha = (int) nextc[3];
-              if (alpha != 0xff) {
-                nextc[0] = (nextc[0] * alpha) / 0xff;
-                nextc[1] = (nextc[1] * alpha) / 0xff;
-                nextc[2] = (nextc[2] * alpha) / 0xff;
-              }
-              nextc += 4;
-            }
-          }
-          iline += pitch;
-          oline += opitch;
-        }
+        iline += pitch;
+        oline += opitch;
       }
     } else {
     }
@@ -695,3 +919,32 @@ Ymagine_composeImage(Vbitmap *vbitmap, Vbitmap *overlay,
     return rc;
 }
 
+int
+Ymagine_composeImageScaled(Vbitmap *vbitmap, Vbitmap *overlay,
+                           int x, int y, int width, int height,
+                           ymagineCompose composeMode,
+                           YmagineOverlayCache *cache)
+{
+    int rc;
+    Vbitmap *scaled;
+
+    if (vbitmap == NULL || overlay == NULL || width <= 0 || height <= 0) {
+        return YMAGINE_ERROR;
+    }
+
+    if (VbitmapRegionWidth(overlay) == width &&
+        VbitmapRegionHeight(overlay) == height) {
+        return Ymagine_composeImage(vbitmap, overlay, x, y, composeMode);
+    }
+
+    scaled = VbitmapOverlayScaled(cache, overlay, width, height);
+    if (scaled == NULL) {
+        ALOGE("Failed compose (can't resample overlay to %dx%d)", width, height);
+        return YMAGINE_ERROR;
+    }
+
+    rc = Ymagine_composeImage(vbitmap, scaled, x, y, composeMode);
+    VbitmapRelease(scaled);
+
+    return rc;
+}
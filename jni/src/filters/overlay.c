@@ -0,0 +1,418 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#define LOG_TAG "ymagine::overlay"
+
+#include "ymagine/ymagine.h"
+#include "ymagine_priv.h"
+
+#include <pthread.h>
+
+/* Precision of filter weights. Weights of each output pixel sum to
+   OVERLAY_ONE exactly */
+#define OVERLAY_SHIFT 14
+#define OVERLAY_ONE   (1 << OVERLAY_SHIFT)
+#define OVERLAY_HALF  (1 << (OVERLAY_SHIFT - 1))
+
+#define OVERLAY_CACHE_DEFAULT 4
+
+/*
+ * Contributions of input pixels to each output pixel along one axis,
+ * computed once per call and shared by all rows (or columns).
+ */
+typedef struct {
+  int *start;
+  int *count;
+  int *weights;
+  int maxcount;
+} OverlayMap;
+
+typedef struct {
+  Vbitmap *source;
+  Vbitmap *scaled;
+  int width;
+  int height;
+  unsigned int stamp;
+} OverlayCacheEntry;
+
+struct YmagineOverlayCacheStruct {
+  pthread_mutex_t lock;
+  int maxentries;
+  unsigned int clock;
+  OverlayCacheEntry *entries;
+};
+
+static void
+overlayMapRelease(OverlayMap *map)
+{
+  if (map->start != NULL) {
+    Ymem_free(map->start);
+    map->start = NULL;
+  }
+  map->count = NULL;
+  map->weights = NULL;
+}
+
+/* Give rounding remainder to heaviest contribution, so weights sum to one */
+static void
+overlayMapNormalize(int *weights, int count)
+{
+  int k;
+  int kmax = 0;
+  int total = 0;
+
+  for (k = 0; k < count; k++) {
+    total += weights[k];
+    if (weights[k] > weights[kmax]) {
+      kmax = k;
+    }
+  }
+  weights[kmax] += OVERLAY_ONE - total;
+}
+
+static int
+overlayMapPrepare(OverlayMap *map, int insize, int outsize)
+{
+  int i, k;
+  int first, last;
+  int *w;
+  int64_t p0, p1, s;
+  int64_t lo, hi;
+
+  if (insize > outsize) {
+    /* Area filter, +1 for a span straddling pixel boundaries */
+    map->maxcount = (insize + outsize - 1) / outsize + 1;
+  } else {
+    /* Bilinear filter */
+    map->maxcount = 2;
+  }
+
+  map->start = (int*) Ymem_malloc(outsize * (2 + map->maxcount) * sizeof(int));
+  if (map->start == NULL) {
+    return YMAGINE_ERROR;
+  }
+  map->count = map->start + outsize;
+  map->weights = map->count + outsize;
+
+  for (i = 0; i < outsize; i++) {
+    w = map->weights + i * map->maxcount;
+
+    if (insize > outsize) {
+      /* Input span covered by output pixel i, in fixed point */
+      p0 = (((int64_t) i) * insize << OVERLAY_SHIFT) / outsize;
+      p1 = (((int64_t) (i + 1)) * insize << OVERLAY_SHIFT) / outsize;
+      first = (int) (p0 >> OVERLAY_SHIFT);
+      last = (int) ((p1 - 1) >> OVERLAY_SHIFT);
+      if (last >= insize) {
+        last = insize - 1;
+      }
+
+      map->start[i] = first;
+      map->count[i] = last - first + 1;
+      for (k = first; k <= last; k++) {
+        lo = ((int64_t) k) << OVERLAY_SHIFT;
+        hi = lo + OVERLAY_ONE;
+        if (lo < p0) lo = p0;
+        if (hi > p1) hi = p1;
+        w[k - first] = (int) (((hi - lo) << OVERLAY_SHIFT) / (p1 - p0));
+      }
+      overlayMapNormalize(w, map->count[i]);
+    } else {
+      /* Center of output pixel i, mapped into input */
+      s = ((int64_t) (2 * i + 1)) * insize * OVERLAY_ONE / (2 * outsize) -
+        OVERLAY_HALF;
+      if (s < 0) {
+        s = 0;
+      } else if (s > ((int64_t) (insize - 1)) << OVERLAY_SHIFT) {
+        s = ((int64_t) (insize - 1)) << OVERLAY_SHIFT;
+      }
+
+      map->start[i] = (int) (s >> OVERLAY_SHIFT);
+      k = (int) (s & (OVERLAY_ONE - 1));
+      if (k == 0) {
+        map->count[i] = 1;
+        w[0] = OVERLAY_ONE;
+      } else {
+        map->count[i] = 2;
+        w[0] = OVERLAY_ONE - k;
+        w[1] = k;
+      }
+    }
+  }
+
+  return YMAGINE_OK;
+}
+
+/*
+ * Resample overlay. Colors are premultiplied by alpha while filtering, so
+ * transparent pixels don't bleed their color into neighbours. Horizontal
+ * pass keeps premultiplied values at 16 bits precision.
+ */
+static Vbitmap*
+overlayScale(Vbitmap *overlay, int width, int height)
+{
+  OverlayMap xmap;
+  OverlayMap ymap;
+  Vbitmap *scaled = NULL;
+  uint16_t *tmp = NULL;
+  uint16_t *tline;
+  unsigned char *ipixels;
+  unsigned char *iline;
+  unsigned char *opixels;
+  unsigned char *oline;
+  const unsigned char *p;
+  const int *w;
+  int iwidth, iheight, ipitch, opitch;
+  int i, j, k;
+  int alpha;
+  int acc[4];
+  int rc = YMAGINE_ERROR;
+
+  if (VbitmapColormode(overlay) != VBITMAP_COLOR_RGBA) {
+    return NULL;
+  }
+  if (width <= 0 || height <= 0) {
+    return NULL;
+  }
+
+  xmap.start = NULL;
+  ymap.start = NULL;
+
+  if (VbitmapLock(overlay) != YMAGINE_OK) {
+    return NULL;
+  }
+
+  ipixels = VbitmapRegionBuffer(overlay);
+  iwidth = VbitmapRegionWidth(overlay);
+  iheight = VbitmapRegionHeight(overlay);
+  ipitch = VbitmapPitch(overlay);
+
+  if (ipixels == NULL || iwidth <= 0 || iheight <= 0) {
+    VbitmapUnlock(overlay);
+    return NULL;
+  }
+
+  if (overlayMapPrepare(&xmap, iwidth, width) != YMAGINE_OK ||
+      overlayMapPrepare(&ymap, iheight, height) != YMAGINE_OK) {
+    goto cleanup;
+  }
+
+  tmp = (uint16_t*) Ymem_malloc(((size_t) iheight) * width * 4 * sizeof(uint16_t));
+  if (tmp == NULL) {
+    goto cleanup;
+  }
+
+  /* Horizontal pass, into premultiplied 16 bits pixels */
+  iline = ipixels;
+  tline = tmp;
+  for (j = 0; j < iheight; j++) {
+    for (i = 0; i < width; i++) {
+      acc[0] = 0;
+      acc[1] = 0;
+      acc[2] = 0;
+      acc[3] = 0;
+      p = iline + 4 * xmap.start[i];
+      w = xmap.weights + i * xmap.maxcount;
+      for (k = 0; k < xmap.count[i]; k++) {
+        alpha = p[3];
+        acc[0] += w[k] * (p[0] * alpha);
+        acc[1] += w[k] * (p[1] * alpha);
+        acc[2] += w[k] * (p[2] * alpha);
+        acc[3] += w[k] * alpha;
+        p += 4;
+      }
+      tline[0] = (uint16_t) ((acc[0] + OVERLAY_HALF) >> OVERLAY_SHIFT);
+      tline[1] = (uint16_t) ((acc[1] + OVERLAY_HALF) >> OVERLAY_SHIFT);
+      tline[2] = (uint16_t) ((acc[2] + OVERLAY_HALF) >> OVERLAY_SHIFT);
+      tline[3] = (uint16_t) ((acc[3] + OVERLAY_HALF) >> OVERLAY_SHIFT);
+      tline += 4;
+    }
+    iline += ipitch;
+  }
+
+  scaled = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+  if (scaled == NULL) {
+    goto cleanup;
+  }
+  if (VbitmapResize(scaled, width, height) != YMAGINE_OK ||
+      VbitmapLock(scaled) != YMAGINE_OK) {
+    goto cleanup;
+  }
+  opixels = VbitmapBuffer(scaled);
+  opitch = VbitmapPitch(scaled);
+
+  /* Vertical pass, back to straight alpha */
+  for (j = 0; j < height; j++) {
+    oline = opixels + j * opitch;
+    w = ymap.weights + j * ymap.maxcount;
+    for (i = 0; i < width; i++) {
+      acc[0] = 0;
+      acc[1] = 0;
+      acc[2] = 0;
+      acc[3] = 0;
+      tline = tmp + (((size_t) ymap.start[j]) * width + i) * 4;
+      for (k = 0; k < ymap.count[j]; k++) {
+        acc[0] += w[k] * tline[0];
+        acc[1] += w[k] * tline[1];
+        acc[2] += w[k] * tline[2];
+        acc[3] += w[k] * tline[3];
+        tline += width * 4;
+      }
+
+      alpha = (acc[3] + OVERLAY_HALF) >> OVERLAY_SHIFT;
+      if (alpha == 0) {
+        oline[0] = 0;
+        oline[1] = 0;
+        oline[2] = 0;
+        oline[3] = 0;
+      } else {
+        for (k = 0; k < 3; k++) {
+          acc[k] = (((acc[k] + OVERLAY_HALF) >> OVERLAY_SHIFT) + alpha / 2) / alpha;
+          oline[k] = (unsigned char) (acc[k] > 255 ? 255 : acc[k]);
+        }
+        oline[3] = (unsigned char) alpha;
+      }
+      oline += 4;
+    }
+  }
+
+  VbitmapUnlock(scaled);
+  rc = YMAGINE_OK;
+
+cleanup:
+  VbitmapUnlock(overlay);
+  if (tmp != NULL) {
+    Ymem_free(tmp);
+  }
+  overlayMapRelease(&xmap);
+  overlayMapRelease(&ymap);
+
+  if (rc != YMAGINE_OK && scaled != NULL) {
+    VbitmapRelease(scaled);
+    scaled = NULL;
+  }
+
+  return scaled;
+}
+
+YmagineOverlayCache*
+YmagineOverlayCache_Create(int maxentries)
+{
+  YmagineOverlayCache *cache;
+
+  if (maxentries <= 0) {
+    maxentries = OVERLAY_CACHE_DEFAULT;
+  }
+
+  cache = (YmagineOverlayCache*) Ymem_calloc(1, sizeof(YmagineOverlayCache));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->entries = (OverlayCacheEntry*) Ymem_calloc(maxentries, sizeof(OverlayCacheEntry));
+  if (cache->entries == NULL) {
+    Ymem_free(cache);
+    return NULL;
+  }
+  cache->maxentries = maxentries;
+  pthread_mutex_init(&cache->lock, NULL);
+
+  return cache;
+}
+
+void
+YmagineOverlayCache_Release(YmagineOverlayCache *cache)
+{
+  int i;
+
+  if (cache == NULL) {
+    return;
+  }
+
+  for (i = 0; i < cache->maxentries; i++) {
+    if (cache->entries[i].scaled != NULL) {
+      VbitmapRelease(cache->entries[i].scaled);
+      VbitmapRelease(cache->entries[i].source);
+    }
+  }
+
+  pthread_mutex_destroy(&cache->lock);
+  Ymem_free(cache->entries);
+  Ymem_free(cache);
+}
+
+Vbitmap*
+VbitmapOverlayScaled(YmagineOverlayCache *cache, Vbitmap *overlay,
+                     int width, int height)
+{
+  OverlayCacheEntry *entry;
+  Vbitmap *scaled = NULL;
+  int i;
+  int victim;
+
+  if (overlay == NULL) {
+    return NULL;
+  }
+  if (cache == NULL) {
+    return overlayScale(overlay, width, height);
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  for (i = 0; i < cache->maxentries; i++) {
+    entry = cache->entries + i;
+    if (entry->scaled != NULL && entry->source == overlay &&
+        entry->width == width && entry->height == height) {
+      entry->stamp = ++cache->clock;
+      scaled = VbitmapRetain(entry->scaled);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  if (scaled != NULL) {
+    return scaled;
+  }
+
+  /* Resample outside of lock, so other sizes can be served meanwhile */
+  scaled = overlayScale(overlay, width, height);
+  if (scaled == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  /* Replace an empty slot, or else least recently used one */
+  victim = 0;
+  for (i = 0; i < cache->maxentries; i++) {
+    if (cache->entries[i].scaled == NULL) {
+      victim = i;
+      break;
+    }
+    if (cache->entries[i].stamp < cache->entries[victim].stamp) {
+      victim = i;
+    }
+  }
+  entry = cache->entries + victim;
+  if (entry->scaled != NULL) {
+    VbitmapRelease(entry->scaled);
+    VbitmapRelease(entry->source);
+  }
+  /* Keep overlay alive, so its address can't be reused by another bitmap
+     while entry exists */
+  entry->source = VbitmapRetain(overlay);
+  entry->scaled = VbitmapRetain(scaled);
+  entry->width = width;
+  entry->height = height;
+  entry->stamp = ++cache->clock;
+  pthread_mutex_unlock(&cache->lock);
+
+  return scaled;
+}
@@ -0,0 +1,36 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#ifndef _YMAGINE_FILTERS_OVERLAY_H
+#define _YMAGINE_FILTERS_OVERLAY_H 1
+
+#include "ymagine/ymagine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Return a new RGBA bitmap holding RGBA overlay resampled to width x
+ * height, with an area filter along shrinking axis and a bilinear one
+ * along growing axis. If cache isn't NULL, a previous result for same
+ * overlay and size is reused. Caller must release returned bitmap.
+ */
+Vbitmap*
+VbitmapOverlayScaled(YmagineOverlayCache *cache, Vbitmap *overlay,
+                     int width, int height);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* _YMAGINE_FILTERS_OVERLAY_H */
@@ -76,52 +76,391 @@ int CLIP_TO_16(int x)
 }
 #endif
 
-static YINLINE YOPTIMIZE_SPEED
-int
-seamcarving(unsigned char *pix, 
-            int w, int h, int bpp, int pitch,
-            Vbitmap *weightmap,
-            EnergyType eType, double *progress,
-            VbitmapSeamMap *seamMap)
-{					
-  int trimmedHeight = h;
-  int trimmedWidth = w;
-	
-  direction_t *directMap;
-
-  uint16_t *energyX;
-  uint32_t *costMap;
-  uint32_t *costCurrent;
-  uint32_t *costAbove;
+/* Working copy of the image being carved, and dynamic programming tables */
+typedef struct {
+  /* Size of original image, used as row stride of tables */
+  int w;
+  int h;
+  /* Current width of working copy, once seams have been removed */
+  int width;
 
-  Vbitmap *vimage;
   unsigned char *image;
   int imagepitch;
   int imagebpp;
 
-  Vbitmap *venergy;
   unsigned char *energy;
   int energypitch;
-  int energybpp;
+
+  /* Coordinate of each remaining pixel in original image */
+  uint16_t *energyX;
+  /* Cumulative cost of the cheapest seam ending at each pixel */
+  cost_t *costMap;
+  /* Direction to follow from each pixel to go up along that seam */
+  direction_t *directMap;
+} SeamState;
+
+/*
+ * Compute cumulative cost of columns lo to hi of row i from row above,
+ * and return range of columns whose cost differs from what the table
+ * held before (empty range if changedlo > changedhi)
+ */
+static YINLINE YOPTIMIZE_SPEED void
+seamCostRow(SeamState *state, int i, int lo, int hi,
+            int *changedlo, int *changedhi)
+{
+  int j;
+  int last = state->width - 1;
+  int clo = hi + 1;
+  int chi = lo - 1;
+  cost_t cost;
+  direction_t dir;
+  cost_t *costCurrent = state->costMap + i * state->w;
+  direction_t *directCurrent = state->directMap + i * state->w;
+  const cost_t *costAbove = costCurrent - state->w;
+  const unsigned char *energy = state->energy + i * state->energypitch;
+
+  for (j = lo; j <= hi; j++) {
+    if (i == 0) {
+      cost = (cost_t) energy[j];
+      dir = 0;
+    } else {
+      /* Default to pixel above current one */
+      cost = costAbove[j];
+      dir = 0;
+
+      /* Check if up-left one exists and has lower energy */
+      if (j > 0 && costAbove[j - 1] < cost) {
+        cost = costAbove[j - 1];
+        dir = -1;
+      }
+      /* Check if up-right one exists and has lower energy */
+      if (j < last && costAbove[j + 1] < cost) {
+        cost = costAbove[j + 1];
+        dir = 1;
+      }
+
+      cost += energy[j];
+    }
+
+    if (cost != costCurrent[j]) {
+      if (clo > j) {
+        clo = j;
+      }
+      chi = j;
+    }
+    costCurrent[j] = cost;
+    directCurrent[j] = dir;
+  }
+
+  *changedlo = clo;
+  *changedhi = chi;
+}
+
+/* Compute whole cumulative cost table */
+static void
+seamCostFull(SeamState *state)
+{
+  int i;
+  int clo, chi;
+
+  for (i = 0; i < state->h; i++) {
+    seamCostRow(state, i, 0, state->width - 1, &clo, &chi);
+  }
+}
+
+/*
+ * Update cumulative cost table after removal of the seam going through
+ * cols. In each row, only columns next to the seam, where energy and
+ * neighbours changed, and columns below a cost that changed in the row
+ * above, need to be recomputed. Outside of this cone, costs are the same
+ * as before once shifted along with the pixels.
+ */
+static void
+seamCostUpdate(SeamState *state, const int *cols)
+{
+  int i;
+  int lo, hi;
+  int clo = 1;
+  int chi = 0;
+
+  for (i = 0; i < state->h; i++) {
+    lo = cols[i];
+    hi = cols[i];
+    if (i > 0) {
+      if (cols[i - 1] < lo) {
+        lo = cols[i - 1];
+      }
+      if (cols[i - 1] > hi) {
+        hi = cols[i - 1];
+      }
+    }
+    lo--;
+    hi++;
+
+    if (clo <= chi) {
+      if (clo - 1 < lo) {
+        lo = clo - 1;
+      }
+      if (chi + 1 > hi) {
+        hi = chi + 1;
+      }
+    }
+
+    if (lo < 0) {
+      lo = 0;
+    }
+    if (hi > state->width - 1) {
+      hi = state->width - 1;
+    }
+
+    seamCostRow(state, i, lo, hi, &clo, &chi);
+  }
+}
+
+/* Follow seam ending at column j of last row up to the top of the image */
+static void
+seamTrace(SeamState *state, int j, int *cols)
+{
+  int i;
+
+  for (i = state->h - 1; i >= 0; i--) {
+    cols[i] = j;
+    j += state->directMap[i * state->w + j];
+  }
+}
+
+/* Recompute energy of pixels next to a removed one, now at column j */
+static YINLINE void
+seamEnergyUpdate(SeamState *state, int i, int j)
+{
+  int k;
+
+  for (k = j - 1; k <= j; k++) {
+    if (k >= 0 && k < state->width) {
+      state->energy[i * state->energypitch + k] =
+        EnergySobel(state->image + i * state->imagepitch + k * state->imagebpp,
+                    state->imagebpp, state->imagepitch,
+                    k, i, state->width, state->h);
+    }
+  }
+}
+
+/*
+ * Remove a single seam from the working copy of the image, marking it on
+ * the seam index map. Cost table is shifted as well if it is to be
+ * updated incrementally.
+ */
+static void
+seamRemove(SeamState *state, const int *cols, seamid_t id,
+           VbitmapSeamMap *seamMap, YBOOL shiftcost)
+{
+  int i;
+  int c;
+  int tomove;
+  unsigned char *p;
+
+  for (i = 0; i < state->h; i++) {
+    c = cols[i];
+    tomove = state->width - c - 1;
+
+    seamMap->map[i * state->w + state->energyX[i * state->w + c]] = id;
+    if (tomove > 0) {
+      p = state->image + i * state->imagepitch + c * state->imagebpp;
+      memmove(p, p + state->imagebpp, tomove * state->imagebpp);
+
+      p = state->energy + i * state->energypitch + c;
+      memmove(p, p + 1, tomove);
+
+      memmove(state->energyX + i * state->w + c,
+              state->energyX + i * state->w + c + 1,
+              tomove * sizeof(state->energyX[0]));
+
+      if (shiftcost) {
+        memmove(state->costMap + i * state->w + c,
+                state->costMap + i * state->w + c + 1,
+                tomove * sizeof(state->costMap[0]));
+        memmove(state->directMap + i * state->w + c,
+                state->directMap + i * state->w + c + 1,
+                tomove * sizeof(state->directMap[0]));
+      }
+    }
+  }
+
+  /* The seam has been removed from the working copy of the image,
+   * so reduce its width by one */
+  state->width--;
+
+  for (i = 0; i < state->h; i++) {
+    seamEnergyUpdate(state, i, cols[i]);
+  }
+}
+
+/* Candidates tried per seam wanted, before giving up on a pass */
+#define SEAM_SELECT_TRIES 4
+
+/*
+ * Pick up to maxseams seams not sharing any pixel, cheapest first, from
+ * current cost table. Paths are stored into paths, one row of h columns
+ * per seam. Claimed map must be clear, and is left clear on return.
+ */
+static int
+seamSelect(SeamState *state, int maxseams, int *paths,
+           unsigned char *claimed, unsigned char *tried)
+{
+  int i, j;
+  int k;
+  int nseams = 0;
+  int best;
+  int *cols;
+  const cost_t *costLast = state->costMap + (state->h - 1) * state->w;
+  YBOOL overlap;
+
+  memset(tried, 0, state->width);
+
+  for (k = 0; k < maxseams * SEAM_SELECT_TRIES && nseams < maxseams; k++) {
+    /* Cheapest candidate not tried yet */
+    best = -1;
+    for (j = 0; j < state->width; j++) {
+      if (!tried[j] && (best < 0 || costLast[j] < costLast[best])) {
+        best = j;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    tried[best] = 1;
+
+    cols = paths + nseams * state->h;
+    seamTrace(state, best, cols);
+
+    /* Seams meeting at some pixel share their whole path above it */
+    overlap = YFALSE;
+    for (i = 0; i < state->h; i++) {
+      if (claimed[i * state->w + cols[i]]) {
+        overlap = YTRUE;
+        break;
+      }
+    }
+    if (overlap) {
+      continue;
+    }
+
+    for (i = 0; i < state->h; i++) {
+      claimed[i * state->w + cols[i]] = 1;
+    }
+    nseams++;
+  }
+
+  for (k = 0; k < nseams; k++) {
+    cols = paths + k * state->h;
+    for (i = 0; i < state->h; i++) {
+      claimed[i * state->w + cols[i]] = 0;
+    }
+  }
+
+  return nseams;
+}
+
+/*
+ * Remove nseams disjoint seams at once, compacting each row in a single
+ * pass. Seams get consecutive ids starting at id, in order of paths.
+ * Paths are overwritten with the columns left next to removed pixels.
+ */
+static void
+seamRemoveMulti(SeamState *state, int *paths, int nseams, seamid_t id,
+                VbitmapSeamMap *seamMap, int *rowcols)
+{
+  int i, j;
+  int k, t;
+  int c;
+  int next;
+  unsigned char *image;
+  unsigned char *energy;
+  uint16_t *energyX;
+
+  for (i = 0; i < state->h; i++) {
+    image = state->image + i * state->imagepitch;
+    energy = state->energy + i * state->energypitch;
+    energyX = state->energyX + i * state->w;
+
+    /* Mark seams, then sort their columns in this row */
+    for (k = 0; k < nseams; k++) {
+      c = paths[k * state->h + i];
+      seamMap->map[i * state->w + energyX[c]] = id + k;
+
+      for (t = k; t > 0 && rowcols[t - 1] > c; t--) {
+        rowcols[t] = rowcols[t - 1];
+      }
+      rowcols[t] = c;
+    }
+
+    /* Compact row, skipping removed pixels */
+    j = rowcols[0];
+    for (k = 0; k < nseams; k++) {
+      next = (k + 1 < nseams) ? rowcols[k + 1] : state->width;
+      for (c = rowcols[k] + 1; c < next; c++, j++) {
+        memcpy(image + j * state->imagebpp, image + c * state->imagebpp,
+               state->imagebpp);
+        energy[j] = energy[c];
+        energyX[j] = energyX[c];
+      }
+    }
+
+    /* Columns now next to each removed pixel */
+    for (k = 0; k < nseams; k++) {
+      paths[k * state->h + i] = rowcols[k] - k;
+    }
+  }
+
+  state->width -= nseams;
+
+  for (i = 0; i < state->h; i++) {
+    for (k = 0; k < nseams; k++) {
+      seamEnergyUpdate(state, i, paths[k * state->h + i]);
+    }
+  }
+}
+
+static int
+seamcarving(unsigned char *pix,
+            int w, int h, int bpp, int pitch,
+            Vbitmap *weightmap,
+            EnergyType eType, double *progress,
+            int update, int seamsperpass,
+            VbitmapSeamMap *seamMap)
+{
+  SeamState state;
+
+  Vbitmap *vimage;
+  Vbitmap *venergy;
 
   unsigned char *psrc;
   unsigned char *pdest;
+  unsigned char *claimed = NULL;
+  unsigned char *tried = NULL;
+  int *paths = NULL;
+  int *rowcols = NULL;
 
-  uint16_t seam;
-  uint16_t numSeams;
+  int seam;
+  int numSeams;
+  int nseams;
 
   int i, j;
   int mode;
+  int rc = YMAGINE_OK;
 
   int minCostIndex;
-  int currentCostIndex;
-  uint32_t minCost;
-
+  cost_t minCost;
+  const cost_t *costLast;
 
   if (seamMap == NULL || seamMap->width != w || seamMap->height != h) {
     return YMAGINE_ERROR;
   }
 
+  if (seamsperpass < 1) {
+    seamsperpass = 1;
+  }
+
   /* Create a working bitmap */
   switch(bpp) {
   case 1:
@@ -134,24 +473,27 @@ seamcarving(unsigned char *pix,
     mode = VBITMAP_COLOR_RGBA;
     break;
   default:
-    return YMAGINE_ERROR; 
+    return YMAGINE_ERROR;
   }
 
   vimage = VbitmapInitMemory(mode);
   VbitmapResize(vimage, w, h);
 
   VbitmapLock(vimage);
-  imagepitch = VbitmapPitch(vimage);
-  imagebpp = VbitmapBpp(vimage);
-  image = VbitmapBuffer(vimage);
+  state.w = w;
+  state.h = h;
+  state.width = w;
+  state.imagepitch = VbitmapPitch(vimage);
+  state.imagebpp = VbitmapBpp(vimage);
+  state.image = VbitmapBuffer(vimage);
 
   /* Working copy of the input image, to be modified during processing */
   psrc = pix;
-  pdest = image;
+  pdest = state.image;
   for (i = 0; i < h; i++) {
     memcpy(pdest, psrc, w*bpp);
     psrc += pitch;
-    pdest += imagepitch;
+    pdest += state.imagepitch;
   }
 
   /* Compute initial energy map */
@@ -160,164 +502,109 @@ seamcarving(unsigned char *pix,
   Vbitmap_sobel(venergy, vimage);
 
   VbitmapLock(venergy);
-  energypitch = VbitmapPitch(venergy);
-  energybpp = VbitmapBpp(venergy);
-  energy = VbitmapBuffer(venergy);
-
-  energyX = Ymem_malloc(w * h * sizeof(energyX[0]));
-  costMap = Ymem_malloc(w * h * sizeof(costMap[0]));
-  directMap = Ymem_malloc(w * h * sizeof(directMap[0]));
-
-  /* Reset seam map */
-  for (i = 0; i < h; i++) {
-    for (j=0; j < w; j++){
-      seamMap->map[i * w + j] = SEAM_NONE;
-    }
+  state.energypitch = VbitmapPitch(venergy);
+  state.energy = VbitmapBuffer(venergy);
+
+  state.energyX = Ymem_malloc(w * h * sizeof(state.energyX[0]));
+  state.costMap = Ymem_malloc(w * h * sizeof(state.costMap[0]));
+  state.directMap = Ymem_malloc(w * h * sizeof(state.directMap[0]));
+  paths = Ymem_malloc(seamsperpass * h * sizeof(int));
+  if (seamsperpass > 1) {
+    claimed = Ymem_calloc(w * h, 1);
+    tried = Ymem_malloc(w);
+    rowcols = Ymem_malloc(seamsperpass * sizeof(int));
   }
 
-  /* Init coordinate mapping table */
-  for (i = 0; i < h; i++) {
-    for (j = 0; j < w; j++) {
-      energyX[i * w + j] = j;
-    }
-  }
-
-  numSeams = (w + 1) / 2;
-  for (seam = 0; seam < numSeams; seam++) {
-    /* Set cumulative cost for first row to energy */
-    for (j = 0; j < trimmedWidth; j++) {
-      costMap[j] = (cost_t) energy[j];
+  if (state.energyX == NULL || state.costMap == NULL ||
+      state.directMap == NULL || paths == NULL ||
+      (seamsperpass > 1 && (claimed == NULL || tried == NULL || rowcols == NULL))) {
+    rc = YMAGINE_ERROR;
+  } else {
+    /* Reset seam map */
+    for (i = 0; i < h; i++) {
+      for (j=0; j < w; j++){
+        seamMap->map[i * w + j] = SEAM_NONE;
+      }
     }
 
-    if (trimmedWidth == 1) {
-      /* If one one column left, seam can only be vertical one */
-      cost_t cost = costMap[0];
-
-      for (i = 1; i < trimmedHeight; i++) {
-        cost = energy[i * energypitch] + cost;
-        costMap[i * w] = cost;
-        directMap[i * w] = 0;
+    /* Init coordinate mapping table */
+    for (i = 0; i < h; i++) {
+      for (j = 0; j < w; j++) {
+        state.energyX[i * w + j] = j;
       }
-    } else {
-      costCurrent = costMap;
-      for (i = 1; i < trimmedHeight; i++) {
-        direction_t dir;
-        cost_t cost;
-        cost_t lCost, uCost, rCost;
+    }
 
-        costAbove = costCurrent;
-        costCurrent += w;
+    numSeams = (w + 1) / 2;
+    seamCostFull(&state);
 
+    for (seam = 0; seam < numSeams; seam += nseams) {
+      if (seamsperpass == 1) {
+        /* Find the minimum seam cost */
+        costLast = state.costMap + (h - 1) * w;
 
-        /* Manage edge case for first column out of loop for performance */
-        uCost = costAbove[0];
-        rCost = costAbove[1];
+        minCostIndex = 0;
+        minCost = costLast[minCostIndex];
 
-        cost = uCost;
-        dir = 0;
-        if (rCost < cost) {
-          cost = rCost;
-          dir = 1;
+        for (j = 1; j < state.width; j++) {
+          if (costLast[j] < minCost) {
+            minCostIndex = j;
+            minCost = costLast[minCostIndex];
+          }
         }
-        costCurrent[0] = energy[i * energypitch] + cost;
-        directMap[i * w] = dir;
 
-        for (j = 1; j < trimmedWidth - 1; j++) {
-          lCost = uCost;
-          uCost = rCost;
+        seamTrace(&state, minCostIndex, paths);
+        seamRemove(&state, paths, seam + SEAM_FIRST, seamMap,
+                   update == YMAGINE_SEAM_UPDATE_INCREMENTAL);
+        nseams = 1;
 
-          rCost = costAbove[j+1];
-
-          /* Default to pixel above current one */
-          cost = uCost;
-          dir = 0;
-
-          /* Check if up-left one exists and has lower energy */
-          if (lCost < cost) {
-            cost = lCost;
-            dir = -1;             
-          }
-          /* Check if up-right one exists and has lower energy */
-          if (rCost < cost) {
-            cost = rCost;
-            dir = 1;
+        if (seam + nseams < numSeams) {
+          if (update == YMAGINE_SEAM_UPDATE_INCREMENTAL) {
+            seamCostUpdate(&state, paths);
+          } else {
+            seamCostFull(&state);
           }
-
-          costCurrent[j] = energy[i * energypitch + j] + cost;
-          directMap[i * w + j] = dir;
         }
-
-        /* Manage edge case for first column out of loop for performance */
-        lCost = uCost;
-        uCost = rCost;
-
-        cost = uCost;
-        dir = 0;
-        if (lCost < cost) {
-          cost = lCost;
-          dir = -1;
+      } else {
+        /* Several disjoint seams from the same cost table */
+        nseams = numSeams - seam;
+        if (nseams > seamsperpass) {
+          nseams = seamsperpass;
         }
-        costCurrent[j] = energy[i * energypitch + j] + cost;
-        directMap[i * w + j] = dir;
-      }
-    }
-		
-    /* Find the minimum seam cost */
-    costCurrent = costMap + (h - 1) * w;
-
-    minCostIndex = 0;
-    minCost = costCurrent[minCostIndex];
+        nseams = seamSelect(&state, nseams, paths, claimed, tried);
+        seamRemoveMulti(&state, paths, nseams, seam + SEAM_FIRST, seamMap, rowcols);
 
-    for (j = 1; j < trimmedWidth; j++) {
-      if (costCurrent[j] < minCost) {
-        minCostIndex = j;
-        minCost = costCurrent[minCostIndex];
-      }
-    }
-
-    /* Follow the seam up to the top of the image, removing it from the
-     * working copy of the image, marking it on the seam index map, and
-     * shifting the coordinate values in energyMap left accordingly */
-    currentCostIndex = minCostIndex;
-    for (i = h - 1; i >= 0; i--) {
-      int tomove = trimmedWidth - currentCostIndex - 1;
-      unsigned int seamXCoord = energyX[i * w + currentCostIndex];
-
-      seamMap->map[i * w + seamXCoord] = seam + SEAM_FIRST;
-      if (tomove > 0) {
-        psrc = image + i * imagepitch + currentCostIndex * imagebpp;
-        memmove(psrc, psrc+bpp, tomove*bpp);
-        
-        psrc = (unsigned char*) (energyX + i * w + currentCostIndex);
-        memmove(psrc, psrc+sizeof(energyX[0]), tomove*sizeof(energyX[0]));
+        if (seam + nseams < numSeams) {
+          seamCostFull(&state);
+        }
       }
 
-      psrc = energy + i * energypitch + currentCostIndex * energybpp;
-      if (tomove > 0) {
-        memmove(psrc, psrc+energybpp, tomove*energybpp);
+      if (progress != NULL) {
+        *progress = ((double) (seam + nseams)) / numSeams;
       }
-
-      currentCostIndex += directMap[i * w + currentCostIndex];
     }
-
-    currentCostIndex = minCostIndex;
-    for (i = h - 1; i >= 0; i--) {
-      energy[i * energypitch + currentCostIndex] = 
-        EnergySobel(image + i * imagepitch + currentCostIndex * bpp,
-                    imagebpp, imagepitch,
-                    currentCostIndex, i, trimmedWidth, h);
-
-      currentCostIndex += directMap[i * w + currentCostIndex];
-    }
-
-    /* The seam has been removed from the working copy of the image,
-     * so reduce its width by one */
-    trimmedWidth--;
   }
 
-  Ymem_free(energyX);
-  Ymem_free(costMap);
-  Ymem_free(directMap);
+  if (state.energyX != NULL) {
+    Ymem_free(state.energyX);
+  }
+  if (state.costMap != NULL) {
+    Ymem_free(state.costMap);
+  }
+  if (state.directMap != NULL) {
+    Ymem_free(state.directMap);
+  }
+  if (paths != NULL) {
+    Ymem_free(paths);
+  }
+  if (claimed != NULL) {
+    Ymem_free(claimed);
+  }
+  if (tried != NULL) {
+    Ymem_free(tried);
+  }
+  if (rowcols != NULL) {
+    Ymem_free(rowcols);
+  }
 
   VbitmapUnlock(vimage);
   VbitmapRelease(vimage);
@@ -325,7 +612,7 @@ seamcarving(unsigned char *pix,
   VbitmapUnlock(venergy);
   VbitmapRelease(venergy);
 
-  return YMAGINE_OK;
+  return rc;
 }
 
 static YINLINE YOPTIMIZE_SPEED
@@ -534,8 +821,52 @@ VbitmapSeamMap_release(VbitmapSeamMap *seammap)
   return YMAGINE_OK;
 }
 
+int
+VbitmapSeamMap_compare(VbitmapSeamMap *seammap1, VbitmapSeamMap *seammap2,
+                       int *x, int *y)
+{
+  int i, j;
+  int w, h;
+
+  if (x != NULL) {
+    *x = -1;
+  }
+  if (y != NULL) {
+    *y = -1;
+  }
+
+  if (seammap1 == NULL || seammap2 == NULL) {
+    return YMAGINE_ERROR;
+  }
+  if (seammap1->width != seammap2->width || seammap1->height != seammap2->height) {
+    return YMAGINE_ERROR;
+  }
+
+  w = seammap1->width;
+  h = seammap1->height;
+  for (i = 0; i < h; i++) {
+    if (memcmp(seammap1->map + i * w, seammap2->map + i * w,
+               w * sizeof(seammap1->map[0])) != 0) {
+      for (j = 0; j < w; j++) {
+        if (seammap1->map[i * w + j] != seammap2->map[i * w + j]) {
+          break;
+        }
+      }
+      if (x != NULL) {
+        *x = j;
+      }
+      if (y != NULL) {
+        *y = i;
+      }
+      return YMAGINE_ERROR;
+    }
+  }
+
+  return YMAGINE_OK;
+}
+
 VbitmapSeamMap*
-Vbitmap_seamPrepare(Vbitmap *vbitmap)
+Vbitmap_seamPrepareWithOptions(Vbitmap *vbitmap, int update, int seamsperpass)
 {
   int width;
   int height;
@@ -561,20 +892,32 @@ Vbitmap_seamPrepare(Vbitmap *vbitmap)
     /* Parameters verification */
     if (width > 0 && width <= 65535 && height > 0 && height <= 65535) {
       /* Compute seam map */
-      seamMap = VbitmapSeamMap_create(width, height);    
-    
+      seamMap = VbitmapSeamMap_create(width, height);
+
       if (seamMap != NULL) {
         /* Generate seam map */
-        seamcarving(pixels, width, height, bpp, pitch,
-                    weightmap, etype, &progress,
-                    seamMap);
+        if (seamcarving(pixels, width, height, bpp, pitch,
+                        weightmap, etype, &progress,
+                        update, seamsperpass,
+                        seamMap) != YMAGINE_OK) {
+          VbitmapSeamMap_release(seamMap);
+          seamMap = NULL;
+        }
       }
     }
+
+    VbitmapUnlock(vbitmap);
   }
 
   return seamMap;
 }
 
+VbitmapSeamMap*
+Vbitmap_seamPrepare(Vbitmap *vbitmap)
+{
+  return Vbitmap_seamPrepareWithOptions(vbitmap, YMAGINE_SEAM_UPDATE_INCREMENTAL, 1);
+}
+
 int
 Vbitmap_seamCarve(Vbitmap *vbitmap, VbitmapSeamMap *seamMap, Vbitmap *outbitmap)
 {
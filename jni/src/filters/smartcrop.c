@@ -0,0 +1,146 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#define LOG_TAG "ymagine::smartcrop"
+
+#include "ymagine/ymagine.h"
+#include "ymagine_priv.h"
+
+#define iabs(x) (((x) >= 0) ? (x) : (-(x)))
+
+/* Summed-area table of energy map, with an extra row and column of zeros */
+static uint32_t*
+smartCropTable(const unsigned char *energy, int width, int height, int pitch)
+{
+  uint32_t *sat;
+  uint32_t rowsum;
+  int i, j;
+  int tpitch = width + 1;
+
+  sat = Ymem_malloc((width + 1) * (height + 1) * sizeof(uint32_t));
+  if (sat == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i <= width; i++) {
+    sat[i] = 0;
+  }
+  for (j = 0; j < height; j++) {
+    rowsum = 0;
+    sat[(j + 1) * tpitch] = 0;
+    for (i = 0; i < width; i++) {
+      rowsum += energy[j * pitch + i];
+      sat[(j + 1) * tpitch + i + 1] = sat[j * tpitch + i + 1] + rowsum;
+    }
+  }
+
+  return sat;
+}
+
+int
+VbitmapSmartCropFocus(Vbitmap *vbitmap, int aspectwidth, int aspectheight,
+                      float *focusx, float *focusy)
+{
+  Vbitmap *venergy;
+  uint32_t *sat = NULL;
+  uint32_t sum;
+  uint32_t bestsum = 0;
+  int width;
+  int height;
+  int tpitch;
+  int winwidth;
+  int winheight;
+  int x, y;
+  int bestx, besty;
+  int dist;
+  int bestdist = 0;
+  int rc = YMAGINE_ERROR;
+
+  if (vbitmap == NULL || aspectwidth <= 0 || aspectheight <= 0) {
+    return YMAGINE_ERROR;
+  }
+
+  width = VbitmapWidth(vbitmap);
+  height = VbitmapHeight(vbitmap);
+  if (width <= 0 || height <= 0) {
+    return YMAGINE_ERROR;
+  }
+
+  /* Largest window of requested aspect ratio fitting in bitmap */
+  if (width * aspectheight > height * aspectwidth) {
+    winheight = height;
+    winwidth = (height * aspectwidth + aspectheight / 2) / aspectheight;
+  } else {
+    winwidth = width;
+    winheight = (width * aspectheight + aspectwidth / 2) / aspectwidth;
+  }
+  if (winwidth < 1) {
+    winwidth = 1;
+  }
+  if (winheight < 1) {
+    winheight = 1;
+  }
+
+  venergy = VbitmapInitMemory(VBITMAP_COLOR_GRAYSCALE);
+  if (venergy == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  if (Vbitmap_sobelWithOptions(venergy, vbitmap, YMAGINE_SOBEL_APPROX, 1) == YMAGINE_OK &&
+      VbitmapLock(venergy) == YMAGINE_OK) {
+    sat = smartCropTable(VbitmapBuffer(venergy), width, height,
+                         VbitmapPitch(venergy));
+    VbitmapUnlock(venergy);
+  }
+  VbitmapRelease(venergy);
+
+  if (sat == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  /* Default to centered window, as plain cropping does */
+  tpitch = width + 1;
+  bestx = (width - winwidth) / 2;
+  besty = (height - winheight) / 2;
+
+  for (y = 0; y + winheight <= height; y++) {
+    for (x = 0; x + winwidth <= width; x++) {
+      sum = sat[(y + winheight) * tpitch + x + winwidth]
+        - sat[y * tpitch + x + winwidth]
+        - sat[(y + winheight) * tpitch + x]
+        + sat[y * tpitch + x];
+      dist = iabs(2 * x + winwidth - width) + iabs(2 * y + winheight - height);
+
+      if (rc != YMAGINE_OK || sum > bestsum ||
+          (sum == bestsum && dist < bestdist)) {
+        bestsum = sum;
+        bestdist = dist;
+        bestx = x;
+        besty = y;
+        rc = YMAGINE_OK;
+      }
+    }
+  }
+
+  Ymem_free(sat);
+
+  if (rc == YMAGINE_OK) {
+    if (focusx != NULL) {
+      *focusx = (bestx + winwidth * 0.5f) / width;
+    }
+    if (focusy != NULL) {
+      *focusy = (besty + winheight * 0.5f) / height;
+    }
+  }
+
+  return rc;
+}
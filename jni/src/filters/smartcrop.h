@@ -0,0 +1,35 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#ifndef _YMAGINE_FILTERS_SMARTCROP_H
+#define _YMAGINE_FILTERS_SMARTCROP_H 1
+
+#include "ymagine/ymagine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Find the largest region with aspect ratio aspectwidth:aspectheight
+ * holding most edge energy in vbitmap, and return its center relative to
+ * bitmap size. Among regions with same energy, the most central wins.
+ */
+int
+VbitmapSmartCropFocus(Vbitmap *vbitmap, int aspectwidth, int aspectheight,
+                      float *focusx, float *focusy);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* _YMAGINE_FILTERS_SMARTCROP_H */
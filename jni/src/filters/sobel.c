@@ -22,6 +22,8 @@
 #include "ymagine_priv.h"
 
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 
 static YINLINE YOPTIMIZE_SPEED
 int CLIP_TO_8(int x)
@@ -32,12 +34,26 @@ int CLIP_TO_8(int x)
 #define isqrt(x) ((int) sqrt(x))
 #define iabs(x) (((x) >= 0) ? (x) : (-(x)))
 
- 
+/*
+ * Weight of pixel in gradients: its first three channels weighted 1-2-1,
+ * or 4 times its only channel for grayscale, so both have the same range.
+ * Gradient of this weight is the weighted sum of channel gradients.
+ */
+static YINLINE YOPTIMIZE_SPEED
+int sobelWeight(const unsigned char *p, int bpp)
+{
+  if (bpp >= 3) {
+    return p[0] + 2 * p[1] + p[2];
+  }
+
+  return 4 * p[0];
+}
+
 // Computes the x component of the gradient vector
 // at a given point in a image.
 // returns gradient in the x direction
 
-#define GETPIX(p, bpp, pitch, dx, dy) ((int) p[dx * bpp + dy * pitch])
+#define GETPIX(p, bpp, pitch, dx, dy) sobelWeight(p + (dx) * (bpp) + (dy) * (pitch), bpp)
 
 static YINLINE YOPTIMIZE_SPEED
 int gradientXBase(unsigned char *p, int bpp, int pitch,
@@ -65,28 +81,6 @@ int gradientYBase(unsigned char *p, int bpp, int pitch,
     -     GETPIX(p, bpp, pitch, nx, ny);
 }
 
-static YINLINE YOPTIMIZE_SPEED
-int gradientX(unsigned char *p, int bpp, int pitch)
-{
-  int px = -1;
-  int nx = 1;
-  int py = -1;
-  int ny = 1;
-
-  return gradientXBase(p, bpp, pitch, px, nx, py, ny);
-}
-
-static YINLINE YOPTIMIZE_SPEED
-int gradientY(unsigned char *p, int bpp, int pitch)
-{
-  int px = -1;
-  int nx = 1;
-  int py = -1;
-  int ny = 1;
-
-  return gradientYBase(p, bpp, pitch, px, nx, py, ny);
-}
-
 static YINLINE YOPTIMIZE_SPEED
 int gradientXCheck(unsigned char *p, int bpp, int pitch,
                    int x, int y, int width, int height)
@@ -98,12 +92,14 @@ int gradientXCheck(unsigned char *p, int bpp, int pitch,
 
   if (x <= 0) {
     px = 0;
-  } else if (x >= width - 1) {
+  }
+  if (x >= width - 1) {
     nx = 0;
   }
   if (y == 0) {
     py = 0;
-  } else if (y >= height - 1) {
+  }
+  if (y >= height - 1) {
     ny = 0;
   }
 
@@ -137,155 +133,267 @@ int gradientYCheck(unsigned char *p, int bpp, int pitch,
 
 YINLINE YOPTIMIZE_SPEED
 int
-EnergySobelFast(unsigned char *inp, int bpp, int pitch)
+EnergySobel(unsigned char *inp, int bpp, int pitch,
+            int x, int y, int width, int height)
+{
+  int dx;
+  int dy;
+  int s2;
+
+  dx = gradientXCheck(inp, bpp, pitch, x, y, width, height) / 4;
+  dy = gradientYCheck(inp, bpp, pitch, x, y, width, height) / 4;
+  s2 = dx * dx + dy * dy;
+
+  return CLIP_TO_8(isqrt(s2));
+}
+
+/* Rows each worker is given at least, so starting a thread pays off */
+#define SOBEL_MIN_ROWS 64
+#define SOBEL_MAX_THREADS 16
+
+typedef struct {
+  const unsigned char *pixels;
+  int width;
+  int height;
+  int pitch;
+  int bpp;
+  unsigned char *opixels;
+  int opitch;
+  int obpp;
+  int magnitude;
+} SobelImage;
+
+typedef struct {
+  pthread_t thread;
+  const SobelImage *image;
+  int firstrow;
+  int lastrow;
+  int status;
+} SobelWorker;
+
+/*
+ * Weights of pixels of row y, as EnergySobel computes them. Row index and
+ * edge pixels are replicated, so g must hold width + 2 entries.
+ */
+static YINLINE YOPTIMIZE_SPEED void
+sobelRowWeight(const SobelImage *image, int y, int *g)
 {
-  int dx0, dx1, dx2;
-  int dy0, dy1, dy2;
-  int dx = 0;
-  int dy = 0;
-  int s2 = 0;
-
-  if (1) {
-    dx0 = gradientX(inp, bpp, pitch);
-    dx1 = gradientX(inp + 1, bpp, pitch);
-    dx2 = gradientX(inp + 2, bpp, pitch);
-    dx = (dx0 + 2 * dx1 + dx2) / 4;
-    s2 += dx * dx;
+  const unsigned char *inp;
+  int width = image->width;
+  int bpp = image->bpp;
+  int i;
+
+  if (y < 0) {
+    y = 0;
+  } else if (y >= image->height) {
+    y = image->height - 1;
   }
-  if (1) {
-    dy0 = gradientY(inp, bpp, pitch);
-    dy1 = gradientY(inp + 1, bpp, pitch);
-    dy2 = gradientY(inp + 2, bpp, pitch);
-    dy = (dy0 + 2 * dy1 + dy2) / 4;
-    s2 += dy * dy;
+  inp = image->pixels + y * image->pitch;
+
+  for (i = 0; i < width; i++) {
+    g[i + 1] = sobelWeight(inp + i * bpp, bpp);
   }
 
-  return CLIP_TO_8(isqrt(s2));
+  g[0] = g[1];
+  g[width + 1] = g[width];
 }
 
-YINLINE YOPTIMIZE_SPEED
-int
-EnergySobel(unsigned char *inp, int bpp, int pitch,
-            int x, int y, int width, int height)
+/*
+ * Energy of one row from the weighted rows above, at and below it. The
+ * separable kernel keeps both loops free of branches and neighbour
+ * lookups, so the compiler can vectorize them.
+ */
+static YINLINE YOPTIMIZE_SPEED void
+sobelRow(const SobelImage *image, const int *gu, const int *gc, const int *gd,
+         int *v, int *d, int *e, unsigned char *outp)
+{
+  int width = image->width;
+  int obpp = image->obpp;
+  int dx, dy;
+  int i;
+
+  for (i = 0; i < width + 2; i++) {
+    v[i] = gu[i] + 2 * gc[i] + gd[i];
+    d[i] = gu[i] - gd[i];
+  }
+
+  if (image->magnitude == YMAGINE_SOBEL_APPROX) {
+    for (i = 0; i < width; i++) {
+      dx = (v[i] - v[i + 2]) / 4;
+      dy = (d[i] + 2 * d[i + 1] + d[i + 2]) / 4;
+      e[i] = CLIP_TO_8(iabs(dx) + iabs(dy));
+    }
+  } else {
+    for (i = 0; i < width; i++) {
+      dx = (v[i] - v[i + 2]) / 4;
+      dy = (d[i] + 2 * d[i + 1] + d[i + 2]) / 4;
+      e[i] = CLIP_TO_8(isqrt(dx * dx + dy * dy));
+    }
+  }
+
+  if (obpp == 1) {
+    for (i = 0; i < width; i++) {
+      outp[i] = (unsigned char) e[i];
+    }
+  } else {
+    for (i = 0; i < width; i++) {
+      outp[0] = (unsigned char) e[i];
+      if (obpp >= 3) {
+        outp[1] = (unsigned char) e[i];
+        outp[2] = (unsigned char) e[i];
+        if (obpp == 4) {
+          outp[3] = 0xff;
+        }
+      }
+      outp += obpp;
+    }
+  }
+}
+
+static void*
+sobelRun(void *ptr)
 {
-  int dx0, dx1, dx2;
-  int dy0, dy1, dy2;
-  int dx = 0;
-  int dy = 0;
-  int s2 = 0;
-
-  if (1) {
-    dx0 = gradientXCheck(inp, bpp, pitch, x, y, width, height);
-    dx1 = gradientXCheck(inp + 1, bpp, pitch, x, y, width, height);
-    dx2 = gradientXCheck(inp + 2, bpp, pitch, x, y, width, height);
-    dx = (dx0 + 2 * dx1 + dx2) / 4;
-    s2 += dx * dx;
+  SobelWorker *worker = (SobelWorker*) ptr;
+  const SobelImage *image = worker->image;
+  int n = image->width + 2;
+  int *buf;
+  int *rows[3];
+  int y, k;
+
+  buf = Ymem_malloc(6 * n * sizeof(int));
+  if (buf == NULL) {
+    worker->status = YMAGINE_ERROR;
+    return NULL;
   }
-  if (1) {
-    dy0 = gradientYCheck(inp, bpp, pitch, x, y, width, height);
-    dy1 = gradientYCheck(inp + 1, bpp, pitch, x, y, width, height);
-    dy2 = gradientYCheck(inp + 2, bpp, pitch, x, y, width, height);
-    dy = (dy0 + 2 * dy1 + dy2) / 4;
-    s2 += dy * dy;
+  rows[0] = buf;
+  rows[1] = buf + n;
+  rows[2] = buf + 2 * n;
+
+  /* Keep a window of three weighted rows, loading one more per row */
+  sobelRowWeight(image, worker->firstrow - 1, rows[0]);
+  sobelRowWeight(image, worker->firstrow, rows[1]);
+  for (y = worker->firstrow; y < worker->lastrow; y++) {
+    k = y - worker->firstrow;
+    sobelRowWeight(image, y + 1, rows[(k + 2) % 3]);
+    sobelRow(image, rows[k % 3], rows[(k + 1) % 3], rows[(k + 2) % 3],
+             buf + 3 * n, buf + 4 * n, buf + 5 * n,
+             image->opixels + y * image->opitch);
   }
 
-  return CLIP_TO_8(isqrt(s2));
+  Ymem_free(buf);
+  worker->status = YMAGINE_OK;
+
+  return NULL;
 }
 
-int
-Vbitmap_sobel(Vbitmap *outbitmap, Vbitmap *vbitmap)
+static int
+sobelThreads(int nthreads, int height)
 {
-  int width;
-  int height;
-  int pitch;
-  int bpp;
-  unsigned char *pixels;
+  if (nthreads <= 0) {
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads > height / SOBEL_MIN_ROWS) {
+    nthreads = height / SOBEL_MIN_ROWS;
+  }
+  if (nthreads > SOBEL_MAX_THREADS) {
+    nthreads = SOBEL_MAX_THREADS;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
 
-  int owidth;
-  int oheight;
-  int opitch;
-  int obpp;
-  unsigned char *opixels;
+  return nthreads;
+}
+
+/* Compute energy of whole image, one band of rows per worker */
+static int
+sobelBands(const SobelImage *image, int nthreads)
+{
+  SobelWorker workers[SOBEL_MAX_THREADS];
+  int nstarted;
+  int i;
+  int rc = YMAGINE_OK;
+
+  nthreads = sobelThreads(nthreads, image->height);
+
+  for (i = 0; i < nthreads; i++) {
+    workers[i].image = image;
+    workers[i].firstrow = (image->height * i) / nthreads;
+    workers[i].lastrow = (image->height * (i + 1)) / nthreads;
+    workers[i].status = YMAGINE_ERROR;
+  }
+
+  /* Calling thread takes the first band, and the one of any worker which
+     failed to start */
+  for (nstarted = 1; nstarted < nthreads; nstarted++) {
+    if (pthread_create(&workers[nstarted].thread, NULL,
+                       sobelRun, &workers[nstarted]) != 0) {
+      break;
+    }
+  }
+  sobelRun(&workers[0]);
+  for (i = nstarted; i < nthreads; i++) {
+    sobelRun(&workers[i]);
+  }
+  for (i = 1; i < nstarted; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (workers[i].status != YMAGINE_OK) {
+      rc = YMAGINE_ERROR;
+    }
+  }
 
-  int i, j;
+  return rc;
+}
 
-  unsigned char *inp;
-  unsigned char *outp;
+int
+Vbitmap_sobelWithOptions(Vbitmap *outbitmap, Vbitmap *vbitmap,
+                         int magnitude, int nthreads)
+{
+  SobelImage image;
+  int owidth;
+  int oheight;
+  int rc = YMAGINE_ERROR;
 
-  if (vbitmap == NULL) {
+  if (vbitmap == NULL || outbitmap == NULL) {
     return YMAGINE_ERROR;
   }
 
   if (VbitmapLock(vbitmap) == YMAGINE_OK) {
-    pixels = VbitmapBuffer(vbitmap);
-    width = VbitmapWidth(vbitmap);
-    height = VbitmapHeight(vbitmap);
-    pitch = VbitmapPitch(vbitmap);
-    bpp = colorBpp(VbitmapColormode(vbitmap));
+    image.pixels = VbitmapBuffer(vbitmap);
+    image.width = VbitmapWidth(vbitmap);
+    image.height = VbitmapHeight(vbitmap);
+    image.pitch = VbitmapPitch(vbitmap);
+    image.bpp = colorBpp(VbitmapColormode(vbitmap));
+    image.magnitude = magnitude;
 
     if (VbitmapLock(outbitmap) == YMAGINE_OK) {
-      opixels = VbitmapBuffer(outbitmap);
       owidth = VbitmapWidth(outbitmap);
       oheight = VbitmapHeight(outbitmap);
-      opitch = VbitmapPitch(outbitmap);
-      obpp = colorBpp(VbitmapColormode(outbitmap));
 
-      if (width != owidth || height != oheight) {
+      if (image.width != owidth || image.height != oheight) {
         VbitmapUnlock(outbitmap);
-        if (VbitmapResize(outbitmap, width, height) == YMAGINE_OK) {
+        if (VbitmapResize(outbitmap, image.width, image.height) == YMAGINE_OK) {
           if (VbitmapLock(outbitmap) != YMAGINE_OK) {
             VbitmapUnlock(vbitmap);
             return YMAGINE_ERROR;
           }
 
-          opixels = VbitmapBuffer(outbitmap);
           owidth = VbitmapWidth(outbitmap);
           oheight = VbitmapHeight(outbitmap);
-          opitch = VbitmapPitch(outbitmap);
-          obpp = colorBpp(VbitmapColormode(outbitmap));
         }
       }
 
-      if (width == owidth && height == oheight && bpp >= 3) {
-        for (j = 0; j < height; j++) {
-          inp = pixels + pitch * j;
-          outp = opixels + opitch * j;
-
-          outp[0] = EnergySobel(inp, bpp, pitch, 0, j, width, height);
-          outp += obpp;
-          inp += bpp;
-
-          if (j != 0 && j != height-1) {
-            for (i = 1; i < width - 1; i++) {
-              outp[0] = EnergySobelFast(inp, bpp, pitch);
-              outp += obpp;
-              inp += bpp;
-            }
-          } else {
-            for (i = 1; i < width - 1; i++) {
-              outp[0] = EnergySobel(inp, bpp, pitch, i, j, width, height);
-              outp += obpp;
-              inp += bpp;
-            }
-          }
-
-          outp[0] = EnergySobel(inp, bpp, pitch, width - 1, j, width, height);
-        }
+      image.opixels = VbitmapBuffer(outbitmap);
+      image.opitch = VbitmapPitch(outbitmap);
+      image.obpp = colorBpp(VbitmapColormode(outbitmap));
 
-        if (obpp >= 3) {
-          for (j = 0; j < height; j++) {
-            outp = opixels + opitch * j;
-            for (i = 0; i < width; i++) {              
-              outp[1] = outp[0];
-              outp[2] = outp[0];
-              if (obpp == 4) {                
-                outp[0] = 0xff;
-              }
-
-              outp += obpp;
-            }
-          }
-        }
+      if (image.width == owidth && image.height == oheight &&
+          image.width > 0 && image.height > 0 &&
+          (image.bpp == 1 || image.bpp >= 3)) {
+        rc = sobelBands(&image, nthreads);
       }
 
       VbitmapUnlock(outbitmap);
@@ -294,6 +402,11 @@ Vbitmap_sobel(Vbitmap *outbitmap, Vbitmap *vbitmap)
     VbitmapUnlock(vbitmap);
   }
 
-  return YMAGINE_OK;
+  return rc;
 }
 
+int
+Vbitmap_sobel(Vbitmap *outbitmap, Vbitmap *vbitmap)
+{
+  return Vbitmap_sobelWithOptions(outbitmap, vbitmap, YMAGINE_SOBEL_EXACT, 1);
+}
@@ -0,0 +1,559 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#define LOG_TAG "ymagine::batch"
+
+#include "ymagine/ymagine.h"
+#include "ymagine_priv.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BATCH_MAX_THREADS 64
+/* Memory each worker may keep for reuse by its next job */
+#define BATCH_WORKER_CACHE (32 * 1024 * 1024)
+
+typedef struct {
+  BatchRunFunc run;
+  void *data;
+  int njobs;
+  int next;
+  pthread_mutex_t lock;
+} BatchQueue;
+
+static int
+BatchNext(BatchQueue *queue)
+{
+  int idx;
+
+  pthread_mutex_lock(&queue->lock);
+  idx = queue->next;
+  if (idx < queue->njobs) {
+    queue->next++;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return (idx < queue->njobs) ? idx : -1;
+}
+
+static void*
+BatchWorker(void *arg)
+{
+  BatchQueue *queue = (BatchQueue*) arg;
+  YmagineCodecContext *context = NULL;
+  YBOOL cached;
+  int idx;
+
+  /* Calling thread may already have its own context */
+  if (YmagineCodecContext_Current() == NULL) {
+    context = YmagineCodecContext_Create();
+    if (context != NULL) {
+      YmagineCodecContext_Bind(context);
+    }
+  }
+  cached = (VbitmapPoolCacheAttach(BATCH_WORKER_CACHE) == YMAGINE_OK);
+
+  while ((idx = BatchNext(queue)) >= 0) {
+    queue->run(queue->data, idx);
+  }
+
+  if (cached) {
+    VbitmapPoolCacheDetach();
+  }
+  if (context != NULL) {
+    YmagineCodecContext_Release(context);
+  }
+
+  return NULL;
+}
+
+/* Run njobs jobs on at most nthreads workers, calling thread being one of them */
+int
+BatchRun(BatchRunFunc run, void *data, int njobs, int nthreads)
+{
+  BatchQueue queue;
+  pthread_t threads[BATCH_MAX_THREADS];
+  int nstarted = 0;
+  int i;
+
+  if (nthreads <= 0) {
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > BATCH_MAX_THREADS) {
+    nthreads = BATCH_MAX_THREADS;
+  }
+  if (nthreads > njobs) {
+    nthreads = njobs;
+  }
+
+  queue.run = run;
+  queue.data = data;
+  queue.njobs = njobs;
+  queue.next = 0;
+  if (pthread_mutex_init(&queue.lock, NULL) != 0) {
+    return YMAGINE_ERROR;
+  }
+
+  for (i = 1; i < nthreads; i++) {
+    if (pthread_create(&threads[nstarted], NULL, BatchWorker, &queue) == 0) {
+      nstarted++;
+    }
+  }
+
+  BatchWorker(&queue);
+
+  for (i = 0; i < nstarted; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&queue.lock);
+
+  return YMAGINE_OK;
+}
+
+typedef struct {
+  YmagineFormatOptions *options;
+  int idx;
+} BatchOptionsEntry;
+
+static int
+BatchOptionsCompare(const void *a, const void *b)
+{
+  uintptr_t pa = (uintptr_t) ((const BatchOptionsEntry*) a)->options;
+  uintptr_t pb = (uintptr_t) ((const BatchOptionsEntry*) b)->options;
+
+  return (pa > pb) - (pa < pb);
+}
+
+/* Flag which of n options are also given to another job, in which case
+   results of this job can't be handed back into them. Returns NULL on
+   failure */
+static YBOOL*
+BatchSharedOptions(YmagineFormatOptions **options, int n)
+{
+  BatchOptionsEntry *entries;
+  YBOOL *shared;
+  int i;
+
+  shared = (YBOOL*) Ymem_calloc(n, sizeof(YBOOL));
+  entries = (BatchOptionsEntry*) Ymem_malloc(n * sizeof(BatchOptionsEntry));
+  if (shared == NULL || entries == NULL) {
+    if (shared != NULL) {
+      Ymem_free(shared);
+    }
+    if (entries != NULL) {
+      Ymem_free(entries);
+    }
+    return NULL;
+  }
+
+  for (i = 0; i < n; i++) {
+    entries[i].options = options[i];
+    entries[i].idx = i;
+  }
+  qsort(entries, n, sizeof(BatchOptionsEntry), BatchOptionsCompare);
+
+  for (i = 1; i < n; i++) {
+    if (entries[i].options != NULL &&
+        entries[i].options == entries[i - 1].options) {
+      shared[entries[i].idx] = YTRUE;
+      shared[entries[i - 1].idx] = YTRUE;
+    }
+  }
+  Ymem_free(entries);
+
+  return shared;
+}
+
+typedef struct {
+  YmagineTranscodeJob *jobs;
+  YBOOL *shared;
+} BatchTranscodeState;
+
+static void
+BatchTranscodeJob(void *data, int idx)
+{
+  BatchTranscodeState *batch = (BatchTranscodeState*) data;
+  YmagineTranscodeJob *job = &(batch->jobs[idx]);
+  YmagineFormatOptions *options;
+
+  /* Each job works on its own copy, as transcoding stores its results,
+     and progress callbacks may adjust options */
+  if (job->options != NULL) {
+    options = YmagineFormatOptions_Duplicate(job->options);
+  } else {
+    options = YmagineFormatOptions_Create();
+  }
+  if (options == NULL) {
+    job->status = YMAGINE_ERROR;
+    return;
+  }
+
+  job->status = YmagineTranscode(job->channelin, job->channelout, options);
+
+  if (job->options != NULL && !batch->shared[idx]) {
+    YmagineResultsCopy(job->options, options);
+  }
+
+  YmagineFormatOptions_Release(options);
+}
+
+int
+YmagineTranscodeBatch(YmagineTranscodeJob *jobs, int njobs, int nthreads)
+{
+  BatchTranscodeState batch;
+  YmagineFormatOptions **options;
+  int rc = YMAGINE_OK;
+  int i;
+
+  if (jobs == NULL || njobs < 0) {
+    return YMAGINE_ERROR;
+  }
+  if (njobs == 0) {
+    return YMAGINE_OK;
+  }
+
+  for (i = 0; i < njobs; i++) {
+    jobs[i].status = YMAGINE_ERROR;
+  }
+
+  options = (YmagineFormatOptions**) Ymem_malloc(njobs * sizeof(YmagineFormatOptions*));
+  if (options == NULL) {
+    return YMAGINE_ERROR;
+  }
+  for (i = 0; i < njobs; i++) {
+    options[i] = jobs[i].options;
+  }
+  batch.jobs = jobs;
+  batch.shared = BatchSharedOptions(options, njobs);
+  Ymem_free(options);
+  if (batch.shared == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  if (BatchRun(BatchTranscodeJob, &batch, njobs, nthreads) != YMAGINE_OK) {
+    rc = YMAGINE_ERROR;
+  }
+  Ymem_free(batch.shared);
+  if (rc != YMAGINE_OK) {
+    return rc;
+  }
+
+  for (i = 0; i < njobs; i++) {
+    if (jobs[i].status != YMAGINE_OK) {
+      rc = YMAGINE_ERROR;
+    }
+  }
+
+  return rc;
+}
+
+/*
+ * Thumbnail ladder: decode source once, at the smallest eighth of its
+ * size which is still large enough for every output, then resample and
+ * encode each output from that shared master concurrently.
+ */
+typedef struct {
+  YmagineLadderOutput *outputs;
+  int noutputs;
+  /* Outputs whose progress callback rejected the source */
+  YBOOL *skip;
+  /* Outputs whose options are also those of another output */
+  YBOOL *shared;
+
+  int iformat;
+  int srcwidth;
+  int srcheight;
+
+  int colormode;
+  int mwidth;
+  int mheight;
+  int mpitch;
+  unsigned char *mpixels;
+} LadderState;
+
+static double
+LadderScale(YmagineFormatOptions *options, int width, int height)
+{
+  Vrect srcrect;
+  Vrect destrect;
+  double sx, sy;
+
+  if (options == NULL || options->rotate != 0.0f) {
+    /* Rotation is computed on cropped source, keep full resolution */
+    return 1.0;
+  }
+
+  if (YmaginePrepareTransform(NULL, options, width, height,
+                              &srcrect, &destrect) != YMAGINE_OK ||
+      srcrect.width <= 0 || srcrect.height <= 0) {
+    return 1.0;
+  }
+
+  sx = ((double) destrect.width) / srcrect.width;
+  sy = ((double) destrect.height) / srcrect.height;
+
+  return (sx > sy) ? sx : sy;
+}
+
+static int
+LadderCallback(YmagineFormatOptions *options, int format, int width, int height)
+{
+  LadderState *ladder = (LadderState*) YmagineFormatOptions_getData(options);
+  YmagineFormatOptions *ooptions;
+  double scale = 0.0;
+  double s;
+  int q;
+  int quality = -1;
+  int accuracy = -1;
+  int nactive = 0;
+  int reqwidth;
+  int reqheight;
+  int num;
+  int i;
+
+  if (ladder == NULL || width <= 0 || height <= 0) {
+    return YMAGINE_ERROR;
+  }
+
+  ladder->srcwidth = width;
+  ladder->srcheight = height;
+
+  for (i = 0; i < ladder->noutputs; i++) {
+    ooptions = ladder->outputs[i].options;
+
+    /* Let caller adjust each output as it would for a single transcode */
+    if (YmagineFormatOptions_invokeCallback(ooptions, format,
+                                            width, height) != YMAGINE_OK) {
+      ladder->skip[i] = YTRUE;
+      continue;
+    }
+    nactive++;
+
+    s = LadderScale(ooptions, width, height);
+    if (s > scale) {
+      scale = s;
+    }
+
+    q = YmagineFormatOptions_normalizeQuality(ooptions);
+    if (q > quality) {
+      quality = q;
+    }
+    if (ooptions != NULL && ooptions->accuracy > accuracy) {
+      accuracy = ooptions->accuracy;
+    }
+  }
+
+  if (nactive == 0) {
+    return YMAGINE_ERROR;
+  }
+  if (scale > 1.0) {
+    scale = 1.0;
+  }
+
+  /* Smallest DCT scale, as for GetScaleNum, satisfying largest output */
+  reqwidth = (int) (width * scale + 0.999);
+  reqheight = (int) (height * scale + 0.999);
+  for (num = 1; num < 8; num++) {
+    if ((width * num) / 8 >= reqwidth && (height * num) / 8 >= reqheight) {
+      break;
+    }
+  }
+
+  YmagineFormatOptions_setResize(options,
+                                 (width * num + 7) / 8, (height * num + 7) / 8,
+                                 YMAGINE_SCALE_LETTERBOX);
+  YmagineFormatOptions_setQuality(options, quality);
+  YmagineFormatOptions_setAccuracy(options, accuracy);
+
+  return YMAGINE_OK;
+}
+
+/* Absolute crop is given in source coordinates, map it onto master */
+static void
+LadderMapCrop(YmagineFormatOptions *options, LadderState *ladder)
+{
+  int64_t sw = ladder->srcwidth;
+  int64_t sh = ladder->srcheight;
+
+  if (options->cropoffsetmode == CROP_MODE_ABSOLUTE) {
+    options->cropx = (int) ((options->cropx * (int64_t) ladder->mwidth) / sw);
+    options->cropy = (int) ((options->cropy * (int64_t) ladder->mheight) / sh);
+  }
+  if (options->cropsizemode == CROP_MODE_ABSOLUTE) {
+    if (options->cropwidth > 0) {
+      options->cropwidth = (int) ((options->cropwidth * (int64_t) ladder->mwidth + sw - 1) / sw);
+    }
+    if (options->cropheight > 0) {
+      options->cropheight = (int) ((options->cropheight * (int64_t) ladder->mheight + sh - 1) / sh);
+    }
+  }
+}
+
+static void
+LadderOutputJob(void *data, int idx)
+{
+  LadderState *ladder = (LadderState*) data;
+  YmagineLadderOutput *output = &(ladder->outputs[idx]);
+  YmagineFormatOptions *options;
+  Vbitmap *master;
+  Vbitmap *vbitmap;
+  int rc = YMAGINE_ERROR;
+
+  output->status = YMAGINE_ERROR;
+  if (ladder->skip[idx] || output->channelout == NULL) {
+    return;
+  }
+
+  if (output->options != NULL) {
+    options = YmagineFormatOptions_Duplicate(output->options);
+  } else {
+    options = YmagineFormatOptions_Create();
+  }
+  if (options == NULL) {
+    return;
+  }
+
+  /* Callback already ran against source dimensions */
+  YmagineFormatOptions_setCallback(options, NULL);
+  YmagineFormatOptions_setResizable(options, 1);
+  if (options->format == YMAGINE_IMAGEFORMAT_UNKNOWN) {
+    YmagineFormatOptions_setFormat(options, ladder->iformat);
+  }
+  LadderMapCrop(options, ladder);
+
+  /* Private view on master, as lock state of a Vbitmap is not shared safely */
+  master = VbitmapInitStatic(ladder->colormode, ladder->mwidth, ladder->mheight,
+                             ladder->mpitch, ladder->mpixels);
+  vbitmap = VbitmapInitMemory(ladder->colormode);
+  if (master != NULL && vbitmap != NULL) {
+    rc = YmagineDecodeCopy(vbitmap, master, options);
+    if (rc == YMAGINE_OK) {
+      rc = YmagineEncode(vbitmap, output->channelout, options);
+    }
+  }
+
+  if (output->options != NULL && !ladder->shared[idx]) {
+    /* Hand results of this output back to caller */
+    YmagineResultsCopy(output->options, options);
+  }
+
+  if (vbitmap != NULL) {
+    VbitmapRelease(vbitmap);
+  }
+  if (master != NULL) {
+    VbitmapRelease(master);
+  }
+  YmagineFormatOptions_Release(options);
+
+  output->status = rc;
+}
+
+int
+YmagineTranscodeLadder(Ychannel *channelin,
+                       YmagineLadderOutput *outputs, int noutputs,
+                       int nthreads)
+{
+  LadderState ladder;
+  YmagineFormatOptions *options = NULL;
+  YmagineFormatOptions **ooptions;
+  Vbitmap *master = NULL;
+  int rc = YMAGINE_ERROR;
+  int i;
+
+  if (channelin == NULL || outputs == NULL || noutputs <= 0) {
+    return YMAGINE_ERROR;
+  }
+
+  for (i = 0; i < noutputs; i++) {
+    outputs[i].status = YMAGINE_ERROR;
+  }
+
+  memset(&ladder, 0, sizeof(LadderState));
+  ladder.outputs = outputs;
+  ladder.noutputs = noutputs;
+  ladder.iformat = YmagineFormat(channelin);
+  if (ladder.iformat == YMAGINE_IMAGEFORMAT_UNKNOWN) {
+    return YMAGINE_ERROR;
+  }
+
+  /* JPEG has no alpha, save a byte per pixel on master */
+  if (ladder.iformat == YMAGINE_IMAGEFORMAT_JPEG) {
+    ladder.colormode = VBITMAP_COLOR_RGB;
+  } else {
+    ladder.colormode = VBITMAP_COLOR_RGBA;
+  }
+
+  ooptions = (YmagineFormatOptions**) Ymem_malloc(noutputs * sizeof(YmagineFormatOptions*));
+  if (ooptions != NULL) {
+    for (i = 0; i < noutputs; i++) {
+      ooptions[i] = outputs[i].options;
+    }
+    ladder.shared = BatchSharedOptions(ooptions, noutputs);
+    Ymem_free(ooptions);
+  }
+
+  ladder.skip = (YBOOL*) Ymem_calloc(noutputs, sizeof(YBOOL));
+  options = YmagineFormatOptions_Create();
+  master = VbitmapInitMemory(ladder.colormode);
+
+  if (ladder.skip != NULL && ladder.shared != NULL &&
+      options != NULL && master != NULL) {
+    YmagineFormatOptions_setResizable(options, 1);
+    YmagineFormatOptions_setData(options, &ladder);
+    YmagineFormatOptions_setCallback(options, LadderCallback);
+
+    rc = YmagineDecode(master, channelin, options);
+  }
+
+  if (rc == YMAGINE_OK) {
+    rc = VbitmapLock(master);
+  }
+  if (rc == YMAGINE_OK) {
+    ladder.mwidth = VbitmapWidth(master);
+    ladder.mheight = VbitmapHeight(master);
+    ladder.mpitch = VbitmapPitch(master);
+    ladder.mpixels = VbitmapBuffer(master);
+
+    if (ladder.mpixels == NULL ||
+        BatchRun(LadderOutputJob, &ladder, noutputs, nthreads) != YMAGINE_OK) {
+      rc = YMAGINE_ERROR;
+    }
+    VbitmapUnlock(master);
+  }
+
+  if (rc == YMAGINE_OK) {
+    for (i = 0; i < noutputs; i++) {
+      if (outputs[i].status != YMAGINE_OK) {
+        rc = YMAGINE_ERROR;
+      }
+    }
+  }
+
+  if (master != NULL) {
+    VbitmapRelease(master);
+  }
+  if (options != NULL) {
+    YmagineFormatOptions_Release(options);
+  }
+  if (ladder.skip != NULL) {
+    Ymem_free(ladder.skip);
+  }
+  if (ladder.shared != NULL) {
+    Ymem_free(ladder.shared);
+  }
+
+  return rc;
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#define LOG_TAG "ymagine::context"
+
+#include "ymagine/ymagine.h"
+#include "ymagine_priv.h"
+
+#include <pthread.h>
+
+/*
+ * A codec context holds decoder and encoder objects which codecs keep
+ * alive between images instead of creating and destroying them for
+ * each one. Codecs look the context up from the calling thread, so a
+ * context must only be bound to a single thread at a time.
+ */
+
+static pthread_key_t contextKey;
+static pthread_once_t contextOnce = PTHREAD_ONCE_INIT;
+
+static void
+contextKeyCreate()
+{
+  pthread_key_create(&contextKey, NULL);
+}
+
+YmagineCodecContext*
+YmagineCodecContext_Create()
+{
+  YmagineCodecContext *context;
+
+  context = (YmagineCodecContext*) Ymem_calloc(1, sizeof(YmagineCodecContext));
+
+  return context;
+}
+
+void
+YmagineCodecContext_Release(YmagineCodecContext *context)
+{
+  if (context == NULL) {
+    return;
+  }
+
+  if (YmagineCodecContext_Current() == context) {
+    YmagineCodecContext_Bind(NULL);
+  }
+
+  if (context->jpeg != NULL) {
+    JPEGCodecRelease(context->jpeg);
+    context->jpeg = NULL;
+  }
+
+  Ymem_free(context);
+}
+
+int
+YmagineCodecContext_Bind(YmagineCodecContext *context)
+{
+  pthread_once(&contextOnce, contextKeyCreate);
+
+  if (pthread_setspecific(contextKey, context) != 0) {
+    return YMAGINE_ERROR;
+  }
+
+  return YMAGINE_OK;
+}
+
+YmagineCodecContext*
+YmagineCodecContext_Current()
+{
+  pthread_once(&contextOnce, contextKeyCreate);
+
+  return (YmagineCodecContext*) pthread_getspecific(contextKey);
+}
@@ -16,6 +16,7 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <setjmp.h>
+#include <limits.h>
 
 #define LOG_TAG "ymagine::bitmap"
 #include "ymagine_priv.h"
@@ -125,6 +126,10 @@ YmagineFormatOptions_Reset(YmagineFormatOptions *options)
   options->cropheight = 0;
   options->cropwidthp = 0.0f;
   options->cropheightp = 0.0f;
+  options->smartcrop = 0;
+  options->cropfocusx = -1.0f;
+  options->cropfocusy = -1.0f;
+  options->composemode = -1;
   options->maxwidth = -1;
   options->maxheight = -1;
   options->scalemode = YMAGINE_SCALE_CROP;
@@ -134,6 +139,11 @@ YmagineFormatOptions_Reset(YmagineFormatOptions *options)
   options->accuracy = -1;
   options->subsampling = -1;
   options->progressive = -1;
+  options->compression = -1;
+  options->zstrategy = YMAGINE_ZSTRATEGY_AUTO;
+  options->zwindowbits = -1;
+  options->pngfilters = YMAGINE_PNG_FILTER_AUTO;
+  options->threads = 1;
   options->sharpen = 0.0f;
   options->blur = 0.0f;
   options->rotate = 0.0f;
@@ -143,6 +153,16 @@ YmagineFormatOptions_Reset(YmagineFormatOptions *options)
   options->backgroundcolor = YcolorRGBA(0, 0, 0, 0);
   options->metadata = NULL;
   options->progresscb = NULL;
+  options->previewcb = NULL;
+  options->previewinterval = 0;
+  options->themecolors = 0;
+  options->themencolors = -1;
+  options->statsenabled = YFALSE;
+  options->statsvalid = YFALSE;
+  options->haslimits = YFALSE;
+  options->searchmaxbytes = 0;
+  options->searchminssim = 0.0;
+  options->searchedquality = -1;
 
   return options;
 }
@@ -176,6 +196,36 @@ YmagineFormatOptions_normalizeQuality(YmagineFormatOptions *options)
   }
 }
 
+YmagineFormatOptions*
+YmagineFormatOptions_setQualitySearch(YmagineFormatOptions *options,
+                                      int maxbytes, double minssim)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  options->searchmaxbytes = (maxbytes > 0) ? maxbytes : 0;
+  if (minssim <= 0.0) {
+    options->searchminssim = 0.0;
+  } else if (minssim > 1.0) {
+    options->searchminssim = 1.0;
+  } else {
+    options->searchminssim = minssim;
+  }
+
+  return options;
+}
+
+int
+YmagineFormatOptions_getSearchedQuality(YmagineFormatOptions *options)
+{
+  if (options == NULL) {
+    return -1;
+  }
+
+  return options->searchedquality;
+}
+
 YmagineFormatOptions*
 YmagineFormatOptions_setAccuracy(YmagineFormatOptions *options,
                                  int accuracy)
@@ -215,6 +265,90 @@ YmagineFormatOptions_setProgressive(YmagineFormatOptions *options,
   return options;
 }
 
+YmagineFormatOptions*
+YmagineFormatOptions_setCompression(YmagineFormatOptions *options,
+                                    int level)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  if (level > 9) {
+    level = 9;
+  }
+  options->compression = level;
+
+  return options;
+}
+
+YmagineFormatOptions*
+YmagineFormatOptions_setCompressionStrategy(YmagineFormatOptions *options,
+                                            int strategy)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  options->zstrategy = strategy;
+
+  return options;
+}
+
+YmagineFormatOptions*
+YmagineFormatOptions_setWindowBits(YmagineFormatOptions *options,
+                                   int windowbits)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  if (windowbits >= 0) {
+    if (windowbits < 8) {
+      windowbits = 8;
+    } else if (windowbits > 15) {
+      windowbits = 15;
+    }
+  }
+  options->zwindowbits = windowbits;
+
+  return options;
+}
+
+YmagineFormatOptions*
+YmagineFormatOptions_setPngFilters(YmagineFormatOptions *options,
+                                   int filters)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  if (filters >= 0) {
+    filters &= YMAGINE_PNG_FILTER_ALL;
+    if (filters == 0) {
+      filters = YMAGINE_PNG_FILTER_AUTO;
+    }
+  }
+  options->pngfilters = filters;
+
+  return options;
+}
+
+YmagineFormatOptions*
+YmagineFormatOptions_setThreads(YmagineFormatOptions *options,
+                                int threads)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  if (threads < 0) {
+    threads = 1;
+  }
+  options->threads = threads;
+
+  return options;
+}
+
 YmagineFormatOptions*
 YmagineFormatOptions_setSharpen(YmagineFormatOptions *options,
                                 float sigma)
@@ -413,6 +547,19 @@ YmagineFormatOptions_setCropRelative(YmagineFormatOptions *options,
   return options;
 }
 
+YmagineFormatOptions*
+YmagineFormatOptions_setSmartCrop(YmagineFormatOptions *options,
+                                  int smartcrop)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  options->smartcrop = smartcrop ? 1 : 0;
+
+  return options;
+}
+
 YmagineFormatOptions*
 YmagineFormatOptions_setMetaMode(YmagineFormatOptions *options,
                                  int metamode)
@@ -459,6 +606,114 @@ YmagineFormatOptions_getData(YmagineFormatOptions *options)
   return options->metadata;
 }
 
+YmagineFormatOptions*
+YmagineFormatOptions_setThemeColors(YmagineFormatOptions *options,
+                                    int ncolors)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  if (ncolors < 0) {
+    ncolors = 0;
+  } else if (ncolors > YMAGINE_THEME_MAXCOLORS) {
+    ncolors = YMAGINE_THEME_MAXCOLORS;
+  }
+  options->themecolors = ncolors;
+
+  return options;
+}
+
+int
+YmagineFormatOptions_getThemeColors(YmagineFormatOptions *options,
+                                    int *colors, int *scores, int maxcolors)
+{
+  int i;
+  int ncolors;
+
+  if (options == NULL || colors == NULL || options->themencolors <= 0) {
+    return 0;
+  }
+
+  ncolors = options->themencolors;
+  if (ncolors > maxcolors) {
+    ncolors = maxcolors;
+  }
+
+  for (i = 0; i < ncolors; i++) {
+    colors[i] = options->themecolor[i];
+    if (scores != NULL) {
+      scores[i] = options->themescore[i];
+    }
+  }
+
+  return ncolors;
+}
+
+YmagineFormatOptions*
+YmagineFormatOptions_setStats(YmagineFormatOptions *options,
+                              YBOOL enable)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  options->statsenabled = enable ? YTRUE : YFALSE;
+
+  return options;
+}
+
+int
+YmagineFormatOptions_getStats(YmagineFormatOptions *options,
+                              YmagineStats *stats)
+{
+  if (options == NULL || stats == NULL || !options->statsvalid) {
+    return YMAGINE_ERROR;
+  }
+
+  memcpy(stats, &(options->stats), sizeof(YmagineStats));
+
+  return YMAGINE_OK;
+}
+
+void
+YmagineThemePrepare(YmagineFormatOptions *options, Transformer *transformer)
+{
+  if (options == NULL || transformer == NULL || options->themecolors <= 0) {
+    return;
+  }
+
+  TransformerSetStats(transformer, TRANSFORMER_STATS_THEME);
+}
+
+void
+YmagineThemeCollect(YmagineFormatOptions *options, Transformer *transformer)
+{
+  if (options == NULL || transformer == NULL || options->themecolors <= 0) {
+    return;
+  }
+
+  options->themencolors = TransformerGetThemeColors(transformer,
+                                                    options->themecolors,
+                                                    options->themecolor,
+                                                    options->themescore);
+}
+
+void
+YmagineResultsCopy(YmagineFormatOptions *options, const YmagineFormatOptions *from)
+{
+  if (options == NULL || from == NULL || options == from) {
+    return;
+  }
+
+  options->themencolors = from->themencolors;
+  memcpy(options->themecolor, from->themecolor, sizeof(options->themecolor));
+  memcpy(options->themescore, from->themescore, sizeof(options->themescore));
+  options->searchedquality = from->searchedquality;
+  options->statsvalid = from->statsvalid;
+  memcpy(&(options->stats), &(from->stats), sizeof(YmagineStats));
+}
+
 YmagineFormatOptions*
 YmagineFormatOptions_setCallback(YmagineFormatOptions *options,
                                  YmagineFormatOptions_ProgressCB progresscb)
@@ -472,6 +727,25 @@ YmagineFormatOptions_setCallback(YmagineFormatOptions *options,
   return options;
 }
 
+YmagineFormatOptions*
+YmagineFormatOptions_setPreviewCallback(YmagineFormatOptions *options,
+                                        YmagineFormatOptions_PreviewCB previewcb,
+                                        int scaninterval)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  if (scaninterval < 0) {
+    scaninterval = 0;
+  }
+
+  options->previewcb = previewcb;
+  options->previewinterval = scaninterval;
+
+  return options;
+}
+
 int
 YmagineFormatOptions_invokeCallback(YmagineFormatOptions *options,
                                     int width, int height, int format)
@@ -500,6 +774,16 @@ YmagineFormatOptions_setBackgroundColor(YmagineFormatOptions *options,
   return options;
 }
 
+void
+YmagineComposePrepare(YmagineFormatOptions *options, Transformer *transformer)
+{
+  if (options == NULL || transformer == NULL || options->composemode < 0) {
+    return;
+  }
+
+  TransformerSetCompose(transformer, options->composemode);
+}
+
 int
 YmagineFormat(Ychannel *channel)
 {
@@ -587,6 +871,8 @@ decodeBitmap(Vbitmap *src, Vbitmap *vbitmap, YmagineFormatOptions *options)
   TransformerSetBitmap(transformer, vbitmap, destrect.x, destrect.y);
   TransformerSetShader(transformer, shader);
   TransformerSetSharpen(transformer, sharpen);
+  YmagineThemePrepare(options, transformer);
+  YmagineComposePrepare(options, transformer);
 
   rc = VbitmapLock(src);
   if (rc == YMAGINE_OK) {
@@ -605,19 +891,250 @@ decodeBitmap(Vbitmap *src, Vbitmap *vbitmap, YmagineFormatOptions *options)
   }
 
   if (transformer != NULL) {
+    YmagineThemeCollect(options, transformer);
     TransformerRelease(transformer);
   }
 
   return nlines;
 }
 
+/* Largest side of preview decoded to choose region kept by smart crop */
+#define SMARTCROP_PREVIEW_SIZE 128
+/* Minimum read size when loading stream input in memory */
+#define SMARTCROP_READ_SIZE ((size_t) (64 * 1024))
+/* Largest stream input loaded in memory, as read back by a byte array channel */
+#define SMARTCROP_MAX_SIZE ((size_t) INT_MAX)
+
 static int
 decodeGeneric(Vbitmap *bitmap, Ychannel *channel, Vbitmap *srcbitmap,
-              YmagineFormatOptions *options)
+              YmagineFormatOptions *options, YBOOL smartcrop);
+
+/*
+ * Read what is left of channel in memory. Its buffer of *psize bytes is
+ * reserved against limits, and must be released with smartCropRelease().
+ * Returns YMAGINE_OK, YMAGINE_ERROR, or YMAGINE_ERROR_LIMIT if input
+ * doesn't fit in memory granted (or in a byte array channel).
+ */
+static int
+smartCropLoad(Ychannel *channel, char **pdata, size_t *psize, size_t *plen)
+{
+  char *data = NULL;
+  char *newdata;
+  size_t size = 0;
+  size_t newsize;
+  size_t len = 0;
+  int rc;
+  int n;
+
+  for (;;) {
+    if (size - len < SMARTCROP_READ_SIZE) {
+      if (size >= SMARTCROP_MAX_SIZE) {
+        YmagineLimitsExceeded();
+        rc = YMAGINE_ERROR_LIMIT;
+        goto failure;
+      }
+      newsize = 2 * size + SMARTCROP_READ_SIZE;
+      if (newsize > SMARTCROP_MAX_SIZE) {
+        newsize = SMARTCROP_MAX_SIZE;
+      }
+
+      rc = YmagineLimitsReserve(newsize, YFALSE);
+      if (rc != YMAGINE_OK) {
+        goto failure;
+      }
+      newdata = (char*) Ymem_malloc(newsize);
+      if (newdata == NULL) {
+        YmagineLimitsReserve(newsize, YTRUE);
+        rc = YMAGINE_ERROR;
+        goto failure;
+      }
+      if (data != NULL) {
+        memcpy(newdata, data, len);
+        Ymem_free(data);
+        YmagineLimitsReserve(size, YTRUE);
+      }
+      data = newdata;
+      size = newsize;
+    }
+
+    n = YmagineIORead(channel, data + len, (int) (size - len));
+    if (n <= 0) {
+      break;
+    }
+    len += (size_t) n;
+  }
+
+  *pdata = data;
+  *psize = size;
+  *plen = len;
+
+  return YMAGINE_OK;
+
+ failure:
+  if (data != NULL) {
+    Ymem_free(data);
+    YmagineLimitsReserve(size, YTRUE);
+  }
+
+  return rc;
+}
+
+/* Per-call state of smart crop, see smartCropPrepare */
+typedef struct {
+  /* Stream input loaded in memory, and size of its buffer (NULL if none) */
+  char *data;
+  size_t size;
+  /* Whether channel reads were counted before reading data back */
+  YBOOL countio;
+  /* Duplicate of caller options holding focus found (NULL if none) */
+  YmagineFormatOptions *options;
+} SmartCrop;
+
+/* Release state of smart crop, and channel reading back its data if any */
+static void
+smartCropRelease(Ychannel *channel, SmartCrop *smart)
+{
+  if (smart->data != NULL) {
+    if (channel != NULL) {
+      YchannelResetBuffer(channel);
+      YchannelRelease(channel);
+    }
+    Ymem_free(smart->data);
+    YmagineLimitsReserve(smart->size, YTRUE);
+    YmagineStatsCountIO(smart->countio);
+    smart->data = NULL;
+    smart->size = 0;
+  }
+  if (smart->options != NULL) {
+    YmagineFormatOptions_Release(smart->options);
+    smart->options = NULL;
+  }
+}
+
+/*
+ * Decode a small preview of the region to crop, and find the center of
+ * its window of output aspect ratio with most energy. It is stored into
+ * smart->options, a duplicate of options private to this call, as options
+ * given by caller may be shared. Stream input is loaded in memory to be
+ * decoded twice, *pchannel replaced by a channel reading it back. Reads
+ * of this channel aren't counted, as input got counted while loading it.
+ * State is to be released with smartCropRelease().
+ */
+static int
+smartCropPrepare(YmagineFormatOptions *options, Vbitmap *bitmap,
+                 Ychannel **pchannel, Vbitmap *srcbitmap, SmartCrop *smart)
+{
+  YmagineFormatOptions *previewoptions;
+  Vbitmap *preview;
+  Ychannel *channel = NULL;
+  char *data = NULL;
+  size_t size = 0;
+  size_t len = 0;
+  int rc;
+  int aspectwidth;
+  int aspectheight;
+  float focusx;
+  float focusy;
+
+  smart->data = NULL;
+  smart->size = 0;
+  smart->countio = YTRUE;
+  smart->options = NULL;
+
+  if (!options->smartcrop || options->scalemode != YMAGINE_SCALE_CROP ||
+      options->rotate != 0.0f) {
+    return YMAGINE_OK;
+  }
+
+  if (bitmap != NULL && !options->resizable) {
+    aspectwidth = VbitmapWidth(bitmap);
+    aspectheight = VbitmapHeight(bitmap);
+  } else {
+    aspectwidth = options->maxwidth;
+    aspectheight = options->maxheight;
+  }
+  if (aspectwidth <= 0 || aspectheight <= 0) {
+    /* Nothing cropped */
+    return YMAGINE_OK;
+  }
+
+  if (pchannel != NULL && *pchannel != NULL) {
+    rc = smartCropLoad(*pchannel, &data, &size, &len);
+    if (rc != YMAGINE_OK) {
+      return rc;
+    }
+    channel = YchannelInitByteArray(data, (int) len);
+    if (channel == NULL) {
+      Ymem_free(data);
+      YmagineLimitsReserve(size, YTRUE);
+      return YMAGINE_ERROR;
+    }
+    smart->countio = YmagineStatsCountIO(YFALSE);
+  }
+
+  previewoptions = YmagineFormatOptions_Duplicate(options);
+  preview = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+  if (previewoptions != NULL && preview != NULL) {
+    /* Same region, only small and without any processing. Progress
+       callback is kept, as it may still update the crop region */
+    YmagineFormatOptions_setResize(previewoptions,
+                                   SMARTCROP_PREVIEW_SIZE, SMARTCROP_PREVIEW_SIZE,
+                                   YMAGINE_SCALE_LETTERBOX);
+    previewoptions->resizable = 1;
+    previewoptions->smartcrop = 0;
+    previewoptions->sharpen = 0.0f;
+    previewoptions->blur = 0.0f;
+    previewoptions->pixelshader = NULL;
+    previewoptions->themecolors = 0;
+    previewoptions->composemode = -1;
+    previewoptions->previewcb = NULL;
+    previewoptions->progresscb = NULL;
+
+    if (decodeGeneric(preview, channel, srcbitmap, previewoptions, YFALSE) == YMAGINE_OK &&
+        VbitmapSmartCropFocus(preview, aspectwidth, aspectheight,
+                              &focusx, &focusy) == YMAGINE_OK) {
+      /* Without focus, image is still cropped around its center */
+      smart->options = YmagineFormatOptions_Duplicate(options);
+      if (smart->options != NULL) {
+        smart->options->cropfocusx = focusx;
+        smart->options->cropfocusy = focusy;
+      }
+    }
+  }
+  if (preview != NULL) {
+    VbitmapRelease(preview);
+  }
+  if (previewoptions != NULL) {
+    YmagineFormatOptions_Release(previewoptions);
+  }
+
+  if (channel != NULL) {
+    /* Rewind for actual decoding */
+    YchannelResetBuffer(channel);
+    YchannelRelease(channel);
+    smart->data = data;
+    smart->size = size;
+    channel = YchannelInitByteArray(data, (int) len);
+    if (channel == NULL) {
+      smartCropRelease(NULL, smart);
+      return YMAGINE_ERROR;
+    }
+    *pchannel = channel;
+  }
+
+  return YMAGINE_OK;
+}
+
+static int
+decodeGeneric(Vbitmap *bitmap, Ychannel *channel, Vbitmap *srcbitmap,
+              YmagineFormatOptions *options, YBOOL smartcrop)
 {
   int rc = YMAGINE_ERROR;
   int nlines;
   int default_options = 0;
+  SmartCrop smart;
+  int smartrc;
+  YmagineFormatOptions *calleroptions = NULL;
   Vbitmap *decodebitmap;
   YmagineFormatOptions *decodeoptions;
 #if YMAGINE_PROFILE
@@ -641,6 +1158,26 @@ decodeGeneric(Vbitmap *bitmap, Ychannel *channel, Vbitmap *srcbitmap,
     default_options = 1;
   }
 
+  options->themencolors = -1;
+  memset(&smart, 0, sizeof(SmartCrop));
+
+  if (smartcrop) {
+    smartrc = smartCropPrepare(options, bitmap, &channel, srcbitmap, &smart);
+    if (smartrc != YMAGINE_OK) {
+      if (default_options) {
+        YmagineFormatOptions_Release(options);
+        options = NULL;
+      }
+
+      return smartrc;
+    }
+    if (smart.options != NULL) {
+      /* Decode with focus found, results handed back to caller at the end */
+      calleroptions = options;
+      options = smart.options;
+    }
+  }
+
   if (options->rotate != 0.0f) {
     decodeoptions = YmagineFormatOptions_Duplicate(options);
     decodebitmap = VbitmapInitMemory(VbitmapColormode(bitmap));
@@ -656,16 +1193,24 @@ decodeGeneric(Vbitmap *bitmap, Ychannel *channel, Vbitmap *srcbitmap,
         decodebitmap = NULL;
       }
 
+      if (calleroptions != NULL) {
+        options = calleroptions;
+      }
+
       if (default_options) {
         YmagineFormatOptions_Release(options);
         options = NULL;
       }
 
+      smartCropRelease(channel, &smart);
+
       return YMAGINE_ERROR;
     }
 
     decodeoptions->cropoffsetmode = CROP_MODE_NONE;
     decodeoptions->cropsizemode = CROP_MODE_NONE;
+    /* Rotated into bitmap afterwards, which replaces its pixels */
+    decodeoptions->composemode = -1;
   } else {
     decodeoptions = options;
     decodebitmap = bitmap;
@@ -693,6 +1238,8 @@ decodeGeneric(Vbitmap *bitmap, Ychannel *channel, Vbitmap *srcbitmap,
   }
 
   if (decodeoptions != options) {
+    /* Theme colors are those of the unrotated image */
+    YmagineResultsCopy(options, decodeoptions);
     YmagineFormatOptions_Release(decodeoptions);
     decodeoptions = NULL;
   }
@@ -734,11 +1281,27 @@ decodeGeneric(Vbitmap *bitmap, Ychannel *channel, Vbitmap *srcbitmap,
     Ymagine_blur(bitmap, (int) options->blur);
   }
 
+  if (rc == YMAGINE_OK && options->themecolors > 0 && options->themencolors < 0 &&
+      VbitmapColormode(bitmap) == VBITMAP_COLOR_RGBA) {
+    /* Decoder didn't go through a transformer, fall back to output bitmap */
+    options->themencolors = getThemeColorsWithMethod(bitmap, options->themecolors,
+                                                     options->themecolor,
+                                                     options->themescore,
+                                                     YMAGINE_QUANTIZE_HISTOGRAM);
+  }
+
+  if (calleroptions != NULL) {
+    options = calleroptions;
+    YmagineResultsCopy(options, smart.options);
+  }
+
   if (default_options) {
     YmagineFormatOptions_Release(options);
     options = NULL;
   }
 
+  smartCropRelease(channel, &smart);
+
 #if YMAGINE_PROFILE
   end = NSTIME();
   ALOGI("image decoded in %.2f ms", ((double) (end - start)) / 1000000.0);
@@ -750,14 +1313,46 @@ decodeGeneric(Vbitmap *bitmap, Ychannel *channel, Vbitmap *srcbitmap,
 int
 YmagineDecodeCopy(Vbitmap *bitmap, Vbitmap *srcbitmap, YmagineFormatOptions *options)
 {
-  return decodeGeneric(bitmap, NULL, srcbitmap, options);
+  YmagineStatsCollector collector;
+  YmagineLimitsScope scope;
+  YBOOL collecting;
+  YBOOL limiting;
+  int rc;
+
+  collecting = YmagineStatsBegin(options, &collector);
+  limiting = YmagineLimitsBegin(options, &scope);
+  rc = decodeGeneric(bitmap, NULL, srcbitmap, options, YTRUE);
+  if (limiting) {
+    rc = YmagineLimitsEnd(&scope, rc);
+  }
+  if (collecting) {
+    YmagineStatsEnd(options, &collector);
+  }
+
+  return rc;
 }
 
 int
 YmagineDecode(Vbitmap *bitmap, Ychannel *channel,
               YmagineFormatOptions *options)
 {
-  return decodeGeneric(bitmap, channel, NULL, options);
+  YmagineStatsCollector collector;
+  YmagineLimitsScope scope;
+  YBOOL collecting;
+  YBOOL limiting;
+  int rc;
+
+  collecting = YmagineStatsBegin(options, &collector);
+  limiting = YmagineLimitsBegin(options, &scope);
+  rc = decodeGeneric(bitmap, channel, NULL, options, YTRUE);
+  if (limiting) {
+    rc = YmagineLimitsEnd(&scope, rc);
+  }
+  if (collecting) {
+    YmagineStatsEnd(options, &collector);
+  }
+
+  return rc;
 }
 
 int
@@ -796,13 +1391,15 @@ YmagineDecodeInPlace(Vbitmap *bitmap, Ychannel *channel,
   return rc;
 }
 
-int
-YmagineTranscode(Ychannel *channelin, Ychannel *channelout,
+static int
+transcodeGeneric(Ychannel *channelin, Ychannel *channelout,
                  YmagineFormatOptions *options)
 {
   int rc = YMAGINE_ERROR;
   int iformat;
   Vbitmap* vbitmap;
+  SmartCrop smart;
+  YmagineFormatOptions *calleroptions = options;
 
   if (channelin == NULL || channelout == NULL) {
     return rc;
@@ -814,15 +1411,38 @@ YmagineTranscode(Ychannel *channelin, Ychannel *channelout,
     return rc;
   }
 
+  options->themencolors = -1;
+  options->searchedquality = -1;
+
+  rc = smartCropPrepare(options, NULL, &channelin, NULL, &smart);
+  if (rc != YMAGINE_OK) {
+    return rc;
+  }
+  if (smart.options != NULL) {
+    /* Transcode with focus found, results handed back to caller at the end */
+    options = smart.options;
+  }
+
   if ( ( iformat == YMAGINE_IMAGEFORMAT_JPEG ) &&
        ( options->format == YMAGINE_IMAGEFORMAT_JPEG ||
          options->format == YMAGINE_IMAGEFORMAT_UNKNOWN ) ) {
     /* Transcode JPEG into JPEG using optimized code path */
     rc = transcodeJPEG(channelin, channelout, options);
   } else {
+    int colormode = VBITMAP_COLOR_RGBA;
+
+    if (iformat == YMAGINE_IMAGEFORMAT_WEBP &&
+        options->format == YMAGINE_IMAGEFORMAT_JPEG &&
+        options->rotate == 0.0f && options->blur <= 1.0f &&
+        options->themecolors <= 0 && WEBPIsOpaque(channelin)) {
+      /* WEBP is natively YUV, hand YCbCr samples to JPEG encoder
+         directly instead of round-tripping through RGB */
+      colormode = VBITMAP_COLOR_YUV;
+    }
+
     /* Decode from any supported format */
-    vbitmap = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
-    rc = YmagineDecode(vbitmap, channelin, options);
+    vbitmap = VbitmapInitMemory(colormode);
+    rc = decodeGeneric(vbitmap, channelin, NULL, options, YFALSE);
 
     if (rc == YMAGINE_OK) {
       YmagineFormatOptions *outoptions = YmagineFormatOptions_Duplicate(options);
@@ -834,6 +1454,7 @@ YmagineTranscode(Ychannel *channelin, Ychannel *channelout,
         }
 
         rc = YmagineEncode(vbitmap, channelout, outoptions);
+        options->searchedquality = outoptions->searchedquality;
         YmagineFormatOptions_Release(outoptions);
       }
     }
@@ -842,6 +1463,35 @@ YmagineTranscode(Ychannel *channelin, Ychannel *channelout,
     vbitmap = NULL;
   }
 
+  if (smart.options != NULL) {
+    YmagineResultsCopy(calleroptions, smart.options);
+  }
+
+  smartCropRelease(channelin, &smart);
+
+  return rc;
+}
+
+int
+YmagineTranscode(Ychannel *channelin, Ychannel *channelout,
+                 YmagineFormatOptions *options)
+{
+  YmagineStatsCollector collector;
+  YmagineLimitsScope scope;
+  YBOOL collecting;
+  YBOOL limiting;
+  int rc;
+
+  collecting = YmagineStatsBegin(options, &collector);
+  limiting = YmagineLimitsBegin(options, &scope);
+  rc = transcodeGeneric(channelin, channelout, options);
+  if (limiting) {
+    rc = YmagineLimitsEnd(&scope, rc);
+  }
+  if (collecting) {
+    YmagineStatsEnd(options, &collector);
+  }
+
   return rc;
 }
 
@@ -852,6 +1502,12 @@ YmagineEncode(Vbitmap *bitmap, Ychannel *channel,
   int format = YMAGINE_IMAGEFORMAT_UNKNOWN;
   int rc = YMAGINE_ERROR;
   YBOOL defaultoptions = YFALSE;
+  YmagineStatsCollector collector;
+  YmagineStatsCollector *current;
+  YBOOL collecting;
+  YmagineLimitsScope scope;
+  YBOOL limiting;
+  nsecs_t encodestart;
 #if YMAGINE_PROFILE
   NSTYPE start = 0;
   NSTYPE end = 0;
@@ -876,6 +1532,13 @@ YmagineEncode(Vbitmap *bitmap, Ychannel *channel,
     format = YMAGINE_IMAGEFORMAT_JPEG;
   }
 
+  options->searchedquality = -1;
+
+  collecting = YmagineStatsBegin(options, &collector);
+  limiting = YmagineLimitsBegin(options, &scope);
+  current = YmagineStatsCurrent();
+  encodestart = YMAGINE_STATS_NOW(current);
+
   switch(format) {
   case YMAGINE_IMAGEFORMAT_JPEG:
     rc = encodeJPEG(bitmap, channel, options);
@@ -891,6 +1554,14 @@ YmagineEncode(Vbitmap *bitmap, Ychannel *channel,
     break;
   }
 
+  YMAGINE_STATS_TIME(current, encode, encodestart);
+  if (limiting) {
+    rc = YmagineLimitsEnd(&scope, rc);
+  }
+  if (collecting) {
+    YmagineStatsEnd(options, &collector);
+  }
+
   if (defaultoptions) {
     YmagineFormatOptions_Release(options);
     options = NULL;
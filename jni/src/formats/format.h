@@ -37,6 +37,11 @@ struct YmagineFormatOptionsStruct {
   int accuracy;
   int subsampling;
   int progressive;
+  int compression;
+  int zstrategy;
+  int zwindowbits;
+  int pngfilters;
+  int threads;
   float sharpen;
   float rotate;
   float blur;
@@ -56,16 +61,250 @@ struct YmagineFormatOptionsStruct {
   float cropwidthp;
   float cropheightp;
 
+  /* Content-aware crop, and center of kept region relative to crop
+     region, as found from a preview (negative if none). Focus is only set
+     on options private to a call, never on those of caller */
+  int smartcrop;
+  float cropfocusx;
+  float cropfocusy;
+
   PixelShader* pixelshader;
 
+  /* Compose decoded pixels onto target bitmap with this mode instead of
+     replacing them (-1 if not). Only honored by decoders going through a
+     transformer, i.e. JPEG, PNG and bitmap copy */
+  int composemode;
+
   void *metadata;
   YmagineFormatOptions_ProgressCB progresscb;
+  /* Progressive JPEG previews, see YmagineFormatOptions_setPreviewCallback */
+  YmagineFormatOptions_PreviewCB previewcb;
+  int previewinterval;
+
+  /* Theme colors requested, and collected while decoding (-1 if not) */
+  int themecolors;
+  int themencolors;
+  int themecolor[YMAGINE_THEME_MAXCOLORS];
+  int themescore[YMAGINE_THEME_MAXCOLORS];
+
+  /* Statistics requested, and collected by last call (if statsvalid) */
+  YBOOL statsenabled;
+  YBOOL statsvalid;
+  YmagineStats stats;
+
+  /* JPEG quality search targets (0 if none), and quality it chose */
+  int searchmaxbytes;
+  double searchminssim;
+  int searchedquality;
+
+  /* Limits set for these options, default ones used if not */
+  YBOOL haslimits;
+  YmagineLimits limits;
 };
 
 /* Helper to display scale mode as string */
 const char*
 Ymagine_scaleModeStr(int scalemode);
 
+/* Check if a WEBP stream is known to have no alpha channel */
+YBOOL
+WEBPIsOpaque(Ychannel *channel);
+
+/* Have transformer collect theme colors requested by options */
+void
+YmagineThemePrepare(YmagineFormatOptions *options, Transformer *transformer);
+
+/* Store theme colors collected by transformer into options */
+void
+YmagineThemeCollect(YmagineFormatOptions *options, Transformer *transformer);
+
+/* Copy results of a call (theme colors, searched quality and statistics)
+   made with options duplicated from these back into them */
+void
+YmagineResultsCopy(YmagineFormatOptions *options, const YmagineFormatOptions *from);
+
+/* Have transformer compose its output as requested by options */
+void
+YmagineComposePrepare(YmagineFormatOptions *options, Transformer *transformer);
+
+/* Worker pool of batch.c. Calls run(data, idx) for each idx in
+   [0..njobs[ from at most nthreads threads (0 for one per CPU), calling
+   thread included. Workers get their own codec context and pool cache */
+typedef void (*BatchRunFunc)(void *data, int idx);
+
+int
+BatchRun(BatchRunFunc run, void *data, int njobs, int nthreads);
+
+/* Statistics of the call running on calling thread, see stats.c.
+   Codecs and transformer look the collector up once per image, and
+   accumulate into it only when it isn't NULL */
+typedef struct {
+  YmagineStats stats;
+  /* Scratch memory currently held */
+  size_t scratch;
+  nsecs_t start;
+  /* Channel reads not counted, see YmagineStatsCountIO */
+  YBOOL ioskip;
+  /* Channel last peeked into, and bytes still pushed back into it */
+  Ychannel *peekchannel;
+  int peeked;
+} YmagineStatsCollector;
+
+/* Start collecting statistics requested by options on calling thread,
+   unless an outer call already is. Returns YTRUE if it did, in which case
+   YmagineStatsEnd must be called before returning */
+YBOOL
+YmagineStatsBegin(YmagineFormatOptions *options, YmagineStatsCollector *collector);
+
+void
+YmagineStatsEnd(YmagineFormatOptions *options, YmagineStatsCollector *collector);
+
+YmagineStatsCollector*
+YmagineStatsCurrent();
+
+/* Stop collecting statistics on calling thread, e.g. while decoding for
+   internal purposes. Returns collector to hand to YmagineStatsResume,
+   NULL if none */
+YmagineStatsCollector*
+YmagineStatsSuspend();
+
+void
+YmagineStatsResume(YmagineStatsCollector *collector);
+
+/* Count channel reads of calling thread or not, the latter while reading
+   back input already read into memory. Returns previous setting */
+YBOOL
+YmagineStatsCountIO(YBOOL count);
+
+/* Account for scratch memory acquired (or released) by calling thread */
+void
+YmagineStatsScratch(size_t size, YBOOL release);
+
+#define YMAGINE_STATS_NOW(collector) \
+  ((collector) != NULL ? (nsecs_t) Ytime(YTIME_CLOCK_REALTIME) : (nsecs_t) 0)
+
+#define YMAGINE_STATS_ADD(collector, field, value) do {   \
+    if ((collector) != NULL) {                            \
+      (collector)->stats.field += (value);                \
+    }                                                     \
+  } while (0)
+
+/* Add time elapsed since start, as returned by YMAGINE_STATS_NOW */
+#define YMAGINE_STATS_TIME(collector, field, start) \
+  YMAGINE_STATS_ADD(collector, field, (nsecs_t) Ytime(YTIME_CLOCK_REALTIME) - (start))
+
+/* Limits of the call running on calling thread, see limits.c. Only bound
+   when some limit applies, so checks are free otherwise */
+typedef struct {
+  YmagineLimits limits;
+  /* Scratch memory currently reserved against limits.maxscratch */
+  int64_t scratch;
+  /* Set once any limit got exceeded */
+  YBOOL exceeded;
+} YmagineLimitsScope;
+
+/* Start enforcing limits of options (or default ones) on calling thread,
+   unless an outer call already is. Returns YTRUE if it did, in which case
+   YmagineLimitsEnd must be called before returning */
+YBOOL
+YmagineLimitsBegin(YmagineFormatOptions *options, YmagineLimitsScope *scope);
+
+/* Returns YMAGINE_ERROR_LIMIT if a limit got exceeded, rc otherwise */
+int
+YmagineLimitsEnd(YmagineLimitsScope *scope, int rc);
+
+/* Check image of given size and number of frames, and an output bitmap
+   of outbytes (0 if none) to be allocated, against limits. Returns
+   YMAGINE_OK, or YMAGINE_ERROR_LIMIT */
+int
+YmagineLimitsCheck(int width, int height, int frames, int64_t outbytes);
+
+/* Reserve (or release) scratch memory against limits. Returns YMAGINE_OK,
+   or YMAGINE_ERROR_LIMIT in which case nothing got reserved */
+int
+YmagineLimitsReserve(size_t size, YBOOL release);
+
+/* Memory still available to codec libraries, or 0 if unlimited */
+int64_t
+YmagineLimitsAvailable();
+
+/* Flag limits as exceeded, for codecs running out of the memory granted */
+void
+YmagineLimitsExceeded();
+
+/* Channel I/O of codecs, see io.c. Reads and writes are accounted for
+   into statistics of calling thread */
+int
+YmagineIOBufferSize();
+
+int
+YmagineIORead(Ychannel *channel, void *data, int len);
+
+int
+YmagineIOWrite(Ychannel *channel, const void *data, int len);
+
+const char*
+YmagineIOFetch(Ychannel *channel, int len, int *nbytes);
+
+/* Read data and push it back into channel, for format probes. Not
+   accounted for, as codec reads the same bytes again */
+int
+YmagineIOPeek(Ychannel *channel, void *data, int len);
+
+/* Reader serving small reads out of one large read ahead of them */
+typedef struct {
+  Ychannel *channel;
+  unsigned char *buffer;
+  int size;
+  int pos;
+  int len;
+} YmagineReader;
+
+int
+YmagineReaderInit(YmagineReader *reader, Ychannel *channel);
+
+/* Same as YchannelRead, short only at end of input */
+int
+YmagineReaderRead(YmagineReader *reader, void *data, int len);
+
+/* Push data read ahead but not consumed back into channel, and release */
+void
+YmagineReaderRelease(YmagineReader *reader);
+
+/* Writer gathering small writes into one large write. Channels have no
+   vectored write, so data is copied into a single buffer, and writes
+   larger than it go straight through */
+typedef struct {
+  Ychannel *channel;
+  unsigned char *buffer;
+  int size;
+  int len;
+  YBOOL failed;
+} YmagineWriter;
+
+int
+YmagineWriterInit(YmagineWriter *writer, Ychannel *channel);
+
+/* Returns len, or -1 if this or an earlier write failed */
+int
+YmagineWriterWrite(YmagineWriter *writer, const void *data, int len);
+
+int
+YmagineWriterFlush(YmagineWriter *writer);
+
+/* Release without flushing */
+void
+YmagineWriterRelease(YmagineWriter *writer);
+
+/* Codec objects kept alive across images, see context.c */
+struct YmagineCodecContextStruct {
+  /* libjpeg decompressor and compressor, owned by jpeg.c */
+  void *jpeg;
+};
+
+void
+JPEGCodecRelease(void *jpeg);
+
 #ifdef __cplusplus
 };
 #endif
@@ -82,7 +82,7 @@ ReadGIFHeader(Ychannel *f, int *widthPtr, int *heightPtr)
   int headerlen;
 
   /* Read header */
-  headerlen = YchannelRead(f, (char *) header, GIF_HEADER_SIZE);
+  headerlen = YmagineIORead(f, (char *) header, GIF_HEADER_SIZE);
   if (headerlen != GIF_HEADER_SIZE) {
     return 0;
   }
@@ -154,7 +154,7 @@ ReadColorMap(Ychannel *fd, int number, unsigned char *colormap)
   }
 
   for (i = 0; i < number; ++i) {
-    if (YchannelRead(fd, (char*) rgb, sizeof(rgb)) != sizeof(rgb)) {
+    if (YmagineIORead(fd, (char*) rgb, sizeof(rgb)) != sizeof(rgb)) {
       break;
     }
     if (colormap!=NULL) {
@@ -227,7 +227,7 @@ GIFDecode(Ychannel *fd, Vbitmap *vbitmap, YmagineFormatOptions *options,
   }
 
   /* Image information */
-  if (YchannelRead(fd,(char*) buf, 3) != 3) {
+  if (YmagineIORead(fd,(char*) buf, 3) != 3) {
     GIFDEBUG(("failed to read image header\n"));
     return 0;
   }
@@ -243,6 +243,12 @@ GIFDecode(Ychannel *fd, Vbitmap *vbitmap, YmagineFormatOptions *options,
     return 0;
   }
 
+  /* Decoded at full size, without going through YmaginePrepareTransform */
+  if (YmagineLimitsCheck(width, height, 1,
+                         ((int64_t) width) * ((int64_t) height) * 4) != YMAGINE_OK) {
+    return 0;
+  }
+
   /* Create image */
   if (VbitmapResize(vbitmap, width, height) != YMAGINE_OK) {
     return 0;
@@ -302,7 +308,7 @@ GIFDecode(Ychannel *fd, Vbitmap *vbitmap, YmagineFormatOptions *options,
   /* Scan frames */
   cpt=0;
   while (1) {
-    if (YchannelRead(fd,(char*) buf, 1) != 1) {
+    if (YmagineIORead(fd,(char*) buf, 1) != 1) {
       /* Premature end of image.  We should really notify
 	 the user, but for now just show garbage. */
       break;
@@ -315,7 +321,7 @@ GIFDecode(Ychannel *fd, Vbitmap *vbitmap, YmagineFormatOptions *options,
 
     if (buf[0] == '!') {
       /* GIF extension */
-      if (YchannelRead(fd, (char*) buf, 1) != 1) {
+      if (YmagineIORead(fd, (char*) buf, 1) != 1) {
 	GIFDEBUG(("error reading extension function code"));
 	goto readerror;
       }
@@ -332,7 +338,7 @@ GIFDecode(Ychannel *fd, Vbitmap *vbitmap, YmagineFormatOptions *options,
       continue;
     }
 
-    if (YchannelRead(fd, (char*) buf, 9) != 9) {
+    if (YmagineIORead(fd, (char*) buf, 9) != 9) {
       GIFDEBUG(("invalid geometry for frame\n"));
       goto readerror;
     }
@@ -342,6 +348,11 @@ GIFDecode(Ychannel *fd, Vbitmap *vbitmap, YmagineFormatOptions *options,
     frameWidth = LM_to_uint(buf[4],buf[5]);
     frameHeight = LM_to_uint(buf[6],buf[7]);
 
+    /* Don't let a stream of tiny frames keep the decoder busy */
+    if (YmagineLimitsCheck(frameWidth, frameHeight, cpt + 1, 0) != YMAGINE_OK) {
+      goto readerror;
+    }
+
     printf("Frame %d: @%d,%d %dx%d\n", cpt, framePosx, framePosy, frameWidth, frameHeight);
 
     interlace = BitSet(buf[8], INTERLACE);
@@ -394,7 +405,7 @@ GIFDecode(Ychannel *fd, Vbitmap *vbitmap, YmagineFormatOptions *options,
 	      interlace,nbframecmap));
     
     /* Initialize decompression routines */
-    if (YchannelRead(fd,(char*) &c,1)!=1) {
+    if (YmagineIORead(fd,(char*) &c,1)!=1) {
       GIFDEBUG(("failed to initialize decoder\n"));
       goto readerror;
     }
@@ -590,14 +601,14 @@ GetDataBlock(GifReadHandle *gifr, unsigned char *buf)
 {
   unsigned char count;
 
-  if (YchannelRead(gifr->fd,(char*) &count,1)!=1) {
+  if (YmagineIORead(gifr->fd,(char*) &count,1)!=1) {
     return -1;
   }
   
   gifr->ZeroDataBlock = (count == 0);
   if (count != 0) {
     /* Read block (up to 255 characteres, since count is unsigned char */
-    if (YchannelRead(gifr->fd, (char*) buf, count)!=count) {
+    if (YmagineIORead(gifr->fd, (char*) buf, count)!=count) {
       /* Failed to read block */
       return -1;
     }
@@ -818,10 +829,7 @@ matchGIF(Ychannel *channel)
     return YFALSE;
   }
 
-  hlen = YchannelRead(channel, header, sizeof(header));
-  if (hlen > 0) {
-    YchannelPush(channel, header, hlen);
-  }
+  hlen = YmagineIOPeek(channel, header, sizeof(header));
 
   if (GifCheckHeader(header, hlen, NULL, NULL) <= 0) {
     return YFALSE;
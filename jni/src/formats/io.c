@@ -0,0 +1,307 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#define LOG_TAG "ymagine::io"
+
+#include "ymagine/ymagine.h"
+#include "ymagine_priv.h"
+
+/*
+ * Channel I/O shared by codecs. Every read and write to a channel may be
+ * a system call (or a call into Java), so codecs go through buffers of a
+ * common, tunable size, and calls are counted into statistics. Format
+ * probes, whose data is pushed back, and reads of input already loaded
+ * in memory aren't counted, so input is accounted for once.
+ */
+
+#define IOBUFFER_MIN (4 * 1024)
+#define IOBUFFER_MAX (4 * 1024 * 1024)
+
+static int ioBufferSize = YMAGINE_IOBUFFER_DEFAULT;
+
+void
+Ymagine_setIOBufferSize(int size)
+{
+  if (size <= 0) {
+    size = YMAGINE_IOBUFFER_DEFAULT;
+  } else if (size < IOBUFFER_MIN) {
+    size = IOBUFFER_MIN;
+  } else if (size > IOBUFFER_MAX) {
+    size = IOBUFFER_MAX;
+  }
+
+  ioBufferSize = size;
+}
+
+int
+Ymagine_getIOBufferSize()
+{
+  return ioBufferSize;
+}
+
+int
+YmagineIOBufferSize()
+{
+  return ioBufferSize;
+}
+
+/* Count read of n bytes from channel. Reads served only from data a
+   probe pushed back don't reach the channel, so aren't counted as calls */
+static void
+ioCountRead(YmagineStatsCollector *collector, Ychannel *channel, int n)
+{
+  int served = 0;
+
+  if (collector == NULL || collector->ioskip) {
+    return;
+  }
+
+  if (collector->peekchannel == channel && collector->peeked > 0) {
+    served = (n < collector->peeked) ? n : collector->peeked;
+    collector->peeked -= served;
+  }
+
+  if (n <= 0 || n > served) {
+    collector->stats.readcalls++;
+  }
+  if (n > 0) {
+    collector->stats.bytesread += n;
+  }
+}
+
+int
+YmagineIORead(Ychannel *channel, void *data, int len)
+{
+  YmagineStatsCollector *collector = YmagineStatsCurrent();
+  int n;
+
+  n = YchannelRead(channel, data, len);
+  ioCountRead(collector, channel, n);
+
+  return n;
+}
+
+int
+YmagineIOPeek(Ychannel *channel, void *data, int len)
+{
+  YmagineStatsCollector *collector = YmagineStatsCurrent();
+  int n;
+
+  n = YchannelRead(channel, data, len);
+  if (n > 0) {
+    YchannelPush(channel, (const char*) data, n);
+  }
+  if (collector != NULL) {
+    collector->peekchannel = channel;
+    collector->peeked = (n > 0) ? n : 0;
+  }
+
+  return n;
+}
+
+int
+YmagineIOWrite(Ychannel *channel, const void *data, int len)
+{
+  YmagineStatsCollector *collector = YmagineStatsCurrent();
+  int n;
+
+  n = YchannelWrite(channel, data, len);
+  YMAGINE_STATS_ADD(collector, writecalls, 1);
+  if (n > 0) {
+    YMAGINE_STATS_ADD(collector, byteswritten, n);
+  }
+
+  return n;
+}
+
+const char*
+YmagineIOFetch(Ychannel *channel, int len, int *nbytes)
+{
+  YmagineStatsCollector *collector = YmagineStatsCurrent();
+  const char *data;
+
+  data = YchannelFetch(channel, len, nbytes);
+  ioCountRead(collector, channel, (data != NULL) ? *nbytes : -1);
+
+  return data;
+}
+
+int
+YmagineReaderInit(YmagineReader *reader, Ychannel *channel)
+{
+  if (reader == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  reader->channel = channel;
+  reader->pos = 0;
+  reader->len = 0;
+  reader->size = YmagineIOBufferSize();
+  reader->buffer = (unsigned char*) Ymem_malloc(reader->size);
+  if (reader->buffer == NULL) {
+    /* Still usable, reading straight from channel */
+    reader->size = 0;
+  }
+
+  return YMAGINE_OK;
+}
+
+int
+YmagineReaderRead(YmagineReader *reader, void *data, int len)
+{
+  unsigned char *out = (unsigned char*) data;
+  int total = 0;
+  int n;
+
+  while (total < len) {
+    if (reader->pos >= reader->len) {
+      if (len - total >= reader->size) {
+        /* Large enough to skip buffer */
+        n = YmagineIORead(reader->channel, out + total, len - total);
+        if (n <= 0) {
+          break;
+        }
+        total += n;
+        continue;
+      }
+
+      reader->pos = 0;
+      reader->len = YmagineIORead(reader->channel, reader->buffer, reader->size);
+      if (reader->len <= 0) {
+        reader->len = 0;
+        break;
+      }
+    }
+
+    n = reader->len - reader->pos;
+    if (n > len - total) {
+      n = len - total;
+    }
+    memcpy(out + total, reader->buffer + reader->pos, n);
+    reader->pos += n;
+    total += n;
+  }
+
+  if (total == 0 && len > 0) {
+    return -1;
+  }
+
+  return total;
+}
+
+void
+YmagineReaderRelease(YmagineReader *reader)
+{
+  if (reader == NULL) {
+    return;
+  }
+
+  if (reader->buffer != NULL) {
+    if (reader->pos < reader->len) {
+      /* Leave channel where caller would expect it */
+      YchannelPush(reader->channel, (const char*) (reader->buffer + reader->pos),
+                   reader->len - reader->pos);
+    }
+    Ymem_free(reader->buffer);
+    reader->buffer = NULL;
+  }
+  reader->pos = 0;
+  reader->len = 0;
+}
+
+int
+YmagineWriterInit(YmagineWriter *writer, Ychannel *channel)
+{
+  if (writer == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  writer->channel = channel;
+  writer->len = 0;
+  writer->failed = YFALSE;
+  writer->size = YmagineIOBufferSize();
+  writer->buffer = (unsigned char*) Ymem_malloc(writer->size);
+  if (writer->buffer == NULL) {
+    /* Still usable, writing straight to channel */
+    writer->size = 0;
+  }
+
+  return YMAGINE_OK;
+}
+
+static int
+writerDrain(YmagineWriter *writer)
+{
+  if (writer->len > 0) {
+    if (YmagineIOWrite(writer->channel, writer->buffer, writer->len) != writer->len) {
+      writer->failed = YTRUE;
+    }
+    writer->len = 0;
+  }
+
+  return writer->failed ? YMAGINE_ERROR : YMAGINE_OK;
+}
+
+int
+YmagineWriterWrite(YmagineWriter *writer, const void *data, int len)
+{
+  if (writer->failed) {
+    return -1;
+  }
+  if (len <= 0) {
+    return 0;
+  }
+
+  if (writer->len + len > writer->size) {
+    if (writerDrain(writer) != YMAGINE_OK) {
+      return -1;
+    }
+    if (len >= writer->size) {
+      /* Large enough to skip buffer */
+      if (YmagineIOWrite(writer->channel, data, len) != len) {
+        writer->failed = YTRUE;
+        return -1;
+      }
+      return len;
+    }
+  }
+
+  memcpy(writer->buffer + writer->len, data, len);
+  writer->len += len;
+
+  return len;
+}
+
+int
+YmagineWriterFlush(YmagineWriter *writer)
+{
+  if (writerDrain(writer) != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+  YchannelFlush(writer->channel);
+
+  return YMAGINE_OK;
+}
+
+void
+YmagineWriterRelease(YmagineWriter *writer)
+{
+  if (writer == NULL) {
+    return;
+  }
+
+  if (writer->buffer != NULL) {
+    Ymem_free(writer->buffer);
+    writer->buffer = NULL;
+  }
+  writer->len = 0;
+}
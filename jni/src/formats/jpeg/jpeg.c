@@ -46,6 +46,11 @@
 
 #include "formats/jpeg/jpegio.h"
 
+/* Memory granted to libjpeg when no memory limit is set */
+#define JPEG_MAX_MEMORY (30 * 1024 * 1024)
+/* Tables, pools and small buffers of libjpeg, charged on top of image buffers */
+#define JPEG_BASE_MEMORY (1024 * 1024)
+
 /* No error reporting */
 struct noop_error_mgr {           /* Extended libjpeg error manager */
   struct jpeg_error_mgr pub;    /* public fields */
@@ -71,7 +76,15 @@ static void
 noop_error_exit (j_common_ptr cinfo)
 {
   struct noop_error_mgr *myerr = (struct noop_error_mgr *) cinfo->err;
-  
+
+  if (cinfo->err->msg_code == JERR_OUT_OF_MEMORY ||
+      cinfo->err->msg_code == JERR_NO_BACKING_STORE) {
+    /* Ran out of memory granted by grantDecompressor */
+    if (YmagineLimitsAvailable() > 0) {
+      YmagineLimitsExceeded();
+    }
+  }
+
   longjmp(myerr->setjmp_buffer, 1);
 }
 
@@ -117,6 +130,133 @@ noop_jpeg_std_error (struct jpeg_error_mgr * err)
   return err;
 }
 
+/*
+ * Decompressor and compressor pair. When a codec context is bound to the
+ * calling thread, the pair lives in it and is only reset with jpeg_abort
+ * between images, so libjpeg permanent allocations (source and destination
+ * managers, quantization and Huffman tables, component info) are reused.
+ */
+typedef struct {
+  struct jpeg_decompress_struct cinfo;
+  struct noop_error_mgr jerr;
+  int dcreated;
+
+  struct jpeg_compress_struct cinfoout;
+  struct noop_error_mgr jerr2;
+  int ccreated;
+  /* Flattened bitmap of a quality search, NULL if none */
+  Vbitmap *searchreference;
+  /* Memory reserved against limits for the decompressor */
+  size_t grant;
+
+  int busy;
+} JPEGCodec;
+
+static JPEGCodec*
+JPEGCodecAcquire(JPEGCodec *local)
+{
+  YmagineCodecContext *context;
+  JPEGCodec *codec = NULL;
+
+  context = YmagineCodecContext_Current();
+  if (context != NULL) {
+    if (context->jpeg == NULL) {
+      context->jpeg = Ymem_calloc(1, sizeof(JPEGCodec));
+    }
+    codec = (JPEGCodec*) context->jpeg;
+    if (codec != NULL && codec->busy) {
+      /* Nested use, fall back to a private pair */
+      codec = NULL;
+    }
+  }
+
+  if (codec == NULL) {
+    memset(local, 0, sizeof(JPEGCodec));
+    codec = local;
+  }
+
+  codec->cinfo.err = noop_jpeg_std_error(&(codec->jerr.pub));
+  codec->cinfoout.err = noop_jpeg_std_error(&(codec->jerr2.pub));
+  codec->busy = 1;
+
+  return codec;
+}
+
+/* Those may raise a libjpeg error, so must be called with setjmp context set */
+static void
+JPEGCodecCreateDecompress(JPEGCodec *codec)
+{
+  if (!codec->dcreated) {
+    jpeg_create_decompress(&(codec->cinfo));
+    codec->dcreated = 1;
+  }
+}
+
+static void
+JPEGCodecCreateCompress(JPEGCodec *codec)
+{
+  if (!codec->ccreated) {
+    /* Equivalent to:
+       jpeg_CreateCompress(&cinfoout, JPEG_LIB_VERSION,
+       (size_t) sizeof(struct jpeg_compress_struct));
+     */
+    jpeg_create_compress(&(codec->cinfoout));
+    codec->ccreated = 1;
+  }
+}
+
+static void
+JPEGCodecDone(JPEGCodec *codec, JPEGCodec *local)
+{
+  int i;
+
+  if (codec->ccreated) {
+    /* Drop output left in memory by an interrupted quality search */
+    ymaginejpeg_output_release(&(codec->cinfoout));
+  }
+  if (codec->searchreference != NULL) {
+    VbitmapRelease(codec->searchreference);
+    codec->searchreference = NULL;
+  }
+  if (codec->grant > 0) {
+    YmagineLimitsReserve(codec->grant, YTRUE);
+    codec->grant = 0;
+  }
+
+  if (codec == local) {
+    jpeg_destroy_compress(&(codec->cinfoout));
+    jpeg_destroy_decompress(&(codec->cinfo));
+    return;
+  }
+
+  if (codec->dcreated) {
+    jpeg_abort_decompress(&(codec->cinfo));
+    /* Restore default processing for markers saved or intercepted last time */
+    jpeg_save_markers(&(codec->cinfo), JPEG_COM, 0);
+    for (i = 0; i < 16; i++) {
+      jpeg_save_markers(&(codec->cinfo), JPEG_APP0 + i, 0);
+    }
+  }
+  if (codec->ccreated) {
+    jpeg_abort_compress(&(codec->cinfoout));
+  }
+  codec->busy = 0;
+}
+
+void
+JPEGCodecRelease(void *jpeg)
+{
+  JPEGCodec *codec = (JPEGCodec*) jpeg;
+
+  if (codec == NULL) {
+    return;
+  }
+
+  jpeg_destroy_compress(&(codec->cinfoout));
+  jpeg_destroy_decompress(&(codec->cinfo));
+  Ymem_free(codec);
+}
+
 static int
 JpegPixelMode(J_COLOR_SPACE colorspace)
 {
@@ -218,15 +358,73 @@ set_colormode(struct jpeg_compress_struct *cinfo, int colormode) {
   }
 }
 
+/* Most rows per jpeg_write_scanlines call, i.e. one iMCU row at largest
+   sampling factor */
+#define JPEG_WRITE_MAXROWS (MAX_SAMP_FACTOR * DCTSIZE)
+
+/* Rows compressor consumes at once, once jpeg_start_compress has been called */
+static int
+JpegWriteRows(struct jpeg_compress_struct *cinfoout)
+{
+  int nrows = cinfoout->max_v_samp_factor * DCTSIZE;
+
+  if (nrows < 1) {
+    nrows = 1;
+  } else if (nrows > JPEG_WRITE_MAXROWS) {
+    nrows = JPEG_WRITE_MAXROWS;
+  }
+
+  return nrows;
+}
+
+/* Lines from transformer, gathered to be compressed one iMCU row at a time */
+typedef struct {
+  struct jpeg_compress_struct *cinfoout;
+  JSAMPARRAY rows;
+  int nrows;
+  int maxrows;
+  size_t rowsize;
+} JpegBatch;
+
+static int
+JpegBatchInit(JpegBatch *batch, struct jpeg_compress_struct *cinfoout)
+{
+  batch->cinfoout = cinfoout;
+  batch->nrows = 0;
+  batch->maxrows = JpegWriteRows(cinfoout);
+  batch->rowsize = cinfoout->image_width * cinfoout->input_components;
+  /* Released by libjpeg when compression completes or aborts */
+  batch->rows = (*cinfoout->mem->alloc_sarray)((j_common_ptr) cinfoout, JPOOL_IMAGE,
+                                               (JDIMENSION) batch->rowsize,
+                                               (JDIMENSION) batch->maxrows);
+  if (batch->rows == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  return YMAGINE_OK;
+}
+
+static void
+JpegBatchFlush(JpegBatch *batch)
+{
+  if (batch->nrows > 0) {
+    jpeg_write_scanlines(batch->cinfoout, batch->rows, batch->nrows);
+    batch->nrows = 0;
+  }
+}
+
 static int
 JpegWriter(Transformer *transformer, void *writedata, void *line)
 {
-  JSAMPROW row_pointer[1];
-  struct jpeg_compress_struct *cinfoout = (struct jpeg_compress_struct *) writedata;
-  
-  if (cinfoout != NULL) {
-    row_pointer[0] = line;
-    jpeg_write_scanlines(cinfoout, row_pointer, 1);
+  JpegBatch *batch = (JpegBatch *) writedata;
+
+  if (batch != NULL) {
+    /* Line is only valid for this call, keep a copy */
+    memcpy(batch->rows[batch->nrows], line, batch->rowsize);
+    batch->nrows++;
+    if (batch->nrows >= batch->maxrows) {
+      JpegBatchFlush(batch);
+    }
   }
 
   return YMAGINE_OK;
@@ -330,10 +528,109 @@ setCompressorOptions(struct jpeg_compress_struct *cinfoout,
   return YMAGINE_OK;
 }
 
+/*
+ * Consume all input of a decompressor started in buffered-image mode,
+ * emitting previews of the scans selected by options into a bitmap of
+ * output size. Returns YMAGINE_OK once input is complete
+ */
+static int
+JPEGPreviewScans(struct jpeg_decompress_struct *cinfo,
+                 JSAMPARRAY buffer, int scanlines,
+                 Vrect *srcrect, Vrect *destrect, int colormode,
+                 YmagineFormatOptions *options)
+{
+  Vbitmap *preview = NULL;
+  Transformer *transformer;
+  YmagineStatsCollector *collector;
+  nsecs_t start;
+  YBOOL active = YTRUE;
+  int nextscan = 1;
+  int scan;
+  int status;
+  int nlines;
+  int j;
+
+  collector = YmagineStatsCurrent();
+
+  for (;;) {
+    start = YMAGINE_STATS_NOW(collector);
+    status = jpeg_consume_input(cinfo);
+    YMAGINE_STATS_TIME(collector, decode, start);
+    if (status == JPEG_REACHED_EOI) {
+      break;
+    }
+    if (status == JPEG_SUSPENDED) {
+      /* Channel input never suspends */
+      break;
+    }
+    if (status != JPEG_SCAN_COMPLETED || !active) {
+      continue;
+    }
+
+    scan = cinfo->input_scan_number;
+    if (scan < nextscan) {
+      continue;
+    }
+
+    if (preview == NULL) {
+      preview = VbitmapInitMemory(colormode);
+      if (preview == NULL ||
+          VbitmapResize(preview, destrect->width, destrect->height) != YMAGINE_OK) {
+        active = YFALSE;
+        continue;
+      }
+    }
+
+    transformer = TransformerCreate();
+    if (transformer == NULL) {
+      active = YFALSE;
+      continue;
+    }
+    TransformerSetScale(transformer,
+                        cinfo->output_width, cinfo->output_height,
+                        destrect->width, destrect->height);
+    TransformerSetRegion(transformer,
+                         srcrect->x, srcrect->y, srcrect->width, srcrect->height);
+    TransformerSetMode(transformer, JpegPixelMode(cinfo->out_color_space), VBITMAP_COLOR_RGB);
+    TransformerSetBitmap(transformer, preview, 0, 0);
+
+    /* Output pass over coefficients received so far */
+    start = YMAGINE_STATS_NOW(collector);
+    jpeg_start_output(cinfo, scan);
+    while (cinfo->output_scanline < cinfo->output_height) {
+      nlines = jpeg_read_scanlines(cinfo, buffer, scanlines);
+      if (nlines <= 0) {
+        break;
+      }
+      for (j = 0; j < nlines; j++) {
+        TransformerPush(transformer, (const char*) buffer[j]);
+      }
+    }
+    jpeg_finish_output(cinfo);
+    YMAGINE_STATS_TIME(collector, decode, start);
+    TransformerRelease(transformer);
+
+    if (options->previewcb(options, preview, scan) != YMAGINE_OK) {
+      active = YFALSE;
+    }
+    if (options->previewinterval > 0) {
+      nextscan = scan + options->previewinterval;
+    } else {
+      active = YFALSE;
+    }
+  }
+
+  if (preview != NULL) {
+    VbitmapRelease(preview);
+  }
+
+  return jpeg_input_complete(cinfo) ? YMAGINE_OK : YMAGINE_ERROR;
+}
+
 static YOPTIMIZE_SPEED int
 decompress_jpeg(struct jpeg_decompress_struct *cinfo,
                 struct jpeg_compress_struct *cinfoout, JCOPY_OPTION copyoption,
-                Vbitmap *vbitmap, YmagineFormatOptions *options)
+                Vbitmap *vbitmap, YmagineFormatOptions *options, YBOOL previews)
 {
   int scanlines;
   int nlines;
@@ -346,9 +643,12 @@ decompress_jpeg(struct jpeg_decompress_struct *cinfo,
   Vrect rotaterect;
   size_t row_stride;
   Transformer *transformer;
+  JpegBatch batch;
   PixelShader *shader = NULL;
   int iwidth, iheight;
   float sharpen = 0.0f;
+  YmagineStatsCollector *collector;
+  nsecs_t start;
 
   if (vbitmap == NULL && cinfoout == NULL) {
     /* No output specified */
@@ -461,13 +761,17 @@ decompress_jpeg(struct jpeg_decompress_struct *cinfo,
         scanlines);
 #endif
 
+  collector = YmagineStatsCurrent();
+
   /* Resize encoder */
   if (cinfoout != NULL) {
+    start = YMAGINE_STATS_NOW(collector);
     jpeg_start_compress(cinfoout, TRUE);
     if (copyoption != JCOPYOPT_NONE) {
       /* Copy to the output file any extra markers that we want to preserve */
       jcopy_markers_execute(cinfo, cinfoout, copyoption);
     }
+    YMAGINE_STATS_TIME(collector, encode, start);
   }
 
   /* Resize target bitmap */
@@ -485,13 +789,20 @@ decompress_jpeg(struct jpeg_decompress_struct *cinfo,
     }
   }
 
+  /* Progressive input can be output once per scan, while consumed */
+  previews = (previews && vbitmap != NULL && cinfoout == NULL &&
+              options->previewcb != NULL && jpeg_has_multiple_scans(cinfo));
+  cinfo->buffered_image = previews ? TRUE : FALSE;
+
   /* TODO: if supporting suspending input, need to check for suspension as return code */
+  start = YMAGINE_STATS_NOW(collector);
   if (!jpeg_start_decompress(cinfo)) {
     if (cinfoout != NULL) {
       jpeg_abort_compress(cinfoout);
     }
     return 0;
   }
+  YMAGINE_STATS_TIME(collector, decode, start);
   
   buffer = (JSAMPARRAY) (*cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE,
                                                     row_stride, scanlines);
@@ -502,6 +813,24 @@ decompress_jpeg(struct jpeg_decompress_struct *cinfo,
     jpeg_abort_decompress(cinfo);
     return 0;
   }
+
+  if (vbitmap == NULL && JpegBatchInit(&batch, cinfoout) != YMAGINE_OK) {
+    jpeg_abort_compress(cinfoout);
+    jpeg_abort_decompress(cinfo);
+    return 0;
+  }
+
+  if (previews) {
+    if (JPEGPreviewScans(cinfo, buffer, scanlines, &srcrect, &destrect,
+                         VbitmapColormode(vbitmap), options) != YMAGINE_OK) {
+      jpeg_abort_decompress(cinfo);
+      return 0;
+    }
+    /* Final output pass, with all scans */
+    start = YMAGINE_STATS_NOW(collector);
+    jpeg_start_output(cinfo, cinfo->input_scan_number);
+    YMAGINE_STATS_TIME(collector, decode, start);
+  }
   
   totallines = 0;
   
@@ -518,17 +847,21 @@ decompress_jpeg(struct jpeg_decompress_struct *cinfo,
          perform colorspace conversion only as final pass when writing to bitmap */
       TransformerSetMode(transformer, JpegPixelMode(cinfo->out_color_space), VBITMAP_COLOR_RGB);
       TransformerSetBitmap(transformer, vbitmap, destrect.x, destrect.y);
+      YmagineComposePrepare(options, transformer);
     } else {
       TransformerSetMode(transformer, JpegPixelMode(cinfo->out_color_space),
                          JpegPixelMode(cinfoout->in_color_space));
-      TransformerSetWriter(transformer, JpegWriter, cinfoout);
+      TransformerSetWriter(transformer, JpegWriter, &batch);
     }
     TransformerSetShader(transformer, shader);
     TransformerSetSharpen(transformer, sharpen);
+    YmagineThemePrepare(options, transformer);
   }
 
   while (transformer != NULL && cinfo->output_scanline < cinfo->output_height) {
+    start = YMAGINE_STATS_NOW(collector);
     nlines = jpeg_read_scanlines(cinfo, buffer, scanlines);
+    YMAGINE_STATS_TIME(collector, decode, start);
     if (nlines <= 0) {
       /* Decoding error */
       ALOGD("decoding error (nlines=%d)", nlines);
@@ -547,14 +880,23 @@ decompress_jpeg(struct jpeg_decompress_struct *cinfo,
 
   /* Clean up */
   if (transformer != NULL) {
+    YmagineThemeCollect(options, transformer);
     TransformerRelease(transformer);
   }
   if (cinfo->output_scanline > 0 && cinfo->output_scanline == cinfo->output_height) {
     /* Do normal cleanup if whole image has been read and decoded */
+    start = YMAGINE_STATS_NOW(collector);
+    if (cinfo->buffered_image) {
+      jpeg_finish_output(cinfo);
+    }
     jpeg_finish_decompress(cinfo);
+    YMAGINE_STATS_TIME(collector, decode, start);
     if (cinfoout != NULL && vbitmap == NULL) {
       /* Finish compress only if caller didn't request partial encoding */
+      start = YMAGINE_STATS_NOW(collector);
+      JpegBatchFlush(&batch);
       jpeg_finish_compress(cinfoout);
+      YMAGINE_STATS_TIME(collector, encode, start);
     }
   }
   else {
@@ -578,12 +920,6 @@ prepareDecompressor(struct jpeg_decompress_struct *cinfo, YmagineFormatOptions *
     return YMAGINE_ERROR;
   }
 
-  if (1) {
-    cinfo->mem->max_memory_to_use = 30 * 1024 * 1024;
-  } else {
-    cinfo->mem->max_memory_to_use = 5 * 1024 * 1024;
-  }
-  
   if (quality < 90) {
     /* DCT method, one of JDCT_FASTEST, JDCT_IFAST, JDCT_ISLOW or JDCT_FLOAT */
     cinfo->dct_method = JDCT_IFAST;
@@ -707,6 +1043,44 @@ APP1_handler (j_decompress_ptr cinfo) {
 }
 
 
+/*
+ * Once header is read, charge memory limits, if any, with what libjpeg
+ * needs to decode the image, and cap libjpeg to that grant. Reservation
+ * is released by JPEGCodecDone.
+ */
+static int
+grantDecompressor(JPEGCodec *codec)
+{
+  struct jpeg_decompress_struct *cinfo = &(codec->cinfo);
+  jpeg_component_info *compptr;
+  size_t grant = JPEG_BASE_MEMORY;
+  int ci;
+
+  if (YmagineLimitsAvailable() <= 0) {
+    cinfo->mem->max_memory_to_use = JPEG_MAX_MEMORY;
+    return YMAGINE_OK;
+  }
+
+  for (ci = 0, compptr = cinfo->comp_info; ci < cinfo->num_components; ci++, compptr++) {
+    /* One iMCU row of samples, with context rows and upsampling */
+    grant += (size_t) compptr->width_in_blocks * compptr->v_samp_factor *
+      DCTSIZE2 * 4;
+    if (jpeg_has_multiple_scans(cinfo)) {
+      /* Whole image coefficient buffer */
+      grant += (size_t) compptr->width_in_blocks * compptr->height_in_blocks *
+        sizeof(JBLOCK);
+    }
+  }
+
+  if (YmagineLimitsReserve(grant, YFALSE) != YMAGINE_OK) {
+    return YMAGINE_ERROR_LIMIT;
+  }
+  codec->grant += grant;
+  cinfo->mem->max_memory_to_use = (long) grant;
+
+  return YMAGINE_OK;
+}
+
 static int
 startDecompressor(struct jpeg_decompress_struct *cinfo,
                   struct jpeg_compress_struct *cinfoout,
@@ -833,10 +1207,13 @@ startDecompressor(struct jpeg_decompress_struct *cinfo,
 
 
 static int
-bitmap_decode(struct jpeg_decompress_struct *cinfo, Vbitmap *vbitmap,
+bitmap_decode(JPEGCodec *codec, Vbitmap *vbitmap,
               YmagineFormatOptions *options)
 {
+  struct jpeg_decompress_struct *cinfo = &(codec->cinfo);
   int nlines = -1;
+  YmagineStatsCollector *collector;
+  nsecs_t start;
 
   cinfo->client_data = (void*) vbitmap;
   
@@ -847,15 +1224,23 @@ bitmap_decode(struct jpeg_decompress_struct *cinfo, Vbitmap *vbitmap,
   /* Intercept APP1 markers for PhotoSphere parsing */
   jpeg_set_marker_processor(cinfo, JPEG_APP0 + 1, APP1_handler);
 
+  collector = YmagineStatsCurrent();
+  start = YMAGINE_STATS_NOW(collector);
   if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK) {
     return nlines;
   }
+  YMAGINE_STATS_TIME(collector, parse, start);
 
   if (YmagineFormatOptions_invokeCallback(options, YMAGINE_IMAGEFORMAT_JPEG,
                                           cinfo->image_width, cinfo->image_height) != YMAGINE_OK) {
     return nlines;
   }
 
+  if (VbitmapType(vbitmap) != VBITMAP_NONE &&
+      grantDecompressor(codec) != YMAGINE_OK) {
+    return nlines;
+  }
+
   if (startDecompressor(cinfo, NULL, vbitmap, options) != YMAGINE_OK) {
     return nlines;
   }
@@ -868,7 +1253,7 @@ bitmap_decode(struct jpeg_decompress_struct *cinfo, Vbitmap *vbitmap,
 #endif
 
   nlines = decompress_jpeg(cinfo, NULL, JCOPYOPT_NONE,
-                           vbitmap, options);
+                           vbitmap, options, YTRUE);
 
   return nlines;
 }
@@ -877,8 +1262,9 @@ int
 decodeJPEG(Ychannel *channel, Vbitmap *vbitmap,
            YmagineFormatOptions *options)
 {
-  struct jpeg_decompress_struct cinfo;
-  struct noop_error_mgr jerr;
+  JPEGCodec local;
+  JPEGCodec *codec;
+  struct jpeg_decompress_struct *cinfo;
   int nlines = -1;
   
   if (!YchannelReadable(channel)) {
@@ -888,77 +1274,518 @@ decodeJPEG(Ychannel *channel, Vbitmap *vbitmap,
     return nlines;
   }
   
-  memset(&cinfo, 0, sizeof(struct jpeg_decompress_struct));
-  cinfo.err = noop_jpeg_std_error(&jerr.pub);
+  codec = JPEGCodecAcquire(&local);
+  cinfo = &(codec->cinfo);
   
   /* Establish the setjmp return context for noop_error_exit to use. */
-  if (setjmp(jerr.setjmp_buffer)) {
+  if (setjmp(codec->jerr.setjmp_buffer)) {
     /* If we get here, the JPEG code has signaled an error. */
-    noop_append_jpeg_message((j_common_ptr) &cinfo);
+    noop_append_jpeg_message((j_common_ptr) cinfo);
   } else {
-    jpeg_create_decompress(&cinfo);
-    if (ymaginejpeg_input(&cinfo, channel) >= 0) {
-      nlines = bitmap_decode(&cinfo, vbitmap,
+    JPEGCodecCreateDecompress(codec);
+    if (ymaginejpeg_input(cinfo, channel) >= 0) {
+      nlines = bitmap_decode(codec, vbitmap,
                              options);
     }
   }
-  jpeg_destroy_decompress(&cinfo);
+  JPEGCodecDone(codec, &local);
   
   return nlines;
 }
 
+/*
+ * Extra markers of input, saved before the decompressor releases them so
+ * they can be written into every output encoded by a quality search
+ */
+typedef struct JPEGMarkerStruct JPEGMarker;
+struct JPEGMarkerStruct {
+  JPEGMarker *next;
+  int marker;
+  unsigned int length;
+  JOCTET *data;
+};
+
+static JPEGMarker*
+JPEGMarkersSave(struct jpeg_decompress_struct *cinfo)
+{
+  jpeg_saved_marker_ptr saved;
+  JPEGMarker *markers = NULL;
+  JPEGMarker **last = &markers;
+  JPEGMarker *marker;
+
+  for (saved = cinfo->marker_list; saved != NULL; saved = saved->next) {
+    marker = (JPEGMarker*) Ymem_malloc(sizeof(JPEGMarker) + saved->data_length);
+    if (marker == NULL) {
+      break;
+    }
+    marker->next = NULL;
+    marker->marker = saved->marker;
+    marker->length = saved->data_length;
+    marker->data = (JOCTET*) (marker + 1);
+    memcpy(marker->data, saved->data, saved->data_length);
+
+    *last = marker;
+    last = &(marker->next);
+  }
+
+  return markers;
+}
+
+/* Same as jcopy_markers_execute, must be called right after jpeg_start_compress */
+static void
+JPEGMarkersWrite(struct jpeg_compress_struct *cinfoout, JPEGMarker *markers)
+{
+  JPEGMarker *marker;
+
+  for (marker = markers; marker != NULL; marker = marker->next) {
+    /* Skip JFIF and Adobe markers, already emitted by encoder */
+    if (cinfoout->write_JFIF_header && marker->marker == JPEG_APP0 &&
+        marker->length >= 5 && memcmp(marker->data, "JFIF", 5) == 0) {
+      continue;
+    }
+    if (cinfoout->write_Adobe_marker && marker->marker == JPEG_APP0 + 14 &&
+        marker->length >= 5 && memcmp(marker->data, "Adobe", 5) == 0) {
+      continue;
+    }
+    jpeg_write_marker(cinfoout, marker->marker, marker->data, marker->length);
+  }
+}
+
+static void
+JPEGMarkersRelease(JPEGMarker *markers)
+{
+  JPEGMarker *marker;
+
+  while (markers != NULL) {
+    marker = markers;
+    markers = marker->next;
+    Ymem_free(marker);
+  }
+}
+
+/* Compress whole bitmap at given quality into destination set on
+   compressor. Must be called with setjmp context set */
+static int
+compressBitmap(struct jpeg_compress_struct *cinfoout, Vbitmap *vbitmap,
+               YmagineFormatOptions *options, int quality,
+               JPEGMarker *markers)
+{
+  int nlines = 0;
+  JSAMPROW row_pointer[JPEG_WRITE_MAXROWS];
+  unsigned char *pixels;
+  unsigned char *opixels;
+  int width;
+  int height;
+  int pitch;
+  int colormode;
+  int i;
+  int j;
+  int batch;
+  int nrows;
+  int background = 0;
+  YmagineFlatten flatten;
+  YBOOL flattened = YFALSE;
+  /* Other compression settings */
+  int optimize = 0;
+  int grayscale = 0;
+
+  if (VbitmapLock(vbitmap) != YMAGINE_OK) {
+    ALOGE("AndroidBitmap_lockPixels() failed");
+    return YMAGINE_ERROR;
+  }
+
+  if (quality >= 90) {
+    optimize = 1;
+  }
+
+  width = VbitmapWidth(vbitmap);
+  height = VbitmapHeight(vbitmap);
+  pitch = VbitmapPitch(vbitmap);
+  colormode = VbitmapColormode(vbitmap);
+
+  cinfoout->image_width = width;
+  cinfoout->image_height = height;
+
+  set_colormode(cinfoout, colormode);
+
+  jpeg_set_defaults(cinfoout);
+
+  jpeg_set_quality(cinfoout, quality, FALSE);
+  if (grayscale) {
+    /* Force a monochrome JPEG file to be generated. */
+    jpeg_set_colorspace(cinfoout, JCS_GRAYSCALE);
+  }
+  if (optimize) {
+    /* Enable entropy parm optimization. */
+    cinfoout->optimize_coding = TRUE;
+  }
+  /* This must be called after color space is set */
+  setCompressorOptions(cinfoout, NULL, options);
+
+  jpeg_start_compress(cinfoout, TRUE);
+  JPEGMarkersWrite(cinfoout, markers);
+
+  pixels = VbitmapBuffer(vbitmap);
+  opixels = NULL;
+
+  /* Hand rows to compressor one iMCU row at a time */
+  batch = JpegWriteRows(cinfoout);
+
+  /* Default to black background */
+  if (options != NULL) {
+    background = options->backgroundcolor;
+  }
+
+  if (YmagineFlattenPrepare(&flatten, colormode, background) == YMAGINE_OK) {
+    /* Need to flatten image, i.e. convert from RGBA to RGB */
+    opixels = Ymem_malloc(width * 3 * batch);
+    if (opixels == NULL) {
+      jpeg_abort_compress(cinfoout);
+      VbitmapUnlock(vbitmap);
+      return YMAGINE_ERROR;
+    }
+    flattened = YTRUE;
+  }
+
+  for (i = 0; i < height; i += nrows) {
+    nrows = height - i;
+    if (nrows > batch) {
+      nrows = batch;
+    }
+
+    for (j = 0; j < nrows; j++) {
+      if (flattened) {
+        row_pointer[j] = opixels + j * width * 3;
+        YmagineFlattenLine(row_pointer[j], pixels + (i + j) * pitch, width, &flatten);
+      } else {
+        row_pointer[j] = pixels + (i + j) * pitch;
+      }
+    }
+    nlines += jpeg_write_scanlines(cinfoout, row_pointer, nrows);
+  }
+  if (opixels != NULL) {
+    Ymem_free(opixels);
+    opixels = NULL;
+  }
+
+  /* Clean up compressor */
+  jpeg_finish_compress(cinfoout);
+  VbitmapUnlock(vbitmap);
+
+  if (nlines <= 0) {
+    return YMAGINE_ERROR;
+  }
+
+  return YMAGINE_OK;
+}
+
+/* Lowest quality probed by quality search */
+#define JPEG_SEARCH_MINQUALITY 10
+
+static YBOOL
+searchEnabled(YmagineFormatOptions *options)
+{
+  return options != NULL &&
+    (options->searchmaxbytes > 0 || options->searchminssim > 0.0);
+}
+
+/*
+ * Quality search state. Each probe encodes the same bitmap again, at a
+ * different quality, into memory, so only the encoder runs again.
+ */
+typedef struct {
+  struct jpeg_compress_struct *cinfoout;
+  Vbitmap *vbitmap;
+  YmagineFormatOptions *options;
+  JPEGMarker *markers;
+  /* What SSIM of probes is measured against, see searchReference */
+  Vbitmap *reference;
+  /* Output size and SSIM of each quality, negative if not probed yet */
+  int size[101];
+  double ssim[101];
+  /* Quality of output currently held in memory, -1 if none */
+  int current;
+} JPEGSearch;
+
+static double
+searchSSIM(const JOCTET *data, size_t length, Vbitmap *reference)
+{
+  Ychannel *channel;
+  Vbitmap *decoded;
+  YmagineFormatOptions *options;
+  YmagineStatsCollector *collector;
+  int nlines;
+  double ssim = -1.0;
+
+  channel = YchannelInitByteArray((const char*) data, (int) length);
+  decoded = VbitmapInitMemory(VBITMAP_COLOR_RGB);
+  options = YmagineFormatOptions_Create();
+
+  if (channel != NULL && decoded != NULL && options != NULL) {
+    /* Decode accurately, so only encoding losses get measured. Not part
+       of the call statistics are collected for */
+    YmagineFormatOptions_setQuality(options, 100);
+    YmagineFormatOptions_setAccuracy(options, 100);
+    collector = YmagineStatsSuspend();
+    nlines = decodeJPEG(channel, decoded, options);
+    YmagineStatsResume(collector);
+    if (nlines > 0) {
+      ssim = VbitmapComputeSSIM(decoded, reference);
+    }
+  }
+
+  if (options != NULL) {
+    YmagineFormatOptions_Release(options);
+  }
+  if (decoded != NULL) {
+    VbitmapRelease(decoded);
+  }
+  if (channel != NULL) {
+    YchannelResetBuffer(channel);
+    YchannelRelease(channel);
+  }
+
+  return ssim;
+}
+
+/* Bitmap as handed to encoder by compressBitmap, i.e. flattened onto
+   background color if it has alpha, so SSIM doesn't measure flattening.
+   Returns vbitmap itself if encoded as is, NULL on failure */
+static Vbitmap*
+searchReference(Vbitmap *vbitmap, YmagineFormatOptions *options)
+{
+  Vbitmap *reference;
+  YmagineFlatten flatten;
+  unsigned char *ipixels;
+  unsigned char *opixels;
+  int ipitch;
+  int opitch;
+  int width;
+  int height;
+  int i;
+
+  if (YmagineFlattenPrepare(&flatten, VbitmapColormode(vbitmap),
+                            options->backgroundcolor) != YMAGINE_OK) {
+    return vbitmap;
+  }
+
+  width = VbitmapWidth(vbitmap);
+  height = VbitmapHeight(vbitmap);
+
+  reference = VbitmapInitMemory(VBITMAP_COLOR_RGB);
+  if (reference == NULL) {
+    return NULL;
+  }
+  if (VbitmapResize(reference, width, height) != YMAGINE_OK) {
+    VbitmapRelease(reference);
+    return NULL;
+  }
+
+  if (VbitmapLock(vbitmap) != YMAGINE_OK) {
+    VbitmapRelease(reference);
+    return NULL;
+  }
+  if (VbitmapLock(reference) != YMAGINE_OK) {
+    VbitmapUnlock(vbitmap);
+    VbitmapRelease(reference);
+    return NULL;
+  }
+
+  ipixels = VbitmapBuffer(vbitmap);
+  ipitch = VbitmapPitch(vbitmap);
+  opixels = VbitmapBuffer(reference);
+  opitch = VbitmapPitch(reference);
+  for (i = 0; i < height; i++) {
+    YmagineFlattenLine(opixels + i * opitch, ipixels + i * ipitch, width, &flatten);
+  }
+
+  VbitmapUnlock(reference);
+  VbitmapUnlock(vbitmap);
+
+  return reference;
+}
+
+static int
+searchProbe(JPEGSearch *search, int quality)
+{
+  const JOCTET *data;
+  size_t length;
+
+  if (search->size[quality] >= 0) {
+    return YMAGINE_OK;
+  }
+
+  search->current = -1;
+  ymaginejpeg_output_memory(search->cinfoout);
+  if (compressBitmap(search->cinfoout, search->vbitmap, search->options,
+                     quality, search->markers) != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+
+  data = ymaginejpeg_output_data(search->cinfoout, &length);
+  search->size[quality] = (int) length;
+  search->current = quality;
+
+  if (search->options->searchminssim > 0.0) {
+    search->ssim[quality] = searchSSIM(data, length, search->reference);
+  }
+
+  return YMAGINE_OK;
+}
+
+/* Encode bitmap at quality meeting targets of options, see
+   YmagineFormatOptions_setQualitySearch. Must be called with setjmp
+   context of codec compressor set, whose JPEGCodecDone releases what a
+   search interrupted by an error left behind */
+static int
+searchQuality(JPEGCodec *codec, Vbitmap *vbitmap,
+              YmagineFormatOptions *options, Ychannel *channelout,
+              JPEGMarker *markers)
+{
+  struct jpeg_compress_struct *cinfoout = &(codec->cinfoout);
+  JPEGSearch search;
+  const JOCTET *data;
+  size_t length;
+  int lo = JPEG_SEARCH_MINQUALITY;
+  int hi = 100;
+  int mid;
+  int quality;
+  int i;
+  int rc = YMAGINE_OK;
+
+  search.cinfoout = cinfoout;
+  search.vbitmap = vbitmap;
+  search.options = options;
+  search.markers = markers;
+  search.reference = vbitmap;
+  search.current = -1;
+  for (i = 0; i <= 100; i++) {
+    search.size[i] = -1;
+    search.ssim[i] = -1.0;
+  }
+
+  /* Lowest quality reaching SSIM target, highest one if none does */
+  if (options->searchminssim > 0.0) {
+    search.reference = searchReference(vbitmap, options);
+    if (search.reference == NULL) {
+      return YMAGINE_ERROR;
+    }
+    if (search.reference != vbitmap) {
+      codec->searchreference = search.reference;
+    }
+    rc = searchProbe(&search, hi);
+    if (rc == YMAGINE_OK && search.ssim[hi] >= options->searchminssim) {
+      while (rc == YMAGINE_OK && lo < hi) {
+        mid = (lo + hi) / 2;
+        rc = searchProbe(&search, mid);
+        if (search.ssim[mid] >= options->searchminssim) {
+          hi = mid;
+        } else {
+          lo = mid + 1;
+        }
+      }
+    }
+  }
+  quality = hi;
+
+  /* Then highest quality not above it which fits in size budget, lowest
+     one if none does */
+  if (rc == YMAGINE_OK && options->searchmaxbytes > 0) {
+    rc = searchProbe(&search, quality);
+    if (rc == YMAGINE_OK && search.size[quality] > options->searchmaxbytes) {
+      lo = JPEG_SEARCH_MINQUALITY;
+      hi = quality - 1;
+      while (rc == YMAGINE_OK && lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        rc = searchProbe(&search, mid);
+        if (search.size[mid] <= options->searchmaxbytes) {
+          lo = mid;
+        } else {
+          hi = mid - 1;
+        }
+      }
+      quality = lo;
+    }
+  }
+
+  if (rc == YMAGINE_OK) {
+    if (search.current == quality) {
+      /* Last probe is the one chosen, just copy it */
+      data = ymaginejpeg_output_data(cinfoout, &length);
+      if (YmagineIOWrite(channelout, data, (int) length) != (int) length) {
+        rc = YMAGINE_ERROR;
+      } else {
+        YchannelFlush(channelout);
+      }
+    } else if (ymaginejpeg_output(cinfoout, channelout) == YMAGINE_OK) {
+      rc = compressBitmap(cinfoout, vbitmap, options, quality, markers);
+    } else {
+      rc = YMAGINE_ERROR;
+    }
+  }
+  ymaginejpeg_output_release(cinfoout);
+
+  if (codec->searchreference != NULL) {
+    VbitmapRelease(codec->searchreference);
+    codec->searchreference = NULL;
+  }
+
+  if (rc == YMAGINE_OK) {
+    options->searchedquality = quality;
+  }
+
+  return rc;
+}
+
 int
 transcodeJPEG(Ychannel *channelin, Ychannel *channelout,
               YmagineFormatOptions *options)
 {
-  struct jpeg_decompress_struct cinfo;
-  struct noop_error_mgr jerr;
-  
-  struct jpeg_compress_struct cinfoout;
-  struct noop_error_mgr jerr2;
+  JPEGCodec local;
+  JPEGCodec *codec;
+  struct jpeg_decompress_struct *cinfo;
+  struct jpeg_compress_struct *cinfoout;
   int rc = YMAGINE_ERROR;
   int nlines = 0;
   int quality;
   Vbitmap *decodebitmap = NULL;
+  JPEGMarker *markers = NULL;
+  YmagineFormatOptions *searchoptions = NULL;
   
   if (!YchannelReadable(channelin) || !YchannelWritable(channelout)) {
     return rc;
   }
   
-  if (options != NULL && (options->rotate != 0.0f || options->blur > 0.0f)) {
+  if (options != NULL && (options->rotate != 0.0f || options->blur > 0.0f ||
+                          searchEnabled(options))) {
     decodebitmap = VbitmapInitMemory(VBITMAP_COLOR_RGB);
     if (decodebitmap == NULL) {
       return rc;
     }
   }
 
-  memset(&cinfo, 0, sizeof(struct jpeg_decompress_struct));
-  cinfo.err = noop_jpeg_std_error(&jerr.pub);
-  
-  memset(&cinfoout, 0, sizeof(struct jpeg_compress_struct));
-  cinfoout.err = noop_jpeg_std_error(&jerr2.pub);
+  codec = JPEGCodecAcquire(&local);
+  cinfo = &(codec->cinfo);
+  cinfoout = &(codec->cinfoout);
   
-  if (setjmp(jerr.setjmp_buffer)) {
+  if (setjmp(codec->jerr.setjmp_buffer)) {
     /* If we get here, the JPEG code has signaled an error in decoder */
-    noop_append_jpeg_message((j_common_ptr) &cinfo);
-  } else if (setjmp(jerr2.setjmp_buffer)) {
+    noop_append_jpeg_message((j_common_ptr) cinfo);
+  } else if (setjmp(codec->jerr2.setjmp_buffer)) {
     /* If we get here, the JPEG code has signaled an error in encoder */
-    noop_append_jpeg_message((j_common_ptr) &cinfoout);
+    noop_append_jpeg_message((j_common_ptr) cinfoout);
   } else {
-    jpeg_create_decompress(&cinfo);
-    
-    /* Equivalent to:
-	   jpeg_CreateCompress(&cinfoout, JPEG_LIB_VERSION,
-	   (size_t) sizeof(struct jpeg_compress_struct));
-     */
-    jpeg_create_compress(&cinfoout);
+    JPEGCodecCreateDecompress(codec);
+    JPEGCodecCreateCompress(codec);
 
-    if (ymaginejpeg_input(&cinfo, channelin) == YMAGINE_OK &&
-        ymaginejpeg_output(&cinfoout, channelout)  == YMAGINE_OK) {
-      if (prepareDecompressor(&cinfo, options) == YMAGINE_OK) {
+    if (ymaginejpeg_input(cinfo, channelin) == YMAGINE_OK &&
+        ymaginejpeg_output(cinfoout, channelout)  == YMAGINE_OK) {
+      if (prepareDecompressor(cinfo, options) == YMAGINE_OK) {
         /* markers copy option (NONE, COMMENTS or ALL) */
         JCOPY_OPTION copyoption;
         int metamode = YMAGINE_METAMODE_DEFAULT;
+        YmagineStatsCollector *collector;
+        nsecs_t start;
 
         if (options != NULL) {
           metamode = options->metamode;
@@ -976,46 +1803,63 @@ transcodeJPEG(Ychannel *channelin, Ychannel *channelout,
 
         /* Enable saving of extra markers that we want to copy */
         if (copyoption != JCOPYOPT_NONE) {
-          jcopy_markers_setup(&cinfo, copyoption);
+          jcopy_markers_setup(cinfo, copyoption);
         }
         
+        collector = YmagineStatsCurrent();
+        start = YMAGINE_STATS_NOW(collector);
+
         /* Force image to be decoded without colorspace conversion if possible */
-        if (jpeg_read_header(&cinfo, TRUE) == JPEG_HEADER_OK) {
+        if (jpeg_read_header(cinfo, TRUE) == JPEG_HEADER_OK) {
           /* Other compression settings */
           int optimize = 0;
           int grayscale = 0;
 
+          YMAGINE_STATS_TIME(collector, parse, start);
+
           if (YmagineFormatOptions_invokeCallback(options, YMAGINE_IMAGEFORMAT_JPEG,
-                                                  cinfo.image_width, cinfo.image_height) == YMAGINE_OK) {
+                                                  cinfo->image_width, cinfo->image_height) == YMAGINE_OK) {
           
             quality = YmagineFormatOptions_normalizeQuality(options);
             if (quality >= 90) {
               optimize = 1;
             }
 
-            if (startDecompressor(&cinfo, &cinfoout, decodebitmap, options) == YMAGINE_OK) {
-              jpeg_set_defaults(&cinfoout);
-              cinfoout.optimize_coding = FALSE;
+            if (decodebitmap != NULL && searchEnabled(options)) {
+              /* Quality search encodes once decoding is over, after
+                 decoder released markers and scan info, so keep them */
+              markers = JPEGMarkersSave(cinfo);
+              searchoptions = YmagineFormatOptions_Duplicate(options);
+              if (searchoptions != NULL && searchoptions->progressive < 0 &&
+                  jpeg_has_multiple_scans(cinfo)) {
+                searchoptions->progressive = 1;
+              }
+            }
 
-              jpeg_set_quality(&cinfoout, quality, FALSE);
+            if (grantDecompressor(codec) == YMAGINE_OK &&
+                startDecompressor(cinfo, cinfoout, decodebitmap, options) == YMAGINE_OK) {
+              jpeg_set_defaults(cinfoout);
+              cinfoout->optimize_coding = FALSE;
+
+              jpeg_set_quality(cinfoout, quality, FALSE);
               if (grayscale) {
                 /* Force a monochrome JPEG file to be generated. */
-                jpeg_set_colorspace(&cinfoout, JCS_GRAYSCALE);
+                jpeg_set_colorspace(cinfoout, JCS_GRAYSCALE);
               }
               if (optimize) {
                 /* Enable entropy parm optimization. */
-                cinfoout.optimize_coding = TRUE;
+                cinfoout->optimize_coding = TRUE;
               }
 
               /* If non-zero, the input image is smoothed; the value should
                  be 1 for minimal smoothing to 100 for maximum smoothing. */
-              cinfoout.smoothing_factor = 0;
+              cinfoout->smoothing_factor = 0;
 
               /* This must be called after color space is set */
-              setCompressorOptions(&cinfoout, &cinfo, options);
+              setCompressorOptions(cinfoout, cinfo, options);
 
-              cinfo.client_data = (void*) NULL;
-              cinfoout.client_data = (void*) NULL;
+              cinfo->client_data = (void*) NULL;
+              cinfoout->client_data = (void*) NULL;
 
               if (decodebitmap != NULL) {
                 Vrect croprect;
@@ -1024,8 +1868,20 @@ transcodeJPEG(Ychannel *channelin, Ychannel *channelout,
                 int width;
                 int height;
 
-                nlines = decompress_jpeg(&cinfo, &cinfoout, copyoption,
-                                         decodebitmap, options);
+                if (searchoptions == NULL) {
+                  nlines = decompress_jpeg(cinfo, cinfoout, copyoption,
+                                           decodebitmap, options, YFALSE);
+                } else if (options->rotate != 0.0f) {
+                  /* Only need encoder for size of rotated image, discard
+                     header it writes */
+                  ymaginejpeg_output_memory(cinfoout);
+                  nlines = decompress_jpeg(cinfo, cinfoout, JCOPYOPT_NONE,
+                                           decodebitmap, options, YFALSE);
+                  jpeg_abort_compress(cinfoout);
+                } else {
+                  nlines = decompress_jpeg(cinfo, NULL, JCOPYOPT_NONE,
+                                           decodebitmap, options, YFALSE);
+                }
                 if (nlines > 0) {
                   rc = YMAGINE_OK;
 
@@ -1045,7 +1901,7 @@ transcodeJPEG(Ychannel *channelin, Ychannel *channelout,
                       if (rotatebitmap == NULL) {
                         rc = YMAGINE_ERROR;
                       } else {
-                        rc = VbitmapResize(rotatebitmap, cinfoout.image_width, cinfoout.image_height);
+                        rc = VbitmapResize(rotatebitmap, cinfoout->image_width, cinfoout->image_height);
                         if (rc == YMAGINE_OK) {
                           rc = Ymagine_rotate(rotatebitmap, decodebitmap,
                                               centerx, centery, options->rotate);
@@ -1066,35 +1922,55 @@ transcodeJPEG(Ychannel *channelin, Ychannel *channelout,
                   }
                 }
 
-                if (rc == YMAGINE_OK && decodebitmap != NULL) {
+                start = YMAGINE_STATS_NOW(collector);
+                if (searchoptions != NULL) {
+                  if (rc == YMAGINE_OK) {
+                    rc = searchQuality(codec, decodebitmap, searchoptions,
+                                       channelout, markers);
+                    options->searchedquality = searchoptions->searchedquality;
+                  }
+                } else if (rc == YMAGINE_OK && decodebitmap != NULL) {
                   rc = VbitmapLock(decodebitmap);
                   if (rc == YMAGINE_OK) {
                     int height;
                     int pitch;
                     unsigned char *pixels;
-                    JSAMPROW row_pointer[1];
+                    JSAMPROW row_pointer[JPEG_WRITE_MAXROWS];
+                    int batch;
+                    int nrows;
                     int j;
+                    int k;
 
-                    /* Encode transformed bitmap */
+                    /* Encode transformed bitmap, one iMCU row at a time */
                     height = VbitmapHeight(decodebitmap);
                     pitch = VbitmapPitch(decodebitmap);
                     pixels = VbitmapBuffer(decodebitmap);
+                    batch = JpegWriteRows(cinfoout);
 
-                    for (j = 0; j < height; j++) {
-                      row_pointer[0] = pixels + j * pitch;
-                      jpeg_write_scanlines(&cinfoout, row_pointer, 1);
+                    for (j = 0; j < height; j += nrows) {
+                      nrows = height - j;
+                      if (nrows > batch) {
+                        nrows = batch;
+                      }
+                      for (k = 0; k < nrows; k++) {
+                        row_pointer[k] = pixels + (j + k) * pitch;
+                      }
+                      jpeg_write_scanlines(cinfoout, row_pointer, nrows);
                     }
 
                     VbitmapUnlock(decodebitmap);
                   }
-                }
-                if (rc == YMAGINE_OK) {
-                  jpeg_finish_compress(&cinfoout);
+                  if (rc == YMAGINE_OK) {
+                    jpeg_finish_compress(cinfoout);
+                  } else {
+                    jpeg_abort_compress(cinfoout);
+                  }
                 } else {
-                  jpeg_abort_compress(&cinfoout);
+                  jpeg_abort_compress(cinfoout);
                 }
+                YMAGINE_STATS_TIME(collector, encode, start);
               } else {
-                nlines = decompress_jpeg(&cinfo, &cinfoout, copyoption, NULL, options);
+                nlines = decompress_jpeg(cinfo, cinfoout, copyoption, NULL, options, YFALSE);
                 if (nlines > 0) {
                   rc = YMAGINE_OK;
                 }
@@ -1109,9 +1985,12 @@ transcodeJPEG(Ychannel *channelin, Ychannel *channelout,
   if (decodebitmap != NULL) {
     VbitmapRelease(decodebitmap);
   }
+  if (searchoptions != NULL) {
+    YmagineFormatOptions_Release(searchoptions);
+  }
+  JPEGMarkersRelease(markers);
 
-  jpeg_destroy_compress(&cinfoout);
-  jpeg_destroy_decompress(&cinfo);
+  JPEGCodecDone(codec, &local);
 
   return rc;
 }
@@ -1119,191 +1998,39 @@ transcodeJPEG(Ychannel *channelin, Ychannel *channelout,
 int
 encodeJPEG(Vbitmap *vbitmap, Ychannel *channelout, YmagineFormatOptions *options)
 {
-  struct jpeg_compress_struct cinfoout;
-  struct noop_error_mgr jerr;
-  int result = YMAGINE_ERROR;
-  int rc;
-  int nlines = 0;
-  JSAMPROW row_pointer[1];
-  unsigned char *pixels;
-  unsigned char *opixels;
-  unsigned char *inext;
-  int width;
-  int height;
-  int pitch;
-  int colormode;
-  int bpp;
-  int i;
-  unsigned char background[4];
-  int alphaidx = -1;
-  int premultiplied = 0;
+  JPEGCodec local;
+  JPEGCodec *codec;
+  struct jpeg_compress_struct *cinfoout;
+  int rc = YMAGINE_ERROR;
 
   if (!YchannelWritable(channelout)) {
-    return result;
+    return rc;
   }
 
   if (vbitmap == NULL) {
-    return result;
-  }
-
-  rc = VbitmapLock(vbitmap);
-  if (rc != YMAGINE_OK) {
-    ALOGE("AndroidBitmap_lockPixels() failed");
-    return result;
+    return rc;
   }
 
-  memset(&cinfoout, 0, sizeof(struct jpeg_compress_struct));
-  cinfoout.err = noop_jpeg_std_error(&jerr.pub);
+  codec = JPEGCodecAcquire(&local);
+  cinfoout = &(codec->cinfoout);
 
-  if (setjmp(jerr.setjmp_buffer)) {
+  if (setjmp(codec->jerr2.setjmp_buffer)) {
     /* If we get here, the JPEG code has signaled an error in encoder */
-    noop_append_jpeg_message((j_common_ptr) &cinfoout);
+    noop_append_jpeg_message((j_common_ptr) cinfoout);
+    rc = YMAGINE_ERROR;
   } else {
-    /* Equivalent to:
-	   jpeg_CreateCompress(&cinfoout, JPEG_LIB_VERSION,
-	   (size_t) sizeof(struct jpeg_compress_struct));
-     */
-    jpeg_create_compress(&cinfoout);
-
-    if (ymaginejpeg_output(&cinfoout, channelout) >= 0) {
-      /* Other compression settings */
-      int optimize = 0;
-      int grayscale = 0;
-      int quality = YmagineFormatOptions_normalizeQuality(options);
-
-      if (quality >= 90) {
-        optimize = 1;
-      }
-
-      width = VbitmapWidth(vbitmap);
-      height = VbitmapHeight(vbitmap);
-      pitch = VbitmapPitch(vbitmap);
-      colormode = VbitmapColormode(vbitmap);
-      bpp = colorBpp(colormode);
-
-      cinfoout.image_width = width;
-      cinfoout.image_height = height;
-
-      set_colormode(&cinfoout, colormode);
-
-      jpeg_set_defaults(&cinfoout);
-
-      jpeg_set_quality(&cinfoout, quality, FALSE);
-      if (grayscale) {
-        /* Force a monochrome JPEG file to be generated. */
-        jpeg_set_colorspace(&cinfoout, JCS_GRAYSCALE);
-      }
-      if (optimize) {
-        /* Enable entropy parm optimization. */
-        cinfoout.optimize_coding = TRUE;
-      }
-      /* This must be called after color space is set */
-      setCompressorOptions(&cinfoout, NULL, options);
-
-      jpeg_start_compress(&cinfoout, TRUE);
-
-      pixels = VbitmapBuffer(vbitmap);
-      opixels = NULL;
-
-      switch (colormode) {
-      case VBITMAP_COLOR_ARGB:
-        alphaidx = 0;
-        premultiplied = 0;
-        break;
-      case VBITMAP_COLOR_Argb:
-        alphaidx = 0;
-        premultiplied = 1;
-        break;
-      case VBITMAP_COLOR_RGBA:
-        alphaidx = 3;
-        premultiplied = 0;
-        break;
-      case VBITMAP_COLOR_rgbA:
-        alphaidx = 3;
-        premultiplied = 1;
-        break;
-      }
-
-      if (alphaidx >= 0) {
-        /* Need to flatten image, i.e. convert from RGBA to RGB */
-        opixels = Ymem_malloc(width * bpp);
-      } else {
-        opixels = NULL;
-      }
-
-      /* Default to black background */
-      background[0] = 0x00;
-      background[1] = 0x00;
-      background[2] = 0x00;
-      background[3] = 0xff;
-
-      if (options != NULL) {
-        background[0] = YcolorRGBtoRed(options->backgroundcolor);
-        background[1] = YcolorRGBtoGreen(options->backgroundcolor);
-        background[2] = YcolorRGBtoBlue(options->backgroundcolor);
-      }
-
-      for (i = 0; i < height; i++) {
-        inext = pixels + i * pitch;
-
-        if (alphaidx >= 0) {
-          const unsigned char *ialpha;
-          unsigned char *onext = opixels;
-          int alpha;
-          int k;
+    JPEGCodecCreateCompress(codec);
 
-          if (alphaidx == 0) {
-            ialpha = inext;
-            inext++;
-          } else {
-            ialpha = inext + alphaidx;
-          }
-
-          for (k = 0; k < width; k++) {
-            alpha = ialpha[0];
-            if (alpha == 0xff) {
-              onext[0] = inext[0];
-              onext[1] = inext[1];
-              onext[2] = inext[2];
-            } else if (alpha == 0x00) {
-              onext[0] = background[0];
-              onext[1] = background[1];
-              onext[2] = background[2];
-            } else if (premultiplied) {
-              onext[0] = (((int) inext[0]) + background[0] * (255 - alpha)) / 255;
-              onext[1] = (((int) inext[1]) + background[1] * (255 - alpha)) / 255;
-              onext[2] = (((int) inext[2]) + background[2] * (255 - alpha)) / 255;
-            } else {
-              onext[0] = (inext[0] * alpha + background[0] * (255 - alpha)) / 255;
-              onext[1] = (inext[1] * alpha + background[1] * (255 - alpha)) / 255;
-              onext[2] = (inext[2] * alpha + background[2] * (255 - alpha)) / 255;
-            }
-            inext += 4;
-            ialpha += 4;
-            onext += 3;
-          }
-          row_pointer[0] = opixels;
-        } else {
-          row_pointer[0] = inext;
-        }
-        jpeg_write_scanlines(&cinfoout, row_pointer, 1);
-        nlines++;
-      }
-      if (opixels != NULL) {
-        Ymem_free(opixels);
-        opixels = NULL;
-      }
-
-      if (nlines > 0) {
-        rc = YMAGINE_OK;
-      }
-
-      /* Clean up compressor */
-      jpeg_finish_compress(&cinfoout);
+    if (searchEnabled(options)) {
+      rc = searchQuality(codec, vbitmap, options, channelout, NULL);
+    } else if (ymaginejpeg_output(cinfoout, channelout) >= 0) {
+      rc = compressBitmap(cinfoout, vbitmap, options,
+                          YmagineFormatOptions_normalizeQuality(options), NULL);
     }
   }
 
-  jpeg_destroy_compress(&cinfoout);
+  JPEGCodecDone(codec, &local);
+  /* Encoder may have bailed out with bitmap still locked */
   VbitmapUnlock(vbitmap);
 
   return rc;
@@ -1315,7 +2042,7 @@ verifyJPEG(Ychannel *channel)
   unsigned char buf[8];
   int i;
   
-  i = YchannelRead(channel, buf, 3);
+  i = YmagineIORead(channel, buf, 3);
   if ( (i != 3) || (buf[0] != 0xff) || (buf[1] != 0xd8) || (buf[2] != 0xff) ) {
     return YFALSE;
   }
@@ -1326,7 +2053,7 @@ verifyJPEG(Ychannel *channel)
   for (;;) {
     /* get marker type byte, skipping any padding FFs */
     while (buf[0] == (char) 0xff) {
-      if (YchannelRead(channel, buf, 1) != 1) {
+      if (YmagineIORead(channel, buf, 1) != 1) {
         return YFALSE;
       }
     }
@@ -1339,30 +2066,30 @@ verifyJPEG(Ychannel *channel)
     }
     
     /* nope, skip the marker parameters */
-    if (YchannelRead(channel, buf, 2) != 2) {
+    if (YmagineIORead(channel, buf, 2) != 2) {
       return YFALSE;
     }
     i = ((buf[0] & 0x0ff)<<8) + (buf[1] & 0x0ff) - 1;
     while (i > 256) {
-      YchannelRead(channel, buf, 256);
+      YmagineIORead(channel, buf, 256);
       i -= 256;
     }
     
-    if ((i<1) || (YchannelRead(channel, buf, i)) != i) {
+    if ((i<1) || (YmagineIORead(channel, buf, i)) != i) {
       return YFALSE;
     }
     
     buf[0] = buf[i-1];
     /* skip any inter-marker junk (there shouldn't be any, really) */
     while (buf[0] != (char) 0xff) {
-      if (YchannelRead(channel, buf, 1) != 1) {
+      if (YmagineIORead(channel, buf, 1) != 1) {
         return YFALSE;
       }
     }
   }
   
   /* Found the SOFn marker, get image dimensions */
-  if (YchannelRead(channel, buf, 7) != 7) {
+  if (YmagineIORead(channel, buf, 7) != 7) {
     return YFALSE;
   }
   
@@ -1387,10 +2114,7 @@ matchJPEG(Ychannel *channel)
     return YFALSE;
   }
 
-  hlen = YchannelRead(channel, header, sizeof(header));
-  if (hlen > 0) {
-    YchannelPush(channel, (const char*) header, hlen);
-  }
+  hlen = YmagineIOPeek(channel, header, sizeof(header));
 
   if (hlen < 3) {
     return YFALSE;
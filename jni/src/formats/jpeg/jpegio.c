@@ -106,7 +106,7 @@ fill_input_buffer(j_decompress_ptr cinfo)
   my_src_ptr src = (my_src_ptr) cinfo->src;
 
   // nbytes = YchannelRead(src->infile, src->buffer, INPUT_BUF_SIZE);
-  buffer = YchannelFetch(src->channel, 32*1024, &nbytes);
+  buffer = YmagineIOFetch(src->channel, YmagineIOBufferSize(), &nbytes);
 
   if (buffer == NULL || nbytes <= 0) {
     if (src->start_of_file) {
@@ -231,8 +231,6 @@ ymaginejpeg_input(j_decompress_ptr cinfo, Ychannel *channel)
  libjpeg destination manager for writing to Ychannel
  */
 
-#define STRING_BUF_SIZE  (16*1024)
-
 /* Expanded data source object for stdio and stream input */
 typedef struct {
   /* Public fields */
@@ -240,18 +238,64 @@ typedef struct {
 
   /* Private fields */
   Ychannel *channel;
-  JOCTET buffer[STRING_BUF_SIZE];
+  /* Output collected in memory when channel is NULL */
+  JOCTET *mem;
+  size_t memlen;
+  size_t memsize;
+  /* Start of buffer, of bufsize bytes, allocated for each image */
+  JOCTET *buffer;
+  size_t bufsize;
 } my_destination_mgr;
 
 typedef my_destination_mgr * my_dest_ptr;
 
+#define MEMORY_BUF_SIZE  (64*1024)
+
+static void
+append_memory (j_compress_ptr cinfo, size_t datacount)
+{
+  my_dest_ptr dest = (my_dest_ptr) cinfo->dest;
+  JOCTET *mem;
+  size_t memsize;
+
+  if (dest->memlen + datacount > dest->memsize) {
+    memsize = dest->memsize;
+    if (memsize < MEMORY_BUF_SIZE) {
+      memsize = MEMORY_BUF_SIZE;
+    }
+    while (dest->memlen + datacount > memsize) {
+      memsize *= 2;
+    }
+
+    mem = (JOCTET*) Ymem_malloc(memsize);
+    if (mem == NULL) {
+      ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+    }
+    if (dest->mem != NULL) {
+      memcpy(mem, dest->mem, dest->memlen);
+      Ymem_free(dest->mem);
+    }
+    dest->mem = mem;
+    dest->memsize = memsize;
+  }
+
+  memcpy(dest->mem + dest->memlen, dest->buffer, datacount);
+  dest->memlen += datacount;
+}
+
 static void
 init_destination (j_compress_ptr cinfo)
 {
   my_dest_ptr dest = (my_dest_ptr) cinfo->dest;
 
+  /* Allocate the output buffer --- it will be released when done with image */
+  dest->bufsize = (size_t) YmagineIOBufferSize();
+  dest->buffer = (JOCTET *)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+                                dest->bufsize * SIZEOF(JOCTET));
+
   dest->pub.next_output_byte = dest->buffer;
-  dest->pub.free_in_buffer = STRING_BUF_SIZE;
+  dest->pub.free_in_buffer = dest->bufsize;
 }
 
 static boolean
@@ -259,14 +303,18 @@ empty_output_buffer (j_compress_ptr cinfo)
 {
   my_dest_ptr dest = (my_dest_ptr) cinfo->dest;
 
-  if (YchannelWrite(dest->channel,
-                    dest->buffer,
-                    STRING_BUF_SIZE) != STRING_BUF_SIZE) {
-    ERREXIT(cinfo, JERR_FILE_WRITE);
+  if (dest->channel == NULL) {
+    append_memory(cinfo, dest->bufsize);
+  } else {
+    if (YmagineIOWrite(dest->channel,
+                       dest->buffer,
+                       (int) dest->bufsize) != (int) dest->bufsize) {
+      ERREXIT(cinfo, JERR_FILE_WRITE);
+    }
   }
 
   dest->pub.next_output_byte = dest->buffer;
-  dest->pub.free_in_buffer = STRING_BUF_SIZE;
+  dest->pub.free_in_buffer = dest->bufsize;
 
   return TRUE;
 }
@@ -275,10 +323,17 @@ static void
 term_destination (j_compress_ptr cinfo)
 {
   my_dest_ptr dest = (my_dest_ptr) cinfo->dest;
-  size_t datacount = STRING_BUF_SIZE - dest->pub.free_in_buffer;
+  size_t datacount = dest->bufsize - dest->pub.free_in_buffer;
+
+  if (dest->channel == NULL) {
+    if (datacount > 0) {
+      append_memory(cinfo, datacount);
+    }
+    return;
+  }
 
   if (datacount>0) {
-    if (YchannelWrite(dest->channel, dest->buffer, datacount) != datacount) {
+    if (YmagineIOWrite(dest->channel, dest->buffer, (int) datacount) != (int) datacount) {
 	    ERREXIT(cinfo, JERR_FILE_WRITE);
     }
   }
@@ -286,28 +341,86 @@ term_destination (j_compress_ptr cinfo)
   YchannelFlush(dest->channel);
 }
 
-int
-ymaginejpeg_output(j_compress_ptr cinfo, Ychannel *channel)
+static my_dest_ptr
+prepare_destination (j_compress_ptr cinfo)
 {
   my_dest_ptr dest;
 
-  if (!YchannelWritable(channel)) {
-    return YMAGINE_ERROR;
-  }
-
   if (cinfo->dest == NULL) {    /* first time for this JPEG object? */
     cinfo->dest = (struct jpeg_destination_mgr *)
     (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
                                 SIZEOF(my_destination_mgr));
+    dest = (my_dest_ptr) cinfo->dest;
+    dest->mem = NULL;
   }
 
   dest = (my_dest_ptr) cinfo->dest;
 
-  dest->channel = channel;
+  if (dest->mem != NULL) {
+    Ymem_free(dest->mem);
+  }
+  dest->mem = NULL;
+  dest->memlen = 0;
+  dest->memsize = 0;
+  dest->buffer = NULL;
+  dest->bufsize = 0;
 
   dest->pub.init_destination = init_destination;
   dest->pub.empty_output_buffer = empty_output_buffer;
   dest->pub.term_destination = term_destination;
 
+  return dest;
+}
+
+int
+ymaginejpeg_output(j_compress_ptr cinfo, Ychannel *channel)
+{
+  my_dest_ptr dest;
+
+  if (!YchannelWritable(channel)) {
+    return YMAGINE_ERROR;
+  }
+
+  dest = prepare_destination(cinfo);
+  dest->channel = channel;
+
   return YMAGINE_OK;
 }
+
+int
+ymaginejpeg_output_memory(j_compress_ptr cinfo)
+{
+  my_dest_ptr dest;
+
+  dest = prepare_destination(cinfo);
+  dest->channel = NULL;
+
+  return YMAGINE_OK;
+}
+
+const JOCTET*
+ymaginejpeg_output_data(j_compress_ptr cinfo, size_t *length)
+{
+  my_dest_ptr dest = (my_dest_ptr) cinfo->dest;
+
+  if (dest == NULL || dest->channel != NULL) {
+    *length = 0;
+    return NULL;
+  }
+
+  *length = dest->memlen;
+  return dest->mem;
+}
+
+void
+ymaginejpeg_output_release(j_compress_ptr cinfo)
+{
+  my_dest_ptr dest = (my_dest_ptr) cinfo->dest;
+
+  if (dest != NULL && dest->mem != NULL) {
+    Ymem_free(dest->mem);
+    dest->mem = NULL;
+    dest->memlen = 0;
+    dest->memsize = 0;
+  }
+}
@@ -32,6 +32,19 @@ ymaginejpeg_input(j_decompress_ptr cinfo, Ychannel *channel);
 int
 ymaginejpeg_output(j_compress_ptr cinfo, Ychannel *channel);
 
+/* Collect compressed output in memory, instead of writing it to a channel */
+int
+ymaginejpeg_output_memory(j_compress_ptr cinfo);
+
+/* Output collected in memory so far, owned by destination manager */
+const JOCTET*
+ymaginejpeg_output_data(j_compress_ptr cinfo, size_t *length);
+
+/* Release output collected in memory. Must be called before destroying
+   compressor, or it leaks */
+void
+ymaginejpeg_output_release(j_compress_ptr cinfo);
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,232 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#define LOG_TAG "ymagine::limits"
+
+#include "ymagine/ymagine.h"
+#include "ymagine_priv.h"
+
+#include <pthread.h>
+
+/*
+ * Limits are bound to the calling thread by the outermost decode,
+ * transcode or encode call, the same way statistics are, so codecs and
+ * scratch allocators, which don't get the options, can enforce them.
+ */
+
+static pthread_key_t limitsKey;
+static pthread_once_t limitsOnce = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t defaultLock = PTHREAD_MUTEX_INITIALIZER;
+static YmagineLimits defaultLimits = { 0, 0, 0 };
+
+static void
+limitsKeyCreate()
+{
+  pthread_key_create(&limitsKey, NULL);
+}
+
+static YmagineLimitsScope*
+limitsCurrent()
+{
+  pthread_once(&limitsOnce, limitsKeyCreate);
+
+  return (YmagineLimitsScope*) pthread_getspecific(limitsKey);
+}
+
+YmagineFormatOptions*
+YmagineFormatOptions_setLimits(YmagineFormatOptions *options,
+                               const YmagineLimits *limits)
+{
+  if (options == NULL) {
+    return NULL;
+  }
+
+  if (limits == NULL) {
+    options->haslimits = YFALSE;
+  } else {
+    memcpy(&(options->limits), limits, sizeof(YmagineLimits));
+    options->haslimits = YTRUE;
+  }
+
+  return options;
+}
+
+void
+Ymagine_setDefaultLimits(const YmagineLimits *limits)
+{
+  pthread_mutex_lock(&defaultLock);
+  if (limits == NULL) {
+    memset(&defaultLimits, 0, sizeof(YmagineLimits));
+  } else {
+    memcpy(&defaultLimits, limits, sizeof(YmagineLimits));
+  }
+  pthread_mutex_unlock(&defaultLock);
+}
+
+void
+Ymagine_getDefaultLimits(YmagineLimits *limits)
+{
+  if (limits == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&defaultLock);
+  memcpy(limits, &defaultLimits, sizeof(YmagineLimits));
+  pthread_mutex_unlock(&defaultLock);
+}
+
+YBOOL
+YmagineLimitsBegin(YmagineFormatOptions *options, YmagineLimitsScope *scope)
+{
+  if (scope == NULL) {
+    return YFALSE;
+  }
+
+  if (limitsCurrent() != NULL) {
+    /* Nested call, enforced by outer one */
+    return YFALSE;
+  }
+
+  memset(scope, 0, sizeof(YmagineLimitsScope));
+  if (options != NULL && options->haslimits) {
+    memcpy(&(scope->limits), &(options->limits), sizeof(YmagineLimits));
+  } else {
+    Ymagine_getDefaultLimits(&(scope->limits));
+  }
+
+  if (scope->limits.maxpixels <= 0 && scope->limits.maxscratch <= 0 &&
+      scope->limits.maxframes <= 0) {
+    /* Nothing to enforce */
+    return YFALSE;
+  }
+
+  if (pthread_setspecific(limitsKey, scope) != 0) {
+    return YFALSE;
+  }
+
+  return YTRUE;
+}
+
+int
+YmagineLimitsEnd(YmagineLimitsScope *scope, int rc)
+{
+  if (scope == NULL) {
+    return rc;
+  }
+
+  pthread_setspecific(limitsKey, NULL);
+
+  if (rc != YMAGINE_OK && scope->exceeded) {
+    rc = YMAGINE_ERROR_LIMIT;
+  }
+
+  return rc;
+}
+
+int
+YmagineLimitsCheck(int width, int height, int frames, int64_t outbytes)
+{
+  YmagineLimitsScope *scope;
+  YmagineLimits *limits;
+
+  scope = limitsCurrent();
+  if (scope == NULL) {
+    return YMAGINE_OK;
+  }
+  limits = &(scope->limits);
+
+  if (limits->maxpixels > 0 &&
+      ((int64_t) width) * ((int64_t) height) > limits->maxpixels) {
+    ALOGD("image %dx%d exceeds %lld pixels limit", width, height,
+          (long long) limits->maxpixels);
+    scope->exceeded = YTRUE;
+    return YMAGINE_ERROR_LIMIT;
+  }
+
+  if (limits->maxframes > 0 && frames > limits->maxframes) {
+    ALOGD("image exceeds %d frames limit", limits->maxframes);
+    scope->exceeded = YTRUE;
+    return YMAGINE_ERROR_LIMIT;
+  }
+
+  if (limits->maxscratch > 0 && scope->scratch + outbytes > limits->maxscratch) {
+    ALOGD("output of %lld bytes exceeds %lld bytes limit",
+          (long long) outbytes, (long long) limits->maxscratch);
+    scope->exceeded = YTRUE;
+    return YMAGINE_ERROR_LIMIT;
+  }
+
+  return YMAGINE_OK;
+}
+
+int
+YmagineLimitsReserve(size_t size, YBOOL release)
+{
+  YmagineLimitsScope *scope;
+
+  scope = limitsCurrent();
+  if (scope == NULL || scope->limits.maxscratch <= 0) {
+    return YMAGINE_OK;
+  }
+
+  if (release) {
+    /* Memory may have been reserved before limits got bound */
+    if ((int64_t) size > scope->scratch) {
+      size = (size_t) scope->scratch;
+    }
+    scope->scratch -= (int64_t) size;
+    return YMAGINE_OK;
+  }
+
+  if (scope->scratch + (int64_t) size > scope->limits.maxscratch) {
+    ALOGD("scratch of %lld bytes exceeds %lld bytes limit",
+          (long long) (scope->scratch + size),
+          (long long) scope->limits.maxscratch);
+    scope->exceeded = YTRUE;
+    return YMAGINE_ERROR_LIMIT;
+  }
+  scope->scratch += (int64_t) size;
+
+  return YMAGINE_OK;
+}
+
+int64_t
+YmagineLimitsAvailable()
+{
+  YmagineLimitsScope *scope;
+  int64_t available;
+
+  scope = limitsCurrent();
+  if (scope == NULL || scope->limits.maxscratch <= 0) {
+    return 0;
+  }
+
+  available = scope->limits.maxscratch - scope->scratch;
+  if (available < 1) {
+    /* 0 would mean unlimited */
+    available = 1;
+  }
+
+  return available;
+}
+
+void
+YmagineLimitsExceeded()
+{
+  YmagineLimitsScope *scope;
+
+  scope = limitsCurrent();
+  if (scope != NULL) {
+    scope->exceeded = YTRUE;
+  }
+}
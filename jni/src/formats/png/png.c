@@ -33,6 +33,8 @@
 typedef struct
 {
   Ychannel *channel; /* Input channel */
+  /* libpng reads chunk headers and CRCs a few bytes at a time */
+  YmagineReader reader;
   Vbitmap *bitmap;
 
   int isdirect;
@@ -46,6 +48,9 @@ typedef struct
   int outstride;
   int outformat;
   unsigned char *outbuffer;
+
+  /* Statistics of running call, if collected */
+  YmagineStatsCollector *collector;
 } PNGDec;
 
 /* Assume integer are at least 32 bits */
@@ -123,6 +128,7 @@ static int PNGCheckHeader(const char *header, int len, int *pWidth, int *pHeight
 #if HAVE_PNG
 
 #include "png.h"
+#include "zlib.h"
 
 typedef struct cleanup_info {
   char **data;
@@ -149,6 +155,42 @@ ymagine_png_warning(png_structp png_ptr, png_const_charp error_msg)
   return;
 }
 
+/*
+ * libpng and zlib allocations go through the buffer pool, so row buffers,
+ * inflate windows and deflate state are recycled from one image to the
+ * next instead of being reallocated each time. libpng structs themselves
+ * can not be reset and reused, but their memory can.
+ */
+#if PNG_LIBPNG_VER >= 10500
+typedef png_alloc_size_t ymagine_png_size_t;
+#else
+typedef png_size_t ymagine_png_size_t;
+#endif
+
+static png_voidp
+ymagine_png_malloc(png_structp png_ptr, ymagine_png_size_t size)
+{
+  return (png_voidp) VbitmapPoolAlloc((size_t) size);
+}
+
+static void
+ymagine_png_free(png_structp png_ptr, png_voidp ptr)
+{
+  VbitmapPoolFree(ptr);
+}
+
+static voidpf
+ymagine_zalloc(voidpf opaque, uInt items, uInt size)
+{
+  return (voidpf) VbitmapPoolAlloc(((size_t) items) * size);
+}
+
+static void
+ymagine_zfree(voidpf opaque, voidpf ptr)
+{
+  VbitmapPoolFree(ptr);
+}
+
 static void
 ymagine_png_read(png_structp png_ptr, png_bytep data, png_size_t length)
 {
@@ -157,7 +199,7 @@ ymagine_png_read(png_structp png_ptr, png_bytep data, png_size_t length)
 
   dec = (PNGDec*) png_get_progressive_ptr(png_ptr);
   if (dec != NULL) {
-    check = YchannelRead(dec->channel, data, (int) length);
+    check = YmagineReaderRead(&(dec->reader), data, (int) length);
   }
   if (check != (int) length) {
     png_error(png_ptr, "Read Error");
@@ -167,13 +209,564 @@ ymagine_png_read(png_structp png_ptr, png_bytep data, png_size_t length)
 static YINLINE void
 ymagine_png_write(png_structp png_ptr, png_bytep data, png_size_t length)
 {
-  Ychannel *channel = (Ychannel*) png_get_progressive_ptr(png_ptr);
+  YmagineWriter *writer = (YmagineWriter*) png_get_progressive_ptr(png_ptr);
+
+  if (YmagineWriterWrite(writer, (const char *) data, (int) length) != (int) length) {
+    png_error(png_ptr, "Write Error");
+  }
+}
+
+static void
+ymagine_png_flush(png_structp png_ptr)
+{
+  YmagineWriter *writer = (YmagineWriter*) png_get_progressive_ptr(png_ptr);
 
-  if (YchannelWrite(channel, (const char *) data, (int) length) != length) {
+  if (YmagineWriterFlush(writer) != YMAGINE_OK) {
     png_error(png_ptr, "Write Error");
   }
 }
 
+typedef struct {
+  int level;
+  int strategy;
+  int windowbits;
+  int filters;
+} PNGCompression;
+
+/*
+ * Select zlib and row filter settings for encoder. Explicit options take
+ * precedence, others are derived from the effort requested through accuracy
+ * (or quality when accuracy is not set). Settings left negative mean
+ * libpng defaults.
+ */
+static void
+PNGGetCompression(YmagineFormatOptions *options, PNGCompression *compression)
+{
+  int effort = -1;
+
+  compression->level = -1;
+  compression->strategy = YMAGINE_ZSTRATEGY_AUTO;
+  compression->windowbits = -1;
+  compression->filters = YMAGINE_PNG_FILTER_AUTO;
+
+  if (options == NULL) {
+    return;
+  }
+
+  if (options->accuracy >= 0) {
+    effort = options->accuracy;
+  } else if (options->quality >= 0) {
+    effort = options->quality;
+  }
+  if (effort > 100) {
+    effort = 100;
+  }
+
+  if (effort >= 0) {
+    /* Fastest settings use a single cheap filter and run-length matching,
+       highest ones let libpng pick among all filters for each row */
+    compression->level = 1 + (effort * 8) / 100;
+    if (effort < 10) {
+      compression->strategy = YMAGINE_ZSTRATEGY_RLE;
+    }
+    if (effort < 30) {
+      compression->filters = YMAGINE_PNG_FILTER_SUB;
+    } else if (effort < 70) {
+      compression->filters = YMAGINE_PNG_FILTER_SUB | YMAGINE_PNG_FILTER_PAETH;
+    } else {
+      compression->filters = YMAGINE_PNG_FILTER_ALL;
+    }
+  }
+
+  if (options->compression >= 0) {
+    compression->level = options->compression;
+  }
+  if (options->zstrategy >= 0) {
+    compression->strategy = options->zstrategy;
+  }
+  if (options->zwindowbits >= 8) {
+    compression->windowbits = options->zwindowbits;
+  }
+  if (options->pngfilters >= 0) {
+    compression->filters = options->pngfilters;
+  }
+}
+
+static int
+PNGZlibStrategy(int strategy, int filters)
+{
+  switch (strategy) {
+  case YMAGINE_ZSTRATEGY_DEFAULT:
+    return Z_DEFAULT_STRATEGY;
+  case YMAGINE_ZSTRATEGY_FILTERED:
+    return Z_FILTERED;
+  case YMAGINE_ZSTRATEGY_HUFFMAN:
+    return Z_HUFFMAN_ONLY;
+  case YMAGINE_ZSTRATEGY_RLE:
+    return Z_RLE;
+  default:
+    /* Same choice as libpng */
+    return (filters == YMAGINE_PNG_FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+  }
+}
+
+static void
+PNGSetCompression(png_structp png_ptr, const PNGCompression *compression)
+{
+  if (compression->level >= 0) {
+    png_set_compression_level(png_ptr, compression->level);
+  }
+  if (compression->strategy >= 0) {
+    png_set_compression_strategy(png_ptr,
+                                 PNGZlibStrategy(compression->strategy,
+                                                 compression->filters));
+  }
+  if (compression->windowbits >= 8) {
+    png_set_compression_window_bits(png_ptr, compression->windowbits);
+  }
+  if (compression->filters > 0) {
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, compression->filters);
+  }
+}
+
+/*
+ * Parallel deflate, in the pigz style. Rows are split in chunks of about
+ * PNG_PARALLEL_CHUNK_SIZE bytes, each filtered and compressed into raw
+ * deflate data by a worker thread. Chunks but the last one end with a sync
+ * flush, so their outputs concatenate into a single zlib stream. To keep
+ * compression ratio close to serial encoding, each chunk is primed with the
+ * filtered data preceding it as preset dictionary. Filtering is recomputed
+ * by the worker, since filter choice for a row only depends on the raw
+ * pixels of this row and the previous one.
+ */
+#define PNG_PARALLEL_CHUNK_SIZE (128*1024)
+#define PNG_PARALLEL_MAX_THREADS 16
+
+static png_byte png_IDAT[5] = { 73,  68,  65,  84, '\0'};
+static png_byte png_IEND[5] = { 73,  69,  78,  68, '\0'};
+
+typedef struct {
+  const unsigned char *pixels;
+  int pitch;
+  int height;
+  int bpp;
+  /* Size of a filtered row, including filter type byte */
+  int rowbytes;
+  int level;
+  int strategy;
+  int windowbits;
+  int filters;
+} PNGParallelImage;
+
+typedef struct {
+  int firstrow;
+  int nrows;
+  int last;
+  unsigned char *out;
+  int outlen;
+  uLong adler;
+  int status;
+} PNGParallelChunk;
+
+typedef struct {
+  pthread_t thread;
+  const PNGParallelImage *image;
+  PNGParallelChunk *chunks;
+  int nchunks;
+  int first;
+  int step;
+} PNGParallelWorker;
+
+static YINLINE int
+PNGPaeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = p > a ? p - a : a - p;
+  int pb = p > b ? p - b : b - p;
+  int pc = p > c ? p - c : c - p;
+
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  if (pb <= pc) {
+    return b;
+  }
+  return c;
+}
+
+/* Apply filter to one row, returning sum of absolute values of output
+   bytes taken as signed, i.e. the heuristic libpng uses to pick filters */
+static YOPTIMIZE_SPEED int
+PNGFilterApply(int type, const unsigned char *cur, const unsigned char *prev,
+               int len, int bpp, unsigned char *out)
+{
+  int i;
+  int v;
+  int sum = 0;
+
+  out[0] = (unsigned char) type;
+  out++;
+
+  for (i = 0; i < len; i++) {
+    int left = (i >= bpp) ? cur[i - bpp] : 0;
+    int up = prev[i];
+    int upleft = (i >= bpp) ? prev[i - bpp] : 0;
+
+    switch (type) {
+    case PNG_FILTER_VALUE_SUB:
+      v = cur[i] - left;
+      break;
+    case PNG_FILTER_VALUE_UP:
+      v = cur[i] - up;
+      break;
+    case PNG_FILTER_VALUE_AVG:
+      v = cur[i] - ((left + up) >> 1);
+      break;
+    case PNG_FILTER_VALUE_PAETH:
+      v = cur[i] - PNGPaeth(left, up, upleft);
+      break;
+    default:
+      v = cur[i];
+      break;
+    }
+
+    v &= 0xff;
+    out[i] = (unsigned char) v;
+    sum += (v < 128) ? v : 256 - v;
+  }
+
+  return sum;
+}
+
+/* Filter row y into out, using trial as scratch when several filters are
+   allowed */
+static void
+PNGFilterRow(const PNGParallelImage *image, int y, const unsigned char *zero,
+             unsigned char *out, unsigned char *trial)
+{
+  const unsigned char *cur = image->pixels + y * image->pitch;
+  const unsigned char *prev = (y > 0) ? cur - image->pitch : zero;
+  int len = image->rowbytes - 1;
+  int best = -1;
+  int type;
+  int sum;
+
+  for (type = PNG_FILTER_VALUE_NONE; type <= PNG_FILTER_VALUE_PAETH; type++) {
+    if ((image->filters & (PNG_FILTER_NONE << type)) == 0) {
+      continue;
+    }
+    if (best < 0) {
+      best = PNGFilterApply(type, cur, prev, len, image->bpp, out);
+    } else {
+      sum = PNGFilterApply(type, cur, prev, len, image->bpp, trial);
+      if (sum < best) {
+        best = sum;
+        memcpy(out, trial, image->rowbytes);
+      }
+    }
+  }
+}
+
+static int
+PNGCompressChunk(const PNGParallelImage *image, PNGParallelChunk *chunk)
+{
+  z_stream strm;
+  unsigned char *zero = NULL;
+  unsigned char *rowbuf = NULL;
+  unsigned char *dict = NULL;
+  uLong bound;
+  int y;
+  int flush;
+  int zrc;
+  int rc = YMAGINE_ERROR;
+
+  memset(&strm, 0, sizeof(strm));
+  strm.zalloc = ymagine_zalloc;
+  strm.zfree = ymagine_zfree;
+  if (deflateInit2(&strm, image->level, Z_DEFLATED, -image->windowbits,
+                   8, image->strategy) != Z_OK) {
+    return YMAGINE_ERROR;
+  }
+
+  zero = Ymem_calloc(1, image->rowbytes);
+  rowbuf = Ymem_malloc(2 * image->rowbytes);
+  if (zero == NULL || rowbuf == NULL) {
+    goto cleanup;
+  }
+
+  if (chunk->firstrow > 0) {
+    int dictsize = 1 << image->windowbits;
+    int dictrows = (dictsize + image->rowbytes - 1) / image->rowbytes;
+    int dictfirst = chunk->firstrow - dictrows;
+    int dictlen;
+
+    if (dictfirst < 0) {
+      dictfirst = 0;
+    }
+    dictlen = (chunk->firstrow - dictfirst) * image->rowbytes;
+    dict = Ymem_malloc(dictlen);
+    if (dict == NULL) {
+      goto cleanup;
+    }
+    for (y = dictfirst; y < chunk->firstrow; y++) {
+      PNGFilterRow(image, y, zero, dict + (y - dictfirst) * image->rowbytes,
+                   rowbuf + image->rowbytes);
+    }
+    if (dictlen > dictsize) {
+      deflateSetDictionary(&strm, dict + dictlen - dictsize, dictsize);
+    } else {
+      deflateSetDictionary(&strm, dict, dictlen);
+    }
+  }
+
+  /* Margin for the sync flush marker and block headers */
+  bound = deflateBound(&strm, (uLong) chunk->nrows * image->rowbytes) + 64;
+  chunk->out = Ymem_malloc(bound);
+  if (chunk->out == NULL) {
+    goto cleanup;
+  }
+
+  strm.next_out = chunk->out;
+  strm.avail_out = (uInt) bound;
+  chunk->adler = adler32(0L, Z_NULL, 0);
+
+  for (y = 0; y < chunk->nrows; y++) {
+    PNGFilterRow(image, chunk->firstrow + y, zero, rowbuf,
+                 rowbuf + image->rowbytes);
+    chunk->adler = adler32(chunk->adler, rowbuf, image->rowbytes);
+
+    if (y < chunk->nrows - 1) {
+      flush = Z_NO_FLUSH;
+    } else {
+      flush = chunk->last ? Z_FINISH : Z_SYNC_FLUSH;
+    }
+
+    strm.next_in = rowbuf;
+    strm.avail_in = image->rowbytes;
+    zrc = deflate(&strm, flush);
+    if (zrc == Z_STREAM_ERROR || strm.avail_in != 0 || strm.avail_out == 0) {
+      goto cleanup;
+    }
+    if (flush == Z_FINISH && zrc != Z_STREAM_END) {
+      goto cleanup;
+    }
+  }
+
+  chunk->outlen = (int) (bound - strm.avail_out);
+  rc = YMAGINE_OK;
+
+cleanup:
+  deflateEnd(&strm);
+  if (dict != NULL) {
+    Ymem_free(dict);
+  }
+  if (rowbuf != NULL) {
+    Ymem_free(rowbuf);
+  }
+  if (zero != NULL) {
+    Ymem_free(zero);
+  }
+
+  return rc;
+}
+
+static void*
+PNGParallelRun(void *ptr)
+{
+  PNGParallelWorker *worker = (PNGParallelWorker*) ptr;
+  int i;
+
+  for (i = worker->first; i < worker->nchunks; i += worker->step) {
+    worker->chunks[i].status = PNGCompressChunk(worker->image,
+                                                &worker->chunks[i]);
+  }
+
+  return NULL;
+}
+
+static int
+PNGParallelThreads(YmagineFormatOptions *options)
+{
+  int nthreads;
+
+  if (options == NULL) {
+    return 1;
+  }
+
+  nthreads = options->threads;
+  if (nthreads == 0) {
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > PNG_PARALLEL_MAX_THREADS) {
+    nthreads = PNG_PARALLEL_MAX_THREADS;
+  }
+
+  return nthreads;
+}
+
+static void
+PNGParallelFree(PNGParallelChunk *chunks, int nchunks)
+{
+  int i;
+
+  if (chunks == NULL) {
+    return;
+  }
+
+  for (i = 0; i < nchunks; i++) {
+    if (chunks[i].out != NULL) {
+      Ymem_free(chunks[i].out);
+    }
+  }
+  Ymem_free(chunks);
+}
+
+/*
+ * Filter and compress whole image with nthreads workers. On success,
+ * returns the array of compressed chunks, to be written with
+ * PNGParallelWrite() then released with PNGParallelFree().
+ */
+static PNGParallelChunk*
+PNGParallelCompress(PNGParallelImage *image, const PNGCompression *compression,
+                    int nthreads, int *pnchunks)
+{
+  PNGParallelChunk *chunks;
+  PNGParallelWorker workers[PNG_PARALLEL_MAX_THREADS];
+  int chunkrows;
+  int nchunks;
+  int nstarted;
+  int i;
+  int rc = YMAGINE_OK;
+
+  image->level = compression->level >= 0 ? compression->level : 6;
+  image->windowbits = compression->windowbits >= 8 ? compression->windowbits : 15;
+  image->filters = compression->filters > 0 ? compression->filters : YMAGINE_PNG_FILTER_ALL;
+  image->strategy = PNGZlibStrategy(compression->strategy, image->filters);
+
+  chunkrows = PNG_PARALLEL_CHUNK_SIZE / image->rowbytes;
+  if (chunkrows < 1) {
+    chunkrows = 1;
+  }
+  nchunks = (image->height + chunkrows - 1) / chunkrows;
+  if (nchunks < 2) {
+    /* Not worth it */
+    return NULL;
+  }
+  if (nthreads > nchunks) {
+    nthreads = nchunks;
+  }
+
+  chunks = Ymem_calloc(nchunks, sizeof(PNGParallelChunk));
+  if (chunks == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < nchunks; i++) {
+    chunks[i].firstrow = i * chunkrows;
+    chunks[i].nrows = chunkrows;
+    if (chunks[i].firstrow + chunks[i].nrows > image->height) {
+      chunks[i].nrows = image->height - chunks[i].firstrow;
+    }
+    chunks[i].last = (i == nchunks - 1);
+    chunks[i].status = YMAGINE_ERROR;
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    workers[i].image = image;
+    workers[i].chunks = chunks;
+    workers[i].nchunks = nchunks;
+    workers[i].first = i;
+    workers[i].step = nthreads;
+  }
+
+  /* Calling thread takes its share of the work as first worker, and the
+     one of any worker which failed to start */
+  for (nstarted = 1; nstarted < nthreads; nstarted++) {
+    if (pthread_create(&workers[nstarted].thread, NULL,
+                       PNGParallelRun, &workers[nstarted]) != 0) {
+      break;
+    }
+  }
+  PNGParallelRun(&workers[0]);
+  for (i = nstarted; i < nthreads; i++) {
+    PNGParallelRun(&workers[i]);
+  }
+  for (i = 1; i < nstarted; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  for (i = 0; i < nchunks; i++) {
+    if (chunks[i].status != YMAGINE_OK) {
+      rc = YMAGINE_ERROR;
+      break;
+    }
+  }
+  if (rc != YMAGINE_OK) {
+    PNGParallelFree(chunks, nchunks);
+    return NULL;
+  }
+
+  *pnchunks = nchunks;
+  return chunks;
+}
+
+/* Write compressed chunks as a single IDAT, wrapped into a zlib stream */
+static void
+PNGParallelWrite(png_structp png_ptr, const PNGParallelImage *image,
+                 const PNGParallelChunk *chunks, int nchunks)
+{
+  unsigned char header[2];
+  unsigned char trailer[4];
+  unsigned int cmf;
+  unsigned int flg;
+  uLong adler;
+  png_uint_32 length;
+  int i;
+
+  cmf = ((image->windowbits - 8) << 4) | Z_DEFLATED;
+  if (image->level < 2 || image->strategy == Z_HUFFMAN_ONLY ||
+      image->strategy == Z_RLE) {
+    flg = 0;
+  } else if (image->level < 6) {
+    flg = 1;
+  } else if (image->level == 6) {
+    flg = 2;
+  } else {
+    flg = 3;
+  }
+  flg <<= 6;
+  flg += 31 - (((cmf << 8) | flg) % 31);
+  header[0] = (unsigned char) cmf;
+  header[1] = (unsigned char) flg;
+
+  length = sizeof(header) + sizeof(trailer);
+  adler = chunks[0].adler;
+  for (i = 0; i < nchunks; i++) {
+    length += chunks[i].outlen;
+    if (i > 0) {
+      adler = adler32_combine(adler, chunks[i].adler,
+                              (z_off_t) chunks[i].nrows * image->rowbytes);
+    }
+  }
+
+  trailer[0] = (unsigned char) ((adler >> 24) & 0xff);
+  trailer[1] = (unsigned char) ((adler >> 16) & 0xff);
+  trailer[2] = (unsigned char) ((adler >> 8) & 0xff);
+  trailer[3] = (unsigned char) (adler & 0xff);
+
+  png_write_chunk_start(png_ptr, png_IDAT, length);
+  png_write_chunk_data(png_ptr, header, sizeof(header));
+  for (i = 0; i < nchunks; i++) {
+    png_write_chunk_data(png_ptr, chunks[i].out, chunks[i].outlen);
+  }
+  png_write_chunk_data(png_ptr, trailer, sizeof(trailer));
+  png_write_chunk_end(png_ptr);
+
+  png_write_chunk(png_ptr, png_IEND, NULL, 0);
+}
+
 static int
 PNGInit(PNGDec* pSrc, Ychannel *f, Vbitmap *bitmap)
 {
@@ -182,8 +775,9 @@ PNGInit(PNGDec* pSrc, Ychannel *f, Vbitmap *bitmap)
   
   pSrc->bitmap = bitmap;
   pSrc->channel = f;
+  pSrc->collector = YmagineStatsCurrent();
 
-  return YMAGINE_OK;
+  return YmagineReaderInit(&(pSrc->reader), f);
 }
 
 static void
@@ -192,6 +786,269 @@ PNGFini(PNGDec* pPNG)
   if (pPNG==NULL) {
     return;
   }
+
+  YmagineReaderRelease(&(pPNG->reader));
+}
+
+/*
+ * Adam7 interlacing. Without libpng interlace handling, each pass is read
+ * as a reduced image, whose pixels are spread over the full image with
+ * the following pattern.
+ */
+#define PNG_ADAM7_PASSES 7
+
+static const int adam7RowStart[PNG_ADAM7_PASSES] = { 0, 0, 4, 0, 2, 0, 1 };
+static const int adam7RowInc[PNG_ADAM7_PASSES]   = { 8, 8, 8, 4, 4, 2, 2 };
+static const int adam7ColStart[PNG_ADAM7_PASSES] = { 0, 4, 0, 2, 0, 1, 0 };
+static const int adam7ColInc[PNG_ADAM7_PASSES]   = { 8, 8, 4, 4, 2, 2, 1 };
+
+/* Spacing of the regular grid of pixels available after each pass */
+static const int adam7ColSpacing[PNG_ADAM7_PASSES] = { 8, 4, 4, 2, 2, 1, 1 };
+static const int adam7RowSpacing[PNG_ADAM7_PASSES] = { 8, 8, 4, 4, 2, 2, 1 };
+
+static int
+PNGPassRows(int height, int pass)
+{
+  if (height <= adam7RowStart[pass]) {
+    return 0;
+  }
+  return (height - adam7RowStart[pass] + adam7RowInc[pass] - 1) / adam7RowInc[pass];
+}
+
+static int
+PNGPassCols(int width, int pass)
+{
+  if (width <= adam7ColStart[pass]) {
+    return 0;
+  }
+  return (width - adam7ColStart[pass] + adam7ColInc[pass] - 1) / adam7ColInc[pass];
+}
+
+/*
+ * Accumulate pixels of an interlaced image directly at output resolution.
+ * Each output pixel is the average of the input pixels of the region it
+ * covers, so memory only depends on output size, and rows can be added
+ * in the order passes deliver them.
+ */
+typedef struct {
+  int destwidth;
+  int destheight;
+  /* Output column (resp. row) of each input column (resp. row), -1 if
+     outside of the region to decode */
+  int *xmap;
+  int *ymap;
+  /* Number of input columns (resp. rows) merged in each output one */
+  int *colcount;
+  int *rowcount;
+  uint32_t *sums;
+} PNGAccumulator;
+
+static void
+PNGAccumulatorFini(PNGAccumulator *acc)
+{
+  if (acc->xmap != NULL) {
+    Ymem_free(acc->xmap);
+    acc->xmap = NULL;
+  }
+  if (acc->ymap != NULL) {
+    Ymem_free(acc->ymap);
+    acc->ymap = NULL;
+  }
+  if (acc->colcount != NULL) {
+    Ymem_free(acc->colcount);
+    acc->colcount = NULL;
+  }
+  if (acc->rowcount != NULL) {
+    Ymem_free(acc->rowcount);
+    acc->rowcount = NULL;
+  }
+  if (acc->sums != NULL) {
+    Ymem_free(acc->sums);
+    acc->sums = NULL;
+  }
+}
+
+static void
+PNGAccumulatorMap(int *map, int *count, int size,
+                  int srcstart, int srcsize, int destsize, int spacing)
+{
+  int i;
+  int d;
+
+  for (i = 0; i < destsize; i++) {
+    count[i] = 0;
+  }
+  for (i = 0; i < size; i++) {
+    if (i < srcstart || i >= srcstart + srcsize) {
+      map[i] = -1;
+    } else {
+      d = (int) ((((int64_t) (i - srcstart)) * destsize) / srcsize);
+      map[i] = d;
+      /* Only pixels on the grid of decoded passes contribute */
+      if ((i % spacing) == 0) {
+        count[d]++;
+      }
+    }
+  }
+}
+
+static int
+PNGAccumulatorInit(PNGAccumulator *acc, int width, int height,
+                   const Vrect *srcrect, int destwidth, int destheight,
+                   int passes)
+{
+  memset(acc, 0, sizeof(PNGAccumulator));
+
+  acc->destwidth = destwidth;
+  acc->destheight = destheight;
+
+  acc->xmap = Ymem_malloc(width * sizeof(int));
+  acc->ymap = Ymem_malloc(height * sizeof(int));
+  acc->colcount = Ymem_malloc(destwidth * sizeof(int));
+  acc->rowcount = Ymem_malloc(destheight * sizeof(int));
+  acc->sums = Ymem_calloc(destwidth * destheight * 4, sizeof(uint32_t));
+
+  if (acc->xmap == NULL || acc->ymap == NULL ||
+      acc->colcount == NULL || acc->rowcount == NULL || acc->sums == NULL) {
+    PNGAccumulatorFini(acc);
+    return YMAGINE_ERROR;
+  }
+
+  PNGAccumulatorMap(acc->xmap, acc->colcount, width,
+                    srcrect->x, srcrect->width, destwidth,
+                    adam7ColSpacing[passes - 1]);
+  PNGAccumulatorMap(acc->ymap, acc->rowcount, height,
+                    srcrect->y, srcrect->height, destheight,
+                    adam7RowSpacing[passes - 1]);
+
+  return YMAGINE_OK;
+}
+
+/* Read all rows of one pass, as RGBA, and add them to accumulator */
+static void
+PNGAccumulatePass(png_structp png_ptr, PNGAccumulator *acc,
+                  int width, int height, int pass, unsigned char *rowbuf)
+{
+  int nrows = PNGPassRows(height, pass);
+  int ncols = PNGPassCols(width, pass);
+  int i;
+  int j;
+  int x;
+  int y;
+  int dx;
+  uint32_t *sumrow;
+  uint32_t *sum;
+  const unsigned char *p;
+
+  if (nrows <= 0 || ncols <= 0) {
+    /* libpng skips empty passes */
+    return;
+  }
+
+  for (i = 0; i < nrows; i++) {
+    png_read_row(png_ptr, rowbuf, NULL);
+
+    y = adam7RowStart[pass] + i * adam7RowInc[pass];
+    if (acc->ymap[y] < 0) {
+      continue;
+    }
+
+    sumrow = acc->sums + acc->ymap[y] * acc->destwidth * 4;
+    x = adam7ColStart[pass];
+    p = rowbuf;
+    for (j = 0; j < ncols; j++) {
+      dx = acc->xmap[x];
+      if (dx >= 0) {
+        sum = sumrow + dx * 4;
+        sum[0] += p[0];
+        sum[1] += p[1];
+        sum[2] += p[2];
+        sum[3] += p[3];
+      }
+      x += adam7ColInc[pass];
+      p += 4;
+    }
+  }
+}
+
+/* Compute one output row, as RGBA */
+static void
+PNGAccumulatorRow(PNGAccumulator *acc, int dy, unsigned char *out)
+{
+  const uint32_t *sum = acc->sums + dy * acc->destwidth * 4;
+  uint32_t n;
+  int dx;
+
+  for (dx = 0; dx < acc->destwidth; dx++) {
+    n = (uint32_t) acc->colcount[dx] * (uint32_t) acc->rowcount[dy];
+    if (n <= 1) {
+      out[0] = (unsigned char) sum[0];
+      out[1] = (unsigned char) sum[1];
+      out[2] = (unsigned char) sum[2];
+      out[3] = (unsigned char) sum[3];
+    } else {
+      out[0] = (unsigned char) ((sum[0] + n / 2) / n);
+      out[1] = (unsigned char) ((sum[1] + n / 2) / n);
+      out[2] = (unsigned char) ((sum[2] + n / 2) / n);
+      out[3] = (unsigned char) ((sum[3] + n / 2) / n);
+    }
+    sum += 4;
+    out += 4;
+  }
+}
+
+/*
+ * Number of passes to decode for a preview. Like DCT scaling for JPEG,
+ * when output is 1/2, 1/4 or 1/8 of the input, the first Adam7 passes
+ * already hold at least one pixel for each output one, so decoding can
+ * stop there.
+ */
+static int
+PNGPreviewPasses(const Vrect *srcrect, int destwidth, int destheight)
+{
+  int xratio = srcrect->width / destwidth;
+  int yratio = srcrect->height / destheight;
+  int passes;
+
+  for (passes = 1; passes < PNG_ADAM7_PASSES; passes++) {
+    if (adam7ColSpacing[passes - 1] <= xratio &&
+        adam7RowSpacing[passes - 1] <= yratio) {
+      break;
+    }
+  }
+
+  return passes;
+}
+
+/*
+ * Check if accumulating at output resolution is possible and saves memory
+ * compared to buffering whole interlaced image
+ */
+static int
+PNGAccumulatorSuitable(int width, int height,
+                       const Vrect *srcrect, int destwidth, int destheight)
+{
+  int64_t accsize;
+  int64_t fullsize;
+  int64_t maxsamples;
+
+  if (destwidth <= 0 || destheight <= 0 ||
+      destwidth > srcrect->width || destheight > srcrect->height) {
+    return 0;
+  }
+
+  /* Sums are 32 bits, for at most 255 per sample */
+  maxsamples = ((int64_t) (srcrect->width / destwidth + 1)) *
+    ((int64_t) (srcrect->height / destheight + 1));
+  if (maxsamples > 0xffffffff / 255) {
+    return 0;
+  }
+
+  accsize = ((int64_t) destwidth) * destheight * 4 * sizeof(uint32_t) +
+    ((int64_t) width + height) * sizeof(int);
+  fullsize = ((int64_t) width) * height * 4;
+
+  return accsize < fullsize;
 }
 
 static int
@@ -219,16 +1076,17 @@ PNGDecode(PNGDec* pSrc, Vbitmap *vbitmap,
   unsigned char *data = NULL;
   float sharpen = 0.0f;
   PixelShader *shader = NULL;
+  PNGAccumulator acc;
+  int useacc = 0;
+  int accpasses = PNG_ADAM7_PASSES;
+  nsecs_t start;
 
   if (options == NULL) {
     /* Options argument is mandatory */
     return 0;
   }
 
-  headerlen = YchannelRead(pSrc->channel, (char *) header, sizeof(header));
-  if (headerlen > 0) {
-    YchannelPush(pSrc->channel, (const char*) header, headerlen);
-  }
+  headerlen = YmagineIOPeek(pSrc->channel, (char *) header, sizeof(header));
 
   /* Check PNG header */
   if (headerlen < PNG_HEADER_SIZE) {
@@ -282,10 +1140,28 @@ PNGDecode(PNGDec* pSrc, Vbitmap *vbitmap,
   /* Default to error, set return code to OK only if decoding completes */
   rc = YMAGINE_ERROR;
 
+  /* For interlaced images (interlace method is last byte of IHDR), prefer
+     accumulating passes at output resolution to buffering the full image */
+  if (header[PNG_HEADER_SIZE - 1] == PNG_INTERLACE_ADAM7 &&
+      PNGAccumulatorSuitable(origWidth, origHeight, &srcrect,
+                             destrect.width, destrect.height)) {
+    /* Unless high quality is requested, only decode the early passes
+       needed for output size */
+    if (YmagineFormatOptions_normalizeQuality(options) < 90) {
+      accpasses = PNGPreviewPasses(&srcrect, destrect.width, destrect.height);
+    }
+    if (PNGAccumulatorInit(&acc, origWidth, origHeight, &srcrect,
+                           destrect.width, destrect.height,
+                           accpasses) == YMAGINE_OK) {
+      useacc = 1;
+    }
+  }
+
   cleanup.data = NULL;
-  png_ptr= png_create_read_struct(PNG_LIBPNG_VER_STRING,
-                                  (png_voidp) &cleanup,
-                                  ymagine_png_error,ymagine_png_warning);
+  png_ptr= png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+                                    (png_voidp) &cleanup,
+                                    ymagine_png_error,ymagine_png_warning,
+                                    NULL, ymagine_png_malloc, ymagine_png_free);
   if (png_ptr != NULL) {
     png_set_read_fn(png_ptr, pSrc, ymagine_png_read);
   }
@@ -310,7 +1186,9 @@ PNGDecode(PNGDec* pSrc, Vbitmap *vbitmap,
     rc = YMAGINE_ERROR;
   } else {
     /* png_set_sib_bytes(png_ptr,8); */
+    start = YMAGINE_STATS_NOW(pSrc->collector);
     png_read_info(png_ptr,info_ptr);
+    YMAGINE_STATS_TIME(pSrc->collector, parse, start);
     png_get_IHDR(png_ptr, info_ptr,
                  &info_width, &info_height,
                  &bit_depth,&color_type, &interlace_type,
@@ -361,7 +1239,12 @@ PNGDecode(PNGDec* pSrc, Vbitmap *vbitmap,
 
 
     /* Get number of passes (1 if not interlaced, 7 for Adam7 */
-    passes = png_set_interlace_handling (png_ptr);
+    if (useacc) {
+      /* Passes are read one after the other as reduced images */
+      passes = PNG_ADAM7_PASSES;
+    } else {
+      passes = png_set_interlace_handling (png_ptr);
+    }
 #ifdef YMAGINE_PNG_GAMMA
     if (png_get_sRGB && png_setsRGB) {
       if (png_get_sRGB(png_ptr, info_ptr, &intent)) {
@@ -407,15 +1290,27 @@ PNGDecode(PNGDec* pSrc, Vbitmap *vbitmap,
       int pass;
 
       TransformerSetMode(transformer, VBITMAP_COLOR_RGBA, VBITMAP_COLOR_RGBA);
-      TransformerSetScale(transformer, info_width, info_height, destrect.width, destrect.height);
-      TransformerSetRegion(transformer,
-                           srcrect.x, srcrect.y, srcrect.width, srcrect.height);
+      if (useacc) {
+        /* Rows are already scaled and cropped by accumulator */
+        TransformerSetScale(transformer, destrect.width, destrect.height,
+                            destrect.width, destrect.height);
+        TransformerSetRegion(transformer, 0, 0, destrect.width, destrect.height);
+      } else {
+        TransformerSetScale(transformer, info_width, info_height, destrect.width, destrect.height);
+        TransformerSetRegion(transformer,
+                             srcrect.x, srcrect.y, srcrect.width, srcrect.height);
+      }
 
       TransformerSetBitmap(transformer, vbitmap, destrect.x, destrect.y);
       TransformerSetShader(transformer, shader);
       TransformerSetSharpen(transformer, sharpen);
+      YmagineThemePrepare(options, transformer);
+      YmagineComposePrepare(options, transformer);
 
-      if (passes == 1) {
+      if (useacc) {
+        /* Single row, large enough for any pass and for output */
+        nrows = 1;
+      } else if (passes == 1) {
         /* Max memory to allocate for intermediate buffer */
         nrows = getWorkingBufferSize() / pitch;
         if (nrows > info_height) {
@@ -428,9 +1323,31 @@ PNGDecode(PNGDec* pSrc, Vbitmap *vbitmap,
         nrows = info_height;
       }
 
-      data = (unsigned char*) Ymem_malloc(nrows * pitch);
-      if (data != NULL) {
-        png_data = (unsigned char **) Ymem_malloc(nrows * sizeof(char*));
+      /* Working rows are released together with transformer */
+      data = (unsigned char*) TransformerScratch(transformer, nrows * pitch);
+      if (data != NULL && useacc) {
+        start = YMAGINE_STATS_NOW(pSrc->collector);
+        for (pass = 0; pass < accpasses; pass++) {
+          PNGAccumulatePass(png_ptr, &acc, info_width, info_height, pass, data);
+        }
+        YMAGINE_STATS_TIME(pSrc->collector, decode, start);
+        for (ypos = 0; ypos < destrect.height; ypos++) {
+          PNGAccumulatorRow(&acc, ypos, data);
+          if (TransformerPush(transformer, (const char*) data) != YMAGINE_OK) {
+            ymagine_png_error(png_ptr, "push failed");
+          }
+        }
+
+        /* Remaining passes, if any, are never read */
+        if (accpasses == passes) {
+          start = YMAGINE_STATS_NOW(pSrc->collector);
+          png_read_end(png_ptr, NULL);
+          YMAGINE_STATS_TIME(pSrc->collector, decode, start);
+        }
+        rc = YMAGINE_OK;
+      } else if (data != NULL) {
+        png_data = (unsigned char **) TransformerScratch(transformer,
+                                                         nrows * sizeof(char*));
         if (png_data != NULL) {
           int j;
           int reqrows;
@@ -449,7 +1366,9 @@ PNGDecode(PNGDec* pSrc, Vbitmap *vbitmap,
               if (reqrows <= 0) {
                 break;
               }
+              start = YMAGINE_STATS_NOW(pSrc->collector);
               png_read_rows(png_ptr, png_data, NULL, reqrows);
+              YMAGINE_STATS_TIME(pSrc->collector, decode, start);
               for (j = 0; j < reqrows; j++) {
                 /* Last pass, decoding for those lines is completed */
                 if (pass == passes - 1) {
@@ -462,7 +1381,9 @@ PNGDecode(PNGDec* pSrc, Vbitmap *vbitmap,
             }
           }
 
+          start = YMAGINE_STATS_NOW(pSrc->collector);
           png_read_end(png_ptr, NULL);
+          YMAGINE_STATS_TIME(pSrc->collector, decode, start);
           rc = YMAGINE_OK;
         }
       }
@@ -470,15 +1391,11 @@ PNGDecode(PNGDec* pSrc, Vbitmap *vbitmap,
   }
 
   /* Clean up */
-  if (png_data != NULL) {
-    Ymem_free(png_data);
-    png_data = NULL;
-  }
-  if (data != NULL) {
-    Ymem_free(data);
-    data = NULL;
+  if (useacc) {
+    PNGAccumulatorFini(&acc);
   }
   if (transformer != NULL) {
+    YmagineThemeCollect(options, transformer);
     TransformerRelease(transformer);
   }
   if (png_ptr != NULL) {
@@ -547,12 +1464,19 @@ encodePNG(Vbitmap *vbitmap, Ychannel *channelout, YmagineFormatOptions *options)
   png_infop info_ptr;
   int interlace;
   unsigned char **png_data = NULL;
+  PNGCompression compression;
+  PNGParallelImage image;
+  PNGParallelChunk *chunks = NULL;
+  int nchunks = 0;
+  int nthreads;
+  YmagineWriter writer;
   
   cleanup.data = (char **) NULL;
 
-  png_ptr= png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                                   (png_voidp) &cleanup,
-                                   ymagine_png_error,ymagine_png_warning);
+  png_ptr= png_create_write_struct_2(PNG_LIBPNG_VER_STRING,
+                                     (png_voidp) &cleanup,
+                                     ymagine_png_error,ymagine_png_warning,
+                                     NULL, ymagine_png_malloc, ymagine_png_free);
   if (!png_ptr) {
     return YMAGINE_ERROR;
   }
@@ -564,14 +1488,16 @@ encodePNG(Vbitmap *vbitmap, Ychannel *channelout, YmagineFormatOptions *options)
   }
 
   /* Define custom */
+  YmagineWriterInit(&writer, channelout);
   png_set_write_fn(png_ptr,
-                   (png_voidp) channelout,
-                   ymagine_png_write, (png_voidp) NULL);
+                   (png_voidp) &writer,
+                   ymagine_png_write, ymagine_png_flush);
 
 
   rc = VbitmapLock(vbitmap);
   if (rc != YMAGINE_OK) {
     ALOGE("AndroidBitmap_lockPixels() failed");
+    YmagineWriterRelease(&writer);
     png_destroy_write_struct(&png_ptr, &info_ptr);
     return YMAGINE_ERROR;
   }
@@ -586,6 +1512,25 @@ encodePNG(Vbitmap *vbitmap, Ychannel *channelout, YmagineFormatOptions *options)
 
   png_data = (unsigned char **) Ymem_malloc(height * sizeof(char*));
 
+  if (options != NULL && options->progressive > 0) {
+    interlace = PNG_INTERLACE_ADAM7;
+  } else {
+    interlace = PNG_INTERLACE_NONE;
+  }
+
+  PNGGetCompression(options, &compression);
+
+  nthreads = PNGParallelThreads(options);
+  if (nthreads > 1 && interlace == PNG_INTERLACE_NONE && pixels != NULL) {
+    /* Compress ahead of writing, so failure can fall back to libpng */
+    image.pixels = pixels;
+    image.pitch = pitch;
+    image.height = height;
+    image.bpp = bpp;
+    image.rowbytes = width * bpp + 1;
+    chunks = PNGParallelCompress(&image, &compression, nthreads, &nchunks);
+  }
+
   if (setjmp(*(jmp_buf *)png_ptr)) {
   } else {
     if (png_data != NULL) {
@@ -604,31 +1549,36 @@ encodePNG(Vbitmap *vbitmap, Ychannel *channelout, YmagineFormatOptions *options)
         }
       }
 
-      if (options != NULL && options->progressive > 0) {
-        interlace = PNG_INTERLACE_ADAM7;
-      } else {
-        interlace = PNG_INTERLACE_NONE;
-      }
-
       png_set_IHDR(png_ptr, info_ptr, width, height, 8, color_type,
                    interlace, PNG_COMPRESSION_TYPE_DEFAULT,
                    PNG_FILTER_TYPE_DEFAULT);
+      PNGSetCompression(png_ptr, &compression);
       png_write_info(png_ptr, info_ptr);
 
-      number_passes = png_set_interlace_handling(png_ptr);
-      for (pass = 0; pass < number_passes; pass++) {
-        png_write_rows(png_ptr, png_data, height);
+      if (chunks != NULL) {
+        PNGParallelWrite(png_ptr, &image, chunks, nchunks);
+      } else {
+        number_passes = png_set_interlace_handling(png_ptr);
+        for (pass = 0; pass < number_passes; pass++) {
+          png_write_rows(png_ptr, png_data, height);
+        }
+        png_write_end(png_ptr,NULL);
       }
-      png_write_end(png_ptr,NULL);
       rc = YMAGINE_OK;
     }
   }
 
+  if (rc == YMAGINE_OK) {
+    rc = YmagineWriterFlush(&writer);
+  }
+  YmagineWriterRelease(&writer);
+
   VbitmapUnlock(vbitmap);
   png_destroy_write_struct(&png_ptr,&info_ptr);
   if (png_data != NULL) {
     Ymem_free((char *) png_data);
   }
+  PNGParallelFree(chunks, nchunks);
   if (text) {
     Ymem_free((char *) text);
   }
@@ -652,10 +1602,7 @@ matchPNG(Ychannel *channel)
     return YFALSE;
   }
 
-  hlen = YchannelRead(channel, header, sizeof(header));
-  if (hlen > 0) {
-    YchannelPush(channel, header, hlen);
-  }
+  hlen = YmagineIOPeek(channel, header, sizeof(header));
 
   if (PNGCheckHeader(header, hlen, &width, &height) <= 0) {
     return YFALSE;
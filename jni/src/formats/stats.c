@@ -0,0 +1,141 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#define LOG_TAG "ymagine::stats"
+
+#include "ymagine/ymagine.h"
+#include "ymagine_priv.h"
+
+#include <pthread.h>
+
+/*
+ * Statistics are accumulated into a collector bound to the calling thread
+ * by the outermost decode, transcode or encode call, so nested calls
+ * (preview decoding for smart crop, encoding of transcoded bitmap) and
+ * codec I/O callbacks, which don't get the options, add up into it.
+ */
+
+static pthread_key_t statsKey;
+static pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+
+static void
+statsKeyCreate()
+{
+  pthread_key_create(&statsKey, NULL);
+}
+
+YmagineStatsCollector*
+YmagineStatsCurrent()
+{
+  pthread_once(&statsOnce, statsKeyCreate);
+
+  return (YmagineStatsCollector*) pthread_getspecific(statsKey);
+}
+
+YBOOL
+YmagineStatsBegin(YmagineFormatOptions *options, YmagineStatsCollector *collector)
+{
+  if (options == NULL || collector == NULL || !options->statsenabled) {
+    return YFALSE;
+  }
+
+  if (YmagineStatsCurrent() != NULL) {
+    /* Nested call, accounted for by outer one */
+    return YFALSE;
+  }
+
+  memset(collector, 0, sizeof(YmagineStatsCollector));
+  if (pthread_setspecific(statsKey, collector) != 0) {
+    return YFALSE;
+  }
+  collector->start = (nsecs_t) Ytime(YTIME_CLOCK_REALTIME);
+
+  return YTRUE;
+}
+
+void
+YmagineStatsEnd(YmagineFormatOptions *options, YmagineStatsCollector *collector)
+{
+  if (collector == NULL) {
+    return;
+  }
+
+  collector->stats.total = (nsecs_t) Ytime(YTIME_CLOCK_REALTIME) - collector->start;
+  pthread_setspecific(statsKey, NULL);
+
+  if (options != NULL) {
+    memcpy(&(options->stats), &(collector->stats), sizeof(YmagineStats));
+    options->statsvalid = YTRUE;
+  }
+}
+
+YmagineStatsCollector*
+YmagineStatsSuspend()
+{
+  YmagineStatsCollector *collector;
+
+  collector = YmagineStatsCurrent();
+  if (collector != NULL) {
+    pthread_setspecific(statsKey, NULL);
+  }
+
+  return collector;
+}
+
+void
+YmagineStatsResume(YmagineStatsCollector *collector)
+{
+  if (collector != NULL) {
+    pthread_setspecific(statsKey, collector);
+  }
+}
+
+YBOOL
+YmagineStatsCountIO(YBOOL count)
+{
+  YmagineStatsCollector *collector;
+  YBOOL previous;
+
+  collector = YmagineStatsCurrent();
+  if (collector == NULL) {
+    return YTRUE;
+  }
+
+  previous = collector->ioskip ? YFALSE : YTRUE;
+  collector->ioskip = count ? YFALSE : YTRUE;
+
+  return previous;
+}
+
+void
+YmagineStatsScratch(size_t size, YBOOL release)
+{
+  YmagineStatsCollector *collector;
+
+  collector = YmagineStatsCurrent();
+  if (collector == NULL) {
+    return;
+  }
+
+  if (release) {
+    /* Memory may have been acquired before collection started */
+    if (size > collector->scratch) {
+      size = collector->scratch;
+    }
+    collector->scratch -= size;
+  } else {
+    collector->scratch += size;
+    if (collector->scratch > collector->stats.scratchpeak) {
+      collector->stats.scratchpeak = collector->scratch;
+    }
+  }
+}
@@ -36,6 +36,13 @@
 #include "graphics/bitmap.h"
 
 
+/* Parse headers of RIFF container */
+#define WEBP_HEADER_SIZE 16
+#define VP8_HEADER_SIZE 10
+
+/* Number of bytes read ahead to parse image information */
+#define WEBP_INFO_SIZE (WEBP_HEADER_SIZE + 32)
+
 typedef struct
 {
   Ychannel *channel; /* Input channel */
@@ -52,6 +59,21 @@ typedef struct
   int outstride;
   int outformat;
   unsigned char *outbuffer;
+
+  /* Planar YUV 4:2:0 output, when decoding without RGB conversion, and
+     its size reserved against memory limits */
+  unsigned char *yuvbuffer;
+  size_t yuvsize;
+  unsigned char *yplane;
+  unsigned char *uplane;
+  unsigned char *vplane;
+  int ystride;
+  int uvstride;
+  int uvheight;
+
+  unsigned char header[WEBP_INFO_SIZE];
+  int headerlen;
+  int contentsize;
 } WEBPDec;
 
 #if HAVE_WEBP
@@ -78,10 +100,6 @@ static unsigned int getInt32L(const void *in) {
   return result;
 }
 
-/* Parse headers of RIFF container */
-#define WEBP_HEADER_SIZE 16
-#define VP8_HEADER_SIZE 10
-
 static int WebpCheckHeader(const char *header, int len)
 {
   const unsigned char *buffer;
@@ -178,6 +196,384 @@ WEBPFini(WEBPDec* pWEBP)
   if (pWEBP==NULL) {
     return;
   }  
+
+  if (pWEBP->yuvbuffer != NULL) {
+    VbitmapPoolFree(pWEBP->yuvbuffer);
+    YmagineLimitsReserve(pWEBP->yuvsize, YTRUE);
+    pWEBP->yuvbuffer = NULL;
+    pWEBP->yuvsize = 0;
+    pWEBP->yplane = NULL;
+    pWEBP->uplane = NULL;
+    pWEBP->vplane = NULL;
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WEBPReadInfo --
+ *
+ *		Read the head of the WEBP stream, check its container and
+ *		extract the image dimensions. The progress callback of the
+ *		options is invoked with the original size.
+ *
+ * Results:
+ *		YMAGINE_OK, or YMAGINE_ERROR if the stream is not a valid WEBP
+ *		or if decoding was aborted by the callback.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WEBPReadInfo(WEBPDec* pSrc, YmagineFormatOptions *options)
+{
+  int origWidth = 0;
+  int origHeight = 0;
+  YmagineStatsCollector *collector;
+  nsecs_t start;
+
+  collector = YmagineStatsCurrent();
+  start = YMAGINE_STATS_NOW(collector);
+
+  pSrc->headerlen = YmagineIORead(pSrc->channel, (char *) pSrc->header,
+                                  sizeof(pSrc->header));
+  if (pSrc->headerlen < WEBP_HEADER_SIZE) {
+    return YMAGINE_ERROR;
+  }
+
+  /* Check WEBP header */
+  pSrc->contentsize = WebpCheckHeader((const char*) pSrc->header, pSrc->headerlen);
+  if (pSrc->contentsize <= 0) {
+    return YMAGINE_ERROR;
+  }
+
+  if (WebPGetInfo(pSrc->header, pSrc->headerlen, &origWidth, &origHeight) == 0) {
+    ALOGD("invalid VP8 header");
+    return YMAGINE_ERROR;
+  }
+
+  if (origWidth <= 0 || origHeight <= 0) {
+    return YMAGINE_ERROR;
+  }
+  YMAGINE_STATS_TIME(collector, parse, start);
+
+  if (YmagineFormatOptions_invokeCallback(options, YMAGINE_IMAGEFORMAT_WEBP,
+                                          origWidth, origHeight) != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+
+  pSrc->inwidth = origWidth;
+  pSrc->inheight = origHeight;
+
+  return YMAGINE_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WEBPPrepareConfig --
+ *
+ *		Initialize a libwebp decoder configuration, with quality
+ *		trade-offs, cropping and scaling derived from the options.
+ *		Output buffer is left for the caller to set up.
+ *
+ * Results:
+ *		None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WEBPPrepareConfig(WEBPDec* pSrc, WebPDecoderConfig *config,
+                  YmagineFormatOptions *options, const Vrect *srcrect)
+{
+  int quality;
+
+  WebPInitDecoderConfig(config);
+
+  quality = YmagineFormatOptions_normalizeQuality(options);
+  if (quality < 90) {
+    config->options.no_fancy_upsampling = 1;
+  }
+  if (quality < 60) {
+    config->options.bypass_filtering = 1;
+  }
+  config->options.use_threads = 1;
+
+  if (srcrect->x != 0 || srcrect->y != 0 ||
+      srcrect->width != pSrc->inwidth || srcrect->height != pSrc->inheight) {
+    /* Crop on source */
+    config->options.use_cropping = 1;
+    config->options.crop_left = srcrect->x;
+    config->options.crop_top = srcrect->y;
+    config->options.crop_width = srcrect->width;
+    config->options.crop_height = srcrect->height;
+  }
+  if (pSrc->outwidth != pSrc->inwidth || pSrc->outheight != pSrc->inheight) {
+    config->options.use_scaling = 1;
+    config->options.scaled_width = pSrc->outwidth;
+    config->options.scaled_height = pSrc->outheight;
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WEBPPrepareYUV --
+ *
+ *		Allocate planar YUV 4:2:0 buffers matching the output size and
+ *		have the decoder configuration write into them. This is the
+ *		native colorspace of VP8, so no color conversion is done by
+ *		libwebp in this mode.
+ *
+ * Results:
+ *		YMAGINE_OK, YMAGINE_ERROR_LIMIT if planes exceed memory
+ *		limits, or YMAGINE_ERROR if allocation failed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WEBPPrepareYUV(WEBPDec* pSrc, WebPDecoderConfig *config)
+{
+  int ysize;
+  int uvsize;
+  size_t yuvsize;
+  int rc;
+
+  pSrc->ystride = pSrc->outwidth;
+  pSrc->uvstride = (pSrc->outwidth + 1) / 2;
+  pSrc->uvheight = (pSrc->outheight + 1) / 2;
+
+  ysize = pSrc->ystride * pSrc->outheight;
+  uvsize = pSrc->uvstride * pSrc->uvheight;
+
+  /* Fail before allocating if it would exceed memory limit */
+  yuvsize = (size_t) ysize + 2 * (size_t) uvsize;
+  rc = YmagineLimitsReserve(yuvsize, YFALSE);
+  if (rc != YMAGINE_OK) {
+    return rc;
+  }
+
+  /* Planes are recycled through buffer pool from one image to the next */
+  pSrc->yuvbuffer = VbitmapPoolAlloc(yuvsize);
+  if (pSrc->yuvbuffer == NULL) {
+    YmagineLimitsReserve(yuvsize, YTRUE);
+    return YMAGINE_ERROR;
+  }
+  pSrc->yuvsize = yuvsize;
+
+  pSrc->yplane = pSrc->yuvbuffer;
+  pSrc->uplane = pSrc->yplane + ysize;
+  pSrc->vplane = pSrc->uplane + uvsize;
+
+  config->output.colorspace = MODE_YUV;
+  config->output.u.YUV.y = pSrc->yplane;
+  config->output.u.YUV.y_stride = pSrc->ystride;
+  config->output.u.YUV.y_size = ysize;
+  config->output.u.YUV.u = pSrc->uplane;
+  config->output.u.YUV.u_stride = pSrc->uvstride;
+  config->output.u.YUV.u_size = uvsize;
+  config->output.u.YUV.v = pSrc->vplane;
+  config->output.u.YUV.v_stride = pSrc->uvstride;
+  config->output.u.YUV.v_size = uvsize;
+  config->output.is_external_memory = 1;
+
+  return YMAGINE_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WEBPRun --
+ *
+ *		Feed the rest of the WEBP stream into an incremental decoder
+ *		using the given configuration. Header bytes already consumed
+ *		by WEBPReadInfo are appended first.
+ *
+ * Results:
+ *		YMAGINE_OK, or YMAGINE_ERROR if an I/O error occurs or the
+ *		stream is corrupted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WEBPRun(WEBPDec* pSrc, WebPDecoderConfig *config)
+{
+  int rc = YMAGINE_ERROR;
+  WebPIDecoder* idec;
+  YmagineStatsCollector *collector;
+  nsecs_t start;
+
+  collector = YmagineStatsCurrent();
+  start = YMAGINE_STATS_NOW(collector);
+
+  idec = WebPIDecode(NULL, 0, config);
+  if (idec != NULL) {
+    VP8StatusCode status;
+
+    status = WebPIAppend(idec, pSrc->header, pSrc->headerlen);
+    if (status == VP8_STATUS_OK || status == VP8_STATUS_SUSPENDED) {
+      int bytes_remaining = pSrc->contentsize - pSrc->headerlen;
+      int bytes_read;
+      int bytes_req;
+      unsigned char *rbuf;
+
+      // See WebPIUpdate(idec, buffer, size_of_transmitted_buffer);
+      bytes_req = YmagineIOBufferSize();
+      rbuf = (unsigned char*) Ymem_malloc(bytes_req);
+      if (rbuf == NULL) {
+        bytes_remaining = 0;
+      }
+      while (bytes_remaining > 0) {
+        if (bytes_req > bytes_remaining) {
+          bytes_req = bytes_remaining;
+        }
+        bytes_read = YmagineIORead(pSrc->channel, rbuf, bytes_req);
+        if (bytes_read <= 0) {
+          break;
+        }
+        status = WebPIAppend(idec, (uint8_t*) rbuf, bytes_read);
+        if (status == VP8_STATUS_OK) {
+          rc = YMAGINE_OK;
+          break;
+        } else if (status == VP8_STATUS_SUSPENDED) {
+          if (bytes_remaining > 0) {
+            bytes_remaining -= bytes_read;
+          }
+        } else {
+          /* error */
+          break;
+        }
+        // The above call decodes the current available buffer.
+        // Part of the image can now be refreshed by calling
+        // WebPIDecGetRGB()/WebPIDecGetYUVA() etc.
+      }
+      if (rbuf != NULL) {
+        Ymem_free(rbuf);
+      }
+    }
+  }
+
+  // the object doesn't own the image memory, so it can now be deleted.
+  WebPIDelete(idec);
+  WebPFreeDecBuffer(&config->output);
+  YMAGINE_STATS_TIME(collector, decode, start);
+
+  return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WEBPWriteYCbCr --
+ *
+ *		Expand the decoded YUV 4:2:0 planes into the interleaved
+ *		YCbCr layout of VBITMAP_COLOR_YUV bitmaps, as consumed by the
+ *		JPEG encoder. VP8 uses limited range (Y in [16..235], chroma
+ *		in [16..240]) while JFIF expects full range, so samples are
+ *		rescaled on the way.
+ *
+ * Results:
+ *		None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WEBPWriteYCbCr(WEBPDec* pSrc)
+{
+  unsigned char ylut[256];
+  unsigned char clut[256];
+  int i;
+  int x;
+  int y;
+  int v;
+
+  for (i = 0; i < 256; i++) {
+    /* 255/219 and 255/224 in 8 bits fixed point */
+    v = ((i - 16) * 298 + 128) >> 8;
+    ylut[i] = (unsigned char) (v < 0 ? 0 : (v > 255 ? 255 : v));
+    v = 128 + (((i - 128) * 291 + 128) >> 8);
+    clut[i] = (unsigned char) (v < 0 ? 0 : (v > 255 ? 255 : v));
+  }
+
+  for (y = 0; y < pSrc->outheight; y++) {
+    const unsigned char *yrow = pSrc->yplane + y * pSrc->ystride;
+    const unsigned char *urow = pSrc->uplane + (y >> 1) * pSrc->uvstride;
+    const unsigned char *vrow = pSrc->vplane + (y >> 1) * pSrc->uvstride;
+    unsigned char *orow = pSrc->outbuffer + y * pSrc->outstride;
+
+    for (x = 0; x + 1 < pSrc->outwidth; x += 2) {
+      unsigned char cb = clut[*urow++];
+      unsigned char cr = clut[*vrow++];
+
+      orow[0] = ylut[yrow[0]];
+      orow[1] = cb;
+      orow[2] = cr;
+      orow[3] = ylut[yrow[1]];
+      orow[4] = cb;
+      orow[5] = cr;
+
+      yrow += 2;
+      orow += 6;
+    }
+    if (x < pSrc->outwidth) {
+      orow[0] = ylut[yrow[0]];
+      orow[1] = clut[*urow];
+      orow[2] = clut[*vrow];
+    }
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WEBPWriteNV21 --
+ *
+ *		Pack the decoded YUV 4:2:0 planes into a NV21 buffer, i.e. a
+ *		full resolution Y plane followed by an interleaved VU plane.
+ *		Samples are kept in their native (video) range, which is what
+ *		ycolor_nv21torgb expects.
+ *
+ * Results:
+ *		None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WEBPWriteNV21(WEBPDec* pSrc, unsigned char *nv21)
+{
+  unsigned char *vu;
+  int vustride;
+  int x;
+  int y;
+
+  /* Y plane is written with no padding, so it can be copied at once */
+  memcpy(nv21, pSrc->yplane, pSrc->ystride * pSrc->outheight);
+
+  vu = nv21 + pSrc->ystride * pSrc->outheight;
+  vustride = 2 * pSrc->uvstride;
+
+  for (y = 0; y < pSrc->uvheight; y++) {
+    const unsigned char *urow = pSrc->uplane + y * pSrc->uvstride;
+    const unsigned char *vrow = pSrc->vplane + y * pSrc->uvstride;
+    unsigned char *orow = vu + y * vustride;
+
+    for (x = 0; x < pSrc->uvstride; x++) {
+      orow[0] = vrow[x];
+      orow[1] = urow[x];
+      orow += 2;
+    }
+  }
 }
 
 
@@ -204,62 +600,31 @@ static int
 WEBPDecode(WEBPDec* pSrc, Vbitmap *vbitmap,
            YmagineFormatOptions *options)
 {
-  int contentSize;
-  int origWidth = 0;
-  int origHeight = 0;
-  int quality;
-  unsigned char header[WEBP_HEADER_SIZE + 32];
-  int headerlen;
-  int toRead;
-  unsigned char *input = NULL;
-  int inputlen;
   int oformat;
   int opitch;
   unsigned char *odata;
   int rc;
   Vrect srcrect;
   Vrect destrect;
-  WebPIDecoder* idec;
 
   if (options == NULL) {
     /* Options argument is mandatory */
     return 0;
   }
 
-  headerlen = YchannelRead(pSrc->channel, (char *) header, sizeof(header));
-  if (headerlen < WEBP_HEADER_SIZE) {
-    return 0;
-  }
-
-  /* Check WEBP header */
-  contentSize = WebpCheckHeader((const char*) header, headerlen);
-  if (contentSize <= 0) {
-    return 0;
-  }
-
-  if (WebPGetInfo(header, headerlen, &origWidth, &origHeight) == 0) {
-    ALOGD("invalid VP8 header");
-    return 0;
-  }
-
-  if (origWidth <= 0 || origHeight <= 0) {
-    return 0;
-  }
-
-  if (YmagineFormatOptions_invokeCallback(options, YMAGINE_IMAGEFORMAT_WEBP,
-                                          origWidth, origHeight) != YMAGINE_OK) {
+  if (WEBPReadInfo(pSrc, options) != YMAGINE_OK) {
     return 0;
   }
 
   if (YmaginePrepareTransform(vbitmap, options,
-                              origWidth, origHeight,
+                              pSrc->inwidth, pSrc->inheight,
                               &srcrect, &destrect) != YMAGINE_OK) {
     return 0;
   }
 
 #if YMAGINE_DEBUG_WEBP
   ALOGD("size: %dx%d req: %dx%d %s -> output: %dx%d",
-        origWidth, origHeight,
+        pSrc->inwidth, pSrc->inheight,
         destrect.width, destrect.height,
         (options->scalemode == YMAGINE_SCALE_CROP) ? "crop" :
         (options->scalemode == YMAGINE_SCALE_FIT ? "fit" : "letterbox"),
@@ -282,9 +647,6 @@ WEBPDecode(WEBPDec* pSrc, Vbitmap *vbitmap,
 
   pSrc->bitmap = vbitmap;
 
-  inputlen = contentSize;
-  toRead = inputlen - headerlen;
-
   rc = VbitmapLock(vbitmap);
   if (rc != YMAGINE_OK) {
     ALOGE("VbitmapLock() failed (code %d)", rc);
@@ -294,8 +656,6 @@ WEBPDecode(WEBPDec* pSrc, Vbitmap *vbitmap,
     opitch = VbitmapPitch(vbitmap);
     oformat = VbitmapColormode(vbitmap);
 
-    pSrc->inwidth = origWidth;
-    pSrc->inheight = origHeight;
     pSrc->outwidth = destrect.width;
     pSrc->outheight = destrect.height;
 
@@ -323,8 +683,10 @@ WEBPDecode(WEBPDec* pSrc, Vbitmap *vbitmap,
       case VBITMAP_COLOR_Argb:
         webpcolorspace = MODE_Argb;
         break;
-      case VBITMAP_COLOR_GRAYSCALE:
       case VBITMAP_COLOR_YUV:
+        webpcolorspace = MODE_YUV;
+        break;
+      case VBITMAP_COLOR_GRAYSCALE:
       case VBITMAP_COLOR_CMYK:
       case VBITMAP_COLOR_YCbCr:
       default:
@@ -333,7 +695,7 @@ WEBPDecode(WEBPDec* pSrc, Vbitmap *vbitmap,
       }
 
       if (!supported) {
-        ALOGD("currently only support RGB, RGBA webp decoding");
+        ALOGD("currently only support RGB, RGBA and YUV webp decoding");
         rc = YMAGINE_ERROR;
       } else {
         pSrc->isdirect = 1;
@@ -342,105 +704,108 @@ WEBPDecode(WEBPDec* pSrc, Vbitmap *vbitmap,
         pSrc->outstride = opitch;
         pSrc->outbuffer = odata + destrect.x * pSrc->outbpp + destrect.y * pSrc->outstride;
 
-        WebPInitDecoderConfig(&config);
+        WEBPPrepareConfig(pSrc, &config, options, &srcrect);
 
-        quality = YmagineFormatOptions_normalizeQuality(options);
-        if (quality < 90) {
-          config.options.no_fancy_upsampling = 1;
-        }
-        if (quality < 60) {
-          config.options.bypass_filtering = 1;
-        }
-        config.options.use_threads = 1;
-
-        if (srcrect.x != 0 || srcrect.y != 0 || srcrect.width != origWidth || srcrect.height != origHeight) {
-          /* Crop on source */
-          config.options.use_cropping = 1;
-          config.options.crop_left = srcrect.x;
-          config.options.crop_top = srcrect.y;
-          config.options.crop_width = srcrect.width;
-          config.options.crop_height = srcrect.height;
-        }
-        if (pSrc->outwidth != pSrc->inwidth || pSrc->outheight != pSrc->inheight) {
-          config.options.use_scaling = 1;
-          config.options.scaled_width = pSrc->outwidth;
-          config.options.scaled_height = pSrc->outheight;
-        }
+        if (webpcolorspace == MODE_YUV) {
+          /* Decode planes, then interleave into bitmap */
+          rc = WEBPPrepareYUV(pSrc, &config);
+          if (rc == YMAGINE_OK) {
+            rc = WEBPRun(pSrc, &config);
+          }
+          if (rc == YMAGINE_OK) {
+            WEBPWriteYCbCr(pSrc);
+          }
+        } else {
+          // Specify the desired output colorspace:
+          config.output.colorspace = webpcolorspace;
 
-        rc = YMAGINE_ERROR;
+          // Have config.output point to an external buffer:
+          config.output.u.RGBA.rgba = (uint8_t*) pSrc->outbuffer;
+          config.output.u.RGBA.stride = pSrc->outstride;
+          config.output.u.RGBA.size = pSrc->outstride * pSrc->outheight;
+          config.output.is_external_memory = 1;
 
-        // Specify the desired output colorspace:
-        config.output.colorspace = webpcolorspace;
-
-        // Have config.output point to an external buffer:
-        config.output.u.RGBA.rgba = (uint8_t*) pSrc->outbuffer;
-        config.output.u.RGBA.stride = pSrc->outstride;
-        config.output.u.RGBA.size = pSrc->outstride * pSrc->outheight;
-        config.output.is_external_memory = 1;
-
-        idec = WebPIDecode(NULL, 0, &config);
-        if (idec != NULL) {
-          VP8StatusCode status;
-
-          status = WebPIAppend(idec, header, headerlen);
-          if (status == VP8_STATUS_OK || status == VP8_STATUS_SUSPENDED) {
-            int bytes_remaining = toRead;
-            int bytes_read;
-            int bytes_req;
-            unsigned char rbuf[8192];
-
-            // See WebPIUpdate(idec, buffer, size_of_transmitted_buffer);
-            bytes_req = sizeof(rbuf);
-            while (bytes_remaining > 0) {
-              if (bytes_req > bytes_remaining) {
-                bytes_req = bytes_remaining;
-              }
-              bytes_read = YchannelRead(pSrc->channel, rbuf, bytes_req);
-              if (bytes_read <= 0) {
-                break;
-              }
-              status = WebPIAppend(idec, (uint8_t*) rbuf, bytes_read);
-              if (status == VP8_STATUS_OK) {
-                rc = YMAGINE_OK;
-                break;
-              } else if (status == VP8_STATUS_SUSPENDED) {
-                if (bytes_remaining > 0) {
-                  bytes_remaining -= bytes_read;
-                }
-              } else {
-                /* error */
-                break;
-              }
-              // The above call decodes the current available buffer.
-              // Part of the image can now be refreshed by calling
-              // WebPIDecGetRGB()/WebPIDecGetYUVA() etc.
-            }
-          }
+          rc = WEBPRun(pSrc, &config);
         }
-
-        // the object doesn't own the image memory, so it can now be deleted.
-        WebPIDelete(idec);
-        WebPFreeDecBuffer(&config.output);
       }
     }
 
     VbitmapUnlock(vbitmap);
   }
 
-  if (input) {
-    Ymem_free((char*) input);
-  }
   if (!pSrc->isdirect) {
     Ymem_free(pSrc->outbuffer);
   }
 
   if (rc == YMAGINE_OK) {
-    return origHeight;
+    return pSrc->inheight;
   }
 
   return 0;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * WEBPDecodeNV21 --
+ *
+ *		Decode a WEBP stream into a newly allocated NV21 buffer,
+ *		honoring the scaling and cropping options.
+ *
+ * Results:
+ *		YMAGINE_OK, or YMAGINE_ERROR if an I/O error occurs or any problems
+ *		are detected in the WEBP file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WEBPDecodeNV21(WEBPDec* pSrc, YmagineFormatOptions *options,
+               unsigned char **nv21, int *width, int *height)
+{
+  WebPDecoderConfig config;
+  Vrect srcrect;
+  Vrect destrect;
+  unsigned char *obuffer;
+  int rc;
+
+  if (WEBPReadInfo(pSrc, options) != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+
+  if (YmaginePrepareTransform(NULL, options,
+                              pSrc->inwidth, pSrc->inheight,
+                              &srcrect, &destrect) != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+
+  pSrc->outwidth = destrect.width;
+  pSrc->outheight = destrect.height;
+
+  WEBPPrepareConfig(pSrc, &config, options, &srcrect);
+  rc = WEBPPrepareYUV(pSrc, &config);
+  if (rc == YMAGINE_OK) {
+    rc = WEBPRun(pSrc, &config);
+  }
+  if (rc != YMAGINE_OK) {
+    return YMAGINE_ERROR;
+  }
+
+  obuffer = Ymem_malloc(pSrc->ystride * pSrc->outheight +
+                        2 * pSrc->uvstride * pSrc->uvheight);
+  if (obuffer == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  WEBPWriteNV21(pSrc, obuffer);
+
+  *nv21 = obuffer;
+  *width = pSrc->outwidth;
+  *height = pSrc->outheight;
+
+  return YMAGINE_OK;
+}
+
 #endif /* HAVE_WEBP */
 
 int
@@ -469,6 +834,76 @@ decodeWEBP(Ychannel *channel, Vbitmap *vbitmap,
   return nlines;
 }
 
+int
+decodeWEBPToNV21(Ychannel *channel, YmagineFormatOptions *options,
+                 unsigned char **nv21, int *width, int *height)
+{
+  int rc = YMAGINE_ERROR;
+#if HAVE_WEBP
+  WEBPDec  webp;
+  YmagineFormatOptions *decodeoptions = options;
+#endif
+
+  if (nv21 == NULL || width == NULL || height == NULL) {
+    return rc;
+  }
+
+  *nv21 = NULL;
+  *width = 0;
+  *height = 0;
+
+  if (!YchannelReadable(channel)) {
+#if YMAGINE_DEBUG_WEBP
+    ALOGD("input channel not readable");
+#endif
+    return rc;
+  }
+
+#if HAVE_WEBP
+  if (decodeoptions == NULL) {
+    decodeoptions = YmagineFormatOptions_Create();
+    if (decodeoptions == NULL) {
+      return rc;
+    }
+  }
+
+  if (WEBPInit(&webp, channel, NULL) == YMAGINE_OK) {
+    rc = WEBPDecodeNV21(&webp, decodeoptions, nv21, width, height);
+    WEBPFini(&webp);
+  }
+
+  if (decodeoptions != options) {
+    YmagineFormatOptions_Release(decodeoptions);
+  }
+#endif
+
+  return rc;
+}
+
+YBOOL
+WEBPIsOpaque(Ychannel *channel)
+{
+  YBOOL opaque = YFALSE;
+#if HAVE_WEBP
+  char header[WEBP_INFO_SIZE];
+  int hlen;
+  WebPBitstreamFeatures features;
+
+  if (!YchannelReadable(channel)) {
+    return YFALSE;
+  }
+
+  hlen = YmagineIOPeek(channel, header, sizeof(header));
+
+  if (WebpCheckHeader(header, hlen) > 0 &&
+      WebPGetFeatures((const uint8_t*) header, hlen, &features) == VP8_STATUS_OK) {
+    opaque = features.has_alpha ? YFALSE : YTRUE;
+  }
+#endif
+
+  return opaque;
+}
+
 #if HAVE_WEBP
 static int
 WebPYchannelWrite(const uint8_t* data, size_t data_size,
@@ -477,7 +912,7 @@ WebPYchannelWrite(const uint8_t* data, size_t data_size,
   Ychannel *channel = (Ychannel*) picture->custom_ptr;
 
   if (channel != NULL) {
-    if (YchannelWrite(channel, data, data_size) != data_size) {
+    if (YmagineIOWrite(channel, data, (int) data_size) != (int) data_size) {
       return 0;
     }
   }
@@ -612,10 +1047,7 @@ matchWEBP(Ychannel *channel)
     return YFALSE;
   }
 
-  hlen = YchannelRead(channel, header, sizeof(header));
-  if (hlen > 0) {
-    YchannelPush(channel, header, hlen);
-  }
+  hlen = YmagineIOPeek(channel, header, sizeof(header));
 
   if (WebpCheckHeader(header, hlen) > 0) {
     return YTRUE;
@@ -387,6 +387,22 @@ computeTransform(int srcwidth, int srcheight, const Vrect *croprect,
 }
 
 
+/* Offset of window of size winsize, centered on focus if it fits in size */
+static int
+focusOffset(float focus, int size, int winsize)
+{
+  int offset = (int) (focus * size) - winsize / 2;
+
+  if (offset > size - winsize) {
+    offset = size - winsize;
+  }
+  if (offset < 0) {
+    offset = 0;
+  }
+
+  return offset;
+}
+
 int
 YmaginePrepareTransform(Vbitmap* vbitmap, YmagineFormatOptions *options,
                         int imagewidth, int imageheight,
@@ -395,6 +411,7 @@ YmaginePrepareTransform(Vbitmap* vbitmap, YmagineFormatOptions *options,
   Vrect croprect;
   int owidth;
   int oheight;
+  int64_t outbytes;
 
   if (srcrect == NULL || destrect == NULL) {
     return YMAGINE_ERROR;
@@ -430,6 +447,28 @@ YmaginePrepareTransform(Vbitmap* vbitmap, YmagineFormatOptions *options,
   computeTransform(croprect.width, croprect.height, NULL,
                    owidth, oheight, options->scalemode,
                    srcrect, destrect);
+
+  /* Every decoder gets here once header is parsed, before allocating
+     output, so enforce limits on input size and output bitmap here */
+  if (vbitmap == NULL || options->resizable) {
+    outbytes = ((int64_t) destrect->width) * ((int64_t) destrect->height) * 4;
+  } else {
+    outbytes = 0;
+  }
+  if (YmagineLimitsCheck(imagewidth, imageheight, 1, outbytes) != YMAGINE_OK) {
+    return YMAGINE_ERROR_LIMIT;
+  }
+
+  /* Center cropped window on focus point chosen by smart crop */
+  if (options->cropfocusx >= 0.0f &&
+      srcrect->width > 0 && srcrect->width < croprect.width) {
+    srcrect->x = focusOffset(options->cropfocusx, croprect.width, srcrect->width);
+  }
+  if (options->cropfocusy >= 0.0f &&
+      srcrect->height > 0 && srcrect->height < croprect.height) {
+    srcrect->y = focusOffset(options->cropfocusy, croprect.height, srcrect->height);
+  }
+
   srcrect->x += croprect.x;
   srcrect->y += croprect.y;
 
@@ -0,0 +1,457 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#define LOG_TAG "ymagine::pool"
+
+#include "ymagine/ymagine.h"
+#include "ymagine_priv.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/*
+ * Blocks are bucketed in 4 size classes per power of two, so a block
+ * is never more than 25% larger than the request it serves. Requests
+ * of POOL_MIN_SIZE bytes or less share the first bucket. Requests below
+ * POOL_SMALL_SIZE, which the system allocator serves well, and requests
+ * above 1 << POOL_MAX_SHIFT bytes bypass the pool.
+ */
+#define POOL_MIN_SHIFT 12
+#define POOL_MIN_SIZE (((size_t) 1) << POOL_MIN_SHIFT)
+#define POOL_SMALL_SIZE (POOL_MIN_SIZE / 4)
+#define POOL_MAX_SHIFT 28
+#define POOL_NBUCKETS (1 + (POOL_MAX_SHIFT - POOL_MIN_SHIFT) * 4)
+
+typedef union PoolHeaderUnion PoolHeader;
+
+union PoolHeaderUnion {
+  struct {
+    PoolHeader *next;
+    size_t size;
+    int bucket;
+  } h;
+  /* Pad header so payload keeps the alignment of the allocator */
+  double align[4];
+};
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static PoolHeader *poolFree[POOL_NBUCKETS];
+static size_t poolLimit = 0;
+static VbitmapPoolStats poolStats;
+
+/* Optional per-thread cache, checked before the shared pool without locking */
+typedef struct {
+  PoolHeader *free[POOL_NBUCKETS];
+  size_t limit;
+  size_t bytesretained;
+  unsigned long hits;
+} PoolCache;
+
+static pthread_key_t poolCacheKey;
+static pthread_once_t poolCacheOnce = PTHREAD_ONCE_INIT;
+
+/* Hand cached blocks over to shared pool, which may retain them */
+static void
+poolCacheDrain(void *ptr)
+{
+  int i;
+  PoolHeader *hdr;
+  PoolCache *cache = (PoolCache*) ptr;
+
+  pthread_mutex_lock(&poolLock);
+  poolStats.hits += cache->hits;
+  pthread_mutex_unlock(&poolLock);
+
+  for (i = 0; i < POOL_NBUCKETS; i++) {
+    while (cache->free[i] != NULL) {
+      hdr = cache->free[i];
+      cache->free[i] = hdr->h.next;
+      VbitmapPoolFree(hdr + 1);
+    }
+  }
+  Ymem_free(cache);
+}
+
+static void
+poolCacheKeyCreate()
+{
+  /* Cache of a thread exiting while still attached is drained too */
+  pthread_key_create(&poolCacheKey, poolCacheDrain);
+}
+
+static PoolCache*
+poolCacheGet()
+{
+  pthread_once(&poolCacheOnce, poolCacheKeyCreate);
+
+  return (PoolCache*) pthread_getspecific(poolCacheKey);
+}
+
+static int
+poolBucket(size_t size)
+{
+  int k;
+  size_t q;
+
+  if (size < POOL_SMALL_SIZE) {
+    return -1;
+  }
+  if (size <= POOL_MIN_SIZE) {
+    return 0;
+  }
+
+  /* Find k such as 2^k < size <= 2^(k+1) */
+  k = POOL_MIN_SHIFT;
+  while (k + 1 < POOL_MAX_SHIFT && (((size_t) 1) << (k + 1)) < size) {
+    k++;
+  }
+  if ((((size_t) 1) << (k + 1)) < size) {
+    return -1;
+  }
+
+  /* Round up to a quarter of 2^k, q is then in [5..8] */
+  q = (size + (((size_t) 1) << (k - 2)) - 1) >> (k - 2);
+
+  return 1 + (k - POOL_MIN_SHIFT) * 4 + (int) (q - 5);
+}
+
+static size_t
+poolBucketSize(int bucket)
+{
+  int k;
+  size_t q;
+
+  if (bucket <= 0) {
+    return POOL_MIN_SIZE;
+  }
+
+  k = POOL_MIN_SHIFT + (bucket - 1) / 4;
+  q = 5 + (bucket - 1) % 4;
+
+  return q << (k - 2);
+}
+
+/* Release retained blocks until at most maxbytes are left. Caller holds lock */
+static void
+poolTrimLocked(size_t maxbytes)
+{
+  int i;
+  PoolHeader *hdr;
+
+  for (i = POOL_NBUCKETS - 1; i >= 0; i--) {
+    if (poolStats.bytesretained <= maxbytes) {
+      break;
+    }
+    while (poolFree[i] != NULL && poolStats.bytesretained > maxbytes) {
+      hdr = poolFree[i];
+      poolFree[i] = hdr->h.next;
+      poolStats.bytesretained -= hdr->h.size;
+      poolStats.blocksretained--;
+      Ymem_free(hdr);
+    }
+  }
+}
+
+void*
+VbitmapPoolAlloc(size_t size)
+{
+  int bucket;
+  size_t bsize;
+  PoolCache *cache;
+  PoolHeader *hdr = NULL;
+
+  if (size == 0) {
+    return NULL;
+  }
+
+  bucket = poolBucket(size);
+  bsize = (bucket >= 0) ? poolBucketSize(bucket) : size;
+
+  cache = poolCacheGet();
+  if (bucket < 0 || (cache == NULL && poolLimit == 0)) {
+    /* Block can't be retained anyway, skip lock and statistics */
+    hdr = (PoolHeader*) Ymem_malloc(sizeof(PoolHeader) + bsize);
+    if (hdr == NULL) {
+      return NULL;
+    }
+    hdr->h.size = bsize;
+    hdr->h.bucket = bucket;
+    hdr->h.next = NULL;
+
+    return (void*) (hdr + 1);
+  }
+
+  if (cache != NULL && cache->free[bucket] != NULL) {
+    hdr = cache->free[bucket];
+    cache->free[bucket] = hdr->h.next;
+    cache->bytesretained -= hdr->h.size;
+    cache->hits++;
+    hdr->h.next = NULL;
+
+    return (void*) (hdr + 1);
+  }
+
+  pthread_mutex_lock(&poolLock);
+  if (bucket >= 0 && poolFree[bucket] != NULL) {
+    hdr = poolFree[bucket];
+    poolFree[bucket] = hdr->h.next;
+    poolStats.bytesretained -= hdr->h.size;
+    poolStats.blocksretained--;
+    poolStats.hits++;
+  } else {
+    poolStats.misses++;
+  }
+  pthread_mutex_unlock(&poolLock);
+
+  if (hdr == NULL) {
+    hdr = (PoolHeader*) Ymem_malloc(sizeof(PoolHeader) + bsize);
+    if (hdr == NULL) {
+      return NULL;
+    }
+    hdr->h.size = bsize;
+    hdr->h.bucket = bucket;
+  }
+  hdr->h.next = NULL;
+
+  return (void*) (hdr + 1);
+}
+
+void
+VbitmapPoolFree(void *ptr)
+{
+  PoolHeader *hdr;
+  PoolCache *cache;
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  hdr = ((PoolHeader*) ptr) - 1;
+
+  cache = poolCacheGet();
+  if (hdr->h.bucket < 0 || (cache == NULL && poolLimit == 0)) {
+    /* Block can't be retained, skip lock and statistics */
+    Ymem_free(hdr);
+    return;
+  }
+
+  if (cache != NULL &&
+      cache->bytesretained + hdr->h.size <= cache->limit) {
+    hdr->h.next = cache->free[hdr->h.bucket];
+    cache->free[hdr->h.bucket] = hdr;
+    cache->bytesretained += hdr->h.size;
+    return;
+  }
+
+  pthread_mutex_lock(&poolLock);
+  if (hdr->h.bucket >= 0 &&
+      poolStats.bytesretained + hdr->h.size <= poolLimit) {
+    hdr->h.next = poolFree[hdr->h.bucket];
+    poolFree[hdr->h.bucket] = hdr;
+    poolStats.bytesretained += hdr->h.size;
+    poolStats.blocksretained++;
+    hdr = NULL;
+  } else {
+    poolStats.discards++;
+  }
+  pthread_mutex_unlock(&poolLock);
+
+  if (hdr != NULL) {
+    Ymem_free(hdr);
+  }
+}
+
+size_t
+VbitmapPoolCapacity(void *ptr)
+{
+  if (ptr == NULL) {
+    return 0;
+  }
+
+  return (((PoolHeader*) ptr) - 1)->h.size;
+}
+
+int
+VbitmapPoolCacheAttach(size_t maxbytes)
+{
+  PoolCache *cache;
+
+  if (poolCacheGet() != NULL) {
+    /* Already attached */
+    return YMAGINE_ERROR;
+  }
+
+  cache = (PoolCache*) Ymem_calloc(1, sizeof(PoolCache));
+  if (cache == NULL) {
+    return YMAGINE_ERROR;
+  }
+  cache->limit = maxbytes;
+
+  if (pthread_setspecific(poolCacheKey, cache) != 0) {
+    Ymem_free(cache);
+    return YMAGINE_ERROR;
+  }
+
+  return YMAGINE_OK;
+}
+
+int
+VbitmapPoolCacheDetach()
+{
+  PoolCache *cache;
+
+  cache = poolCacheGet();
+  if (cache == NULL) {
+    return YMAGINE_ERROR;
+  }
+  pthread_setspecific(poolCacheKey, NULL);
+  poolCacheDrain(cache);
+
+  return YMAGINE_OK;
+}
+
+int
+VbitmapPoolSetLimit(size_t maxbytes)
+{
+  pthread_mutex_lock(&poolLock);
+  poolLimit = maxbytes;
+  poolTrimLocked(maxbytes);
+  pthread_mutex_unlock(&poolLock);
+
+  return YMAGINE_OK;
+}
+
+int
+VbitmapPoolTrim()
+{
+  pthread_mutex_lock(&poolLock);
+  poolTrimLocked(0);
+  pthread_mutex_unlock(&poolLock);
+
+  return YMAGINE_OK;
+}
+
+int
+VbitmapPoolGetStats(VbitmapPoolStats *stats, YBOOL reset)
+{
+  if (stats == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  pthread_mutex_lock(&poolLock);
+  *stats = poolStats;
+  stats->limit = poolLimit;
+  if (reset) {
+    /* Only reset counters, retained memory is still accounted for */
+    poolStats.hits = 0;
+    poolStats.misses = 0;
+    poolStats.discards = 0;
+  }
+  pthread_mutex_unlock(&poolLock);
+
+  return YMAGINE_OK;
+}
+
+/*
+ * Scratch arena
+ */
+#define VARENA_ALIGN 32
+#define VARENA_BLOCK_SIZE (64 * 1024)
+
+struct VarenaBlockStruct {
+  VarenaBlock *next;
+  size_t size;
+  size_t used;
+};
+
+#define VARENA_HEADER_SIZE \
+  (((sizeof(VarenaBlock) + VARENA_ALIGN - 1) / VARENA_ALIGN) * VARENA_ALIGN)
+
+void
+VarenaInit(Varena *arena)
+{
+  if (arena != NULL) {
+    arena->blocks = NULL;
+  }
+}
+
+void*
+VarenaAlloc(Varena *arena, size_t size)
+{
+  VarenaBlock *block;
+  size_t bsize;
+  size_t capacity;
+  int64_t available;
+  unsigned char *ptr;
+
+  if (arena == NULL || size == 0) {
+    return NULL;
+  }
+
+  size = ((size + VARENA_ALIGN - 1) / VARENA_ALIGN) * VARENA_ALIGN;
+
+  block = arena->blocks;
+  if (block == NULL || block->size - block->used < size) {
+    bsize = VARENA_HEADER_SIZE + size;
+    if (bsize < VARENA_BLOCK_SIZE) {
+      bsize = VARENA_BLOCK_SIZE;
+    }
+
+    /* Fail before allocating if it would exceed memory limit */
+    if (YmagineLimitsReserve(bsize, YFALSE) != YMAGINE_OK) {
+      return NULL;
+    }
+    block = (VarenaBlock*) VbitmapPoolAlloc(bsize);
+    if (block == NULL) {
+      YmagineLimitsReserve(bsize, YTRUE);
+      return NULL;
+    }
+    /* Use whole bucket, which may be larger than requested, unless
+       limit only allows for what was requested */
+    capacity = VbitmapPoolCapacity(block);
+    if (capacity > bsize) {
+      available = YmagineLimitsAvailable();
+      if (available == 0 || (int64_t) (capacity - bsize) <= available) {
+        YmagineLimitsReserve(capacity - bsize, YFALSE);
+        bsize = capacity;
+      }
+    }
+    block->size = bsize - VARENA_HEADER_SIZE;
+    YmagineStatsScratch(VARENA_HEADER_SIZE + block->size, YFALSE);
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  ptr = ((unsigned char*) block) + VARENA_HEADER_SIZE + block->used;
+  block->used += size;
+
+  return ptr;
+}
+
+void
+VarenaReset(Varena *arena)
+{
+  VarenaBlock *block;
+
+  if (arena == NULL) {
+    return;
+  }
+
+  while (arena->blocks != NULL) {
+    block = arena->blocks;
+    arena->blocks = block->next;
+    YmagineStatsScratch(VARENA_HEADER_SIZE + block->size, YTRUE);
+    YmagineLimitsReserve(VARENA_HEADER_SIZE + block->size, YTRUE);
+    VbitmapPoolFree(block);
+  }
+}
@@ -0,0 +1,71 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#ifndef _YMAGINE_GRAPHICS_POOL_H
+#define _YMAGINE_GRAPHICS_POOL_H 1
+
+#include "ymagine/ymagine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Size bucketed pool of large memory blocks. Blocks returned by
+ * VbitmapPoolAlloc carry a private header and must only be released
+ * with VbitmapPoolFree, never with Ymem_free.
+ */
+void*
+VbitmapPoolAlloc(size_t size);
+
+void
+VbitmapPoolFree(void *ptr);
+
+/* Usable size of a block returned by VbitmapPoolAlloc */
+size_t
+VbitmapPoolCapacity(void *ptr);
+
+/*
+ * Give calling thread a private cache of up to maxbytes, used before the
+ * shared pool and regardless of its limit. Detaching, or exiting the
+ * thread, hands cached blocks back to the shared pool.
+ */
+int
+VbitmapPoolCacheAttach(size_t maxbytes);
+
+int
+VbitmapPoolCacheDetach();
+
+/*
+ * Scratch arena. All allocations are released at once by VarenaReset,
+ * and backing blocks are drawn from, and returned to, the pool above.
+ */
+typedef struct VarenaBlockStruct VarenaBlock;
+
+typedef struct {
+  VarenaBlock *blocks;
+} Varena;
+
+void
+VarenaInit(Varena *arena);
+
+void*
+VarenaAlloc(Varena *arena, size_t size);
+
+void
+VarenaReset(Varena *arena);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* _YMAGINE_GRAPHICS_POOL_H */
@@ -136,67 +136,53 @@ static const Vcolor white = {
   .alpha = 0xff
 };
 
-static int
-quantizeWithOptions(Vbitmap *vbitmap, int maxcolors,
-                    Vcolor *colors, int *scores, int processing)
+/*
+ * Move each centroid to the mean of the colors assigned to it, and
+ * return the largest distance any of them moved by
+ */
+static uint64_t
+updateCentroids(ColorArea *centroid, int ncentroids)
 {
-  int i;
-  int x, y, c;
-  unsigned char *pixels;
-  unsigned char *line;
-  ColorArea centroid[PALETTESIZE];
+  int c;
   Vcolor current;
-  int width, height, pitch;
   uint64_t dist;
-  uint64_t refdist;
-  int refid;
-  int ncolors;
-  int maxiters = 100;
-
-  if (maxcolors <= 0 || colors == NULL) {
-    return 0;
-  }
-  if (vbitmap == NULL) {
-    return 0;
-  }
-
-  if (processing == YMAGINE_THEME_DEFAULT) {
-    processing = YMAGINE_THEME_SATURATION;
-  }
-
-  if (processing != YMAGINE_THEME_NONE && processing != YMAGINE_THEME_SATURATION) {
-    return 0;
-  }
-
-  if (VbitmapLock(vbitmap) != YMAGINE_OK) {
-    return 0;
-  }
-
-  pixels = VbitmapBuffer(vbitmap);
-  if (pixels == NULL) {
-    VbitmapUnlock(vbitmap);
-    return 0;
-  }
+  uint64_t refdist = 0;
+
+  for (c = 0; c < ncentroids; c++) {
+    if (centroid[c].count == 0) {
+      current.red = 0xff;
+      current.green = 0xff;
+      current.blue = 0xff;
+      current.alpha = 0xff;
+    } else {
+      current.red = centroid[c].accum_red/centroid[c].count;
+      current.green = centroid[c].accum_green/centroid[c].count;
+      current.blue = centroid[c].accum_blue/centroid[c].count;
+      current.alpha = 0xff;
+    }
 
-  width = VbitmapWidth(vbitmap);
-  height = VbitmapHeight(vbitmap);
-  pitch = VbitmapPitch(vbitmap);
-  if (width <= 0 || height <= 0 || pitch <= 0) {
-    VbitmapUnlock(vbitmap);
-    return 0;
+    dist = norm2(&current, &(centroid[c].color));
+    if (dist > refdist) {
+      refdist = dist;
+    }
+    centroid[c].color = current;
   }
 
-  /* Verify that width*height < 1<<24. This quarantee that will be
-   no overflow in accumulators */
-  if (hasMultiplyOverflow((((uint32_t) 1)<<24), width, height)) {
-    VbitmapUnlock(vbitmap);
-    return 0;
-  }
+  return refdist;
+}
 
-  /* Initial result, using default palette */
-  if (maxcolors > PALETTESIZE) {
-    maxcolors = PALETTESIZE;
-  }
+/* Plain k-means, assigning every pixel of the bitmap at each iteration */
+static void
+quantizePixels(const unsigned char *pixels, int width, int height, int pitch,
+               ColorArea *centroid, int maxcolors, int maxiters)
+{
+  int i;
+  int x, y, c;
+  const unsigned char *line;
+  Vcolor current;
+  uint64_t dist;
+  uint64_t refdist;
+  int refid;
 
   for (c = 0; c < maxcolors; c++) {
     centroid[c].color = palette[c];
@@ -260,33 +246,212 @@ quantizeWithOptions(Vbitmap *vbitmap, int maxcolors,
       }
     }
 
-    refdist = 0;
-    for (c = 0; c < maxcolors; c++) {
-      if (centroid[c].count == 0) {
-	      current.red = 0xff;
-	      current.green = 0xff;
-	      current.blue = 0xff;
-	      current.alpha = 0xff;
-      } else {
-	      current.red = centroid[c].accum_red/centroid[c].count;
-	      current.green = centroid[c].accum_green/centroid[c].count;
-	      current.blue = centroid[c].accum_blue/centroid[c].count;
-	      current.alpha = 0xff;
+    if (updateCentroids(centroid, maxcolors) < 1) {
+      break;
+    }
+  }
+}
+
+#define HIST_INDEX(r, g, b) \
+  ((((r) >> (8 - VCOLOR_HISTOGRAM_BITS)) << (2 * VCOLOR_HISTOGRAM_BITS)) | \
+   (((g) >> (8 - VCOLOR_HISTOGRAM_BITS)) << VCOLOR_HISTOGRAM_BITS) | \
+   ((b) >> (8 - VCOLOR_HISTOGRAM_BITS)))
+
+void
+VcolorHistogramAdd(VcolorBin *bins, const unsigned char *pixels,
+                   int width, int bpp, int step)
+{
+  int x;
+  VcolorBin *bin;
+  int incr = bpp * step;
+
+  if (bpp >= 3) {
+    for (x = 0; x < width; x += step) {
+      bin = &bins[HIST_INDEX(pixels[RED_OFFSET], pixels[GREEN_OFFSET], pixels[BLUE_OFFSET])];
+      bin->accum_red += pixels[RED_OFFSET];
+      bin->accum_green += pixels[GREEN_OFFSET];
+      bin->accum_blue += pixels[BLUE_OFFSET];
+      bin->count++;
+      pixels += incr;
+    }
+  } else if (bpp == 1) {
+    /* Grayscale */
+    for (x = 0; x < width; x += step) {
+      bin = &bins[HIST_INDEX(pixels[0], pixels[0], pixels[0])];
+      bin->accum_red += pixels[0];
+      bin->accum_green += pixels[0];
+      bin->accum_blue += pixels[0];
+      bin->count++;
+      pixels += incr;
+    }
+  }
+}
+
+/* Fixed seed, so same bitmap always gives same palette */
+#define KMEANS_SEED 0x2545f4914f6cdd1dULL
+
+static uint64_t
+kmeansRandom(uint64_t *state)
+{
+  *state = (*state) * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (*state) >> 11;
+}
+
+/*
+ * Weighted k-means over the populated bins of a color histogram, seeded
+ * with k-means++. Cost of each iteration depends on the number of distinct
+ * colors, at most VCOLOR_HISTOGRAM_SIZE, instead of on the number of pixels.
+ * Populated bins get packed at the start of the histogram.
+ */
+static int
+quantizeBins(VcolorBin *bins, ColorArea *centroid, int maxcolors, int maxiters)
+{
+  int i;
+  int c, b;
+  int nbins;
+  int nseeds;
+  Vcolor *means;
+  uint32_t *mindist;
+  uint64_t total, target, weight;
+  uint64_t state = KMEANS_SEED;
+  uint32_t dist;
+  uint32_t refdist;
+  int refid;
+
+  /* Pack populated bins at start of array */
+  nbins = 0;
+  for (b = 0; b < VCOLOR_HISTOGRAM_SIZE; b++) {
+    if (bins[b].count > 0) {
+      bins[nbins++] = bins[b];
+    }
+  }
+
+  if (nbins == 0) {
+    return YMAGINE_ERROR;
+  }
+
+  means = (Vcolor*) Ymem_malloc(nbins * (sizeof(Vcolor) + sizeof(uint32_t)));
+  if (means == NULL) {
+    return YMAGINE_ERROR;
+  }
+  mindist = (uint32_t*) (means + nbins);
+
+  for (b = 0; b < nbins; b++) {
+    means[b].red = bins[b].accum_red / bins[b].count;
+    means[b].green = bins[b].accum_green / bins[b].count;
+    means[b].blue = bins[b].accum_blue / bins[b].count;
+    means[b].alpha = 0xff;
+  }
+
+  /*
+   * k-means++ seeding: each seed is a bin picked with a probability
+   * proportional to its pixel count times its squared distance to the
+   * nearest seed already picked.
+   */
+  for (c = 0; c < maxcolors; c++) {
+    total = 0;
+    for (b = 0; b < nbins; b++) {
+      total += ((uint64_t) bins[b].count) * (c == 0 ? 1 : mindist[b]);
+    }
+    if (total == 0) {
+      /* Fewer distinct colors than centroids */
+      break;
+    }
+
+    target = kmeansRandom(&state) % total;
+    for (b = 0; b < nbins - 1; b++) {
+      weight = ((uint64_t) bins[b].count) * (c == 0 ? 1 : mindist[b]);
+      if (target < weight) {
+        break;
       }
+      target -= weight;
+    }
+    centroid[c].color = means[b];
+
+    for (b = 0; b < nbins; b++) {
+      dist = norm2(&means[b], &(centroid[c].color));
+      if (c == 0 || dist < mindist[b]) {
+        mindist[b] = dist;
+      }
+    }
+  }
+  nseeds = c;
+
+  /* Unused centroids end up with a null count */
+  for (c = nseeds; c < maxcolors; c++) {
+    centroid[c].color = white;
+    centroid[c].count = 0;
+  }
+
+  for (i = 0; i < maxiters && nseeds > 0; i++) {
+    for (c = 0; c < nseeds; c++) {
+      centroid[c].accum_red = 0;
+      centroid[c].accum_green = 0;
+      centroid[c].accum_blue = 0;
+      centroid[c].accum_alpha = 0;
+      centroid[c].count = 0;
+    }
 
-      dist = norm2(&current, &(centroid[c].color));
-      if (dist > refdist) {
-	      refdist = dist;
+    /* Assign each bin, with all its pixels, to its nearest centroid */
+    for (b = 0; b < nbins; b++) {
+      refdist = norm2(&means[b], &(centroid[0].color));
+      refid = 0;
+      for (c = 1; c < nseeds; c++) {
+        dist = norm2(&means[b], &(centroid[c].color));
+        if (dist < refdist) {
+          refdist = dist;
+          refid = c;
+        }
       }
-      centroid[c].color = current;
+
+      centroid[refid].accum_red += bins[b].accum_red;
+      centroid[refid].accum_green += bins[b].accum_green;
+      centroid[refid].accum_blue += bins[b].accum_blue;
+      centroid[refid].accum_alpha += 0xff * bins[b].count;
+      centroid[refid].count += bins[b].count;
     }
 
-    if (refdist < 1) {
+    if (updateCentroids(centroid, nseeds) < 1) {
       break;
     }
   }
 
-  VbitmapUnlock(vbitmap);
+  Ymem_free(means);
+
+  return YMAGINE_OK;
+}
+
+static int
+quantizeHistogram(const unsigned char *pixels, int width, int height, int pitch,
+                  ColorArea *centroid, int maxcolors, int maxiters)
+{
+  int y;
+  int rc;
+  VcolorBin *bins;
+
+  bins = (VcolorBin*) Ymem_calloc(VCOLOR_HISTOGRAM_SIZE, sizeof(VcolorBin));
+  if (bins == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  /* Single pass over pixels */
+  for (y = 0; y < height; y++){
+    VcolorHistogramAdd(bins, pixels + y * pitch, width, 4, 1);
+  }
+
+  rc = quantizeBins(bins, centroid, maxcolors, maxiters);
+  Ymem_free(bins);
+
+  return rc;
+}
+
+/* Rank centroids and copy non-empty ones into colors */
+static int
+quantizeFinish(ColorArea *centroid, int maxcolors,
+               Vcolor *colors, int *scores, int processing)
+{
+  int c;
+  int ncolors;
 
   /* Saturation */
   if (processing == YMAGINE_THEME_SATURATION) {
@@ -352,15 +517,99 @@ quantizeWithOptions(Vbitmap *vbitmap, int maxcolors,
   return ncolors;
 }
 
+static int
+quantizeWithOptions(Vbitmap *vbitmap, int maxcolors,
+                    Vcolor *colors, int *scores, int processing, int method)
+{
+  unsigned char *pixels;
+  ColorArea centroid[PALETTESIZE];
+  int width, height, pitch;
+  int maxiters = 100;
+
+  if (maxcolors <= 0 || colors == NULL) {
+    return 0;
+  }
+  if (vbitmap == NULL) {
+    return 0;
+  }
+
+  if (processing == YMAGINE_THEME_DEFAULT) {
+    processing = YMAGINE_THEME_SATURATION;
+  }
+
+  if (processing != YMAGINE_THEME_NONE && processing != YMAGINE_THEME_SATURATION) {
+    return 0;
+  }
+
+  if (method == YMAGINE_QUANTIZE_DEFAULT) {
+    method = YMAGINE_QUANTIZE_EXACT;
+  }
+
+  if (method != YMAGINE_QUANTIZE_EXACT && method != YMAGINE_QUANTIZE_HISTOGRAM) {
+    return 0;
+  }
+
+  if (VbitmapLock(vbitmap) != YMAGINE_OK) {
+    return 0;
+  }
+
+  pixels = VbitmapBuffer(vbitmap);
+  if (pixels == NULL) {
+    VbitmapUnlock(vbitmap);
+    return 0;
+  }
+
+  width = VbitmapWidth(vbitmap);
+  height = VbitmapHeight(vbitmap);
+  pitch = VbitmapPitch(vbitmap);
+  if (width <= 0 || height <= 0 || pitch <= 0) {
+    VbitmapUnlock(vbitmap);
+    return 0;
+  }
+
+  /* Verify that width*height < 1<<24. This quarantee that will be
+   no overflow in accumulators */
+  if (hasMultiplyOverflow((((uint32_t) 1)<<24), width, height)) {
+    VbitmapUnlock(vbitmap);
+    return 0;
+  }
+
+  /* Initial result, using default palette */
+  if (maxcolors > PALETTESIZE) {
+    maxcolors = PALETTESIZE;
+  }
+
+  if (method != YMAGINE_QUANTIZE_HISTOGRAM ||
+      quantizeHistogram(pixels, width, height, pitch,
+                        centroid, maxcolors, maxiters) != YMAGINE_OK) {
+    quantizePixels(pixels, width, height, pitch,
+                   centroid, maxcolors, maxiters);
+  }
+
+  VbitmapUnlock(vbitmap);
+
+  return quantizeFinish(centroid, maxcolors, colors, scores, processing);
+}
+
 int
 quantize(Vbitmap *vbitmap, int maxcolors,
          Vcolor *colors, int *scores)
 {
-  return quantizeWithOptions(vbitmap, maxcolors, colors, scores, YMAGINE_THEME_NONE);
+  return quantizeWithOptions(vbitmap, maxcolors, colors, scores,
+                             YMAGINE_THEME_NONE, YMAGINE_QUANTIZE_DEFAULT);
 }
 
 int
-getThemeColors(Vbitmap *vbitmap, int ncol, int *colors, int *scores)
+quantizeWithMethod(Vbitmap *vbitmap, int maxcolors,
+                   Vcolor *colors, int *scores, int method)
+{
+  return quantizeWithOptions(vbitmap, maxcolors, colors, scores,
+                             YMAGINE_THEME_NONE, method);
+}
+
+int
+getThemeColorsWithMethod(Vbitmap *vbitmap, int ncol, int *colors, int *scores,
+                         int method)
 {
   int ncolors = 0;
   int i;
@@ -373,7 +622,7 @@ getThemeColors(Vbitmap *vbitmap, int ncol, int *colors, int *scores)
 
   if (vcolors != NULL) {
     ncolors = quantizeWithOptions(vbitmap, ncol, vcolors, scores,
-                                  YMAGINE_THEME_SATURATION);
+                                  YMAGINE_THEME_SATURATION, method);
     for (i = 0; i < ncolors; i++) {
 	    colors[i] = RGBA(vcolors[i].red, vcolors[i].green,
                        vcolors[i].blue, vcolors[i].alpha);
@@ -384,6 +633,45 @@ getThemeColors(Vbitmap *vbitmap, int ncol, int *colors, int *scores)
   return ncolors;
 }
 
+int
+getThemeColorsFromHistogram(VcolorBin *bins, int ncol, int *colors, int *scores)
+{
+  int ncolors = 0;
+  int i;
+  int maxcolors;
+  ColorArea centroid[PALETTESIZE];
+  Vcolor vcolors[PALETTESIZE];
+
+  if (bins == NULL || ncol <= 0) {
+    return 0;
+  }
+
+  maxcolors = ncol;
+  if (maxcolors > PALETTESIZE) {
+    maxcolors = PALETTESIZE;
+  }
+
+  if (quantizeBins(bins, centroid, maxcolors, 100) != YMAGINE_OK) {
+    return 0;
+  }
+
+  ncolors = quantizeFinish(centroid, maxcolors, vcolors, scores,
+                           YMAGINE_THEME_SATURATION);
+  for (i = 0; i < ncolors; i++) {
+    colors[i] = RGBA(vcolors[i].red, vcolors[i].green,
+                     vcolors[i].blue, vcolors[i].alpha);
+  }
+
+  return ncolors;
+}
+
+int
+getThemeColors(Vbitmap *vbitmap, int ncol, int *colors, int *scores)
+{
+  return getThemeColorsWithMethod(vbitmap, ncol, colors, scores,
+                                  YMAGINE_QUANTIZE_DEFAULT);
+}
+
 int
 getThemeColor(Vbitmap *vbitmap)
 {
@@ -28,7 +28,33 @@ typedef struct {
     unsigned char alpha;
 } Vcolor;
 
+/*
+ * Color histogram with 5 bits per channel, as used by
+ * YMAGINE_QUANTIZE_HISTOGRAM. Each bin keeps the sum of the pixels
+ * falling into it, so its mean color is exact even though bins are
+ * coarse. Sums are 32 bits, so at most 1<<24 pixels may be added.
+ */
+#define VCOLOR_HISTOGRAM_BITS 5
+#define VCOLOR_HISTOGRAM_SIZE (1 << (3 * VCOLOR_HISTOGRAM_BITS))
+
+typedef struct {
+  uint32_t accum_red;
+  uint32_t accum_green;
+  uint32_t accum_blue;
+  uint32_t count;
+} VcolorBin;
+
+/* Add one pixel out of step from a line of width pixels of bpp bytes (1, 3 or 4) */
+void VcolorHistogramAdd(VcolorBin *bins, const unsigned char *pixels,
+                        int width, int bpp, int step);
+
+/* Same as getThemeColors, from a histogram. Histogram is modified */
+int getThemeColorsFromHistogram(VcolorBin *bins, int ncol, int *colors, int *scores);
+
 int quantize(Vbitmap *vbitmap, int ncolors, Vcolor *colors, int *scores);
+/* Same as quantize, with a YMAGINE_QUANTIZE_* method */
+int quantizeWithMethod(Vbitmap *vbitmap, int ncolors, Vcolor *colors, int *scores,
+                       int method);
 
 #ifdef __cplusplus
 };
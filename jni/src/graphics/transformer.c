@@ -73,6 +73,9 @@ YOSAL_OBJECT_BEGIN
   int *histg;
   int *histb;
   int *histlum;
+  /* Color histogram for theme colors, fed one line out of themestep */
+  VcolorBin *themebins;
+  int themestep;
 
   unsigned char *destbuf;
   unsigned char *destaligned;
@@ -83,6 +86,17 @@ YOSAL_OBJECT_BEGIN
 
   int *bltmap;
 
+  /* Compose output lines onto bitmap with this mode instead of replacing
+     its pixels (-1 if not), through a RGBA line */
+  int composemode;
+  unsigned char *composebuf;
+
+  /* Scratch memory for transformer and its decoder */
+  Varena arena;
+
+  /* Statistics of running call, if collected */
+  YmagineStatsCollector *collector;
+
   PixelShader *shader;
   float sharpen;
 
@@ -538,6 +552,99 @@ bltLine(unsigned char *opixels, int owidth, int oformat,
   return bltLineExt(opixels, owidth, oformat, ipixels, iwidth, iformat, NULL);
 }
 
+/* Exact n / 255 for n in [0..255*255], without division */
+#define DIV255(n) ((((n) + 1) * 257) >> 16)
+
+int
+YmagineFlattenPrepare(YmagineFlatten *flatten, int iformat, int background)
+{
+  int bg[3];
+  int alpha;
+  int c;
+
+  if (flatten == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  switch (iformat) {
+  case VBITMAP_COLOR_ARGB:
+    flatten->alphaidx = 0;
+    flatten->premultiplied = 0;
+    break;
+  case VBITMAP_COLOR_Argb:
+    flatten->alphaidx = 0;
+    flatten->premultiplied = 1;
+    break;
+  case VBITMAP_COLOR_RGBA:
+    flatten->alphaidx = 3;
+    flatten->premultiplied = 0;
+    break;
+  case VBITMAP_COLOR_rgbA:
+    flatten->alphaidx = 3;
+    flatten->premultiplied = 1;
+    break;
+  default:
+    return YMAGINE_ERROR;
+  }
+
+  bg[0] = YcolorRGBtoRed(background);
+  bg[1] = YcolorRGBtoGreen(background);
+  bg[2] = YcolorRGBtoBlue(background);
+
+  for (c = 0; c < 3; c++) {
+    for (alpha = 0; alpha < 256; alpha++) {
+      flatten->background[c][alpha] = (uint16_t) (bg[c] * (255 - alpha));
+    }
+  }
+
+  return YMAGINE_OK;
+}
+
+YOPTIMIZE_SPEED int
+YmagineFlattenLine(unsigned char *opixels, const unsigned char *ipixels,
+                   int width, const YmagineFlatten *flatten)
+{
+  const unsigned char *ialpha;
+  const unsigned char *icolor;
+  int alpha;
+  int v;
+  int c;
+  int k;
+
+  if (flatten->alphaidx == 0) {
+    ialpha = ipixels;
+    icolor = ipixels + 1;
+  } else {
+    ialpha = ipixels + flatten->alphaidx;
+    icolor = ipixels;
+  }
+
+  for (k = 0; k < width; k++) {
+    alpha = ialpha[0];
+    if (alpha == 0xff) {
+      opixels[0] = icolor[0];
+      opixels[1] = icolor[1];
+      opixels[2] = icolor[2];
+    } else if (flatten->premultiplied) {
+      /* Color already scaled by alpha, only add background */
+      for (c = 0; c < 3; c++) {
+        v = icolor[c] + DIV255(flatten->background[c][alpha]);
+        opixels[c] = (unsigned char) (v > 0xff ? 0xff : v);
+      }
+    } else {
+      for (c = 0; c < 3; c++) {
+        opixels[c] = (unsigned char)
+          DIV255(icolor[c] * alpha + flatten->background[c][alpha]);
+      }
+    }
+    icolor += 4;
+    ialpha += 4;
+    opixels += 3;
+  }
+
+  return YMAGINE_OK;
+}
+
 static YINLINE YOPTIMIZE_SPEED int
 mergeLine(unsigned char *destpixels, int destweight,
           const unsigned char *srcpixels, int srcweight,
@@ -673,21 +780,13 @@ TransformerReleaseCallback(void *ptr)
     return;
   }
 
-  if (transformer->destbuf != NULL) {
-    Ymem_free(transformer->destbuf);
-    transformer->destbuf = NULL;
-    transformer->destaligned = NULL;
-  }
-
-  if (transformer->bltmap != NULL) {
-    Ymem_free(transformer->bltmap);
-    transformer->bltmap = NULL;
-  }
-
-  if (transformer->statsbuf != NULL) {
-    Ymem_free(transformer->statsbuf);
-    transformer->statsbuf = NULL;
-  }
+  /* Working buffers, offset table and histograms all live in arena */
+  VarenaReset(&(transformer->arena));
+  transformer->destbuf = NULL;
+  transformer->destaligned = NULL;
+  transformer->bltmap = NULL;
+  transformer->statsbuf = NULL;
+  transformer->themebins = NULL;
 
   Ymem_free(transformer);
 }
@@ -754,6 +853,8 @@ TransformerCreate()
   transformer->histg = NULL;
   transformer->histb = NULL;
   transformer->histlum = NULL;
+  transformer->themebins = NULL;
+  transformer->themestep = 1;
 
   transformer->scaledbuf = NULL;
   transformer->curbuf = NULL;
@@ -761,6 +862,11 @@ TransformerCreate()
 
   transformer->bltmap = NULL;
 
+  transformer->composemode = -1;
+  transformer->composebuf = NULL;
+
+  VarenaInit(&(transformer->arena));
+
   transformer->obitmap = NULL;
   TransformerSetBitmap(transformer, NULL, 0, 0);
 
@@ -771,9 +877,22 @@ TransformerCreate()
   transformer->writer = NULL;
   transformer->writerdata = NULL;
 
+  /* Transformers live within a single decode or transcode call */
+  transformer->collector = YmagineStatsCurrent();
+
   return transformer;
 }
 
+void*
+TransformerScratch(Transformer *transformer, size_t size)
+{
+  if (transformer == NULL) {
+    return NULL;
+  }
+
+  return VarenaAlloc(&(transformer->arena), size);
+}
+
 Transformer*
 TransformerRetain(Transformer *transformer)
 {
@@ -907,6 +1026,35 @@ TransformerSetStats(Transformer *transformer, int statsmode)
   return YMAGINE_OK;
 }
 
+int
+TransformerGetThemeColors(Transformer *transformer, int ncol, int *colors, int *scores)
+{
+  int ncolors;
+
+  if (transformer == NULL || transformer->themebins == NULL) {
+    return 0;
+  }
+
+  ncolors = getThemeColorsFromHistogram(transformer->themebins, ncol, colors, scores);
+
+  /* Histogram got consumed by quantization */
+  transformer->themebins = NULL;
+
+  return ncolors;
+}
+
+int
+TransformerSetCompose(Transformer *transformer, int composemode)
+{
+  if (transformer == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  transformer->composemode = composemode;
+
+  return YMAGINE_OK;
+}
+
 int
 TransformerSetKernel(Transformer *transformer, int *kernel)
 {
@@ -1017,7 +1165,6 @@ static int
 TransformerPrepare(Transformer *transformer)
 {
   int pitch;
-  void *tmpptr;
   unsigned char* alignedptr = NULL;
   int nlines;
   int alignment = 8;
@@ -1098,12 +1245,13 @@ TransformerPrepare(Transformer *transformer)
   }
 
   if (pitch > 0) {
-    tmpptr = Ymem_malloc_aligned(alignment, pitch * nlines, (void**) &alignedptr);
-    if (tmpptr == NULL) {
+    /* Arena allocations are always aligned on at least 8 bytes */
+    alignedptr = (unsigned char*) VarenaAlloc(&(transformer->arena), pitch * nlines);
+    if (alignedptr == NULL) {
       return YMAGINE_ERROR;
     }
 
-    transformer->destbuf = tmpptr;
+    transformer->destbuf = alignedptr;
     transformer->destaligned = alignedptr;
     transformer->destpitch = pitch;
 
@@ -1119,15 +1267,24 @@ TransformerPrepare(Transformer *transformer)
     }
   }
 
+  if (transformer->composemode >= 0 && transformer->destw > 0) {
+    transformer->composebuf = (unsigned char*) VarenaAlloc(&(transformer->arena),
+                                                           transformer->destw * 4);
+    if (transformer->composebuf == NULL) {
+      return YMAGINE_ERROR;
+    }
+  }
+
   /* Pre-compute offset table for line scaling */
   if (transformer->destrect.width != transformer->srcrect.width && transformer->destrect.width > 0) {
-    transformer->bltmap = (int*) Ymem_malloc(transformer->destrect.width * sizeof(int));
+    transformer->bltmap = (int*) VarenaAlloc(&(transformer->arena),
+                                             transformer->destrect.width * sizeof(int));
     if (transformer->bltmap != NULL) {
       bltLinePrepare(transformer->bltmap, transformer->destrect.width, transformer->srcrect.width);
     }
   }
 
-  if (transformer->statsmode > 0) {
+  if (transformer->statsmode & TRANSFORMER_STATS_HISTOGRAM) {
     if (transformer->srcrect.width > 0 && transformer->srcrect.height > 0) {
       int nchannels;
 
@@ -1142,7 +1299,9 @@ TransformerPrepare(Transformer *transformer)
       }
 
       if (nchannels > 0) {
-        transformer->statsbuf = Ymem_malloc(256 * nchannels * sizeof(int));
+        /* Luminance, then red, green and blue for color modes */
+        transformer->statsbuf = (int*) VarenaAlloc(&(transformer->arena),
+                                                   256 * (nchannels >= 3 ? 4 : 1) * sizeof(int));
         if (transformer->statsbuf != NULL) {
           transformer->histlum = transformer->statsbuf;
           for (i = 0; i < 256; i++) {
@@ -1166,6 +1325,28 @@ TransformerPrepare(Transformer *transformer)
     }
   }
 
+  if (transformer->statsmode & TRANSFORMER_STATS_THEME) {
+    if (transformer->srcrect.width > 0 && transformer->srcrect.height > 0 &&
+        (transformer->srcmode == VBITMAP_COLOR_GRAYSCALE ||
+         transformer->srcmode == VBITMAP_COLOR_RGB ||
+         transformer->srcmode == VBITMAP_COLOR_RGBA)) {
+      int step = 1;
+
+      /* Sample rows and columns so histogram sums can't overflow */
+      while (((uint64_t) ((transformer->srcrect.width + step - 1) / step)) *
+             ((transformer->srcrect.height + step - 1) / step) >= (((uint64_t) 1) << 24)) {
+        step++;
+      }
+      transformer->themestep = step;
+
+      transformer->themebins = (VcolorBin*) VarenaAlloc(&(transformer->arena),
+                                                        VCOLOR_HISTOGRAM_SIZE * sizeof(VcolorBin));
+      if (transformer->themebins != NULL) {
+        memset(transformer->themebins, 0, VCOLOR_HISTOGRAM_SIZE * sizeof(VcolorBin));
+      }
+    }
+  }
+
   return YMAGINE_OK;
 }
 
@@ -1192,9 +1373,18 @@ WriterVbitmap(Transformer *transformer, const unsigned char *destptr)
       unsigned char *srcc = (unsigned char*)
         (destptr + srcx * transformer->srcbpp);
 
-      bltLineExt(destc, destw, transformer->omode,
-                 srcc, destw, transformer->destmode,
-                 NULL);
+      if (transformer->composebuf != NULL) {
+        bltLineExt(transformer->composebuf, destw, VBITMAP_COLOR_RGBA,
+                   srcc, destw, transformer->destmode,
+                   NULL);
+        YmagineComposeLine(destc, transformer->omode,
+                           transformer->composebuf, destw,
+                           transformer->composemode);
+      } else {
+        bltLineExt(destc, destw, transformer->omode,
+                   srcc, destw, transformer->destmode,
+                   NULL);
+      }
     }
   }
 
@@ -1204,14 +1394,20 @@ WriterVbitmap(Transformer *transformer, const unsigned char *destptr)
 static void
 TransformerOutput(Transformer *transformer, unsigned char * destptr)
 {
+  nsecs_t start;
+
   /* Default writers (currently to attached Vbitmap) */
   if (transformer->obuffer != NULL) {
+    start = YMAGINE_STATS_NOW(transformer->collector);
     WriterVbitmap(transformer, destptr);
+    YMAGINE_STATS_TIME(transformer->collector, scale, start);
   }
 
-  /* Custom writer */
+  /* Custom writer, an encoder when transcoding */
   if (transformer->writer != NULL) {
+    start = YMAGINE_STATS_NOW(transformer->collector);
     transformer->writer(transformer, transformer->writerdata, destptr);
+    YMAGINE_STATS_TIME(transformer->collector, encode, start);
   }
 }
 
@@ -1335,9 +1531,16 @@ ConvolutionApply(Transformer *transformer,
 static void
 TransformerFlush(Transformer *transformer, unsigned char* destptr)
 {
+  nsecs_t start;
+  YBOOL ready;
+
   if (transformer->convmode != TRANSFORMER_CONVOLUTION_NONE) {
     /* boundary condition: at row h - 1, replicate convcur as row h */
-    if (ConvolutionApply(transformer, destptr, transformer->convcur)) {
+    start = YMAGINE_STATS_NOW(transformer->collector);
+    ready = ConvolutionApply(transformer, destptr, transformer->convcur);
+    YMAGINE_STATS_TIME(transformer->collector, sharpen, start);
+
+    if (ready) {
       TransformerOutput(transformer, destptr);
     } else {
       ALOGE("convolution should have output when transformer flushes.");
@@ -1352,13 +1555,20 @@ TransformerFlush(Transformer *transformer, unsigned char* destptr)
 static YBOOL
 TransformerPrepareOutput(Transformer *transformer, unsigned char *destptr)
 {
+  nsecs_t start;
+  YBOOL ready;
+
   if (transformer->convmode != TRANSFORMER_CONVOLUTION_NONE) {
+    start = YMAGINE_STATS_NOW(transformer->collector);
     if (transformer->desty == 0) {
       /* boundary condition: at row 0, replicate destptr as row -1 */
       ConvolutionApply(transformer, destptr, destptr);
     }
 
-    return ConvolutionApply(transformer, destptr, destptr);
+    ready = ConvolutionApply(transformer, destptr, destptr);
+    YMAGINE_STATS_TIME(transformer->collector, sharpen, start);
+
+    return ready;
   } else {
     return YTRUE;
   }
@@ -1372,6 +1582,7 @@ TransformerPush(Transformer *transformer, const char *line)
   int i;
   int weight;
   int nextyfrac;
+  nsecs_t start;
 
   if (line == NULL) {
     return YMAGINE_ERROR;
@@ -1417,7 +1628,15 @@ TransformerPush(Transformer *transformer, const char *line)
                                         transformer->srcrect.height, transformer->destrect.height);
   transformer->nexty = Y_INT(transformer->nextyf);
 
-  if (transformer->statsmode > 0) {
+  if (transformer->themebins != NULL &&
+      (transformer->srcline - transformer->srcrect.y) % transformer->themestep == 0) {
+    /* Accumulate colors while pixels go by, so theme colors don't need
+       another pass over the output */
+    VcolorHistogramAdd(transformer->themebins, srcptr, transformer->srcrect.width,
+                       transformer->srcbpp, transformer->themestep);
+  }
+
+  if (transformer->histlum != NULL) {
     /* Collect statistics for the segment of the line intersecting the active region */
     if (transformer->srcrect.width > 0) {
       const unsigned char *nextc = srcptr;
@@ -1467,6 +1686,7 @@ TransformerPush(Transformer *transformer, const char *line)
     weight = YFIXED_ONE;
   }
 
+  start = YMAGINE_STATS_NOW(transformer->collector);
   bltLineExt(transformer->scaledbuf, transformer->destrect.width, transformer->destmode,
              srcptr, transformer->srcrect.width, transformer->srcmode,
              transformer->bltmap);
@@ -1479,6 +1699,7 @@ TransformerPush(Transformer *transformer, const char *line)
     return YMAGINE_ERROR;
   }
   transformer->stashedweight += weight;
+  YMAGINE_STATS_TIME(transformer->collector, scale, start);
 
   if (transformer->nexty > transformer->cury) {
     /* Last input line for this output line */
@@ -1486,6 +1707,7 @@ TransformerPush(Transformer *transformer, const char *line)
       transformer->desty++;
 
       if (transformer->shader != NULL) {
+        start = YMAGINE_STATS_NOW(transformer->collector);
         if (Yshader_hasVignette(transformer->shader)) {
           /* Has vignette shader (y-dependent), save original line,
              and apply shader according to transformer->desty */
@@ -1508,6 +1730,7 @@ TransformerPush(Transformer *transformer, const char *line)
                           0, transformer->desty);
           }
         }
+        YMAGINE_STATS_TIME(transformer->collector, shader, start);
       }
 
       if (TransformerPrepareOutput(transformer, destptr)) {
@@ -26,6 +26,23 @@ extern "C" {
 int bltLine(unsigned char *opixels, int owidth, int obpp,
 	    const unsigned char *ipixels, int iwidth, int ibpp);
 
+/* Lookup tables to flatten pixels with alpha onto an opaque background,
+   for encoders without alpha support */
+typedef struct {
+  int alphaidx;
+  int premultiplied;
+  /* Background component times (255 - alpha) */
+  uint16_t background[3][256];
+} YmagineFlatten;
+
+int
+YmagineFlattenPrepare(YmagineFlatten *flatten, int iformat, int background);
+
+/* Convert width pixels to RGB, flattened as prepared */
+int
+YmagineFlattenLine(unsigned char *opixels, const unsigned char *ipixels,
+                   int width, const YmagineFlatten *flatten);
+
 int
 YmagineMergeLine(unsigned char *destpixels, int destmode, int destweight,
                  const unsigned char *srcpixels, int srcmode, int srcweight,
@@ -33,6 +50,16 @@ YmagineMergeLine(unsigned char *destpixels, int destmode, int destweight,
 
 int
 TransformerSetKernel(Transformer *transformer, int *kernel);
+
+/* Compose lines onto attached bitmap with composemode, instead of
+   overwriting its pixels. Pass -1 to restore overwriting */
+int
+TransformerSetCompose(Transformer *transformer, int composemode);
+
+/* Scratch memory released together with transformer. Decoders driving a
+   transformer should get their own working buffers from here */
+void*
+TransformerScratch(Transformer *transformer, size_t size);
 #ifdef __cplusplus
 };
 #endif
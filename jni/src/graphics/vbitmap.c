@@ -96,7 +96,7 @@ vbitmap_release_callback(void *ptr)
 
   if (vbitmap->bitmaptype == VBITMAP_MEMORY) {
     if (vbitmap->pixels != NULL) {
-      Ymem_free(vbitmap->pixels);
+      VbitmapPoolFree(vbitmap->pixels);
     }
     if (vbitmap->region != NULL) {
       Ymem_free(vbitmap->region);
@@ -243,6 +243,7 @@ VbitmapInitMemory(int colormode)
     case VBITMAP_COLOR_RGBA:
     case VBITMAP_COLOR_RGB:
     case VBITMAP_COLOR_GRAYSCALE:
+    case VBITMAP_COLOR_YUV:
       break;
     default:
       /* Unsupported color mode */
@@ -402,17 +403,26 @@ VbitmapResize(Vbitmap *vbitmap, int width, int height)
   if (vbitmap->bitmaptype == VBITMAP_MEMORY) {
     int bpp = colorBpp(VbitmapColormode(vbitmap));
     int pitch = width * bpp;
+    size_t capacity;
     unsigned char *pixels = NULL;
 
-    if (pitch > 0) {
-      pixels = Ymem_malloc(pitch * height);
-    }
-    if (pixels == NULL) {
+    if (pitch <= 0) {
       return YMAGINE_ERROR;
     }
 
-    if (vbitmap->pixels != NULL) {
-      Ymem_free(vbitmap->pixels);
+    capacity = VbitmapPoolCapacity(vbitmap->pixels);
+    if (capacity >= (size_t) pitch * height &&
+        capacity / 2 < (size_t) pitch * height) {
+      /* Current backing store is large enough and not oversized, keep it */
+      pixels = vbitmap->pixels;
+    } else {
+      pixels = VbitmapPoolAlloc((size_t) pitch * height);
+      if (pixels == NULL) {
+        return YMAGINE_ERROR;
+      }
+      if (vbitmap->pixels != NULL) {
+        VbitmapPoolFree(vbitmap->pixels);
+      }
     }
 
     vbitmap->pixels = pixels;
@@ -880,3 +890,327 @@ VbitmapComputePSNR(Vbitmap *vbitmap, Vbitmap *reference)
   return psnr;
 }
 
+/*
+ * Structural similarity, on luminance only. Statistics are computed over
+ * 8x8 windows laid on a 4 pixels grid, built from sums over 4x4 blocks so
+ * each pixel is only read once. MS-SSIM repeats this on 2x box filtered
+ * images, see Wang et al., "Multi-scale structural similarity for image
+ * quality assessment" (2003).
+ */
+#define SSIM_C1 ((0.01 * 255.0) * (0.01 * 255.0))
+#define SSIM_C2 ((0.03 * 255.0) * (0.03 * 255.0))
+#define SSIM_WINDOW 8
+#define SSIM_MAX_SCALES 5
+
+static const double msssimWeights[SSIM_MAX_SCALES] = {
+  0.0448, 0.2856, 0.3001, 0.2363, 0.1333
+};
+
+/* Luminance plane of bitmap, width x height bytes, or NULL if unsupported */
+static unsigned char*
+ssimLuminance(Vbitmap *vbitmap)
+{
+  int x;
+  int y;
+  int width;
+  int height;
+  int pitch;
+  int bpp;
+  int roff = 0;
+  unsigned char *buffer;
+  unsigned char *plane;
+  const unsigned char *src;
+  unsigned char *dst;
+
+  width = VbitmapWidth(vbitmap);
+  height = VbitmapHeight(vbitmap);
+  bpp = VbitmapBpp(vbitmap);
+
+  switch (VbitmapColormode(vbitmap)) {
+  case VBITMAP_COLOR_RGBA:
+  case VBITMAP_COLOR_rgbA:
+  case VBITMAP_COLOR_RGB:
+    roff = 0;
+    break;
+  case VBITMAP_COLOR_ARGB:
+  case VBITMAP_COLOR_Argb:
+    roff = 1;
+    break;
+  case VBITMAP_COLOR_GRAYSCALE:
+  case VBITMAP_COLOR_YUV:
+  case VBITMAP_COLOR_YCbCr:
+    /* Luminance is first channel */
+    roff = -1;
+    break;
+  default:
+    return NULL;
+  }
+
+  plane = (unsigned char*) Ymem_malloc(width * height);
+  if (plane == NULL) {
+    return NULL;
+  }
+
+  if (VbitmapLock(vbitmap) != YMAGINE_OK) {
+    Ymem_free(plane);
+    return NULL;
+  }
+
+  buffer = VbitmapBuffer(vbitmap);
+  pitch = VbitmapPitch(vbitmap);
+  if (buffer == NULL) {
+    VbitmapUnlock(vbitmap);
+    Ymem_free(plane);
+    return NULL;
+  }
+
+  for (y = 0; y < height; y++) {
+    src = buffer + y * pitch;
+    dst = plane + y * width;
+    if (roff < 0) {
+      for (x = 0; x < width; x++) {
+        dst[x] = src[0];
+        src += bpp;
+      }
+    } else {
+      src += roff;
+      for (x = 0; x < width; x++) {
+        dst[x] = (unsigned char) ((218 * src[0] + 732 * src[1] + 74 * src[2]) >> 10);
+        src += bpp;
+      }
+    }
+  }
+
+  VbitmapUnlock(vbitmap);
+
+  return plane;
+}
+
+/* Sums of p1, p2, p1^2 + p2^2 and p1 * p2 over each 4x4 block of a row of blocks */
+static YOPTIMIZE_SPEED void
+ssimBlockSums(const unsigned char *p1, const unsigned char *p2, int pitch,
+              int nblocks, int *sums)
+{
+  int bx;
+  int x;
+  int y;
+  int a;
+  int b;
+  int s1;
+  int s2;
+  int ss;
+  int s12;
+
+  for (bx = 0; bx < nblocks; bx++) {
+    s1 = 0;
+    s2 = 0;
+    ss = 0;
+    s12 = 0;
+    for (y = 0; y < 4; y++) {
+      for (x = 0; x < 4; x++) {
+        a = p1[y * pitch + 4 * bx + x];
+        b = p2[y * pitch + 4 * bx + x];
+        s1 += a;
+        s2 += b;
+        ss += a * a + b * b;
+        s12 += a * b;
+      }
+    }
+    sums[4 * bx + 0] = s1;
+    sums[4 * bx + 1] = s2;
+    sums[4 * bx + 2] = ss;
+    sums[4 * bx + 3] = s12;
+  }
+}
+
+/* Mean SSIM of two luminance planes, and mean of its contrast and structure term */
+static int
+ssimPlane(const unsigned char *p1, const unsigned char *p2,
+          int width, int height, double *ssim, double *cs)
+{
+  int nbx = width / 4;
+  int nby = height / 4;
+  int bx;
+  int by;
+  int k;
+  int count = 0;
+  int *sums;
+  int *prev;
+  int *cur;
+  int *tmp;
+  int w[4];
+  double n = (double) (SSIM_WINDOW * SSIM_WINDOW);
+  double mu1;
+  double mu2;
+  double var;
+  double cov;
+  double c;
+  double ssimsum = 0.0;
+  double cssum = 0.0;
+
+  if (width < SSIM_WINDOW || height < SSIM_WINDOW) {
+    return YMAGINE_ERROR;
+  }
+
+  sums = (int*) Ymem_malloc(2 * 4 * nbx * sizeof(int));
+  if (sums == NULL) {
+    return YMAGINE_ERROR;
+  }
+  prev = sums;
+  cur = sums + 4 * nbx;
+
+  ssimBlockSums(p1, p2, width, nbx, prev);
+  for (by = 1; by < nby; by++) {
+    ssimBlockSums(p1 + 4 * by * width, p2 + 4 * by * width, width, nbx, cur);
+
+    for (bx = 0; bx + 1 < nbx; bx++) {
+      for (k = 0; k < 4; k++) {
+        w[k] = prev[4 * bx + k] + prev[4 * (bx + 1) + k] +
+          cur[4 * bx + k] + cur[4 * (bx + 1) + k];
+      }
+
+      mu1 = w[0] / n;
+      mu2 = w[1] / n;
+      var = w[2] / n - mu1 * mu1 - mu2 * mu2;
+      cov = w[3] / n - mu1 * mu2;
+
+      c = (2.0 * cov + SSIM_C2) / (var + SSIM_C2);
+      cssum += c;
+      ssimsum += c * (2.0 * mu1 * mu2 + SSIM_C1) / (mu1 * mu1 + mu2 * mu2 + SSIM_C1);
+      count++;
+    }
+
+    tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+
+  Ymem_free(sums);
+
+  if (count <= 0) {
+    return YMAGINE_ERROR;
+  }
+
+  *ssim = ssimsum / count;
+  *cs = cssum / count;
+
+  return YMAGINE_OK;
+}
+
+/* Downscale plane by 2 in place with a box filter */
+static void
+ssimDownscale(unsigned char *plane, int width, int height)
+{
+  int x;
+  int y;
+  int dw = width / 2;
+  int dh = height / 2;
+  const unsigned char *r0;
+  const unsigned char *r1;
+
+  for (y = 0; y < dh; y++) {
+    r0 = plane + (2 * y) * width;
+    r1 = r0 + width;
+    /* Output row y never overlaps input rows 2y and 2y+1 still to be read */
+    for (x = 0; x < dw; x++) {
+      plane[y * dw + x] = (unsigned char)
+        ((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2);
+    }
+  }
+}
+
+static double
+computeSSIM(Vbitmap *vbitmap, Vbitmap *reference, int nscales)
+{
+  unsigned char *p1;
+  unsigned char *p2;
+  int width;
+  int height;
+  int scale;
+  double ssim = -1.0;
+  double value;
+  double cs;
+  double weight = 0.0;
+  double logsum = 0.0;
+
+  if (vbitmap == NULL || reference == NULL ||
+      VbitmapWidth(vbitmap) != VbitmapWidth(reference) ||
+      VbitmapHeight(vbitmap) != VbitmapHeight(reference)) {
+    return -1.0;
+  }
+
+  if (vbitmap == reference) {
+    return 1.0;
+  }
+
+  width = VbitmapWidth(vbitmap);
+  height = VbitmapHeight(vbitmap);
+  if (width < SSIM_WINDOW || height < SSIM_WINDOW) {
+    return -1.0;
+  }
+
+  p1 = ssimLuminance(vbitmap);
+  p2 = ssimLuminance(reference);
+
+  if (p1 != NULL && p2 != NULL) {
+    for (scale = 0; scale < nscales; scale++) {
+      if (ssimPlane(p1, p2, width, height, &value, &cs) != YMAGINE_OK) {
+        break;
+      }
+
+      if (nscales == 1) {
+        ssim = value;
+        break;
+      }
+
+      /* Luminance term only counts at coarsest scale, hence cs before it */
+      if (scale == nscales - 1 ||
+          width / 2 < SSIM_WINDOW || height / 2 < SSIM_WINDOW) {
+        logsum += msssimWeights[scale] * log(MAX(value, 1.0e-10));
+        weight += msssimWeights[scale];
+        break;
+      }
+      logsum += msssimWeights[scale] * log(MAX(cs, 1.0e-10));
+      weight += msssimWeights[scale];
+
+      ssimDownscale(p1, width, height);
+      ssimDownscale(p2, width, height);
+      width /= 2;
+      height /= 2;
+    }
+
+    if (nscales > 1 && weight > 0.0) {
+      /* Renormalize weights when image is too small for all scales */
+      ssim = exp(logsum / weight);
+    }
+  }
+
+  if (p1 != NULL) {
+    Ymem_free(p1);
+  }
+  if (p2 != NULL) {
+    Ymem_free(p2);
+  }
+
+  if (ssim > 1.0) {
+    ssim = 1.0;
+  } else if (ssim < 0.0 && ssim > -1.0) {
+    /* Anticorrelated images aren't any more similar than unrelated ones */
+    ssim = 0.0;
+  }
+
+  return ssim;
+}
+
+double
+VbitmapComputeSSIM(Vbitmap *vbitmap, Vbitmap *reference)
+{
+  return computeSSIM(vbitmap, reference, 1);
+}
+
+double
+VbitmapComputeMSSSIM(Vbitmap *vbitmap, Vbitmap *reference)
+{
+  return computeSSIM(vbitmap, reference, SSIM_MAX_SCALES);
+}
+
@@ -44,10 +44,14 @@
 #include "graphics/fixedpoint.h"
 #include "graphics/xmp.h"
 #include "graphics/region.h"
+#include "graphics/pool.h"
 #include "graphics/bitmap.h"
 #include "graphics/quantize.h"
 #include "filters/blur.h"
+#include "filters/compose.h"
 #include "filters/sobel.h"
+#include "filters/smartcrop.h"
+#include "filters/overlay.h"
 #include "graphics/color.h"
 #include "graphics/transformer.h"
 #include "shaders/filterutils.h"
@@ -21,6 +21,10 @@ LOCAL_SRC_FILES += main_shape.c
 LOCAL_SRC_FILES += main_psnr.c
 LOCAL_SRC_FILES += main_blur.c
 LOCAL_SRC_FILES += main_convolution.c
+LOCAL_SRC_FILES += main_pngsweep.c
+LOCAL_SRC_FILES += main_codecbench.c
+LOCAL_SRC_FILES += main_themebench.c
+LOCAL_SRC_FILES += main_corpusbench.c
 LOCAL_SRC_FILES += ymagine.c
 
 LOCAL_CFLAGS += -Wall -Werror
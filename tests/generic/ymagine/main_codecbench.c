@@ -0,0 +1,226 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#include "ymagine_main.h"
+
+/* Scratch memory kept by each benchmarking thread between images */
+#define CODECBENCH_CACHE_SIZE (32 * 1024 * 1024)
+
+int
+usage_codecbench()
+{
+  fprintf(stdout, "usage: ymagine codecbench [-width width] [-height height] [-iter n] [-format jpeg|webp|png] [-out tmpfile] infile\n");
+  fprintf(stdout, "  transcode infile into a small thumbnail n times, first creating codec\n");
+  fprintf(stdout, "  objects for every image, then reusing them through a codec context,\n");
+  fprintf(stdout, "  and report average time per image for each of them\n");
+  fflush(stdout);
+
+  return 0;
+}
+
+/* Transcode in-memory image niters times, return average time per image in ms */
+static double
+benchTranscode(const char *data, size_t length, int fd,
+               YmagineFormatOptions *options, int niters, int *failures)
+{
+  int i;
+  NSTYPE start, end;
+  double ms = 0.0;
+  Ychannel *channelin;
+  Ychannel *channelout;
+
+  *failures = 0;
+
+  for (i = 0; i < niters; i++) {
+    lseek(fd, 0, SEEK_SET);
+    channelin = YchannelInitByteArray(data, (int) length);
+    channelout = YchannelInitFd(fd, 1);
+    if (channelin == NULL || channelout == NULL) {
+      (*failures)++;
+    } else {
+      start = NSTIME();
+      if (YmagineTranscode(channelin, channelout, options) != YMAGINE_OK) {
+        (*failures)++;
+      }
+      end = NSTIME();
+      ms += ((double) (end - start)) / 1000000.0;
+    }
+
+    if (channelout != NULL) {
+      YchannelRelease(channelout);
+    }
+    if (channelin != NULL) {
+      YchannelResetBuffer(channelin);
+      YchannelRelease(channelin);
+    }
+  }
+
+  return ms / niters;
+}
+
+static void
+benchReport(const char *setup, int niters, int failures, double ms)
+{
+  fprintf(stdout, "%s\t%d\t%d\t%.3f\n", setup, niters, failures, ms);
+  fflush(stdout);
+}
+
+int
+main_codecbench(int argc, const char* argv[])
+{
+  int i;
+  const char *infile;
+  const char *outfile = "codecbench.tmp";
+  int width = 100;
+  int height = 100;
+  int niters = 200;
+  int oformat = YMAGINE_IMAGEFORMAT_UNKNOWN;
+  int fd;
+  int failures;
+  double ms;
+  char *fbase;
+  size_t flen = 0;
+  YmagineCodecContext *context;
+  YmagineFormatOptions *options;
+
+  for (i = 0; i < argc; i++) {
+    if (argv[i][0] != '-') {
+      break;
+    }
+    if (argv[i][1] == '-' && argv[i][2] == 0) {
+      i++;
+      break;
+    }
+
+    if (argv[i][1] == 'w' && strcmp(argv[i], "-width") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      width = atoi(argv[i]);
+    } else if (argv[i][1] == 'h' && strcmp(argv[i], "-height") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      height = atoi(argv[i]);
+    } else if (argv[i][1] == 'i' && strcmp(argv[i], "-iter") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      niters = atoi(argv[i]);
+      if (niters < 1) {
+        niters = 1;
+      }
+    } else if (argv[i][1] == 'f' && strcmp(argv[i], "-format") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      if (strcmp(argv[i], "jpeg") == 0 || strcmp(argv[i], "jpg") == 0) {
+        oformat = YMAGINE_IMAGEFORMAT_JPEG;
+      } else if (strcmp(argv[i], "webp") == 0) {
+        oformat = YMAGINE_IMAGEFORMAT_WEBP;
+      } else if (strcmp(argv[i], "png") == 0) {
+        oformat = YMAGINE_IMAGEFORMAT_PNG;
+      } else {
+        oformat = YMAGINE_IMAGEFORMAT_UNKNOWN;
+      }
+    } else if (argv[i][1] == 'o' && strcmp(argv[i], "-out") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      outfile = argv[i];
+    } else {
+      fprintf(stdout, "unknown option \"%s\"\n", argv[i]);
+      fflush(stdout);
+      return 1;
+    }
+  }
+
+  if (i >= argc) {
+    usage_codecbench();
+    return 1;
+  }
+
+  infile = argv[i];
+
+  /* Keep input in memory, so only codec work gets measured */
+  fbase = LoadDataFromFile(infile, &flen);
+  if (fbase == NULL) {
+    fprintf(stdout, "failed to load input file \"%s\"\n", infile);
+    fflush(stdout);
+    return 1;
+  }
+
+  fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (fd < 0) {
+    fprintf(stdout, "failed to open output file \"%s\"\n", outfile);
+    fflush(stdout);
+    Ymem_free(fbase);
+    return 1;
+  }
+
+  options = YmagineFormatOptions_Create();
+  YmagineFormatOptions_setResize(options, width, height, YMAGINE_SCALE_LETTERBOX);
+  if (oformat != YMAGINE_IMAGEFORMAT_UNKNOWN) {
+    YmagineFormatOptions_setFormat(options, oformat);
+  }
+
+  fprintf(stdout, "# %s to %dx%d, %d iteration(s) per setup\n",
+          infile, width, height, niters);
+  fprintf(stdout, "setup\titer\tfailures\tms\n");
+  fflush(stdout);
+
+  /* Warm up, so first measured setup doesn't pay for page faults */
+  benchTranscode(fbase, flen, fd, options, 1, &failures);
+
+  /* Codec objects created and destroyed for every image */
+  ms = benchTranscode(fbase, flen, fd, options, niters, &failures);
+  benchReport("fresh", niters, failures, ms);
+
+  /* Codec objects reset and reused between images */
+  context = YmagineCodecContext_Create();
+  if (context != NULL && YmagineCodecContext_Bind(context) == YMAGINE_OK) {
+    ms = benchTranscode(fbase, flen, fd, options, niters, &failures);
+    benchReport("context", niters, failures, ms);
+
+    /* Same, with scratch and codec buffers recycled as well */
+    if (VbitmapPoolCacheAttach(CODECBENCH_CACHE_SIZE) == YMAGINE_OK) {
+      ms = benchTranscode(fbase, flen, fd, options, niters, &failures);
+      benchReport("context+pool", niters, failures, ms);
+      VbitmapPoolCacheDetach();
+    }
+
+    YmagineCodecContext_Bind(NULL);
+  }
+  YmagineCodecContext_Release(context);
+
+  YmagineFormatOptions_Release(options);
+  close(fd);
+  unlink(outfile);
+  Ymem_free(fbase);
+
+  return 0;
+}
@@ -0,0 +1,766 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#include "ymagine_main.h"
+
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define CORPUSBENCH_DECODE    0
+#define CORPUSBENCH_TRANSCODE 1
+#define CORPUSBENCH_SHADER    2
+#define CORPUSBENCH_BLUR      3
+#define CORPUSBENCH_QUANTIZE  4
+
+#define CORPUSBENCH_MAXOPS    16
+#define CORPUSBENCH_NAMELEN   64
+
+typedef struct {
+  const char *name;
+  int kind;
+  int format;
+} corpusbenchop;
+
+static const corpusbenchop benchOps[] = {
+  { "decode", CORPUSBENCH_DECODE, YMAGINE_IMAGEFORMAT_UNKNOWN },
+  { "jpeg", CORPUSBENCH_TRANSCODE, YMAGINE_IMAGEFORMAT_JPEG },
+  { "webp", CORPUSBENCH_TRANSCODE, YMAGINE_IMAGEFORMAT_WEBP },
+  { "png", CORPUSBENCH_TRANSCODE, YMAGINE_IMAGEFORMAT_PNG },
+  { "shader", CORPUSBENCH_SHADER, YMAGINE_IMAGEFORMAT_UNKNOWN },
+  { "blur", CORPUSBENCH_BLUR, YMAGINE_IMAGEFORMAT_UNKNOWN },
+  { "quantize", CORPUSBENCH_QUANTIZE, YMAGINE_IMAGEFORMAT_UNKNOWN }
+};
+
+#define CORPUSBENCH_NOPS ((int) (sizeof(benchOps) / sizeof(benchOps[0])))
+
+typedef struct {
+  char *data;
+  size_t length;
+  /* Decoded at benchmark size, input of blur and quantize */
+  Vbitmap *bitmap;
+} corpusbenchimage;
+
+typedef struct {
+  int width;
+  int height;
+  int niters;
+  int radius;
+  int ncolors;
+  int fd;
+  PixelShader *shader;
+} corpusbenchparams;
+
+/* Result of one operation, as reported and as read back from a baseline */
+typedef struct {
+  char name[CORPUSBENCH_NAMELEN];
+  int count;
+  int failures;
+  double p50;
+  double p95;
+  double p99;
+  double ips;
+  double mbps;
+  long maxrss;
+  /* Channel reads and writes per image, when operation does any */
+  double reads;
+  double writes;
+} corpusbenchresult;
+
+int
+usage_corpusbench()
+{
+  fprintf(stdout, "usage: ymagine corpusbench [-width width] [-height height] [-iter n] [-ops op,...] [-save file] [-baseline file] [-threshold percent] [-iobuffer bytes] [-out tmpfile] dir\n");
+  fprintf(stdout, "  run each operation over every image of dir, and report latency percentiles\n");
+  fprintf(stdout, "  (ms), throughput, peak RSS and channel reads and writes per image as tab\n");
+  fprintf(stdout, "  separated values. Operations are\n");
+  fprintf(stdout, "  decode, jpeg, webp, png (transcode), shader, blur and quantize (default all).\n");
+  fprintf(stdout, "  Results can be saved, and later compared against with -baseline, in which\n");
+  fprintf(stdout, "  case exit status is 2 if p50 or p95 of any operation regressed by more than\n");
+  fprintf(stdout, "  threshold percent (default 10)\n");
+  fflush(stdout);
+
+  return 0;
+}
+
+static long
+peakRSS()
+{
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return -1;
+  }
+
+#ifdef __APPLE__
+  /* Reported in bytes instead of kilobytes */
+  return (long) (usage.ru_maxrss / 1024);
+#else
+  return (long) usage.ru_maxrss;
+#endif
+}
+
+static int
+compareDouble(const void *a, const void *b)
+{
+  double da = *((const double*) a);
+  double db = *((const double*) b);
+
+  return (da > db) - (da < db);
+}
+
+/* Nearest rank percentile of sorted samples */
+static double
+percentile(const double *samples, int n, int p)
+{
+  int rank;
+
+  if (n <= 0) {
+    return 0.0;
+  }
+
+  rank = (p * n + 99) / 100;
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  return samples[rank - 1];
+}
+
+static int
+loadCorpus(const char *dirname, int width, int height,
+           corpusbenchimage **imagesref)
+{
+  DIR *dir;
+  struct dirent *entry;
+  struct stat statbuf;
+  char path[1024];
+  int maximages = 0;
+  int nimages = 0;
+  corpusbenchimage *images;
+  corpusbenchimage *image;
+  Ychannel *channel;
+
+  dir = opendir(dirname);
+  if (dir == NULL) {
+    return -1;
+  }
+
+  while ((entry = readdir(dir)) != NULL) {
+    maximages++;
+  }
+  rewinddir(dir);
+
+  images = (corpusbenchimage*) Ymem_calloc(maximages + 1, sizeof(corpusbenchimage));
+  if (images == NULL) {
+    closedir(dir);
+    return -1;
+  }
+
+  while ((entry = readdir(dir)) != NULL && nimages < maximages) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+    if (stat(path, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+      continue;
+    }
+
+    image = &(images[nimages]);
+    image->data = LoadDataFromFile(path, &(image->length));
+    if (image->data == NULL) {
+      continue;
+    }
+
+    /* Keep supported images only, decoded once for in-memory operations */
+    image->bitmap = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+    channel = YchannelInitByteArray(image->data, (int) image->length);
+    if (image->bitmap == NULL || channel == NULL ||
+        YmagineFormat(channel) == YMAGINE_IMAGEFORMAT_UNKNOWN ||
+        YmagineDecodeResize(image->bitmap, channel, width, height,
+                            YMAGINE_SCALE_LETTERBOX) != YMAGINE_OK) {
+      fprintf(stdout, "# skipping \"%s\"\n", path);
+      if (image->bitmap != NULL) {
+        VbitmapRelease(image->bitmap);
+        image->bitmap = NULL;
+      }
+      Ymem_free(image->data);
+      image->data = NULL;
+    } else {
+      nimages++;
+    }
+
+    if (channel != NULL) {
+      YchannelResetBuffer(channel);
+      YchannelRelease(channel);
+    }
+  }
+  closedir(dir);
+
+  *imagesref = images;
+
+  return nimages;
+}
+
+static void
+releaseCorpus(corpusbenchimage *images, int nimages)
+{
+  int i;
+
+  for (i = 0; i < nimages; i++) {
+    if (images[i].bitmap != NULL) {
+      VbitmapRelease(images[i].bitmap);
+    }
+    if (images[i].data != NULL) {
+      Ymem_free(images[i].data);
+    }
+  }
+  Ymem_free(images);
+}
+
+/* Copy of bitmap, for operations modifying their input */
+static Vbitmap*
+cloneBitmap(Vbitmap *vbitmap)
+{
+  Vbitmap *copy;
+  unsigned char *ipixels;
+  unsigned char *opixels;
+  int ipitch;
+  int opitch;
+  int rowlen;
+  int width;
+  int height;
+  int y;
+
+  width = VbitmapWidth(vbitmap);
+  height = VbitmapHeight(vbitmap);
+
+  copy = VbitmapInitMemory(VbitmapColormode(vbitmap));
+  if (copy == NULL) {
+    return NULL;
+  }
+  if (VbitmapResize(copy, width, height) != YMAGINE_OK) {
+    VbitmapRelease(copy);
+    return NULL;
+  }
+
+  if (VbitmapLock(vbitmap) != YMAGINE_OK) {
+    VbitmapRelease(copy);
+    return NULL;
+  }
+  if (VbitmapLock(copy) != YMAGINE_OK) {
+    VbitmapUnlock(vbitmap);
+    VbitmapRelease(copy);
+    return NULL;
+  }
+
+  ipixels = VbitmapBuffer(vbitmap);
+  opixels = VbitmapBuffer(copy);
+  ipitch = VbitmapPitch(vbitmap);
+  opitch = VbitmapPitch(copy);
+  rowlen = width * VbitmapBpp(vbitmap);
+  for (y = 0; y < height; y++) {
+    memcpy(opixels + y * opitch, ipixels + y * ipitch, rowlen);
+  }
+
+  VbitmapUnlock(copy);
+  VbitmapUnlock(vbitmap);
+
+  return copy;
+}
+
+/* Run operation once over image, and return its latency in ms (negative on
+   failure). Statistics, including channel reads and writes, are collected
+   into stats unless NULL */
+static double
+benchImage(const corpusbenchop *op, corpusbenchimage *image,
+           const corpusbenchparams *params, YmagineStats *stats)
+{
+  NSTYPE start = 0;
+  NSTYPE end = 0;
+  int rc = YMAGINE_ERROR;
+  int colors[YMAGINE_THEME_MAXCOLORS];
+  int scores[YMAGINE_THEME_MAXCOLORS];
+  Ychannel *channelin = NULL;
+  Ychannel *channelout = NULL;
+  Vbitmap *vbitmap = NULL;
+  YmagineFormatOptions *options = NULL;
+
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(YmagineStats));
+  }
+
+  if (op->kind == CORPUSBENCH_DECODE || op->kind == CORPUSBENCH_SHADER ||
+      op->kind == CORPUSBENCH_TRANSCODE) {
+    channelin = YchannelInitByteArray(image->data, (int) image->length);
+    options = YmagineFormatOptions_Create();
+    if (channelin == NULL || options == NULL) {
+      goto cleanup;
+    }
+    YmagineFormatOptions_setResize(options, params->width, params->height,
+                                   YMAGINE_SCALE_LETTERBOX);
+    if (stats != NULL) {
+      YmagineFormatOptions_setStats(options, YTRUE);
+    }
+  }
+
+  switch (op->kind) {
+  case CORPUSBENCH_DECODE:
+  case CORPUSBENCH_SHADER:
+    vbitmap = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+    if (vbitmap == NULL) {
+      goto cleanup;
+    }
+    if (op->kind == CORPUSBENCH_SHADER) {
+      YmagineFormatOptions_setShader(options, params->shader);
+    }
+    start = NSTIME();
+    rc = YmagineDecode(vbitmap, channelin, options);
+    end = NSTIME();
+    break;
+  case CORPUSBENCH_TRANSCODE:
+    lseek(params->fd, 0, SEEK_SET);
+    channelout = YchannelInitFd(params->fd, 1);
+    if (channelout == NULL) {
+      goto cleanup;
+    }
+    YmagineFormatOptions_setFormat(options, op->format);
+    start = NSTIME();
+    rc = YmagineTranscode(channelin, channelout, options);
+    end = NSTIME();
+    break;
+  case CORPUSBENCH_BLUR:
+    /* Blur is in place, so every iteration blurs a fresh copy of the image */
+    vbitmap = cloneBitmap(image->bitmap);
+    if (vbitmap == NULL) {
+      goto cleanup;
+    }
+    start = NSTIME();
+    rc = Ymagine_blur(vbitmap, params->radius);
+    end = NSTIME();
+    break;
+  case CORPUSBENCH_QUANTIZE:
+    start = NSTIME();
+    if (getThemeColorsWithMethod(image->bitmap, params->ncolors, colors, scores,
+                                 YMAGINE_QUANTIZE_HISTOGRAM) > 0) {
+      rc = YMAGINE_OK;
+    }
+    end = NSTIME();
+    break;
+  default:
+    break;
+  }
+
+ cleanup:
+  if (vbitmap != NULL) {
+    VbitmapRelease(vbitmap);
+  }
+  if (options != NULL) {
+    if (rc == YMAGINE_OK && stats != NULL) {
+      YmagineFormatOptions_getStats(options, stats);
+    }
+    YmagineFormatOptions_Release(options);
+  }
+  if (channelout != NULL) {
+    YchannelRelease(channelout);
+  }
+  if (channelin != NULL) {
+    YchannelResetBuffer(channelin);
+    YchannelRelease(channelin);
+  }
+
+  if (rc != YMAGINE_OK) {
+    return -1.0;
+  }
+
+  return ((double) (end - start)) / 1000000.0;
+}
+
+static int
+benchOp(const corpusbenchop *op, corpusbenchimage *images, int nimages,
+        const corpusbenchparams *params, corpusbenchresult *result)
+{
+  int i;
+  int iter;
+  int n = 0;
+  double ms;
+  double totalms = 0.0;
+  double totalbytes = 0.0;
+  double totalreads = 0.0;
+  double totalwrites = 0.0;
+  int nstats = 0;
+  double *samples;
+  YmagineStats stats;
+
+  memset(result, 0, sizeof(corpusbenchresult));
+  snprintf(result->name, sizeof(result->name), "%s", op->name);
+
+  samples = (double*) Ymem_malloc(nimages * params->niters * sizeof(double));
+  if (samples == NULL) {
+    return YMAGINE_ERROR;
+  }
+
+  for (i = 0; i < nimages; i++) {
+    /* Count channel reads and writes in an untimed run, as collecting
+       statistics costs clock reads. It also warms up caches, so first
+       image doesn't pay for page faults */
+    if (benchImage(op, &(images[i]), params, &stats) >= 0.0) {
+      totalreads += (double) stats.readcalls;
+      totalwrites += (double) stats.writecalls;
+      nstats++;
+    }
+
+    for (iter = 0; iter < params->niters; iter++) {
+      ms = benchImage(op, &(images[i]), params, NULL);
+      if (ms < 0.0) {
+        result->failures++;
+        continue;
+      }
+      samples[n++] = ms;
+      totalms += ms;
+      totalbytes += (double) images[i].length;
+    }
+  }
+
+  qsort(samples, n, sizeof(double), compareDouble);
+
+  result->count = n;
+  result->p50 = percentile(samples, n, 50);
+  result->p95 = percentile(samples, n, 95);
+  result->p99 = percentile(samples, n, 99);
+  if (totalms > 0.0) {
+    result->ips = n * 1000.0 / totalms;
+    result->mbps = totalbytes / (1024.0 * 1024.0) * 1000.0 / totalms;
+  }
+  result->maxrss = peakRSS();
+  if (nstats > 0) {
+    result->reads = totalreads / nstats;
+    result->writes = totalwrites / nstats;
+  }
+
+  Ymem_free(samples);
+
+  return YMAGINE_OK;
+}
+
+static int
+loadBaseline(const char *filename, corpusbenchresult *results, int maxresults)
+{
+  FILE *f;
+  char line[512];
+  int n = 0;
+  corpusbenchresult *r;
+
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    return -1;
+  }
+
+  while (n < maxresults && fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] == '#' || strncmp(line, "op\t", 3) == 0) {
+      continue;
+    }
+    r = &(results[n]);
+    memset(r, 0, sizeof(corpusbenchresult));
+    /* Baselines saved before reads and writes got reported lack them */
+    if (sscanf(line, "%63s %d %d %lf %lf %lf %lf %lf %ld %lf %lf",
+               r->name, &(r->count), &(r->failures),
+               &(r->p50), &(r->p95), &(r->p99),
+               &(r->ips), &(r->mbps), &(r->maxrss),
+               &(r->reads), &(r->writes)) >= 9) {
+      n++;
+    }
+  }
+  fclose(f);
+
+  return n;
+}
+
+static double
+deltaPercent(double value, double ref)
+{
+  if (ref <= 0.0) {
+    return 0.0;
+  }
+
+  return (value - ref) * 100.0 / ref;
+}
+
+static void
+reportHeader(FILE *f, YBOOL baseline)
+{
+  fprintf(f, "op\tcount\tfailures\tp50_ms\tp95_ms\tp99_ms\timages_per_s\tmb_per_s\tmaxrss_kb"
+          "\treads\twrites");
+  if (baseline) {
+    fprintf(f, "\tbase_p50_ms\tdelta_p50_pct\tbase_p95_ms\tdelta_p95_pct\tstatus");
+  }
+  fprintf(f, "\n");
+}
+
+/* Report result, compared to reference if any. Return YTRUE if it regressed */
+static YBOOL
+reportResult(FILE *f, const corpusbenchresult *r, YBOOL baseline,
+             const corpusbenchresult *ref, double threshold)
+{
+  YBOOL regressed = YFALSE;
+  double d50;
+  double d95;
+
+  fprintf(f, "%s\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.2f\t%.2f\t%ld\t%.1f\t%.1f",
+          r->name, r->count, r->failures, r->p50, r->p95, r->p99,
+          r->ips, r->mbps, r->maxrss, r->reads, r->writes);
+
+  if (baseline) {
+    if (ref == NULL) {
+      fprintf(f, "\t-\t-\t-\t-\tnew");
+    } else {
+      d50 = deltaPercent(r->p50, ref->p50);
+      d95 = deltaPercent(r->p95, ref->p95);
+      regressed = (d50 > threshold || d95 > threshold ||
+                   r->failures > ref->failures);
+      fprintf(f, "\t%.3f\t%+.1f\t%.3f\t%+.1f\t%s",
+              ref->p50, d50, ref->p95, d95, regressed ? "regression" : "ok");
+    }
+  }
+  fprintf(f, "\n");
+  fflush(f);
+
+  return regressed;
+}
+
+static int
+selectOps(const char *list, int *selected)
+{
+  int i;
+  int n = 0;
+  size_t len;
+  const char *p = list;
+  const char *next;
+
+  while (*p != '\0') {
+    next = strchr(p, ',');
+    len = (next != NULL) ? (size_t) (next - p) : strlen(p);
+
+    for (i = 0; i < CORPUSBENCH_NOPS; i++) {
+      if (strlen(benchOps[i].name) == len && strncmp(benchOps[i].name, p, len) == 0) {
+        break;
+      }
+    }
+    if (i >= CORPUSBENCH_NOPS) {
+      fprintf(stdout, "unknown operation \"%.*s\"\n", (int) len, p);
+      fflush(stdout);
+      return -1;
+    }
+    if (n < CORPUSBENCH_MAXOPS) {
+      selected[n++] = i;
+    }
+
+    if (next == NULL) {
+      break;
+    }
+    p = next + 1;
+  }
+
+  return n;
+}
+
+int
+main_corpusbench(int argc, const char* argv[])
+{
+  int i;
+  int j;
+  int rc = 0;
+  const char *dirname;
+  const char *outfile = "corpusbench.tmp";
+  const char *savefile = NULL;
+  const char *basefile = NULL;
+  const char *oplist = NULL;
+  double threshold = 10.0;
+  int nimages;
+  int nops;
+  int nbase = 0;
+  int ops[CORPUSBENCH_MAXOPS];
+  corpusbenchparams params;
+  corpusbenchresult result;
+  corpusbenchresult baseline[CORPUSBENCH_MAXOPS];
+  const corpusbenchresult *ref;
+  corpusbenchimage *images = NULL;
+  FILE *save = NULL;
+
+  params.width = 320;
+  params.height = 320;
+  params.niters = 3;
+  params.radius = 8;
+  params.ncolors = 8;
+  params.fd = -1;
+  params.shader = NULL;
+
+  for (i = 0; i < argc; i++) {
+    if (argv[i][0] != '-') {
+      break;
+    }
+    if (argv[i][1] == '-' && argv[i][2] == 0) {
+      i++;
+      break;
+    }
+
+    if (i+1 >= argc) {
+      fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+      fflush(stdout);
+      return 1;
+    }
+
+    if (argv[i][1] == 'w' && strcmp(argv[i], "-width") == 0) {
+      i++;
+      params.width = atoi(argv[i]);
+    } else if (argv[i][1] == 'h' && strcmp(argv[i], "-height") == 0) {
+      i++;
+      params.height = atoi(argv[i]);
+    } else if (argv[i][1] == 'i' && strcmp(argv[i], "-iter") == 0) {
+      i++;
+      params.niters = atoi(argv[i]);
+      if (params.niters < 1) {
+        params.niters = 1;
+      }
+    } else if (argv[i][1] == 'o' && strcmp(argv[i], "-ops") == 0) {
+      i++;
+      oplist = argv[i];
+    } else if (argv[i][1] == 's' && strcmp(argv[i], "-save") == 0) {
+      i++;
+      savefile = argv[i];
+    } else if (argv[i][1] == 'b' && strcmp(argv[i], "-baseline") == 0) {
+      i++;
+      basefile = argv[i];
+    } else if (argv[i][1] == 'i' && strcmp(argv[i], "-iobuffer") == 0) {
+      i++;
+      Ymagine_setIOBufferSize(atoi(argv[i]));
+    } else if (argv[i][1] == 't' && strcmp(argv[i], "-threshold") == 0) {
+      i++;
+      threshold = atof(argv[i]);
+    } else if (argv[i][1] == 'o' && strcmp(argv[i], "-out") == 0) {
+      i++;
+      outfile = argv[i];
+    } else {
+      fprintf(stdout, "unknown option \"%s\"\n", argv[i]);
+      fflush(stdout);
+      return 1;
+    }
+  }
+
+  if (i >= argc) {
+    usage_corpusbench();
+    return 1;
+  }
+
+  dirname = argv[i];
+
+  if (oplist != NULL) {
+    nops = selectOps(oplist, ops);
+    if (nops < 0) {
+      return 1;
+    }
+  } else {
+    for (nops = 0; nops < CORPUSBENCH_NOPS; nops++) {
+      ops[nops] = nops;
+    }
+  }
+
+  if (basefile != NULL) {
+    nbase = loadBaseline(basefile, baseline, CORPUSBENCH_MAXOPS);
+    if (nbase < 0) {
+      fprintf(stdout, "failed to load baseline \"%s\"\n", basefile);
+      fflush(stdout);
+      return 1;
+    }
+  }
+
+  nimages = loadCorpus(dirname, params.width, params.height, &images);
+  if (nimages <= 0) {
+    fprintf(stdout, "no supported image in \"%s\"\n", dirname);
+    fflush(stdout);
+    if (images != NULL) {
+      releaseCorpus(images, 0);
+    }
+    return 1;
+  }
+
+  params.fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (params.fd < 0) {
+    fprintf(stdout, "failed to open output file \"%s\"\n", outfile);
+    fflush(stdout);
+    releaseCorpus(images, nimages);
+    return 1;
+  }
+
+  if (savefile != NULL) {
+    save = fopen(savefile, "w");
+    if (save == NULL) {
+      fprintf(stdout, "failed to open \"%s\"\n", savefile);
+      fflush(stdout);
+      close(params.fd);
+      unlink(outfile);
+      releaseCorpus(images, nimages);
+      return 1;
+    }
+  }
+
+  /* Fixed, moderately expensive shader */
+  params.shader = Yshader_PixelShader_create();
+  if (params.shader != NULL) {
+    Yshader_PixelShader_saturation(params.shader, 0.5f);
+    Yshader_PixelShader_contrast(params.shader, 0.2f);
+  }
+
+  fprintf(stdout, "# %s: %d image(s) to %dx%d, %d iteration(s) per image, %d bytes I/O buffers\n",
+          dirname, nimages, params.width, params.height, params.niters,
+          Ymagine_getIOBufferSize());
+  reportHeader(stdout, basefile != NULL);
+  if (save != NULL) {
+    fprintf(save, "# %s: %d image(s) to %dx%d, %d iteration(s) per image, %d bytes I/O buffers\n",
+            dirname, nimages, params.width, params.height, params.niters,
+            Ymagine_getIOBufferSize());
+    reportHeader(save, YFALSE);
+  }
+
+  for (i = 0; i < nops; i++) {
+    if (benchOp(&(benchOps[ops[i]]), images, nimages, &params, &result) != YMAGINE_OK) {
+      continue;
+    }
+
+    ref = NULL;
+    for (j = 0; j < nbase; j++) {
+      if (strcmp(baseline[j].name, result.name) == 0) {
+        ref = &(baseline[j]);
+        break;
+      }
+    }
+
+    if (reportResult(stdout, &result, basefile != NULL, ref, threshold)) {
+      rc = 2;
+    }
+    if (save != NULL) {
+      reportResult(save, &result, YFALSE, NULL, threshold);
+    }
+  }
+
+  if (save != NULL) {
+    fclose(save);
+  }
+  if (params.shader != NULL) {
+    Yshader_PixelShader_release(params.shader);
+  }
+  close(params.fd);
+  unlink(outfile);
+  releaseCorpus(images, nimages);
+
+  return rc;
+}
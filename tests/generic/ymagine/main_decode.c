@@ -221,7 +221,8 @@ usage_decode()
   fprintf(stdout, "usage: ymagine decode ?-shaderName <shaderName (seperated "
           "by ';' without whitespace e.g., "
           "color-iced_tea;vignette-white_pinhole)>? "
-          "?-ntimes <ntimes>? ?-cascade <path>? ?--? file1 ?...?\n");
+          "?-ntimes <ntimes>? ?-cascade <path>? ?-pool <maxbytes>? "
+          "?--? file1 ?...?\n");
   fflush(stdout);
 
   return 0;
@@ -246,6 +247,8 @@ main_decode(int argc, const char* argv[])
   const char *convnet_path = NULL;
   int maxWidth = -1;
   int maxHeight = -1;
+  long poollimit = -1;
+  VbitmapPoolStats poolstats;
 
   if (argc <= 1) {
     usage_decode();
@@ -310,6 +313,14 @@ main_decode(int argc, const char* argv[])
       }
       i++;
       nbiters = atoi(argv[i]);
+    } else if (argv[i][1] == 'p' && strcmp(argv[i], "-pool") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      poollimit = atol(argv[i]);
     }
     else {
       /* Unknown option */
@@ -319,6 +330,10 @@ main_decode(int argc, const char* argv[])
     }
   }
 
+  if (poollimit >= 0) {
+    VbitmapPoolSetLimit((size_t) poollimit);
+  }
+
   for (; i < argc; ++i) {
     filename = argv[i];
 
@@ -390,6 +405,20 @@ main_decode(int argc, const char* argv[])
     Ymem_free(fbase);
   }
 
+  if (poollimit >= 0) {
+    VbitmapPoolGetStats(&poolstats, YFALSE);
+    fprintf(stdout, "Pool: %lu hits, %lu misses (%.1f%% hit rate), %lu discards, "
+            "%lu blocks / %lu bytes retained (limit %lu)\n",
+            poolstats.hits, poolstats.misses,
+            (poolstats.hits + poolstats.misses) > 0 ?
+            (100.0 * poolstats.hits) / (poolstats.hits + poolstats.misses) : 0.0,
+            poolstats.discards, poolstats.blocksretained,
+            (unsigned long) poolstats.bytesretained,
+            (unsigned long) poolstats.limit);
+    fflush(stdout);
+    VbitmapPoolSetLimit(0);
+  }
+
   return 0;
 }
 
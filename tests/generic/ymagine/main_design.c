@@ -15,7 +15,8 @@
 int
 usage_design()
 {
-  fprintf(stdout, "usage: ymagine design ?-size n? ?-out out.png? ?--? infile1 ?infile2 ...?\n");
+  fprintf(stdout, "usage: ymagine design ?-size n? ?-threads n? ?-out out.png? ?--? infile1 ?infile2 ...?\n");
+  fprintf(stdout, "  -threads n: decode tiles on n threads, 0 for one per CPU (default 1)\n");
   fflush(stdout);
 
   return 0;
@@ -46,6 +47,9 @@ main_design(int argc, const char* argv[])
   int canvasw;
   int canvash;
   int reqSize = -1;
+  int nthreads = 1;
+  int *fdin = NULL;
+  Ychannel **channelin = NULL;
   const char* outfile = NULL;
   int i;
 
@@ -71,6 +75,17 @@ main_design(int argc, const char* argv[])
       }
       i++;
       reqSize = atoi(argv[i]);
+    } else if (argv[i][1] == 't' && strcmp(argv[i], "-threads") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      nthreads = atoi(argv[i]);
+      if (nthreads < 0) {
+        nthreads = 0;
+      }
     } else if (argv[i][1] == 'o' && strcmp(argv[i], "-out") == 0) {
       if (i+1 >= argc) {
         fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
@@ -109,25 +124,50 @@ main_design(int argc, const char* argv[])
   }
 
   nsuccess = 0;
-  for (i = 0; i < ntiles; i++) {
-    int fdin = -1;
-    if (infiles != NULL && infiles[i] != NULL && infiles[i][0] != '\0') {
-      fdin = open(infiles[i], O_RDONLY | O_BINARY);
+  if (ntiles > 0) {
+    fdin = (int*) Ymem_malloc(ntiles * sizeof(int));
+    channelin = (Ychannel**) Ymem_calloc(ntiles, sizeof(Ychannel*));
+  }
+  if (fdin != NULL && channelin != NULL) {
+    int nopened = 0;
+
+    for (i = 0; i < ntiles; i++) {
+      fdin[i] = -1;
+      if (infiles != NULL && infiles[i] != NULL && infiles[i][0] != '\0') {
+        fdin[i] = open(infiles[i], O_RDONLY | O_BINARY);
+      }
+      if (fdin[i] < 0) {
+        fprintf(stdout, "failed to open input file \"%s\"\n", infiles[i]);
+        fflush(stdout);
+      } else {
+        channelin[i] = YchannelInitFd(fdin[i], 0);
+        nopened++;
+      }
     }
-    if (fdin < 0) {
-      fprintf(stdout, "failed to open input file \"%s\"\n", infiles[i]);
-      fflush(stdout);
-    } else {
-      Ychannel *channelin = YchannelInitFd(fdin, 0);
-      if (VbitmapOrbRenderTile(canvas, ntiles, i, channelin) == YMAGINE_OK) {
-        nsuccess++;
+
+    if (nopened == ntiles) {
+      if (VbitmapOrbRender(canvas, ntiles, channelin, nthreads) == YMAGINE_OK) {
+        nsuccess = ntiles;
       } else {
         fprintf(stdout, "failed to render orb\n");
         fflush(stdout);
       }
-      YchannelRelease(channelin);
-      close(fdin);
     }
+
+    for (i = 0; i < ntiles; i++) {
+      if (channelin[i] != NULL) {
+        YchannelRelease(channelin[i]);
+      }
+      if (fdin[i] >= 0) {
+        close(fdin[i]);
+      }
+    }
+  }
+  if (fdin != NULL) {
+    Ymem_free(fdin);
+  }
+  if (channelin != NULL) {
+    Ymem_free(channelin);
   }
 
   if (nsuccess == ntiles) {
@@ -0,0 +1,251 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#include "ymagine_main.h"
+
+typedef struct {
+  const char *name;
+  int value;
+} sweepentry;
+
+static const sweepentry sweepFilters[] = {
+  { "none", YMAGINE_PNG_FILTER_NONE },
+  { "sub", YMAGINE_PNG_FILTER_SUB },
+  { "up", YMAGINE_PNG_FILTER_UP },
+  { "paeth", YMAGINE_PNG_FILTER_PAETH },
+  { "all", YMAGINE_PNG_FILTER_ALL }
+};
+
+static const sweepentry sweepStrategies[] = {
+  { "default", YMAGINE_ZSTRATEGY_DEFAULT },
+  { "filtered", YMAGINE_ZSTRATEGY_FILTERED },
+  { "huffman", YMAGINE_ZSTRATEGY_HUFFMAN },
+  { "rle", YMAGINE_ZSTRATEGY_RLE }
+};
+
+static const int sweepLevels[] = { 1, 3, 6, 9 };
+
+#define SWEEP_COUNT(a) ((int) (sizeof(a) / sizeof((a)[0])))
+
+int
+usage_pngsweep()
+{
+  fprintf(stdout, "usage: ymagine pngsweep [-width width] [-height height] [-iter n] [-threads n] [-out tmpfile] infile\n");
+  fprintf(stdout, "  encode infile as PNG with a range of compression settings and report\n");
+  fprintf(stdout, "  output size and encoding time for each of them\n");
+  fflush(stdout);
+
+  return 0;
+}
+
+/* Encode bitmap niters times into outfile, return size of the last output */
+static int
+sweepEncode(Vbitmap *vbitmap, YmagineFormatOptions *options,
+            const char *outfile, int niters, double *ms)
+{
+  int i;
+  int fd;
+  int rc = YMAGINE_OK;
+  struct stat st;
+  NSTYPE start, end;
+  Ychannel *channel;
+
+  *ms = 0.0;
+
+  for (i = 0; i < niters && rc == YMAGINE_OK; i++) {
+    fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+      return -1;
+    }
+    channel = YchannelInitFd(fd, 1);
+    if (channel == NULL) {
+      close(fd);
+      return -1;
+    }
+
+    start = NSTIME();
+    rc = YmagineEncode(vbitmap, channel, options);
+    end = NSTIME();
+    *ms += ((double) (end - start)) / 1000000.0;
+
+    YchannelRelease(channel);
+    close(fd);
+  }
+
+  if (rc != YMAGINE_OK || stat(outfile, &st) != 0) {
+    return -1;
+  }
+  *ms /= niters;
+
+  return (int) st.st_size;
+}
+
+static void
+sweepReport(const char *preset, int level, const char *filters,
+            const char *strategy, int bytes, double ms)
+{
+  fprintf(stdout, "%s\t%d\t%s\t%s\t%d\t%.2f\n",
+          preset, level, filters, strategy, bytes, ms);
+  fflush(stdout);
+}
+
+int
+main_pngsweep(int argc, const char* argv[])
+{
+  int i;
+  int l;
+  int f;
+  int s;
+  const char *infile;
+  const char *outfile = "pngsweep.tmp.png";
+  int width = -1;
+  int height = -1;
+  int niters = 1;
+  int nthreads = 1;
+  int fd;
+  int bytes;
+  double ms;
+  char preset[32];
+  Ychannel *channel;
+  Vbitmap *vbitmap;
+  YmagineFormatOptions *options;
+
+  for (i = 0; i < argc; i++) {
+    if (argv[i][0] != '-') {
+      break;
+    }
+    if (argv[i][1] == '-' && argv[i][2] == 0) {
+      i++;
+      break;
+    }
+
+    if (argv[i][1] == 'w' && strcmp(argv[i], "-width") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      width = atoi(argv[i]);
+    } else if (argv[i][1] == 'h' && strcmp(argv[i], "-height") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      height = atoi(argv[i]);
+    } else if (argv[i][1] == 'i' && strcmp(argv[i], "-iter") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      niters = atoi(argv[i]);
+      if (niters < 1) {
+        niters = 1;
+      }
+    } else if (argv[i][1] == 't' && strcmp(argv[i], "-threads") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      nthreads = atoi(argv[i]);
+    } else if (argv[i][1] == 'o' && strcmp(argv[i], "-out") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      outfile = argv[i];
+    } else {
+      fprintf(stdout, "unknown option \"%s\"\n", argv[i]);
+      fflush(stdout);
+      return 1;
+    }
+  }
+
+  if (i >= argc) {
+    usage_pngsweep();
+    return 1;
+  }
+
+  infile = argv[i];
+
+  fd = open(infile, O_RDONLY | O_BINARY);
+  if (fd < 0) {
+    fprintf(stdout, "failed to open input file \"%s\"\n", infile);
+    fflush(stdout);
+    return 1;
+  }
+
+  vbitmap = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+  channel = YchannelInitFd(fd, 0);
+  if (YmagineDecodeResize(vbitmap, channel, width, height,
+                          YMAGINE_SCALE_LETTERBOX) != YMAGINE_OK) {
+    fprintf(stdout, "failed to decode input file \"%s\"\n", infile);
+    fflush(stdout);
+    YchannelRelease(channel);
+    close(fd);
+    VbitmapRelease(vbitmap);
+    return 1;
+  }
+  YchannelRelease(channel);
+  close(fd);
+
+  fprintf(stdout, "# %s %dx%d, %d iteration(s) per setting, %d thread(s)\n",
+          infile, VbitmapWidth(vbitmap), VbitmapHeight(vbitmap), niters,
+          nthreads);
+  fprintf(stdout, "preset\tlevel\tfilters\tstrategy\tbytes\tms\n");
+  fflush(stdout);
+
+  options = YmagineFormatOptions_Create();
+  YmagineFormatOptions_setFormat(options, YMAGINE_IMAGEFORMAT_PNG);
+  YmagineFormatOptions_setThreads(options, nthreads);
+
+  /* libpng defaults */
+  bytes = sweepEncode(vbitmap, options, outfile, niters, &ms);
+  sweepReport("libpng", -1, "auto", "auto", bytes, ms);
+
+  /* Settings derived from accuracy */
+  for (i = 0; i <= 100; i += 10) {
+    YmagineFormatOptions_setAccuracy(options, i);
+    bytes = sweepEncode(vbitmap, options, outfile, niters, &ms);
+    snprintf(preset, sizeof(preset), "accuracy=%d", i);
+    sweepReport(preset, -1, "auto", "auto", bytes, ms);
+  }
+  YmagineFormatOptions_setAccuracy(options, -1);
+
+  /* Explicit settings */
+  for (s = 0; s < SWEEP_COUNT(sweepStrategies); s++) {
+    YmagineFormatOptions_setCompressionStrategy(options, sweepStrategies[s].value);
+    for (f = 0; f < SWEEP_COUNT(sweepFilters); f++) {
+      YmagineFormatOptions_setPngFilters(options, sweepFilters[f].value);
+      for (l = 0; l < SWEEP_COUNT(sweepLevels); l++) {
+        YmagineFormatOptions_setCompression(options, sweepLevels[l]);
+        bytes = sweepEncode(vbitmap, options, outfile, niters, &ms);
+        sweepReport("explicit", sweepLevels[l], sweepFilters[f].name,
+                    sweepStrategies[s].name, bytes, ms);
+      }
+    }
+  }
+
+  YmagineFormatOptions_Release(options);
+  VbitmapRelease(vbitmap);
+  unlink(outfile);
+
+  return 0;
+}
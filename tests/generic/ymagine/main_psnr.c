@@ -16,11 +16,208 @@ int
 usage_psnr()
 {
   fprintf(stdout, "usage: ymagine psnr file1 file2\n");
+  fprintf(stdout, "       ymagine psnr -sweep [-width width] [-height height] [-iter n] [-floor ssim] infile\n");
+  fprintf(stdout, "  sweep mode decodes infile with each quality and accuracy setting, and reports\n");
+  fprintf(stdout, "  average time, PSNR, SSIM and MS-SSIM against a decoding at best settings, as\n");
+  fprintf(stdout, "  well as the fastest setting whose SSIM is at least floor\n");
   fflush(stdout);
 
   return 0;
 }
 
+static const int sweepQualities[] = { 50, 70, 80, 85, 90, 92, 95, 97, 98, 100 };
+/* Automatic (from quality), fast and accurate */
+static const int sweepAccuracies[] = { -1, 0, 100 };
+
+/* Decode in-memory image niters times, return average time per decoding in ms */
+static double
+sweepDecode(Vbitmap *vbitmap, const char *data, size_t length,
+            int width, int height, int quality, int accuracy, int niters)
+{
+  int i;
+  NSTYPE start, end;
+  double ms = 0.0;
+  Ychannel *channel;
+  YmagineFormatOptions *options;
+
+  options = YmagineFormatOptions_Create();
+  if (options == NULL) {
+    return -1.0;
+  }
+  YmagineFormatOptions_setResize(options, width, height, YMAGINE_SCALE_LETTERBOX);
+  YmagineFormatOptions_setQuality(options, quality);
+  YmagineFormatOptions_setAccuracy(options, accuracy);
+
+  for (i = 0; i < niters && ms >= 0.0; i++) {
+    channel = YchannelInitByteArray(data, (int) length);
+    if (channel == NULL) {
+      ms = -1.0;
+      break;
+    }
+
+    start = NSTIME();
+    if (YmagineDecode(vbitmap, channel, options) != YMAGINE_OK) {
+      ms = -1.0;
+    }
+    end = NSTIME();
+    if (ms >= 0.0) {
+      ms += ((double) (end - start)) / 1000000.0;
+    }
+
+    YchannelResetBuffer(channel);
+    YchannelRelease(channel);
+  }
+
+  YmagineFormatOptions_Release(options);
+
+  if (ms < 0.0) {
+    return ms;
+  }
+
+  return ms / niters;
+}
+
+static int
+main_psnr_sweep(int argc, const char* argv[])
+{
+  int i;
+  int q;
+  int a;
+  int width = -1;
+  int height = -1;
+  int niters = 5;
+  double minssim = -1.0;
+  double ms;
+  double psnr;
+  double ssim;
+  double msssim;
+  double bestms = -1.0;
+  int bestquality = -1;
+  int bestaccuracy = -1;
+  const char *infile;
+  char *fbase;
+  size_t flen = 0;
+  Vbitmap *reference;
+  Vbitmap *vbitmap;
+
+  for (i = 0; i < argc; i++) {
+    if (argv[i][0] != '-') {
+      break;
+    }
+    if (argv[i][1] == '-' && argv[i][2] == 0) {
+      i++;
+      break;
+    }
+
+    if (i+1 >= argc) {
+      fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+      fflush(stdout);
+      return 1;
+    }
+
+    if (argv[i][1] == 'w' && strcmp(argv[i], "-width") == 0) {
+      i++;
+      width = atoi(argv[i]);
+    } else if (argv[i][1] == 'h' && strcmp(argv[i], "-height") == 0) {
+      i++;
+      height = atoi(argv[i]);
+    } else if (argv[i][1] == 'i' && strcmp(argv[i], "-iter") == 0) {
+      i++;
+      niters = atoi(argv[i]);
+      if (niters < 1) {
+        niters = 1;
+      }
+    } else if (argv[i][1] == 'f' && strcmp(argv[i], "-floor") == 0) {
+      i++;
+      minssim = atof(argv[i]);
+    } else {
+      fprintf(stdout, "unknown option \"%s\"\n", argv[i]);
+      fflush(stdout);
+      return 1;
+    }
+  }
+
+  if (i >= argc) {
+    usage_psnr();
+    return 1;
+  }
+
+  infile = argv[i];
+
+  /* Keep input in memory, so only decoding gets measured */
+  fbase = LoadDataFromFile(infile, &flen);
+  if (fbase == NULL) {
+    fprintf(stdout, "failed to load input file \"%s\"\n", infile);
+    fflush(stdout);
+    return 1;
+  }
+
+  reference = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+  vbitmap = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+  if (reference == NULL || vbitmap == NULL ||
+      sweepDecode(reference, fbase, flen, width, height, 100, 100, 1) < 0.0) {
+    fprintf(stdout, "decode file %s failed\n", infile);
+    fflush(stdout);
+    if (reference != NULL) {
+      VbitmapRelease(reference);
+    }
+    if (vbitmap != NULL) {
+      VbitmapRelease(vbitmap);
+    }
+    Ymem_free(fbase);
+    return 1;
+  }
+
+  fprintf(stdout, "# %s %dx%d, %d iteration(s) per setting\n",
+          infile, VbitmapWidth(reference), VbitmapHeight(reference), niters);
+  fprintf(stdout, "quality\taccuracy\tms\tpsnr\tssim\tmsssim\n");
+  fflush(stdout);
+
+  for (q = 0; q < (int) (sizeof(sweepQualities) / sizeof(sweepQualities[0])); q++) {
+    for (a = 0; a < (int) (sizeof(sweepAccuracies) / sizeof(sweepAccuracies[0])); a++) {
+      /* Warm up, then measure */
+      sweepDecode(vbitmap, fbase, flen, width, height,
+                  sweepQualities[q], sweepAccuracies[a], 1);
+      ms = sweepDecode(vbitmap, fbase, flen, width, height,
+                       sweepQualities[q], sweepAccuracies[a], niters);
+      if (ms < 0.0) {
+        fprintf(stdout, "%d\t%d\tfailed\n", sweepQualities[q], sweepAccuracies[a]);
+        continue;
+      }
+
+      psnr = VbitmapComputePSNR(vbitmap, reference);
+      ssim = VbitmapComputeSSIM(vbitmap, reference);
+      msssim = VbitmapComputeMSSSIM(vbitmap, reference);
+
+      fprintf(stdout, "%d\t%d\t%.3f\t%.3f\t%.5f\t%.5f\n",
+              sweepQualities[q], sweepAccuracies[a], ms, psnr, ssim, msssim);
+      fflush(stdout);
+
+      if (minssim >= 0.0 && ssim >= minssim && (bestms < 0.0 || ms < bestms)) {
+        bestms = ms;
+        bestquality = sweepQualities[q];
+        bestaccuracy = sweepAccuracies[a];
+      }
+    }
+  }
+
+  if (minssim >= 0.0) {
+    if (bestms >= 0.0) {
+      fprintf(stdout, "# fastest with ssim >= %.5f: quality %d accuracy %d (%.3f ms)\n",
+              minssim, bestquality, bestaccuracy, bestms);
+    } else {
+      fprintf(stdout, "# no setting with ssim >= %.5f\n", minssim);
+    }
+    fflush(stdout);
+  }
+
+  VbitmapRelease(vbitmap);
+  VbitmapRelease(reference);
+  Ymem_free(fbase);
+
+  return 0;
+}
+
 int
 main_psnr(int argc, const char* argv[])
 {
@@ -36,6 +233,10 @@ main_psnr(int argc, const char* argv[])
   int rc;
   int ret = 1;
 
+  if (argc >= 1 && strcmp(argv[0], "-sweep") == 0) {
+    return main_psnr_sweep(argc - 1, argv + 1);
+  }
+
   if (argc < 2) {
     usage_psnr();
     return ret;
@@ -0,0 +1,167 @@
+/**
+ * Copyright 2013 Yahoo! Inc.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License. You may
+ * obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License. See accompanying LICENSE file.
+ */
+
+#include "ymagine_main.h"
+
+#define THEMEBENCH_MAXCOLORS 16
+
+typedef struct {
+  const char *name;
+  int method;
+} themebenchmethod;
+
+static const themebenchmethod benchMethods[] = {
+  { "exact", YMAGINE_QUANTIZE_EXACT },
+  { "histogram", YMAGINE_QUANTIZE_HISTOGRAM }
+};
+
+int
+usage_themebench()
+{
+  fprintf(stdout, "usage: ymagine themebench [-width width] [-height height] [-colors n] [-iter n] infile\n");
+  fprintf(stdout, "  extract theme colors of infile with each quantization method and report\n");
+  fprintf(stdout, "  average time and palette for each of them\n");
+  fflush(stdout);
+
+  return 0;
+}
+
+int
+main_themebench(int argc, const char* argv[])
+{
+  int i;
+  int m;
+  int c;
+  const char *infile;
+  int width = -1;
+  int height = -1;
+  int ncolors = 8;
+  int niters = 10;
+  int fd;
+  int n = 0;
+  double ms;
+  NSTYPE start, end;
+  int colors[THEMEBENCH_MAXCOLORS];
+  int scores[THEMEBENCH_MAXCOLORS];
+  Ychannel *channel;
+  Vbitmap *vbitmap;
+
+  for (i = 0; i < argc; i++) {
+    if (argv[i][0] != '-') {
+      break;
+    }
+    if (argv[i][1] == '-' && argv[i][2] == 0) {
+      i++;
+      break;
+    }
+
+    if (argv[i][1] == 'w' && strcmp(argv[i], "-width") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      width = atoi(argv[i]);
+    } else if (argv[i][1] == 'h' && strcmp(argv[i], "-height") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      height = atoi(argv[i]);
+    } else if (argv[i][1] == 'c' && strcmp(argv[i], "-colors") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      ncolors = atoi(argv[i]);
+      if (ncolors < 1) {
+        ncolors = 1;
+      } else if (ncolors > THEMEBENCH_MAXCOLORS) {
+        ncolors = THEMEBENCH_MAXCOLORS;
+      }
+    } else if (argv[i][1] == 'i' && strcmp(argv[i], "-iter") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      niters = atoi(argv[i]);
+      if (niters < 1) {
+        niters = 1;
+      }
+    } else {
+      fprintf(stdout, "unknown option \"%s\"\n", argv[i]);
+      fflush(stdout);
+      return 1;
+    }
+  }
+
+  if (i >= argc) {
+    usage_themebench();
+    return 1;
+  }
+
+  infile = argv[i];
+
+  fd = open(infile, O_RDONLY | O_BINARY);
+  if (fd < 0) {
+    fprintf(stdout, "failed to open input file \"%s\"\n", infile);
+    fflush(stdout);
+    return 1;
+  }
+
+  vbitmap = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
+  channel = YchannelInitFd(fd, 0);
+  if (YmagineDecodeResize(vbitmap, channel, width, height,
+                          YMAGINE_SCALE_LETTERBOX) != YMAGINE_OK) {
+    fprintf(stdout, "failed to decode input file \"%s\"\n", infile);
+    fflush(stdout);
+    YchannelRelease(channel);
+    close(fd);
+    VbitmapRelease(vbitmap);
+    return 1;
+  }
+  YchannelRelease(channel);
+  close(fd);
+
+  fprintf(stdout, "# %s %dx%d, %d color(s), %d iteration(s) per method\n",
+          infile, VbitmapWidth(vbitmap), VbitmapHeight(vbitmap), ncolors,
+          niters);
+  fflush(stdout);
+
+  for (m = 0; m < (int) (sizeof(benchMethods) / sizeof(benchMethods[0])); m++) {
+    start = NSTIME();
+    for (i = 0; i < niters; i++) {
+      n = getThemeColorsWithMethod(vbitmap, ncolors, colors, scores,
+                                   benchMethods[m].method);
+    }
+    end = NSTIME();
+    ms = ((double) (end - start)) / 1000000.0 / niters;
+
+    fprintf(stdout, "%s\t%.3f ms", benchMethods[m].name, ms);
+    for (c = 0; c < n; c++) {
+      fprintf(stdout, "\t#%06x:%d", colors[c] & 0xffffff, scores[c]);
+    }
+    fprintf(stdout, "\n");
+    fflush(stdout);
+  }
+
+  VbitmapRelease(vbitmap);
+
+  return 0;
+}
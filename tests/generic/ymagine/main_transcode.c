@@ -20,6 +20,11 @@ usage_transcode()
           "?-height <integer> - output max height\\\n"
           "?-crop <string> - crop region, following <width>x<height>@<x>,<y> pattern. Example: -crop 100x150@0,65\\\n"
           "?-cropr <string> - cropr region, following <width>x<height>@<x>,<y> pattern. Example: -cropr 0.5x0.5@0.1,0.1\\\n"
+          "?-theme <integer> - print this many theme colors, collected while transcoding\\\n"
+          "?-smartcrop - keep region with most details when cropping to fill output\\\n"
+          "?-search <integer> <float> - search lowest JPEG quality reaching this SSIM, within this many bytes (0 for no bound)\\\n"
+          "?-preview <integer> - with -format none, print progressive JPEG previews emitted after first scan, then every this many scans\\\n"
+          "?-stats - print time spent in each stage, bytes read and written, and peak scratch memory\\\n"
           "infile outfile\n");
   fflush(stdout);
 
@@ -30,6 +35,20 @@ typedef struct {
   int mode;
 } privateOptions;
 
+/* Start of running decode, for timing previews */
+static NSTYPE previewStart = 0;
+
+static int
+previewCallback(YmagineFormatOptions *options, Vbitmap *preview, int scan)
+{
+  fprintf(stdout, "preview after scan %d: %dx%d at %.3f ms\n",
+          scan, VbitmapWidth(preview), VbitmapHeight(preview),
+          ((double) (NSTIME() - previewStart)) / 1000000.0);
+  fflush(stdout);
+
+  return YMAGINE_OK;
+}
+
 static int
 progressCallback(YmagineFormatOptions *options,
                 int format, int width, int height)
@@ -113,6 +132,12 @@ main_transcode(int argc, const char* argv[])
   YmagineFormatOptions *options = NULL;
   privateOptions *pdata = NULL;
   int dynamicopts = 0;
+  int themecolors = 0;
+  int smartcrop = 0;
+  int stats = 0;
+  int searchmaxbytes = 0;
+  int previewinterval = -1;
+  double searchminssim = 0.0;
 
   if (argc < 1) {
     usage_transcode();
@@ -144,6 +169,35 @@ main_transcode(int argc, const char* argv[])
       }
       i++;
       maxHeight = atoi(argv[i]);
+    } else if (argv[i][1] == 't' && strcmp(argv[i], "-theme") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      themecolors = atoi(argv[i]);
+    } else if (argv[i][1] == 's' && strcmp(argv[i], "-smartcrop") == 0) {
+      smartcrop = 1;
+    } else if (argv[i][1] == 'p' && strcmp(argv[i], "-preview") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      previewinterval = atoi(argv[i]);
+    } else if (argv[i][1] == 's' && strcmp(argv[i], "-search") == 0) {
+      if (i+2 >= argc) {
+        fprintf(stdout, "missing values after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      searchmaxbytes = atoi(argv[i+1]);
+      searchminssim = atof(argv[i+2]);
+      i += 2;
+    } else if (argv[i][1] == 's' && strcmp(argv[i], "-stats") == 0) {
+      stats = 1;
     } else if (argv[i][1] == 'r' && strcmp(argv[i], "-repeat") == 0) {
       if (i+1 >= argc) {
         fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
@@ -518,6 +572,15 @@ main_transcode(int argc, const char* argv[])
             YmagineFormatOptions_setRotate(options, rotate);
           }
           YmagineFormatOptions_setAdjust(options, adjustMode);
+          YmagineFormatOptions_setThemeColors(options, themecolors);
+          YmagineFormatOptions_setSmartCrop(options, smartcrop);
+          YmagineFormatOptions_setStats(options, stats ? YTRUE : YFALSE);
+          if (searchmaxbytes > 0 || searchminssim > 0.0) {
+            YmagineFormatOptions_setQualitySearch(options, searchmaxbytes, searchminssim);
+          }
+          if (previewinterval >= 0 && iter == 0) {
+            YmagineFormatOptions_setPreviewCallback(options, previewCallback, previewinterval);
+          }
 
           if (absolutecrop) {
             YmagineFormatOptions_setCrop(options, cropx, cropy, cropw, croph);
@@ -548,6 +611,7 @@ main_transcode(int argc, const char* argv[])
             vbitmap = VbitmapInitMemory(VBITMAP_COLOR_RGBA);
           }
           if (vbitmap != NULL) {
+            previewStart = start_transcode;
             rc = YmagineDecode(vbitmap, channelin, options);
           }
           VbitmapRelease(vbitmap);
@@ -556,6 +620,43 @@ main_transcode(int argc, const char* argv[])
         }
 
         if (options != NULL) {
+          if (rc == YMAGINE_OK && themecolors > 0 && iter == 0) {
+            int colors[YMAGINE_THEME_MAXCOLORS];
+            int scores[YMAGINE_THEME_MAXCOLORS];
+            int ncolors;
+            int c;
+
+            ncolors = YmagineFormatOptions_getThemeColors(options, colors, scores,
+                                                          YMAGINE_THEME_MAXCOLORS);
+            for (c = 0; c < ncolors; c++) {
+              fprintf(stdout, "theme color %d: #%06x (%d)\n",
+                      c, colors[c] & 0xffffff, scores[c]);
+            }
+            fflush(stdout);
+          }
+          if (rc == YMAGINE_OK && iter == 0 &&
+              (searchmaxbytes > 0 || searchminssim > 0.0)) {
+            fprintf(stdout, "searched quality %d\n",
+                    YmagineFormatOptions_getSearchedQuality(options));
+            fflush(stdout);
+          }
+          if (rc == YMAGINE_OK && stats && iter == 0) {
+            YmagineStats st;
+
+            if (YmagineFormatOptions_getStats(options, &st) == YMAGINE_OK) {
+              fprintf(stdout, "total %.3f ms, parse %.3f ms, decode %.3f ms, scale %.3f ms, "
+                      "shader %.3f ms, sharpen %.3f ms, encode %.3f ms\n",
+                      st.total / 1000000.0, st.parse / 1000000.0, st.decode / 1000000.0,
+                      st.scale / 1000000.0, st.shader / 1000000.0, st.sharpen / 1000000.0,
+                      st.encode / 1000000.0);
+              fprintf(stdout, "read %lld bytes in %lld call(s), wrote %lld bytes in %lld call(s), "
+                      "peak scratch %lu bytes\n",
+                      (long long) st.bytesread, (long long) st.readcalls,
+                      (long long) st.byteswritten, (long long) st.writecalls,
+                      (unsigned long) st.scratchpeak);
+              fflush(stdout);
+            }
+          }
           YmagineFormatOptions_Release(options);
         }
         if (pdata != NULL) {
@@ -18,7 +18,18 @@
 
 static void usage_seam()
 {
-  printf("usage: ymagine seam [-width X] [-height X] infile ?outfile? ?seamfile?\n");
+  printf("usage: ymagine seam [-width X] [-height X] [-seams n] [-full] [-compare] infile ?outfile? ?seamfile?\n");
+  printf("  -seams n: remove up to n non-overlapping seams per pass\n");
+  printf("  -full: recompute whole cost table after each seam\n");
+  printf("  -compare: also time full recomputation, report speedup and check\n");
+  printf("            incremental seams match it\n");
+}
+
+static void usage_sobel()
+{
+  printf("usage: ymagine sobel [-width X] [-height X] [-threads n] [-approx] infile ?outfile?\n");
+  printf("  -threads n: compute bands of rows on n threads, 0 for one per CPU\n");
+  printf("  -approx: approximate gradient magnitude by |dx| + |dy|\n");
 }
 
 static int
@@ -40,6 +51,14 @@ main_filters(int sobel, int argc, const char* argv[])
   int nbiters = 1;
   int pass;
 
+  int update = YMAGINE_SEAM_UPDATE_INCREMENTAL;
+  int seamsperpass = 1;
+  int compare = 0;
+  int rc = 0;
+
+  int magnitude = YMAGINE_SOBEL_EXACT;
+  int nthreads = 1;
+
   NSTYPE start,end;
   int scaleMode = YMAGINE_SCALE_LETTERBOX;
 
@@ -59,6 +78,7 @@ main_filters(int sobel, int argc, const char* argv[])
         return 1;
       }
       i++;
+      width = atoi(argv[i]);
     } else if (argv[i][1] == 'h' && strcmp(argv[i], "-height") == 0) {
       if (i+1 >= argc) {
         fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
@@ -66,6 +86,32 @@ main_filters(int sobel, int argc, const char* argv[])
         return 1;
       }
       i++;
+      height = atoi(argv[i]);
+    } else if (argv[i][1] == 's' && strcmp(argv[i], "-seams") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      seamsperpass = atoi(argv[i]);
+      if (seamsperpass < 1) {
+        seamsperpass = 1;
+      }
+    } else if (argv[i][1] == 'f' && strcmp(argv[i], "-full") == 0) {
+      update = YMAGINE_SEAM_UPDATE_FULL;
+    } else if (argv[i][1] == 'c' && strcmp(argv[i], "-compare") == 0) {
+      compare = 1;
+    } else if (argv[i][1] == 't' && strcmp(argv[i], "-threads") == 0) {
+      if (i+1 >= argc) {
+        fprintf(stdout, "missing value after option \"%s\"\n", argv[i]);
+        fflush(stdout);
+        return 1;
+      }
+      i++;
+      nthreads = atoi(argv[i]);
+    } else if (argv[i][1] == 'a' && strcmp(argv[i], "-approx") == 0) {
+      magnitude = YMAGINE_SOBEL_APPROX;
     } else {
       fprintf(stdout, "unknown option \"%s\"\n", argv[i]);
       fflush(stdout);
@@ -74,7 +120,11 @@ main_filters(int sobel, int argc, const char* argv[])
   }
 
   if (i >= argc) {
-    usage_seam();
+    if (sobel) {
+      usage_sobel();
+    } else {
+      usage_seam();
+    }
     return 1;
   }
 
@@ -125,20 +175,56 @@ main_filters(int sobel, int argc, const char* argv[])
 
       if (sobel) {
         start = NSTIME();
-        Vbitmap_sobel(outbitmap, vbitmap);
+        Vbitmap_sobelWithOptions(outbitmap, vbitmap, magnitude, nthreads);
         end = NSTIME();
 
         fprintf(stderr,
-                "sobel edge-detection (%dx%d) -> %d ms\n",
+                "sobel edge-detection (%dx%d, %s, %d thread(s)) -> %d ms\n",
                 inwidth, inheight,
+                magnitude == YMAGINE_SOBEL_APPROX ? "approx" : "exact",
+                nthreads,
                 (int) ((end - start)/ 1000000L));
       } else {
+        NSTYPE preparetime;
+
         start = NSTIME();
-        seammap = Vbitmap_seamPrepare(vbitmap);
+        seammap = Vbitmap_seamPrepareWithOptions(vbitmap, update, seamsperpass);
         end = NSTIME();
+        preparetime = end - start;
         fprintf(stderr,
-                "Prepared seam map in %d ms\n",
-                (int) ((end - start)/ 1000000L));
+                "Prepared seam map (%s, %d seam(s) per pass) in %d ms\n",
+                update == YMAGINE_SEAM_UPDATE_FULL ? "full" : "incremental",
+                seamsperpass,
+                (int) (preparetime / 1000000L));
+
+        if (compare) {
+          VbitmapSeamMap *refmap;
+
+          start = NSTIME();
+          refmap = Vbitmap_seamPrepareWithOptions(vbitmap,
+                                                  YMAGINE_SEAM_UPDATE_FULL, 1);
+          end = NSTIME();
+          fprintf(stderr,
+                  "Reference full seam map in %d ms (speedup %.2fx)\n",
+                  (int) ((end - start)/ 1000000L),
+                  preparetime > 0 ? ((double) (end - start)) / preparetime : 0.0);
+
+          /* Seams are only expected to match when removed one at a time */
+          if (seamsperpass == 1) {
+            int mismatchx, mismatchy;
+
+            if (VbitmapSeamMap_compare(seammap, refmap,
+                                       &mismatchx, &mismatchy) == YMAGINE_OK) {
+              fprintf(stderr, "Seam map matches full recomputation\n");
+            } else {
+              fprintf(stderr,
+                      "Seam map mismatch with full recomputation at (%d,%d)\n",
+                      mismatchx, mismatchy);
+              rc = 1;
+            }
+          }
+          VbitmapSeamMap_release(refmap);
+        }
 
         start = NSTIME();
         Vbitmap_seamCarve(vbitmap, seammap, outbitmap);
@@ -191,7 +277,7 @@ main_filters(int sobel, int argc, const char* argv[])
     VbitmapRelease(vbitmap);
   }
 
-  return 0;
+  return rc;
 }
 
 static int
@@ -390,7 +476,7 @@ static int
 usage(const char *mode)
 {
   fprintf(stdout, "usage: ymagine mode ?-options ...? ?--? filename...\n");
-  fprintf(stdout, "supported mode: decode, info, design, tile, transcode, video, seam, sobel, blur, convert, conv_profile and colorconv\n");
+  fprintf(stdout, "supported mode: decode, info, design, tile, transcode, video, seam, sobel, blur, convert, conv_profile, colorconv, pngsweep, codecbench, themebench and corpusbench\n");
   fflush(stdout);
 
   return 0;
@@ -417,6 +503,10 @@ int main(int argc, const char* argv[])
     COMMAND_PSNR,
     COMMAND_SHAPE,
     COMMAND_CONVOLUTION_PROFILE,
+    COMMAND_PNGSWEEP,
+    COMMAND_CODECBENCH,
+    COMMAND_THEMEBENCH,
+    COMMAND_CORPUSBENCH,
   };
   int mode = -1;
 
@@ -475,6 +565,18 @@ int main(int argc, const char* argv[])
     else if (argv[1][0] == 'c' && strcmp(argv[1], "conv_profile") == 0) {
       mode = COMMAND_CONVOLUTION_PROFILE;
     }
+    else if (argv[1][0] == 'p' && strcmp(argv[1], "pngsweep") == 0) {
+      mode = COMMAND_PNGSWEEP;
+    }
+    else if (argv[1][0] == 'c' && strcmp(argv[1], "codecbench") == 0) {
+      mode = COMMAND_CODECBENCH;
+    }
+    else if (argv[1][0] == 't' && strcmp(argv[1], "themebench") == 0) {
+      mode = COMMAND_THEMEBENCH;
+    }
+    else if (argv[1][0] == 'c' && strcmp(argv[1], "corpusbench") == 0) {
+      mode = COMMAND_CORPUSBENCH;
+    }
   }
 
   if (mode < 0) {
@@ -513,6 +615,14 @@ int main(int argc, const char* argv[])
       return main_shape(argc - 2, argv + 2);
     case COMMAND_CONVOLUTION_PROFILE:
       return main_convolution_profile(argc - 2, argv + 2);
+    case COMMAND_PNGSWEEP:
+      return main_pngsweep(argc - 2, argv + 2);
+    case COMMAND_CODECBENCH:
+      return main_codecbench(argc - 2, argv + 2);
+    case COMMAND_THEMEBENCH:
+      return main_themebench(argc - 2, argv + 2);
+    case COMMAND_CORPUSBENCH:
+      return main_corpusbench(argc - 2, argv + 2);
     default:
       usage(NULL);
       return 1;
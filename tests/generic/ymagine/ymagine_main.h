@@ -127,6 +127,26 @@ usage_blur();
 int
 main_blur(int argc, const char* argv[]);
 
+int
+usage_pngsweep();
+int
+main_pngsweep(int argc, const char* argv[]);
+
+int
+usage_codecbench();
+int
+main_codecbench(int argc, const char* argv[]);
+
+int
+usage_themebench();
+int
+main_themebench(int argc, const char* argv[]);
+
+int
+usage_corpusbench();
+int
+main_corpusbench(int argc, const char* argv[]);
+
 int
 main_convolution_profile(int argc, const char* argv[]);
 